@@ -0,0 +1,683 @@
+/* SPARQL client: decoder for the RDF4J binary results table format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* application/x-binary-rdf-results-table, as produced by RDF4J (and
+ * Sesame before it), consists of:
+ *
+ *   "BRTR" <int32 version> <int32 columns> <string name>...
+ *
+ * followed by a sequence of records, each introduced by a marker byte.
+ * A solution is a run of one value record per column. Integers are
+ * big-endian; strings are an int32 length followed by UTF-8 (or, in
+ * version 1, a uint16 length followed by Java's modified UTF-8).
+ *
+ * Repeated terms are cheap in this encoding: a REPEAT record stands for
+ * the value in the same column of the previous solution, and IRIs may be
+ * written as a namespace ID plus a local name. Each column's most recent
+ * value is kept decoded, so that a repeated term is passed to the
+ * callbacks again without decoding or copying anything, and namespaces
+ * are stored once, when they're declared. The callbacks receive strings,
+ * not nodes, so a repeated term still becomes a node of its own unless
+ * the receiver shares them: result-sets reuse URI nodes through their
+ * interning cache, and columnar result-sets store each distinct term once.
+ *
+ * A record which spans two buffers is assembled by copying only as many
+ * bytes as it's known to need; everything else is decoded in place.
+ */
+
+#define BRT_MAGIC                       "BRTR"
+#define BRT_MAX_VERSION                 4
+
+#define BRT_NULL                        0
+#define BRT_REPEAT                      1
+#define BRT_NAMESPACE                   2
+#define BRT_QNAME                       3
+#define BRT_URI                         4
+#define BRT_BNODE                       5
+#define BRT_PLAIN_LITERAL               6
+#define BRT_LANG_LITERAL                7
+#define BRT_DATATYPE_LITERAL            8
+#define BRT_EMPTY_ROW                   9
+#define BRT_ERROR                       126
+#define BRT_TABLE_END                   127
+
+/* The most recent value in a column */
+struct sparql_binscan_column
+{
+	char *name;
+	size_t namelen;
+	/* SQE_URI, SQE_BNODE, SQE_LITERAL, or SQE_OTHER if unbound */
+	SPARQLELEMENT el;
+	SPARQLSCANBUF value;
+	SPARQLSCANBUF lang;
+	SPARQLSCANBUF datatype;
+	int has_lang;
+	int has_datatype;
+};
+
+/* A position within the input */
+struct sparql_binscan_cursor
+{
+	const unsigned char *start;
+	const unsigned char *p;
+	const unsigned char *end;
+	/* Set to the number of bytes which the record needs, if known, when
+	 * it's incomplete
+	 */
+	size_t need;
+};
+
+/* A string within the input */
+struct sparql_binscan_str
+{
+	const char *p;
+	size_t len;
+};
+
+struct sparql_binscan_struct
+{
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	int started;
+	int finished;
+	long version;
+	/* An incomplete record carried over from the previous buffer */
+	SPARQLSCANBUF pending;
+	size_t need;
+	struct sparql_binscan_column *columns;
+	size_t ncolumns;
+	/* The column which the next value record belongs to */
+	size_t col;
+	SPARQLSCANBUF *namespaces;
+	size_t nnamespaces;
+};
+
+static int sparql_binscan_header_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur);
+static int sparql_binscan_record_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur);
+static int sparql_binscan_iri_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur, int marker, struct sparql_binscan_str *ns, struct sparql_binscan_str *local);
+static int sparql_binscan_row_(SPARQLBINSCAN *scan);
+static int sparql_binscan_namespace_(SPARQLBINSCAN *scan, unsigned long id, const struct sparql_binscan_str *ns);
+static int sparql_binscan_byte_(struct sparql_binscan_cursor *cur, int *value);
+static int sparql_binscan_int_(struct sparql_binscan_cursor *cur, unsigned long *value);
+static int sparql_binscan_string_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur, struct sparql_binscan_str *str);
+static int sparql_binscan_set_(SPARQLBINSCAN *scan, SPARQLSCANBUF *buf, const struct sparql_binscan_str *a, const struct sparql_binscan_str *b);
+static int sparql_binscan_error_(SPARQLBINSCAN *scan, const char *what);
+
+SPARQLBINSCAN *
+sparql_binscan_create_(SPARQL *connection, SPARQLQUERY *query)
+{
+	SPARQLBINSCAN *p;
+
+	p = (SPARQLBINSCAN *) calloc(1, sizeof(SPARQLBINSCAN));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->connection = connection;
+	p->query = query;
+	return p;
+}
+
+int
+sparql_binscan_destroy_(SPARQLBINSCAN *scan)
+{
+	size_t c;
+
+	for(c = 0; c < scan->ncolumns; c++)
+	{
+		free(scan->columns[c].name);
+		free(scan->columns[c].value.buf);
+		free(scan->columns[c].lang.buf);
+		free(scan->columns[c].datatype.buf);
+	}
+	free(scan->columns);
+	for(c = 0; c < scan->nnamespaces; c++)
+	{
+		free(scan->namespaces[c].buf);
+	}
+	free(scan->namespaces);
+	free(scan->pending.buf);
+	free(scan);
+	return 0;
+}
+
+/* Process the next <len> bytes of a results table; <final> is nonzero once
+ * the whole document has been received
+ */
+int
+sparql_binscan_parse_(SPARQLBINSCAN *scan, const char *buf, size_t len, int final)
+{
+	struct sparql_binscan_cursor cur;
+	const unsigned char *p, *end;
+	size_t n;
+	int r;
+
+	p = (const unsigned char *) buf;
+	end = p + len;
+	/* Complete the record carried over from the previous buffer, copying
+	 * only as much as it's known to need each time
+	 */
+	while(scan->pending.len && p < end)
+	{
+		n = (scan->need > scan->pending.len ? scan->need - scan->pending.len : 1);
+		if(n > (size_t) (end - p))
+		{
+			n = end - p;
+		}
+		if(sparql_scanbuf_append_(scan->connection, &(scan->pending), p, n))
+		{
+			return -1;
+		}
+		p += n;
+		cur.start = cur.p = (const unsigned char *) scan->pending.buf;
+		cur.end = cur.start + scan->pending.len;
+		cur.need = 0;
+		r = (scan->started ? sparql_binscan_record_(scan, &cur) : sparql_binscan_header_(scan, &cur));
+		if(r < 0)
+		{
+			return -1;
+		}
+		if(!r)
+		{
+			/* A record never extends beyond what was needed, so the
+			 * whole of the pending buffer has been consumed
+			 */
+			scan->pending.len = 0;
+			break;
+		}
+		scan->need = cur.need;
+	}
+	cur.end = end;
+	while(!scan->pending.len && p < end)
+	{
+		cur.start = cur.p = p;
+		cur.need = 0;
+		r = (scan->started ? sparql_binscan_record_(scan, &cur) : sparql_binscan_header_(scan, &cur));
+		if(r < 0)
+		{
+			return -1;
+		}
+		if(r)
+		{
+			scan->need = cur.need;
+			if(sparql_scanbuf_append_(scan->connection, &(scan->pending), p, end - p))
+			{
+				return -1;
+			}
+			break;
+		}
+		p = cur.p;
+	}
+	if(final && (!scan->finished || scan->pending.len))
+	{
+		return sparql_binscan_error_(scan, "the results table is incomplete");
+	}
+	return 0;
+}
+
+/* Read the magic number, version and column names; returns 1 if more
+ * input is needed
+ */
+static int
+sparql_binscan_header_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	struct sparql_query_attrs_struct attrs;
+	struct sparql_binscan_str *names;
+	unsigned long version, ncols, c;
+	int r;
+
+	if(cur->end - cur->p < 12)
+	{
+		cur->need = 12;
+		return 1;
+	}
+	if(memcmp(cur->p, BRT_MAGIC, 4))
+	{
+		return sparql_binscan_error_(scan, "the magic number is missing");
+	}
+	cur->p += 4;
+	sparql_binscan_int_(cur, &version);
+	sparql_binscan_int_(cur, &ncols);
+	if(version < 1 || version > BRT_MAX_VERSION)
+	{
+		sparql_logf_(scan->connection, LOG_ERR, "unsupported binary results table format version %lu\n", version);
+		return -1;
+	}
+	if(ncols > 65536)
+	{
+		return sparql_binscan_error_(scan, "the results table has too many columns");
+	}
+	scan->version = (long) version;
+	names = (struct sparql_binscan_str *) calloc(ncols ? ncols : 1, sizeof(struct sparql_binscan_str));
+	if(!names)
+	{
+		sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for result variables\n");
+		return -1;
+	}
+	for(c = 0; c < ncols; c++)
+	{
+		if((r = sparql_binscan_string_(scan, cur, &(names[c]))))
+		{
+			free(names);
+			return r;
+		}
+	}
+	/* The header is complete */
+	scan->columns = (struct sparql_binscan_column *) calloc(ncols ? ncols : 1, sizeof(struct sparql_binscan_column));
+	if(!scan->columns)
+	{
+		free(names);
+		sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for result variables\n");
+		return -1;
+	}
+	scan->started = 1;
+	scan->ncolumns = ncols;
+	r = -1;
+	if(!sparql_query_startel_(scan->query, SQE_SPARQL, "sparql", 6, &noattrs) &&
+	   !sparql_query_startel_(scan->query, SQE_HEAD, "head", 4, &noattrs))
+	{
+		memset(&attrs, 0, sizeof(attrs));
+		for(c = 0; c < ncols; c++)
+		{
+			scan->columns[c].el = SQE_OTHER;
+			scan->columns[c].name = (char *) malloc(names[c].len + 1);
+			if(!scan->columns[c].name)
+			{
+				sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for result variables\n");
+				break;
+			}
+			memcpy(scan->columns[c].name, names[c].p, names[c].len);
+			scan->columns[c].name[names[c].len] = 0;
+			scan->columns[c].namelen = names[c].len;
+			attrs.name = scan->columns[c].name;
+			attrs.namelen = names[c].len;
+			if(sparql_query_startel_(scan->query, SQE_VARIABLE, "variable", 8, &attrs) ||
+			   sparql_query_endel_(scan->query))
+			{
+				break;
+			}
+		}
+		if(c == ncols &&
+		   !sparql_query_endel_(scan->query) &&
+		   !sparql_query_startel_(scan->query, SQE_RESULTS, "results", 7, &noattrs))
+		{
+			r = 0;
+		}
+	}
+	free(names);
+	return r;
+}
+
+/* Process a single record; returns 1 if more input is needed, in which
+ * case nothing has been consumed
+ */
+static int
+sparql_binscan_record_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	struct sparql_binscan_column *column;
+	struct sparql_binscan_str a, b, c, d;
+	unsigned long id;
+	int marker, type, r;
+
+	if(scan->finished)
+	{
+		return sparql_binscan_error_(scan, "data found after the end of the results table");
+	}
+	if((r = sparql_binscan_byte_(cur, &marker)))
+	{
+		return r;
+	}
+	switch(marker)
+	{
+	case BRT_TABLE_END:
+		if(scan->col)
+		{
+			return sparql_binscan_error_(scan, "the results table ended part-way through a solution");
+		}
+		scan->finished = 1;
+		if(sparql_query_endel_(scan->query) || sparql_query_endel_(scan->query))
+		{
+			return -1;
+		}
+		return 0;
+	case BRT_ERROR:
+		if((r = sparql_binscan_byte_(cur, &type)) ||
+		   (r = sparql_binscan_string_(scan, cur, &a)))
+		{
+			return r;
+		}
+		sparql_logf_(scan->connection, LOG_ERR, "server reported a %s error: %.*s\n", (type == 1 ? "malformed query" : "query evaluation"), (int) a.len, a.p);
+		return -1;
+	case BRT_NAMESPACE:
+		if((r = sparql_binscan_int_(cur, &id)) ||
+		   (r = sparql_binscan_string_(scan, cur, &a)))
+		{
+			return r;
+		}
+		return sparql_binscan_namespace_(scan, id, &a);
+	case BRT_EMPTY_ROW:
+		if(scan->col)
+		{
+			return sparql_binscan_error_(scan, "empty solution found part-way through a solution");
+		}
+		if(sparql_query_startel_(scan->query, SQE_RESULT, "result", 6, &noattrs) ||
+		   sparql_query_endel_(scan->query))
+		{
+			return -1;
+		}
+		return 0;
+	default:
+		break;
+	}
+	if(scan->col >= scan->ncolumns)
+	{
+		return sparql_binscan_error_(scan, "value found in a results table with no columns");
+	}
+	column = &(scan->columns[scan->col]);
+	switch(marker)
+	{
+	case BRT_NULL:
+		column->el = SQE_OTHER;
+		break;
+	case BRT_REPEAT:
+		/* The column still holds the previous solution's value */
+		break;
+	case BRT_QNAME:
+	case BRT_URI:
+		if((r = sparql_binscan_iri_(scan, cur, marker, &a, &b)))
+		{
+			return r;
+		}
+		if(sparql_binscan_set_(scan, &(column->value), &a, &b))
+		{
+			return -1;
+		}
+		column->el = SQE_URI;
+		break;
+	case BRT_BNODE:
+		if((r = sparql_binscan_string_(scan, cur, &a)))
+		{
+			return r;
+		}
+		if(sparql_binscan_set_(scan, &(column->value), &a, NULL))
+		{
+			return -1;
+		}
+		column->el = SQE_BNODE;
+		break;
+	case BRT_PLAIN_LITERAL:
+	case BRT_LANG_LITERAL:
+	case BRT_DATATYPE_LITERAL:
+		if((r = sparql_binscan_string_(scan, cur, &a)))
+		{
+			return r;
+		}
+		if(marker == BRT_LANG_LITERAL)
+		{
+			if((r = sparql_binscan_string_(scan, cur, &b)))
+			{
+				return r;
+			}
+		}
+		else if(marker == BRT_DATATYPE_LITERAL)
+		{
+			if((r = sparql_binscan_byte_(cur, &type)))
+			{
+				return r;
+			}
+			if(type != BRT_QNAME && type != BRT_URI)
+			{
+				return sparql_binscan_error_(scan, "invalid datatype for a literal");
+			}
+			if((r = sparql_binscan_iri_(scan, cur, type, &c, &d)))
+			{
+				return r;
+			}
+		}
+		/* The record is complete */
+		if(sparql_binscan_set_(scan, &(column->value), &a, NULL))
+		{
+			return -1;
+		}
+		column->has_lang = (marker == BRT_LANG_LITERAL);
+		column->has_datatype = (marker == BRT_DATATYPE_LITERAL);
+		if(column->has_lang && sparql_binscan_set_(scan, &(column->lang), &b, NULL))
+		{
+			return -1;
+		}
+		if(column->has_datatype && sparql_binscan_set_(scan, &(column->datatype), &c, &d))
+		{
+			return -1;
+		}
+		column->el = SQE_LITERAL;
+		break;
+	default:
+		sparql_logf_(scan->connection, LOG_ERR, "unknown record type %d in binary results table\n", marker);
+		return -1;
+	}
+	scan->col++;
+	if(scan->col == scan->ncolumns)
+	{
+		scan->col = 0;
+		return sparql_binscan_row_(scan);
+	}
+	return 0;
+}
+
+/* Read an IRI, which is either a QName record (a namespace ID followed by
+ * a local name) or a URI record (a string); the marker byte has already
+ * been consumed
+ */
+static int
+sparql_binscan_iri_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur, int marker, struct sparql_binscan_str *ns, struct sparql_binscan_str *local)
+{
+	unsigned long id;
+	int r;
+
+	if(marker == BRT_URI)
+	{
+		ns->p = NULL;
+		ns->len = 0;
+		return sparql_binscan_string_(scan, cur, local);
+	}
+	if((r = sparql_binscan_int_(cur, &id)) ||
+	   (r = sparql_binscan_string_(scan, cur, local)))
+	{
+		return r;
+	}
+	if(id >= scan->nnamespaces || !scan->namespaces[id].buf)
+	{
+		return sparql_binscan_error_(scan, "reference to an undeclared namespace");
+	}
+	ns->p = scan->namespaces[id].buf;
+	ns->len = scan->namespaces[id].len;
+	return 0;
+}
+
+/* Emit a complete solution */
+static int
+sparql_binscan_row_(SPARQLBINSCAN *scan)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	struct sparql_query_attrs_struct attrs;
+	struct sparql_binscan_column *column;
+	size_t c;
+
+	if(sparql_query_startel_(scan->query, SQE_RESULT, "result", 6, &noattrs))
+	{
+		return -1;
+	}
+	for(c = 0; c < scan->ncolumns; c++)
+	{
+		column = &(scan->columns[c]);
+		if(column->el == SQE_OTHER)
+		{
+			continue;
+		}
+		memset(&attrs, 0, sizeof(attrs));
+		attrs.name = column->name;
+		attrs.namelen = column->namelen;
+		if(sparql_query_startel_(scan->query, SQE_BINDING, "binding", 7, &attrs))
+		{
+			return -1;
+		}
+		attrs.name = NULL;
+		attrs.namelen = 0;
+		if(column->el == SQE_LITERAL)
+		{
+			if(column->has_lang)
+			{
+				attrs.lang = column->lang.buf;
+				attrs.langlen = column->lang.len;
+			}
+			if(column->has_datatype)
+			{
+				attrs.datatype = column->datatype.buf;
+				attrs.datatypelen = column->datatype.len;
+			}
+		}
+		if(sparql_query_startel_(scan->query, column->el, (column->el == SQE_URI ? "uri" : (column->el == SQE_BNODE ? "bnode" : "literal")), (column->el == SQE_URI ? 3 : (column->el == SQE_BNODE ? 5 : 7)), &attrs) ||
+		   (column->value.len && sparql_query_characters_(scan->query, column->value.buf, column->value.len)) ||
+		   sparql_query_endel_(scan->query) ||
+		   sparql_query_endel_(scan->query))
+		{
+			return -1;
+		}
+	}
+	return sparql_query_endel_(scan->query);
+}
+
+/* Record a namespace declaration */
+static int
+sparql_binscan_namespace_(SPARQLBINSCAN *scan, unsigned long id, const struct sparql_binscan_str *ns)
+{
+	SPARQLSCANBUF *p;
+	size_t n;
+
+	if(id > 1048576)
+	{
+		return sparql_binscan_error_(scan, "namespace ID is out of range");
+	}
+	if(id >= scan->nnamespaces)
+	{
+		n = (id + 16) & ~((size_t) 15);
+		p = (SPARQLSCANBUF *) realloc(scan->namespaces, n * sizeof(SPARQLSCANBUF));
+		if(!p)
+		{
+			sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for namespace table\n");
+			return -1;
+		}
+		memset(&(p[scan->nnamespaces]), 0, (n - scan->nnamespaces) * sizeof(SPARQLSCANBUF));
+		scan->namespaces = p;
+		scan->nnamespaces = n;
+	}
+	return sparql_binscan_set_(scan, &(scan->namespaces[id]), ns, NULL);
+}
+
+static int
+sparql_binscan_byte_(struct sparql_binscan_cursor *cur, int *value)
+{
+	if(cur->p >= cur->end)
+	{
+		cur->need = (cur->p - cur->start) + 1;
+		return 1;
+	}
+	*value = *(cur->p);
+	cur->p++;
+	return 0;
+}
+
+static int
+sparql_binscan_int_(struct sparql_binscan_cursor *cur, unsigned long *value)
+{
+	if(cur->end - cur->p < 4)
+	{
+		cur->need = (cur->p - cur->start) + 4;
+		return 1;
+	}
+	*value = ((unsigned long) cur->p[0] << 24) | ((unsigned long) cur->p[1] << 16) | ((unsigned long) cur->p[2] << 8) | (unsigned long) cur->p[3];
+	cur->p += 4;
+	return 0;
+}
+
+static int
+sparql_binscan_string_(SPARQLBINSCAN *scan, struct sparql_binscan_cursor *cur, struct sparql_binscan_str *str)
+{
+	unsigned long len;
+	size_t hdr;
+
+	hdr = (scan->version == 1 ? 2 : 4);
+	if((size_t) (cur->end - cur->p) < hdr)
+	{
+		cur->need = (cur->p - cur->start) + hdr;
+		return 1;
+	}
+	if(hdr == 2)
+	{
+		len = ((unsigned long) cur->p[0] << 8) | (unsigned long) cur->p[1];
+	}
+	else
+	{
+		len = ((unsigned long) cur->p[0] << 24) | ((unsigned long) cur->p[1] << 16) | ((unsigned long) cur->p[2] << 8) | (unsigned long) cur->p[3];
+		if(len > 0x7fffffffUL)
+		{
+			return sparql_binscan_error_(scan, "invalid string length");
+		}
+	}
+	if((size_t) (cur->end - cur->p) < hdr + len)
+	{
+		cur->need = (cur->p - cur->start) + hdr + len;
+		return 1;
+	}
+	str->p = (const char *) cur->p + hdr;
+	str->len = len;
+	cur->p += hdr + len;
+	return 0;
+}
+
+/* Set the contents of <buf> to the concatenation of <a> and <b> */
+static int
+sparql_binscan_set_(SPARQLBINSCAN *scan, SPARQLSCANBUF *buf, const struct sparql_binscan_str *a, const struct sparql_binscan_str *b)
+{
+	buf->len = 0;
+	if(sparql_scanbuf_append_(scan->connection, buf, a->p, a->len))
+	{
+		return -1;
+	}
+	if(b && sparql_scanbuf_append_(scan->connection, buf, b->p, b->len))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_binscan_error_(SPARQLBINSCAN *scan, const char *what)
+{
+	sparql_logf_(scan->connection, LOG_ERR, "returned binary results table was not valid: %s\n", what);
+	return -1;
+}
@@ -0,0 +1,846 @@
+/* SPARQL client: streamed HTTP request bodies
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
+
+/* A request body is an ordered list of segments, each of which is either
+ * a buffer (which is referenced rather than copied unless explicitly
+ * requested) or a librdf_stream, which is serialised as N-Triples one
+ * statement at a time as cURL asks for more data. Segments may optionally
+ * be urlencoded as they are read, so that form-encoded bodies never need
+ * a second buffer. Files may be added as segments, too, in which case they
+ * are mapped into memory rather than read.
+ *
+ * If the connection has been configured to compress request bodies, the
+ * output is compressed as it is read, too, using a fixed-size staging
+ * buffer.
+ */
+
+#define BODY_SEGMENT_BLOCK              8
+#define BODY_COMPRESS_BUFSIZE           65536
+/* Bodies smaller than this aren't worth compressing */
+#define BODY_COMPRESS_MIN               1024
+
+struct sparql_body_segment_struct
+{
+	const char *buf;
+	size_t len;
+	char *alloc;
+	void *map;
+	librdf_stream *stream;
+	int encode;
+};
+
+struct sparql_body_struct
+{
+	SPARQL *connection;
+	int encode;
+	struct sparql_body_segment_struct *segments;
+	size_t count;
+	size_t size;
+	/* Read cursor */
+	size_t current;
+	size_t pos;
+	/* Serialisation buffer for stream segments */
+	raptor_iostream *iostr;
+	char *pending;
+	size_t pendlen;
+	size_t pendsize;
+	size_t pendpos;
+	int error;
+	/* Compression state */
+	int compress;
+	int eof;
+	int finished;
+	char *zbuf;
+	size_t zlen;
+	size_t zpos;
+#ifdef HAVE_LIBZ
+	z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_CStream *zcs;
+#endif
+};
+
+static struct sparql_body_segment_struct *sparql_body_segment_(SPARQLBODY *body);
+static size_t sparql_body_read_raw_(SPARQLBODY *body, char *buf, size_t size);
+static int sparql_body_compress_init_(SPARQLBODY *body, int method);
+static size_t sparql_body_read_compressed_(SPARQLBODY *body, char *buf, size_t size);
+static void sparql_body_compress_cleanup_(SPARQLBODY *body);
+static size_t sparql_body_copy_(char *dest, size_t destlen, const char *src, size_t srclen, int encode, size_t *consumed);
+static size_t sparql_body_curl_read_(char *ptr, size_t size, size_t nemb, void *userdata);
+static int sparql_body_curl_seek_(void *userdata, curl_off_t offset, int origin);
+static int sparql_body_iostream_write_byte_(void *context, const int byte);
+static int sparql_body_iostream_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb);
+
+static const raptor_iostream_handler sparql_body_iostream_handler_ = {
+	2,
+	NULL,
+	NULL,
+	sparql_body_iostream_write_byte_,
+	sparql_body_iostream_write_bytes_,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Create a new request body; if <prefix> is not NULL, it is copied and
+ * will be emitted verbatim at the start of the body. If <encode> is
+ * nonzero, all subsequently-added segments will be urlencoded as they are
+ * read.
+ */
+SPARQLBODY *
+sparql_body_create_(SPARQL *connection, const char *prefix, int encode)
+{
+	SPARQLBODY *p;
+
+	p = (SPARQLBODY *) calloc(1, sizeof(SPARQLBODY));
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for request body\n");
+		return NULL;
+	}
+	p->connection = connection;
+	if(prefix)
+	{
+		if(sparql_body_add_copy_(p, prefix, strlen(prefix)))
+		{
+			sparql_body_destroy_(p);
+			return NULL;
+		}
+	}
+	p->encode = encode;
+	return p;
+}
+
+int
+sparql_body_destroy_(SPARQLBODY *body)
+{
+	size_t c;
+
+	for(c = 0; c < body->count; c++)
+	{
+		free(body->segments[c].alloc);
+		if(body->segments[c].map)
+		{
+			munmap(body->segments[c].map, body->segments[c].len);
+		}
+	}
+	if(body->iostr)
+	{
+		raptor_free_iostream(body->iostr);
+	}
+	sparql_body_compress_cleanup_(body);
+	free(body->pending);
+	free(body->segments);
+	free(body);
+	return 0;
+}
+
+/* Append a reference to a buffer, which must remain valid until the body
+ * has been sent
+ */
+int
+sparql_body_add_(SPARQLBODY *body, const char *buf, size_t length)
+{
+	struct sparql_body_segment_struct *seg;
+
+	if(!length)
+	{
+		return 0;
+	}
+	seg = sparql_body_segment_(body);
+	if(!seg)
+	{
+		return -1;
+	}
+	seg->buf = buf;
+	seg->len = length;
+	return 0;
+}
+
+/* Append a copy of a (typically small) buffer */
+int
+sparql_body_add_copy_(SPARQLBODY *body, const char *buf, size_t length)
+{
+	struct sparql_body_segment_struct *seg;
+
+	if(!length)
+	{
+		return 0;
+	}
+	seg = sparql_body_segment_(body);
+	if(!seg)
+	{
+		return -1;
+	}
+	seg->alloc = (char *) malloc(length);
+	if(!seg->alloc)
+	{
+		sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to allocate %u bytes for request body segment\n", (unsigned) length);
+		body->count--;
+		return -1;
+	}
+	memcpy(seg->alloc, buf, length);
+	seg->buf = seg->alloc;
+	seg->len = length;
+	return 0;
+}
+
+int
+sparql_body_add_str_(SPARQLBODY *body, const char *str)
+{
+	return sparql_body_add_(body, str, strlen(str));
+}
+
+/* Append the contents of the file at <path>, which is mapped into memory
+ * for the lifetime of the body
+ */
+int
+sparql_body_add_file_(SPARQLBODY *body, const char *path)
+{
+	struct sparql_body_segment_struct *seg;
+	struct stat sbuf;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		sparql_logf_(body->connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+		sparql_set_error_(body->connection, SPARQLSTATE_FILE, "failed to open file for upload");
+		return -1;
+	}
+	if(fstat(fd, &sbuf))
+	{
+		sparql_logf_(body->connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+		sparql_set_error_(body->connection, SPARQLSTATE_FILE, "failed to obtain information about file for upload");
+		close(fd);
+		return -1;
+	}
+	if(!S_ISREG(sbuf.st_mode))
+	{
+		sparql_logf_(body->connection, LOG_ERR, "SPARQL: %s: not a regular file\n", path);
+		sparql_set_error_(body->connection, SPARQLSTATE_FILE, "file for upload is not a regular file");
+		close(fd);
+		return -1;
+	}
+	if(!sbuf.st_size)
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t) sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		sparql_logf_(body->connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+		sparql_set_error_(body->connection, SPARQLSTATE_FILE, "failed to map file for upload");
+		return -1;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t) sbuf.st_size, MADV_SEQUENTIAL);
+#endif
+	seg = sparql_body_segment_(body);
+	if(!seg)
+	{
+		munmap(map, (size_t) sbuf.st_size);
+		return -1;
+	}
+	seg->map = map;
+	seg->buf = (const char *) map;
+	seg->len = (size_t) sbuf.st_size;
+	return 0;
+}
+
+/* Append a stream of statements, which will be serialised as N-Triples
+ * as the body is read; the stream is not freed when the body is destroyed.
+ */
+int
+sparql_body_add_stream_(SPARQLBODY *body, librdf_stream *stream)
+{
+	struct sparql_body_segment_struct *seg;
+	librdf_world *world;
+
+	if(!body->iostr)
+	{
+		world = sparql_world(body->connection);
+		if(!world)
+		{
+			return -1;
+		}
+		body->iostr = raptor_new_iostream_from_handler(librdf_world_get_raptor(world), (void *) body, &sparql_body_iostream_handler_);
+		if(!body->iostr)
+		{
+			sparql_set_error_(body->connection, SPARQLSTATE_CREATE_STREAM, "failed to create Raptor iostream for statement serialisation");
+			return -1;
+		}
+	}
+	seg = sparql_body_segment_(body);
+	if(!seg)
+	{
+		return -1;
+	}
+	seg->stream = stream;
+	return 0;
+}
+
+/* Return the length of the body as it will be sent, or -1 if it cannot
+ * be determined without reading it (because it includes a stream)
+ */
+curl_off_t
+sparql_body_length_(SPARQLBODY *body)
+{
+	curl_off_t len;
+	size_t c;
+
+	len = 0;
+	for(c = 0; c < body->count; c++)
+	{
+		if(body->segments[c].stream)
+		{
+			return -1;
+		}
+		if(body->segments[c].encode)
+		{
+			len += sparql_urlencode_lsize_(body->segments[c].buf, body->segments[c].len) - 1;
+		}
+		else
+		{
+			len += body->segments[c].len;
+		}
+	}
+	return len;
+}
+
+/* Read up to <size> bytes of the body into <buf>; returns the number of
+ * bytes read, zero at the end of the body, or (size_t) -1 if an error
+ * occurs.
+ */
+size_t
+sparql_body_read_(SPARQLBODY *body, char *buf, size_t size)
+{
+	if(body->compress)
+	{
+		return sparql_body_read_compressed_(body, buf, size);
+	}
+	return sparql_body_read_raw_(body, buf, size);
+}
+
+/* Read up to <size> bytes of the uncompressed body */
+static size_t
+sparql_body_read_raw_(SPARQLBODY *body, char *buf, size_t size)
+{
+	struct sparql_body_segment_struct *seg;
+	librdf_statement *statement;
+	size_t len, n, consumed;
+
+	if(body->error)
+	{
+		return (size_t) -1;
+	}
+	len = 0;
+	while(len < size && body->current < body->count)
+	{
+		seg = &(body->segments[body->current]);
+		if(body->pendpos < body->pendlen)
+		{
+			n = sparql_body_copy_(buf + len, size - len, body->pending + body->pendpos, body->pendlen - body->pendpos, seg->encode, &consumed);
+			if(!consumed)
+			{
+				break;
+			}
+			body->pendpos += consumed;
+			len += n;
+			continue;
+		}
+		if(seg->stream)
+		{
+			if(librdf_stream_end(seg->stream))
+			{
+				body->current++;
+				body->pos = 0;
+				continue;
+			}
+			statement = librdf_stream_get_object(seg->stream);
+			body->pendlen = body->pendpos = 0;
+			if(statement && sparql_statement_write_(body->connection, statement, body->iostr))
+			{
+				body->error = 1;
+				return (size_t) -1;
+			}
+			librdf_stream_next(seg->stream);
+			continue;
+		}
+		if(body->pos >= seg->len)
+		{
+			body->current++;
+			body->pos = 0;
+			continue;
+		}
+		n = sparql_body_copy_(buf + len, size - len, seg->buf + body->pos, seg->len - body->pos, seg->encode, &consumed);
+		if(!consumed)
+		{
+			break;
+		}
+		body->pos += consumed;
+		len += n;
+	}
+	return len;
+}
+
+/* Serialise a single statement as an N-Quads line, in the named <graph>
+ * (or the default graph if it is NULL), to <iostr>
+ */
+int
+sparql_quad_write_(SPARQL *connection, librdf_statement *statement, const char *graph, raptor_iostream *iostr)
+{
+	if(!graph)
+	{
+		return sparql_statement_write_(connection, statement, iostr);
+	}
+	if(librdf_node_write(librdf_statement_get_subject(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_predicate(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_object(statement), iostr) ||
+	   raptor_iostream_counted_string_write(" <", 2, iostr) ||
+	   raptor_iostream_string_write(graph, iostr) ||
+	   raptor_iostream_counted_string_write("> .\n", 4, iostr))
+	{
+		sparql_set_error_(connection, SPARQLSTATE_SERIALISE, "failed to serialise statement");
+		return -1;
+	}
+	return 0;
+}
+
+/* Serialise a single statement as N-Triples to <iostr> */
+int
+sparql_statement_write_(SPARQL *connection, librdf_statement *statement, raptor_iostream *iostr)
+{
+	if(librdf_node_write(librdf_statement_get_subject(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_predicate(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_object(statement), iostr) ||
+	   raptor_iostream_counted_string_write(" .\n", 3, iostr))
+	{
+		sparql_set_error_(connection, SPARQLSTATE_SERIALISE, "failed to serialise statement");
+		return -1;
+	}
+	return 0;
+}
+
+/* Attach the body to a cURL handle as the payload of a POST (or a PUT, if
+ * CURLOPT_CUSTOMREQUEST is also set). Any headers which must be sent as
+ * a result are appended to <headers>.
+ */
+int
+sparql_body_attach_(SPARQLBODY *body, CURL *ch, struct curl_slist **headers)
+{
+	curl_off_t len;
+	struct curl_slist *p;
+	const char *encoding;
+
+	len = sparql_body_length_(body);
+	encoding = NULL;
+	if(body->connection->compress != SPARQL_COMPRESS_NONE &&
+	   (len < 0 || len >= BODY_COMPRESS_MIN))
+	{
+		if(sparql_body_compress_init_(body, body->connection->compress))
+		{
+			sparql_set_error_(body->connection, SPARQLSTATE_COMPRESS, "failed to initialise request body compression");
+			return -1;
+		}
+		encoding = (body->compress == SPARQL_COMPRESS_ZSTD ? "Content-Encoding: zstd" : "Content-Encoding: gzip");
+		/* The compressed length can't be known in advance */
+		len = -1;
+	}
+	curl_easy_setopt(ch, CURLOPT_POST, 1);
+	curl_easy_setopt(ch, CURLOPT_READFUNCTION, sparql_body_curl_read_);
+	curl_easy_setopt(ch, CURLOPT_READDATA, (void *) body);
+	curl_easy_setopt(ch, CURLOPT_SEEKFUNCTION, sparql_body_curl_seek_);
+	curl_easy_setopt(ch, CURLOPT_SEEKDATA, (void *) body);
+	if(encoding)
+	{
+		p = curl_slist_append(*headers, encoding);
+		if(!p)
+		{
+			sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to append HTTP header\n");
+			return -1;
+		}
+		*headers = p;
+	}
+	if(len >= 0)
+	{
+		curl_easy_setopt(ch, CURLOPT_POSTFIELDSIZE_LARGE, len);
+		return 0;
+	}
+	p = curl_slist_append(*headers, "Transfer-Encoding: chunked");
+	if(!p)
+	{
+		sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to append HTTP header\n");
+		return -1;
+	}
+	*headers = p;
+	return 0;
+}
+
+static struct sparql_body_segment_struct *
+sparql_body_segment_(SPARQLBODY *body)
+{
+	struct sparql_body_segment_struct *p;
+
+	if(body->count + 1 > body->size)
+	{
+		p = (struct sparql_body_segment_struct *) realloc(body->segments, sizeof(struct sparql_body_segment_struct) * (body->size + BODY_SEGMENT_BLOCK));
+		if(!p)
+		{
+			sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to reallocate request body segment list\n");
+			return NULL;
+		}
+		body->segments = p;
+		body->size += BODY_SEGMENT_BLOCK;
+	}
+	p = &(body->segments[body->count]);
+	body->count++;
+	memset(p, 0, sizeof(struct sparql_body_segment_struct));
+	p->encode = body->encode;
+	return p;
+}
+
+/* Copy as much of <src> into <dest> as will fit, urlencoding it if
+ * <encode> is nonzero; <consumed> is set to the number of source bytes
+ * used and the number of bytes written is returned.
+ */
+static size_t
+sparql_body_copy_(char *dest, size_t destlen, const char *src, size_t srclen, int encode, size_t *consumed)
+{
+	static const char *xdigit = "0123456789abcdef";
+	size_t n;
+	int ch;
+
+	if(!encode)
+	{
+		n = (srclen < destlen ? srclen : destlen);
+		memcpy(dest, src, n);
+		*consumed = n;
+		return n;
+	}
+	n = 0;
+	*consumed = 0;
+	for(; srclen; src++, srclen--)
+	{
+		if((*src >= 'a' && *src <= 'z') ||
+		   (*src >= 'A' && *src <= 'Z') ||
+		   (*src >= '0' && *src <= '9') ||
+		   *src == '-' ||
+		   *src == '.' ||
+		   *src == '_' ||
+		   *src == '~')
+		{
+			if(n + 1 > destlen)
+			{
+				break;
+			}
+			dest[n] = *src;
+			n++;
+		}
+		else
+		{
+			if(n + 3 > destlen)
+			{
+				break;
+			}
+			ch = (unsigned char) *src;
+			dest[n] = '%';
+			dest[n + 1] = xdigit[ch >> 4];
+			dest[n + 2] = xdigit[ch & 0x0f];
+			n += 3;
+		}
+		(*consumed)++;
+	}
+	return n;
+}
+
+static size_t
+sparql_body_curl_read_(char *ptr, size_t size, size_t nemb, void *userdata)
+{
+	SPARQLBODY *body = (SPARQLBODY *) userdata;
+	size_t r;
+
+	r = sparql_body_read_(body, ptr, size * nemb);
+	if(r == (size_t) -1)
+	{
+		sparql_logf_(body->connection, LOG_ERR, "SPARQL: failed to generate request body\n");
+		return CURL_READFUNC_ABORT;
+	}
+	return r;
+}
+
+/* cURL may need to rewind the body when following a redirect or
+ * performing authentication; this is only possible if the body does not
+ * contain any streams, which can be read only once.
+ */
+static int
+sparql_body_curl_seek_(void *userdata, curl_off_t offset, int origin)
+{
+	SPARQLBODY *body = (SPARQLBODY *) userdata;
+	size_t c;
+	int method;
+
+	if(offset != 0 || origin != SEEK_SET)
+	{
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	for(c = 0; c < body->count; c++)
+	{
+		if(body->segments[c].stream)
+		{
+			return CURL_SEEKFUNC_CANTSEEK;
+		}
+	}
+	body->current = 0;
+	body->pos = 0;
+	body->pendlen = body->pendpos = 0;
+	if(body->compress)
+	{
+		method = body->compress;
+		sparql_body_compress_cleanup_(body);
+		if(sparql_body_compress_init_(body, method))
+		{
+			return CURL_SEEKFUNC_FAIL;
+		}
+	}
+	return CURL_SEEKFUNC_OK;
+}
+
+static int
+sparql_body_compress_init_(SPARQLBODY *body, int method)
+{
+	body->eof = 0;
+	body->finished = 0;
+	body->zlen = body->zpos = 0;
+	if(!body->zbuf)
+	{
+		body->zbuf = (char *) malloc(BODY_COMPRESS_BUFSIZE);
+		if(!body->zbuf)
+		{
+			sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to allocate %u bytes for compression buffer\n", (unsigned) BODY_COMPRESS_BUFSIZE);
+			return -1;
+		}
+	}
+	switch(method)
+	{
+#ifdef HAVE_LIBZ
+	case SPARQL_COMPRESS_GZIP:
+		memset(&(body->zs), 0, sizeof(z_stream));
+		/* A window size of 15 + 16 selects a gzip wrapper */
+		if(deflateInit2(&(body->zs), Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			sparql_logf_(body->connection, LOG_ERR, "SPARQL: failed to initialise gzip compression\n");
+			return -1;
+		}
+		body->compress = method;
+		return 0;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SPARQL_COMPRESS_ZSTD:
+		body->zcs = ZSTD_createCStream();
+		if(!body->zcs || ZSTD_isError(ZSTD_initCStream(body->zcs, 3)))
+		{
+			sparql_logf_(body->connection, LOG_ERR, "SPARQL: failed to initialise zstd compression\n");
+			return -1;
+		}
+		body->compress = method;
+		return 0;
+#endif
+	default:
+		break;
+	}
+	sparql_logf_(body->connection, LOG_ERR, "SPARQL: the requested request body compression method is not supported by this build\n");
+	return -1;
+}
+
+/* Fill <buf> with compressed output, reading raw body data into the
+ * staging buffer as the compressor consumes it
+ */
+static size_t
+sparql_body_read_compressed_(SPARQLBODY *body, char *buf, size_t size)
+{
+	size_t len, n;
+#ifdef HAVE_LIBZ
+	int r;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t zr;
+#endif
+#if !defined(HAVE_LIBZ) && !defined(HAVE_LIBZSTD)
+	(void) buf;
+#endif
+
+	len = 0;
+	while(len < size && !body->finished)
+	{
+		if(body->zpos >= body->zlen && !body->eof)
+		{
+			n = sparql_body_read_raw_(body, body->zbuf, BODY_COMPRESS_BUFSIZE);
+			if(n == (size_t) -1)
+			{
+				return (size_t) -1;
+			}
+			if(!n)
+			{
+				body->eof = 1;
+			}
+			body->zlen = n;
+			body->zpos = 0;
+		}
+#ifdef HAVE_LIBZ
+		if(body->compress == SPARQL_COMPRESS_GZIP)
+		{
+			body->zs.next_in = (Bytef *) (body->zbuf + body->zpos);
+			body->zs.avail_in = (uInt) (body->zlen - body->zpos);
+			body->zs.next_out = (Bytef *) (buf + len);
+			body->zs.avail_out = (uInt) (size - len);
+			r = deflate(&(body->zs), body->eof ? Z_FINISH : Z_NO_FLUSH);
+			if(r == Z_STREAM_ERROR)
+			{
+				sparql_logf_(body->connection, LOG_ERR, "SPARQL: gzip compression of request body failed\n");
+				return (size_t) -1;
+			}
+			body->zpos = body->zlen - body->zs.avail_in;
+			len = size - body->zs.avail_out;
+			if(r == Z_STREAM_END)
+			{
+				body->finished = 1;
+			}
+			continue;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		if(body->compress == SPARQL_COMPRESS_ZSTD)
+		{
+			in.src = body->zbuf;
+			in.size = body->zlen;
+			in.pos = body->zpos;
+			out.dst = buf;
+			out.size = size;
+			out.pos = len;
+			if(body->eof)
+			{
+				zr = ZSTD_endStream(body->zcs, &out);
+				if(!ZSTD_isError(zr) && !zr)
+				{
+					body->finished = 1;
+				}
+			}
+			else
+			{
+				zr = ZSTD_compressStream(body->zcs, &out, &in);
+			}
+			if(ZSTD_isError(zr))
+			{
+				sparql_logf_(body->connection, LOG_ERR, "SPARQL: zstd compression of request body failed: %s\n", ZSTD_getErrorName(zr));
+				return (size_t) -1;
+			}
+			body->zpos = in.pos;
+			len = out.pos;
+			continue;
+		}
+#endif
+		return (size_t) -1;
+	}
+	return len;
+}
+
+static void
+sparql_body_compress_cleanup_(SPARQLBODY *body)
+{
+#ifdef HAVE_LIBZ
+	if(body->compress == SPARQL_COMPRESS_GZIP)
+	{
+		deflateEnd(&(body->zs));
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	if(body->zcs)
+	{
+		ZSTD_freeCStream(body->zcs);
+		body->zcs = NULL;
+	}
+#endif
+	body->compress = 0;
+	free(body->zbuf);
+	body->zbuf = NULL;
+}
+
+static int
+sparql_body_iostream_write_byte_(void *context, const int byte)
+{
+	char ch;
+
+	ch = (char) byte;
+	return (sparql_body_iostream_write_bytes_(context, &ch, 1, 1) == 1 ? 0 : 1);
+}
+
+/* As with fwrite(), returns the number of items written */
+static int
+sparql_body_iostream_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb)
+{
+	SPARQLBODY *body = (SPARQLBODY *) context;
+	char *p;
+	size_t l;
+
+	size *= nmemb;
+	if(body->pendlen + size > body->pendsize)
+	{
+		l = (((body->pendlen + size) / 1024) + 1) * 1024;
+		p = (char *) realloc(body->pending, l);
+		if(!p)
+		{
+			sparql_logf_(body->connection, LOG_CRIT, "SPARQL: failed to reallocate serialisation buffer to %u bytes\n", (unsigned) l);
+			return -1;
+		}
+		body->pending = p;
+		body->pendsize = l;
+	}
+	memcpy(&(body->pending[body->pendlen]), ptr, size);
+	body->pendlen += size;
+	return (int) nmemb;
+}
@@ -25,6 +25,11 @@
 
 static int sparql_librdf_logger_(void *data, librdf_log_message *message);
 static char *sparql_derive_uri_(SPARQL *connection, const URI *base, URI_INFO *info, const char *key, const char *defuri);
+static int sparql_derive_flag_(URI_INFO *info, const char *key, int defval);
+static int sparql_derive_compress_(URI_INFO *info, const char *key, int defval);
+static int sparql_compress_supported_(SPARQL *connection, int method);
+static int sparql_derive_model_mode_(URI_INFO *info, const char *key, int defval);
+static int sparql_derive_storage_(URI_INFO *info, const char *key, int defval);
 
 /* Create a new SPARQL client connection */
 SPARQL *
@@ -37,6 +42,10 @@ sparql_create(const char *base)
 	{
 		return NULL;
 	}
+	p->parallel = SPARQL_DEFAULT_PARALLEL;
+	p->chunk_bytes = SPARQL_DEFAULT_CHUNK_BYTES;
+	p->chunk_triples = SPARQL_DEFAULT_CHUNK_TRIPLES;
+	p->xml_scan = 1;
 	if(base)
 	{
 		if(sparql_set_base(p, base))
@@ -48,9 +57,75 @@ sparql_create(const char *base)
 	return p;
 }
 
+/* Create a new connection with the same endpoints and options as an
+ * existing one, for use by a background thread (which must not share
+ * the original's librdf world or cURL state)
+ */
+SPARQL *
+sparql_clone_(SPARQL *connection)
+{
+	SPARQL *p;
+	char *s;
+
+	p = sparql_create(NULL);
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for new connection\n");
+		return NULL;
+	}
+	if(connection->base)
+	{
+		s = uri_stralloc(connection->base);
+		p->base = (s ? uri_create_str(s, NULL) : NULL);
+		free(s);
+		if(!p->base)
+		{
+			sparql_destroy(p);
+			return NULL;
+		}
+	}
+	p->query_uri = (connection->query_uri ? strdup(connection->query_uri) : NULL);
+	p->update_uri = (connection->update_uri ? strdup(connection->update_uri) : NULL);
+	p->data_uri = (connection->data_uri ? strdup(connection->data_uri) : NULL);
+	if((connection->query_uri && !p->query_uri) ||
+	   (connection->update_uri && !p->update_uri) ||
+	   (connection->data_uri && !p->data_uri))
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for new connection\n");
+		sparql_destroy(p);
+		return NULL;
+	}
+	p->update_form = connection->update_form;
+	p->post_form = connection->post_form;
+	p->data_quads = connection->data_quads;
+	p->xml_scan = connection->xml_scan;
+	if(connection->accept)
+	{
+		p->accept = strdup(connection->accept);
+		if(!p->accept)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for new connection\n");
+			sparql_destroy(p);
+			return NULL;
+		}
+	}
+	p->parallel = connection->parallel;
+	p->chunk_bytes = connection->chunk_bytes;
+	p->chunk_triples = connection->chunk_triples;
+	p->compress = connection->compress;
+	p->model_mode = connection->model_mode;
+	p->results_storage = connection->results_storage;
+	p->verbose = connection->verbose;
+	p->logger = connection->logger;
+	return p;
+}
+
 int
 sparql_destroy(SPARQL *connection)
 {
+	sparql_journal_destroy_(connection);
+	sparql_writebuf_destroy_(connection);
+	sparql_manifest_destroy_(connection);
 	if(connection->world_alloc)
 	{
 		librdf_free_world(connection->world);
@@ -62,6 +137,7 @@ sparql_destroy(SPARQL *connection)
 	free(connection->query_uri);
 	free(connection->update_uri);
 	free(connection->data_uri);
+	free(connection->accept);
 	free(connection->error);
 	free(connection->capture.buf);
 	free(connection);
@@ -132,6 +208,19 @@ sparql_set_nerror_(SPARQL *connection, int status, const char *error)
 	sparql_set_error_(connection, buf, error);
 }
 
+/* Determine whether the last error is one which might not recur if the
+ * request were retried: a transport failure or a server error
+ */
+int
+sparql_error_transient_(SPARQL *connection)
+{
+	if(!isdigit((unsigned char) connection->state[0]))
+	{
+		return 0;
+	}
+	return (atoi(connection->state) >= 500);
+}
+
 /* Set the SPARQL server's base URI
  *
  * We accept URIs in the following forms:
@@ -146,6 +235,31 @@ sparql_set_nerror_(SPARQL *connection, int status, const char *error)
  *  query-uri=xxxx      Specify an alternative query URI (defaults to 'sparql')
  *  update-uri=xxxx     Specify an alternative update URI (defaults to 'sparql')
  *  data-uri=xxxx       Specify an alternative PUT/POST data URI (no default)
+ *  update-form=yes|no  Send updates as urlencoded 'update=' forms rather
+ *                      than as application/sparql-update (defaults to 'no')
+ *  post-form=yes|no    POST data as urlencoded forms rather than as Turtle
+ *                      request bodies (defaults to 'no')
+ *  data-quads=yes|no   The data endpoint accepts N-Quads POSTed to it
+ *                      without a graph parameter (defaults to 'no')
+ *  xml-scanner=yes|no  Parse XML query results with the built-in scanner,
+ *                      falling back to libxml2 for documents it doesn't
+ *                      handle, rather than always using libxml2 (defaults
+ *                      to 'yes')
+ *  results-formats=xxxx
+ *                      Comma-separated list of the query results formats to
+ *                      request, in order of preference; see
+ *                      sparql_set_results_formats()
+ *  compress=none|gzip|zstd
+ *                      Compress PUT, POST and update request bodies
+ *                      (defaults to 'none'); an unrecognised method, or
+ *                      one which this build doesn't support, is an error
+ *  model-add=lookup|bulk|nodedup
+ *                      How sparql_query_model() adds statements in named
+ *                      graphs; see sparql_set_model_mode() (defaults to
+ *                      'lookup')
+ *  results-storage=rows|columns
+ *                      How result-sets are stored; see
+ *                      sparql_set_results_storage() (defaults to 'rows')
  *
  * URIs specified in OPTIONS are resolved relative to the base path.
  *
@@ -154,7 +268,9 @@ sparql_set_nerror_(SPARQL *connection, int status, const char *error)
  *
  * 4store+http[s]://server/basepath
  *     Connect to a 4store server. The default query-uri is /sparql, the default
- *     update-uri is /update, and the default data-uri is /data.
+ *     update-uri is /update, and the default data-uri is /data. Updates
+ *     and POSTed data are sent as urlencoded forms unless update-form=no
+ *     or post-form=no are specified.
  *
  * Note that invoking this function will replace any existing base, query,
  * update or data URIs and options.
@@ -165,8 +281,9 @@ sparql_set_base(SPARQL *connection, const char *uri)
 {
 	URI *base;
 	URI_INFO *info;
-	char *basestr, *query, *update, *data;
-	const char *def_query = "sparql/", *def_update = "sparql/", *def_data = NULL;
+	char *basestr, *query, *update, *data, *accept;
+	const char *formats, *def_query = "sparql/", *def_update = "sparql/", *def_data = NULL;
+	int def_form = 0, update_form, post_form, data_quads, xml_scan, compress, model_mode, storage;
 
 	basestr = NULL;
 	if(!strncmp(uri, "sparql+http:", 11) || !strncmp(uri, "sparql+https:", 12))
@@ -192,6 +309,7 @@ sparql_set_base(SPARQL *connection, const char *uri)
 	{
 		def_update = "update/";
 		def_data = "data/";
+		def_form = 1;
 		uri += 7; /* Skip '4store+' */
 	}
 	else if(!strncmp(uri, "4store:", 7) || !strncmp(uri, "4stores:", 8))
@@ -209,6 +327,7 @@ sparql_set_base(SPARQL *connection, const char *uri)
 		}
 		def_update = "update/";
 		def_data = "data/";
+		def_form = 1;
 		uri = basestr;
 	}
 	base = uri_create_str(uri, NULL);
@@ -231,13 +350,43 @@ sparql_set_base(SPARQL *connection, const char *uri)
 	query = sparql_derive_uri_(connection, base, info, "query-uri", def_query);
 	update = sparql_derive_uri_(connection, base, info, "update-uri", def_update);
 	data = sparql_derive_uri_(connection, base, info, "data-uri", def_data);
+	update_form = sparql_derive_flag_(info, "update-form", def_form);
+	post_form = sparql_derive_flag_(info, "post-form", def_form);
+	data_quads = sparql_derive_flag_(info, "data-quads", 0);
+	xml_scan = sparql_derive_flag_(info, "xml-scanner", 1);
+	compress = sparql_derive_compress_(info, "compress", SPARQL_COMPRESS_NONE);
+	model_mode = sparql_derive_model_mode_(info, "model-add", SPARQL_MODEL_LOOKUP);
+	storage = sparql_derive_storage_(info, "results-storage", SPARQL_RESULTS_ROWS);
+	formats = uri_info_get(info, "results-formats", NULL);
+	accept = ((formats && formats[0]) ? sparql_query_accept_(connection, formats) : NULL);
 
+	if(formats && formats[0] && !accept)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_RESULTS_FORMAT, "Invalid results-formats option in base URI");
+		uri_info_destroy(info);
+		uri_destroy(base);
+		free(query);
+		free(update);
+		free(data);
+		return -1;
+	}
+	if(sparql_compress_supported_(connection, compress))
+	{
+		uri_info_destroy(info);
+		uri_destroy(base);
+		free(query);
+		free(update);
+		free(data);
+		free(accept);
+		return -1;
+	}
 	uri_info_destroy(info);
 	
 	if(!query)
 	{
 		sparql_set_error_(connection, SPARQLSTATE_URI_QUERY, "Failed to derived query URI from base URI");
 		uri_destroy(base);
+		free(accept);
 		return -1;
 	}
 	free(connection->query_uri);
@@ -251,6 +400,15 @@ sparql_set_base(SPARQL *connection, const char *uri)
 	connection->query_uri = query;
 	connection->update_uri = update;
 	connection->data_uri = data;
+	connection->update_form = update_form;
+	connection->post_form = post_form;
+	connection->data_quads = data_quads;
+	connection->xml_scan = xml_scan;
+	free(connection->accept);
+	connection->accept = accept;
+	connection->compress = compress;
+	connection->model_mode = model_mode;
+	connection->results_storage = storage;
 
 	return 0;
 }
@@ -317,6 +475,171 @@ sparql_set_verbose(SPARQL *connection, int verbose)
 	return 0;
 }
 
+/* Specify whether updates should be sent as urlencoded forms (as required
+ * by 4store) instead of as application/sparql-update request bodies
+ */
+int
+sparql_set_update_form(SPARQL *connection, int form)
+{
+	connection->update_form = (form ? 1 : 0);
+	return 0;
+}
+
+/* Specify whether data should be POSTed as urlencoded forms (as required
+ * by 4store) instead of as Turtle request bodies
+ */
+int
+sparql_set_post_form(SPARQL *connection, int form)
+{
+	connection->post_form = (form ? 1 : 0);
+	return 0;
+}
+
+/* Specify whether XML query results should be parsed using the built-in
+ * scanner (which falls back to libxml2 for documents it doesn't handle)
+ * rather than always using libxml2
+ */
+int
+sparql_set_xml_scanner(SPARQL *connection, int scanner)
+{
+	connection->xml_scan = (scanner ? 1 : 0);
+	return 0;
+}
+
+/* Specify the query results formats which should be requested, as a
+ * comma-separated list in order of preference. Each entry is either one of
+ * the short names "binary", "json", "tsv" or "xml" (for result sets),
+ * "nquads", "ntriples", "turtle", "trig" or "rdfxml" (for the graphs returned
+ * by CONSTRUCT and DESCRIBE), or a MIME type, and may be followed by
+ * parameters, such as an explicit q-value; otherwise,
+ * q-values are assigned in descending order. Passing NULL restores the
+ * default list.
+ *
+ * Responses are parsed according to their Content-Type, whatever was
+ * requested.
+ */
+int
+sparql_set_results_formats(SPARQL *connection, const char *formats)
+{
+	char *accept;
+
+	accept = NULL;
+	if(formats)
+	{
+		accept = sparql_query_accept_(connection, formats);
+		if(!accept)
+		{
+			sparql_set_error_(connection, SPARQLSTATE_RESULTS_FORMAT, "Invalid list of results formats");
+			return -1;
+		}
+	}
+	free(connection->accept);
+	connection->accept = accept;
+	return 0;
+}
+
+/* Specify whether the data endpoint accepts N-Quads, allowing statements
+ * in multiple graphs to be POSTed in a single request
+ */
+int
+sparql_set_data_quads(SPARQL *connection, int quads)
+{
+	connection->data_quads = (quads ? 1 : 0);
+	return 0;
+}
+
+/* Specify the maximum number of requests which will be performed
+ * concurrently when uploading data in chunks
+ */
+int
+sparql_set_parallel(SPARQL *connection, size_t parallel)
+{
+	connection->parallel = (parallel ? parallel : 1);
+	return 0;
+}
+
+/* Specify the approximate maximum size, in bytes and in triples, of each
+ * chunk when uploading data in chunks; zero means no limit
+ */
+int
+sparql_set_chunk_limits(SPARQL *connection, size_t bytes, size_t triples)
+{
+	connection->chunk_bytes = bytes;
+	connection->chunk_triples = triples;
+	return 0;
+}
+
+/* Specify whether request bodies should be compressed, and how; note that
+ * the server must support the chosen Content-Encoding for requests
+ */
+int
+sparql_set_compression(SPARQL *connection, int method)
+{
+	if(sparql_compress_supported_(connection, method))
+	{
+		return -1;
+	}
+	connection->compress = method;
+	return 0;
+}
+
+/* Specify how sparql_query_model() adds statements in named graphs to the
+ * model:
+ *
+ * SPARQL_MODEL_LOOKUP        Search the model for each statement before
+ *                            adding it (the default)
+ * SPARQL_MODEL_BULK          Discard duplicates within each response using
+ *                            a client-side hash table, and add statements in
+ *                            batches of transactions where the storage
+ *                            supports them
+ * SPARQL_MODEL_BULK_NODEDUP  As SPARQL_MODEL_BULK, but without any
+ *                            de-duplication
+ *
+ * In the bulk modes, statements which were already present in the model
+ * before the query was performed are not detected as duplicates, and if
+ * the query fails part-way through, only the current batch is rolled back.
+ */
+int
+sparql_set_model_mode(SPARQL *connection, int mode)
+{
+	switch(mode)
+	{
+	case SPARQL_MODEL_LOOKUP:
+	case SPARQL_MODEL_BULK:
+	case SPARQL_MODEL_BULK_NODEDUP:
+		break;
+	default:
+		sparql_set_error_(connection, SPARQLSTATE_MODEL_MODE, "unrecognised model mode");
+		return -1;
+	}
+	connection->model_mode = mode;
+	return 0;
+}
+
+/* Specify how the result-sets returned by sparql_query() are stored:
+ *
+ * SPARQL_RESULTS_ROWS     Each row holds an array of librdf nodes (the
+ *                         default)
+ * SPARQL_RESULTS_COLUMNS  Each variable has a column of 32-bit term IDs,
+ *                         referring to a per-result-set dictionary of
+ *                         distinct terms, whose nodes are created only
+ *                         when they're retrieved
+ *
+ * The accessors behave identically, except that with columnar storage the
+ * row returned by sparqlres_next() is only valid until it's next called.
+ */
+int
+sparql_set_results_storage(SPARQL *connection, int storage)
+{
+	if(storage != SPARQL_RESULTS_ROWS && storage != SPARQL_RESULTS_COLUMNS)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_RESULTS_STORAGE, "unrecognised result-set storage engine");
+		return -1;
+	}
+	connection->results_storage = storage;
+	return 0;
+}
+
 int
 sparql_set_world(SPARQL *connection, librdf_world *world)
 {
@@ -434,3 +757,157 @@ sparql_derive_uri_(SPARQL *connection, const URI *base, URI_INFO *info, const ch
 	uri_destroy(uri);
 	return s;
 }
+
+/* Given a query-string parameter name <key>, determine whether <info>
+ * specifies a boolean option as enabled or disabled, defaulting to <defval>
+ * if it is not present or not recognised.
+ */
+static int
+sparql_derive_flag_(URI_INFO *info, const char *key, int defval)
+{
+	const char *str;
+
+	if(!info)
+	{
+		return defval;
+	}
+	str = uri_info_get(info, key, NULL);
+	if(!str || !str[0])
+	{
+		return defval;
+	}
+	if(!strcasecmp(str, "yes") || !strcasecmp(str, "on") ||
+	   !strcasecmp(str, "true") || !strcmp(str, "1"))
+	{
+		return 1;
+	}
+	if(!strcasecmp(str, "no") || !strcasecmp(str, "off") ||
+	   !strcasecmp(str, "false") || !strcmp(str, "0"))
+	{
+		return 0;
+	}
+	return defval;
+}
+
+/* Given a query-string parameter name <key>, determine which request body
+ * compression method <info> specifies, defaulting to <defval>; returns -1
+ * if the method isn't recognised
+ */
+static int
+sparql_derive_compress_(URI_INFO *info, const char *key, int defval)
+{
+	const char *str;
+
+	if(!info)
+	{
+		return defval;
+	}
+	str = uri_info_get(info, key, NULL);
+	if(!str || !str[0])
+	{
+		return defval;
+	}
+	if(!strcasecmp(str, "gzip"))
+	{
+		return SPARQL_COMPRESS_GZIP;
+	}
+	if(!strcasecmp(str, "zstd"))
+	{
+		return SPARQL_COMPRESS_ZSTD;
+	}
+	if(!strcasecmp(str, "none") || !strcasecmp(str, "no"))
+	{
+		return SPARQL_COMPRESS_NONE;
+	}
+	return -1;
+}
+
+/* Determine whether this build can compress request bodies using <method>,
+ * setting the connection's error state if not
+ */
+static int
+sparql_compress_supported_(SPARQL *connection, int method)
+{
+	switch(method)
+	{
+	case SPARQL_COMPRESS_NONE:
+		return 0;
+	case SPARQL_COMPRESS_GZIP:
+#ifdef HAVE_LIBZ
+		return 0;
+#else
+		sparql_set_error_(connection, SPARQLSTATE_COMPRESS, "gzip compression is not supported by this build");
+		return -1;
+#endif
+	case SPARQL_COMPRESS_ZSTD:
+#ifdef HAVE_LIBZSTD
+		return 0;
+#else
+		sparql_set_error_(connection, SPARQLSTATE_COMPRESS, "zstd compression is not supported by this build");
+		return -1;
+#endif
+	default:
+		sparql_set_error_(connection, SPARQLSTATE_COMPRESS, "unrecognised compression method");
+		return -1;
+	}
+}
+
+/* Given a query-string parameter name <key>, determine how <info> specifies
+ * that statements should be added to models, defaulting to <defval>
+ */
+static int
+sparql_derive_model_mode_(URI_INFO *info, const char *key, int defval)
+{
+	const char *str;
+
+	if(!info)
+	{
+		return defval;
+	}
+	str = uri_info_get(info, key, NULL);
+	if(!str || !str[0])
+	{
+		return defval;
+	}
+	if(!strcasecmp(str, "lookup"))
+	{
+		return SPARQL_MODEL_LOOKUP;
+	}
+	if(!strcasecmp(str, "bulk"))
+	{
+		return SPARQL_MODEL_BULK;
+	}
+	if(!strcasecmp(str, "nodedup"))
+	{
+		return SPARQL_MODEL_BULK_NODEDUP;
+	}
+	return defval;
+}
+
+/* Given a query-string parameter name <key>, determine which result-set
+ * storage engine <info> specifies, defaulting to <defval>
+ */
+static int
+sparql_derive_storage_(URI_INFO *info, const char *key, int defval)
+{
+	const char *str;
+
+	if(!info)
+	{
+		return defval;
+	}
+	str = uri_info_get(info, key, NULL);
+	if(!str || !str[0])
+	{
+		return defval;
+	}
+	if(!strcasecmp(str, "rows"))
+	{
+		return SPARQL_RESULTS_ROWS;
+	}
+	if(!strcasecmp(str, "columns") || !strcasecmp(str, "columnar"))
+	{
+		return SPARQL_RESULTS_COLUMNS;
+	}
+	return defval;
+}
@@ -55,41 +55,44 @@ sparql_curl_perform_(CURL *ch)
 {
 	CURLcode e;
 	SPARQL *connection;
-	long status;
-	struct timeval tv;
-	unsigned long long start;
-	int ms;
 
-	gettimeofday(&tv, NULL);
-	start = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 	e = curl_easy_perform(ch);
-	gettimeofday(&tv, NULL);
-	ms = (int) (((tv.tv_sec * 1000) + (tv.tv_usec / 1000)) - start);
 	connection = NULL;
 	curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **) (&connection));
+	if(!connection)
+	{
+		return (e == CURLE_OK ? 0 : -1);
+	}
+	return sparql_curl_result_(connection, ch, e, &(connection->capture));
+}
+
+/* Determine the outcome of a completed transfer, whose response body (if
+ * any) was captured into <capture>, and set the connection's error state
+ * accordingly.
+ */
+int
+sparql_curl_result_(SPARQL *connection, CURL *ch, CURLcode e, struct sparql_capture_struct *capture)
+{
+	long status;
+	double secs;
+
+	status = 0;
 	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
 	if(status > 299)
 	{
-		if(connection)
-		{
-			sparql_set_nerror_(connection, status, connection->capture.buf);
-		}
+		sparql_set_nerror_(connection, status, capture->buf);
 		return -1;
 	}
 	if(e == CURLE_OK)
 	{
-		sparql_logf_(connection, LOG_DEBUG, "SPARQL: request completed in %dms\n", ms);
-		if(connection)
-		{
-			sparql_set_nerror_(connection, 0, NULL);
-		}
+		secs = 0;
+		curl_easy_getinfo(ch, CURLINFO_TOTAL_TIME, &secs);
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: request completed in %dms\n", (int) (secs * 1000));
+		sparql_set_nerror_(connection, 0, NULL);
 		return 0;
 	}
-	if(connection)
-	{
-		sparql_set_nerror_(connection, 1000, curl_easy_strerror(e));
-		sparql_logf_(connection, LOG_ERR, "SPARQL: cURL request failed: %s\n", curl_easy_strerror(e));
-	}
+	sparql_set_nerror_(connection, 1000, curl_easy_strerror(e));
+	sparql_logf_(connection, LOG_ERR, "SPARQL: cURL request failed: %s\n", curl_easy_strerror(e));
 	return -1;
 }
 
@@ -0,0 +1,74 @@
+/* SPARQL client: deleting graphs via the RESTful endpoint
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* Delete <graph> (or empty the default graph, if <graph> is NULL). As with
+ * DROP SILENT, it isn't an error for the graph not to exist. If there is
+ * no RESTful data endpoint, an update is performed instead.
+ */
+int
+sparql_delete_graph(SPARQL *connection, const char *graph)
+{
+	CURL *ch;
+	CURLcode e;
+	char *uri;
+	long status;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	sparql_manifest_forget_(connection, graph);
+	if(!connection->data_uri)
+	{
+		if(!graph)
+		{
+			return sparql_updatef(connection, "DROP SILENT DEFAULT");
+		}
+		return sparql_updatef(connection, "DROP SILENT GRAPH <%s>", graph);
+	}
+	uri = sparql_data_graph_uri_(connection, graph);
+	ch = (uri ? sparql_curl_create_(connection, uri) : NULL);
+	if(!ch)
+	{
+		free(uri);
+		return -1;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing DELETE on %s\n", uri);
+	free(uri);
+	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, "DELETE");
+	e = curl_easy_perform(ch);
+	status = 0;
+	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+	if(e == CURLE_OK && status == 404)
+	{
+		sparql_set_nerror_(connection, 0, NULL);
+		r = 0;
+	}
+	else
+	{
+		r = sparql_curl_result_(connection, ch, e, &(connection->capture));
+	}
+	curl_easy_cleanup(ch);
+	return r;
+}
@@ -0,0 +1,586 @@
+/* SPARQL client: retrieving graphs from the RESTful endpoint
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* Graphs are fetched with a GET request to the data endpoint, and the
+ * response is fed to a Raptor parser, chosen according to the response's
+ * Content-Type, as it arrives; each statement is added to the model as
+ * soon as it has been parsed, so the response is never held in memory in
+ * its entirety. sparql_fetch_graphs() performs several such requests
+ * concurrently via sparql_multi_perform_(), so that the responses to some
+ * are parsed while others are still in transit.
+ *
+ * Blank node labels are only meaningful within the document which
+ * contains them, so they're prefixed with a label unique to each request;
+ * otherwise, blank nodes in different graphs (or in successive
+ * retrievals of the same graph) which happened to share a label would be
+ * merged in the model.
+ */
+
+#define GET_ACCEPT                      "Accept: application/n-triples, text/turtle;q=0.9, application/rdf+xml;q=0.5"
+
+struct sparql_get_context_struct
+{
+	SPARQL *connection;
+	CURL *ch;
+	struct curl_slist *headers;
+	char *uri;
+	librdf_world *world;
+	librdf_model *model;
+	librdf_node *context;
+	const char *graph;
+	raptor_parser *parser;
+	raptor_uri *base;
+	char *bprefix;
+	int started;
+	int failed;
+	/* Set if the response is an error, which is captured rather than parsed */
+	int error;
+	size_t triples;
+	struct sparql_capture_struct capture;
+};
+
+struct sparql_fetch_context_struct
+{
+	struct sparql_get_context_struct *graphs;
+	size_t count;
+	size_t next;
+	int error;
+	size_t failed;
+	char state[16];
+	char *error_msg;
+};
+
+static int sparql_get_init_(struct sparql_get_context_struct *context, SPARQL *connection, const char *graph, librdf_model *model);
+static CURL *sparql_get_prepare_(struct sparql_get_context_struct *context);
+static int sparql_get_finish_(struct sparql_get_context_struct *context, CURLcode e);
+static void sparql_get_cleanup_(struct sparql_get_context_struct *context);
+static size_t sparql_get_write_(char *ptr, size_t size, size_t nmemb, void *userdata);
+static int sparql_get_start_(struct sparql_get_context_struct *context);
+static void sparql_get_statement_(void *data, raptor_statement *statement);
+static librdf_node *sparql_get_node_(struct sparql_get_context_struct *context, librdf_node *node);
+static int sparql_get_query_(SPARQL *connection, const char *graph, librdf_model *model);
+static CURL *sparql_fetch_next_(SPARQL *connection, void *data);
+static void sparql_fetch_done_(SPARQL *connection, CURL *ch, CURLcode result, void *data);
+
+/* Retrieve the contents of <graph> (or the default graph, if <graph> is
+ * NULL), adding them to <model>; if the model supports contexts, the
+ * statements are added to the context named by <graph>. If there is no
+ * RESTful data endpoint, the statements are obtained via a query instead.
+ */
+int
+sparql_get_graph(SPARQL *connection, const char *graph, librdf_model *model)
+{
+	struct sparql_get_context_struct context;
+	CURLcode e;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	if(!connection->data_uri)
+	{
+		return sparql_get_query_(connection, graph, model);
+	}
+	r = -1;
+	if(!sparql_get_init_(&context, connection, graph, model) &&
+	   sparql_get_prepare_(&context))
+	{
+		e = curl_easy_perform(context.ch);
+		r = sparql_get_finish_(&context, e);
+	}
+	sparql_get_cleanup_(&context);
+	return r;
+}
+
+/* Retrieve the contents of each of the <count> graphs named by <graphs>
+ * into <model>, performing up to the connection's parallel request limit
+ * concurrently. All of the graphs are retrieved even if some fail.
+ */
+int
+sparql_fetch_graphs(SPARQL *connection, const char *const *graphs, size_t count, librdf_model *model)
+{
+	struct sparql_fetch_context_struct fetch;
+	char *msg;
+	size_t c, l;
+	int r;
+
+	if(!count)
+	{
+		return 0;
+	}
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	if(!connection->data_uri)
+	{
+		for(c = 0; c < count; c++)
+		{
+			if(sparql_get_query_(connection, graphs[c], model))
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.count = count;
+	fetch.graphs = (struct sparql_get_context_struct *) calloc(count, sizeof(struct sparql_get_context_struct));
+	if(!fetch.graphs)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph retrieval\n");
+		return -1;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(sparql_get_init_(&(fetch.graphs[c]), connection, graphs[c], model))
+		{
+			break;
+		}
+	}
+	r = -1;
+	if(c == count)
+	{
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: retrieving %u graphs, %u at a time\n", (unsigned) count, (unsigned) connection->parallel);
+		r = sparql_multi_perform_(connection, connection->parallel, sparql_fetch_next_, sparql_fetch_done_, (void *) &fetch);
+	}
+	else
+	{
+		count = c + 1;
+	}
+	for(c = 0; c < count; c++)
+	{
+		sparql_get_cleanup_(&(fetch.graphs[c]));
+	}
+	free(fetch.graphs);
+	if(fetch.failed)
+	{
+		l = (fetch.error_msg ? strlen(fetch.error_msg) : 0) + 96;
+		msg = (char *) malloc(l);
+		if(msg)
+		{
+			snprintf(msg, l, "%u of %u graphs could not be retrieved; first error: %s", (unsigned) fetch.failed, (unsigned) fetch.count, fetch.error_msg ? fetch.error_msg : "unknown error");
+		}
+		sparql_set_error_(connection, fetch.state, msg);
+		free(msg);
+		free(fetch.error_msg);
+		return -1;
+	}
+	if(r || fetch.error)
+	{
+		return -1;
+	}
+	sparql_set_nerror_(connection, 0, NULL);
+	return 0;
+}
+
+/* Determine whether <graph> exists, returning 1 if it does, 0 if it
+ * doesn't, and -1 if an error occurs
+ */
+int
+sparql_head_graph(SPARQL *connection, const char *graph)
+{
+	SPARQLRES *res;
+	CURL *ch;
+	CURLcode e;
+	char *uri;
+	long status;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	if(!connection->data_uri)
+	{
+		if(!graph)
+		{
+			return 1;
+		}
+		res = sparql_queryf(connection, "ASK { GRAPH <%s> { ?s ?p ?o } }", graph);
+		if(!res)
+		{
+			return -1;
+		}
+		r = (sparqlres_boolean(res) ? 1 : 0);
+		sparqlres_destroy(res);
+		return r;
+	}
+	uri = sparql_data_graph_uri_(connection, graph);
+	ch = (uri ? sparql_curl_create_(connection, uri) : NULL);
+	if(!ch)
+	{
+		free(uri);
+		return -1;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing HEAD on %s\n", uri);
+	free(uri);
+	curl_easy_setopt(ch, CURLOPT_NOBODY, 1);
+	e = curl_easy_perform(ch);
+	status = 0;
+	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+	if(e == CURLE_OK && status == 404)
+	{
+		sparql_set_nerror_(connection, 0, NULL);
+		r = 0;
+	}
+	else
+	{
+		r = (sparql_curl_result_(connection, ch, e, &(connection->capture)) ? -1 : 1);
+	}
+	curl_easy_cleanup(ch);
+	return r;
+}
+
+/* Retrieve a graph via a query, for servers lacking a data endpoint */
+static int
+sparql_get_query_(SPARQL *connection, const char *graph, librdf_model *model)
+{
+	if(!graph)
+	{
+		return sparql_queryf_model(connection, model, "SELECT ?s ?p ?o WHERE { ?s ?p ?o }");
+	}
+	if(librdf_model_supports_contexts(model))
+	{
+		return sparql_queryf_model(connection, model, "SELECT ?s ?p ?o ?g WHERE { GRAPH ?g { ?s ?p ?o } FILTER(?g = <%s>) }", graph);
+	}
+	return sparql_queryf_model(connection, model, "SELECT ?s ?p ?o WHERE { GRAPH <%s> { ?s ?p ?o } }", graph);
+}
+
+/* Invoked by sparql_multi_perform_() to obtain the next transfer */
+static CURL *
+sparql_fetch_next_(SPARQL *connection, void *data)
+{
+	struct sparql_fetch_context_struct *fetch = (struct sparql_fetch_context_struct *) data;
+	CURL *ch;
+
+	(void) connection;
+
+	if(fetch->error || fetch->next >= fetch->count)
+	{
+		return NULL;
+	}
+	ch = sparql_get_prepare_(&(fetch->graphs[fetch->next]));
+	fetch->next++;
+	if(!ch)
+	{
+		fetch->error = 1;
+	}
+	return ch;
+}
+
+/* Invoked by sparql_multi_perform_() when a transfer has completed */
+static void
+sparql_fetch_done_(SPARQL *connection, CURL *ch, CURLcode result, void *data)
+{
+	struct sparql_fetch_context_struct *fetch = (struct sparql_fetch_context_struct *) data;
+	struct sparql_get_context_struct *context;
+
+	context = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **) &context);
+	if(sparql_get_finish_(context, result))
+	{
+		fetch->failed++;
+		sparql_logf_(connection, LOG_ERR, "SPARQL: failed to retrieve <%s>: [%s] %s\n", context->graph ? context->graph : "(default graph)", sparql_state(connection), sparql_error(connection));
+		if(!fetch->error_msg)
+		{
+			strcpy(fetch->state, sparql_state(connection));
+			fetch->error_msg = strdup(sparql_error(connection));
+		}
+	}
+	curl_easy_cleanup(ch);
+	context->ch = NULL;
+}
+
+static int
+sparql_get_init_(struct sparql_get_context_struct *context, SPARQL *connection, const char *graph, librdf_model *model)
+{
+	unsigned char *genid;
+
+	memset(context, 0, sizeof(struct sparql_get_context_struct));
+	context->connection = connection;
+	context->model = model;
+	context->graph = graph;
+	context->world = sparql_world(connection);
+	if(!context->world)
+	{
+		return -1;
+	}
+	if(graph && librdf_model_supports_contexts(model))
+	{
+		context->context = librdf_new_node_from_uri_string(context->world, (const unsigned char *) graph);
+		if(!context->context)
+		{
+			sparql_set_error_(connection, SPARQLSTATE_CREATE_NODE, "failed to create node for graph URI");
+			return -1;
+		}
+	}
+	genid = librdf_world_get_genid(context->world);
+	context->bprefix = (genid ? (char *) malloc(strlen((const char *) genid) + 2) : NULL);
+	if(!context->bprefix)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for blank node prefix\n");
+		librdf_free_memory(genid);
+		return -1;
+	}
+	sprintf(context->bprefix, "%s_", (const char *) genid);
+	librdf_free_memory(genid);
+	return 0;
+}
+
+/* Create a cURL handle which will retrieve the graph */
+static CURL *
+sparql_get_prepare_(struct sparql_get_context_struct *context)
+{
+	SPARQL *connection;
+
+	connection = context->connection;
+	context->uri = sparql_data_graph_uri_(connection, context->graph);
+	if(!context->uri)
+	{
+		return NULL;
+	}
+	context->ch = sparql_curl_create_(connection, context->uri);
+	if(!context->ch)
+	{
+		return NULL;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing GET from %s\n", context->uri);
+	context->headers = curl_slist_append(NULL, GET_ACCEPT);
+	curl_easy_setopt(context->ch, CURLOPT_HTTPHEADER, context->headers);
+	curl_easy_setopt(context->ch, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(context->ch, CURLOPT_WRITEDATA, (void *) context);
+	curl_easy_setopt(context->ch, CURLOPT_WRITEFUNCTION, sparql_get_write_);
+	curl_easy_setopt(context->ch, CURLOPT_PRIVATE, (void *) context);
+	return context->ch;
+}
+
+/* Determine the outcome of a retrieval once the transfer has completed */
+static int
+sparql_get_finish_(struct sparql_get_context_struct *context, CURLcode e)
+{
+	SPARQL *connection;
+	int r;
+
+	connection = context->connection;
+	if(context->parser && !context->failed && e == CURLE_OK)
+	{
+		if(raptor_parser_parse_chunk(context->parser, NULL, 0, 1))
+		{
+			context->failed = 1;
+		}
+	}
+	r = sparql_curl_result_(connection, context->ch, e, &(context->capture));
+	if(context->failed && !context->error)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_SERIALISE, "failed to parse the graph retrieved from the server");
+		r = -1;
+	}
+	if(!r)
+	{
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: retrieved %u triples from %s\n", (unsigned) context->triples, context->uri);
+	}
+	return r;
+}
+
+static void
+sparql_get_cleanup_(struct sparql_get_context_struct *context)
+{
+	if(context->ch)
+	{
+		curl_easy_cleanup(context->ch);
+	}
+	if(context->headers)
+	{
+		curl_slist_free_all(context->headers);
+	}
+	if(context->parser)
+	{
+		raptor_free_parser(context->parser);
+	}
+	if(context->base)
+	{
+		raptor_free_uri(context->base);
+	}
+	if(context->context)
+	{
+		librdf_free_node(context->context);
+	}
+	free(context->bprefix);
+	free(context->uri);
+	free(context->capture.buf);
+}
+
+/* Invoked by cURL as the response body arrives */
+static size_t
+sparql_get_write_(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct sparql_get_context_struct *context = (struct sparql_get_context_struct *) userdata;
+
+	if(!context->started)
+	{
+		context->started = 1;
+		if(sparql_get_start_(context))
+		{
+			context->failed = 1;
+			return 0;
+		}
+	}
+	if(context->error)
+	{
+		return sparql_curl_dummy_write_(ptr, size, nmemb, &(context->capture));
+	}
+	if(raptor_parser_parse_chunk(context->parser, (const unsigned char *) ptr, size * nmemb, 0) || context->failed)
+	{
+		context->failed = 1;
+		return 0;
+	}
+	return size * nmemb;
+}
+
+/* Create a parser suitable for the response's content type, unless the
+ * response indicates an error
+ */
+static int
+sparql_get_start_(struct sparql_get_context_struct *context)
+{
+	raptor_world *world;
+	const char *type, *name;
+	char *mime, *t;
+	long status;
+
+	status = 0;
+	curl_easy_getinfo(context->ch, CURLINFO_RESPONSE_CODE, &status);
+	if(status > 299)
+	{
+		context->error = 1;
+		return 0;
+	}
+	world = librdf_world_get_raptor(context->world);
+	type = NULL;
+	curl_easy_getinfo(context->ch, CURLINFO_CONTENT_TYPE, &type);
+	name = NULL;
+	if(type && (mime = strdup(type)))
+	{
+		/* Discard any parameters */
+		for(t = mime; *t && *t != ';' && !isspace((unsigned char) *t); t++)
+		{
+		}
+		*t = 0;
+		name = raptor_world_guess_parser_name(world, NULL, mime, NULL, 0, NULL);
+		free(mime);
+	}
+	if(!name)
+	{
+		name = "turtle";
+	}
+	sparql_logf_(context->connection, LOG_DEBUG, "SPARQL: parsing response of type '%s' using the '%s' parser\n", type ? type : "(unknown)", name);
+	context->parser = raptor_new_parser(world, name);
+	context->base = raptor_new_uri(world, (const unsigned char *) (context->graph ? context->graph : context->connection->data_uri));
+	if(!context->parser || !context->base)
+	{
+		sparql_set_error_(context->connection, SPARQLSTATE_CREATE_STREAM, "failed to create parser for retrieved graph");
+		return -1;
+	}
+	raptor_parser_set_statement_handler(context->parser, (void *) context, sparql_get_statement_);
+	if(raptor_parser_parse_start(context->parser, context->base))
+	{
+		sparql_set_error_(context->connection, SPARQLSTATE_CREATE_STREAM, "failed to start parsing retrieved graph");
+		return -1;
+	}
+	return 0;
+}
+
+/* Invoked by the parser for each statement */
+static void
+sparql_get_statement_(void *data, raptor_statement *statement)
+{
+	struct sparql_get_context_struct *context = (struct sparql_get_context_struct *) data;
+	librdf_statement *st, *copy;
+	int r;
+
+	if(context->failed)
+	{
+		return;
+	}
+	st = (librdf_statement *) statement;
+	copy = NULL;
+	if(librdf_node_is_blank(librdf_statement_get_subject(st)) ||
+	   librdf_node_is_blank(librdf_statement_get_object(st)))
+	{
+		copy = librdf_new_statement_from_nodes(context->world,
+			sparql_get_node_(context, librdf_statement_get_subject(st)),
+			librdf_new_node_from_node(librdf_statement_get_predicate(st)),
+			sparql_get_node_(context, librdf_statement_get_object(st)));
+		st = copy;
+	}
+	if(!st)
+	{
+		r = -1;
+	}
+	else if(context->context)
+	{
+		r = librdf_model_context_add_statement(context->model, context->context, st);
+	}
+	else
+	{
+		r = librdf_model_add_statement(context->model, st);
+	}
+	if(copy)
+	{
+		librdf_free_statement(copy);
+	}
+	if(r)
+	{
+		sparql_logf_(context->connection, LOG_ERR, "SPARQL: failed to add retrieved statement to model\n");
+		context->failed = 1;
+		raptor_parser_parse_abort(context->parser);
+		return;
+	}
+	context->triples++;
+}
+
+/* Copy a node, relabelling it if it's a blank node */
+static librdf_node *
+sparql_get_node_(struct sparql_get_context_struct *context, librdf_node *node)
+{
+	const char *label;
+	char *buf;
+	librdf_node *p;
+
+	if(!librdf_node_is_blank(node))
+	{
+		return librdf_new_node_from_node(node);
+	}
+	label = (const char *) librdf_node_get_blank_identifier(node);
+	if(!label)
+	{
+		return NULL;
+	}
+	buf = (char *) malloc(strlen(context->bprefix) + strlen(label) + 1);
+	if(!buf)
+	{
+		return NULL;
+	}
+	sprintf(buf, "%s%s", context->bprefix, label);
+	p = librdf_new_node_from_blank_identifier(context->world, (const unsigned char *) buf);
+	free(buf);
+	return p;
+}
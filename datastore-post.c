@@ -27,38 +27,176 @@
 int
 sparql_post(SPARQL *connection, const char *graph, const char *triples, size_t length)
 {
-	CURL *ch;
+	SPARQLBODY *body;
+	int r;
+
+	body = sparql_post_body_(connection, graph);
+	if(!body)
+	{
+		return -1;
+	}
+	if(sparql_body_add_(body, triples, length))
+	{
+		sparql_body_destroy_(body);
+		return -1;
+	}
+	r = sparql_post_perform_(connection, graph, body);
+	sparql_body_destroy_(body);
+	return r;
+}
+
+/* POST the contents of the file at <path> to the RESTful endpoint; the
+ * file is mapped into memory and sent (urlencoded, if necessary) directly
+ * from there
+ */
+int
+sparql_post_file(SPARQL *connection, const char *graph, const char *path)
+{
+	SPARQLBODY *body;
+	int r;
+
+	body = sparql_post_body_(connection, graph);
+	if(!body)
+	{
+		return -1;
+	}
+	if(sparql_body_add_file_(body, path))
+	{
+		sparql_body_destroy_(body);
+		return -1;
+	}
+	r = sparql_post_perform_(connection, graph, body);
+	sparql_body_destroy_(body);
+	return r;
+}
+
+/* Create a request body suitable for passing to sparql_post_perform_();
+ * the caller should append the Turtle payload to it. If the connection
+ * POSTs forms, the payload will be urlencoded as it is sent; otherwise,
+ * it's sent verbatim.
+ */
+SPARQLBODY *
+sparql_post_body_(SPARQL *connection, const char *graph)
+{
+	SPARQLBODY *body;
 	char *buf, *t;
 	size_t buflen;
-	int r;
 
 	if(!connection->data_uri)
 	{
 		sparql_set_error_(connection, SPARQLSTATE_NO_DATASTORE, "cannot POST to a server without a RESTful data endpoint");
-		return -1;
+		return NULL;
+	}
+	if(!connection->post_form)
+	{
+		return sparql_body_create_(connection, NULL, 0);
 	}
-	buflen = sparql_urlencode_size_(graph) + sparql_urlencode_lsize_(triples, length) + 64;
+	buflen = sparql_urlencode_size_(graph) + 64;
 	t = buf = (char *) malloc(buflen);
+	if(!buf)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate %u bytes\n", (unsigned) buflen);
+		return NULL;
+	}
 	strcpy(t, "mime-type=application/x-turtle&graph=");
 	t = strchr(buf, 0);
 	sparql_urlencode_(graph, t, buflen - (t - buf));
 	t = strchr(buf, 0);
 	strcpy(t, "&data=");
-	t = strchr(buf, 0);
-	sparql_urlencode_l_(triples, length, t, buflen - (t - buf));
-	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing POST to %s for %s\n", connection->data_uri, graph);
-	sparql_logf_(connection, LOG_DEBUG, "SPARQL: %s\n", buf);
-	r = -1;
-	ch = sparql_curl_create_(connection, connection->data_uri);
+	body = sparql_body_create_(connection, buf, 1);
+	free(buf);
+	return body;
+}
+
+int
+sparql_post_perform_(SPARQL *connection, const char *graph, SPARQLBODY *body)
+{
+	CURL *ch;
+	struct curl_slist *headers;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	sparql_manifest_forget_(connection, graph);
+	headers = NULL;
+	ch = sparql_post_prepare_(connection, graph, body, &headers);
 	if(!ch)
 	{
 		return -1;
 	}
-	curl_easy_setopt(ch, CURLOPT_POST, 1);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDS, buf);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDSIZE, buflen);
 	r = sparql_curl_perform_(ch);
-	free(buf);
+	curl_slist_free_all(headers);
 	curl_easy_cleanup(ch);
 	return r;
 }
+
+/* Create a cURL handle which will POST <body>, consisting of N-Quads, to
+ * the data endpoint (which must have been configured as accepting them);
+ * the caller must free <headers> once the transfer is complete.
+ */
+CURL *
+sparql_post_quads_prepare_(SPARQL *connection, SPARQLBODY *body, struct curl_slist **headers)
+{
+	CURL *ch;
+
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing N-Quads POST to %s\n", connection->data_uri);
+	ch = sparql_curl_create_(connection, connection->data_uri);
+	if(!ch)
+	{
+		return NULL;
+	}
+	*headers = curl_slist_append(NULL, "Content-type: application/n-quads");
+	if(sparql_body_attach_(body, ch, headers))
+	{
+		curl_slist_free_all(*headers);
+		*headers = NULL;
+		curl_easy_cleanup(ch);
+		return NULL;
+	}
+	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, *headers);
+	return ch;
+}
+
+/* Create a cURL handle which will POST <body> to the data endpoint; the
+ * caller must free <headers> once the transfer is complete.
+ */
+CURL *
+sparql_post_prepare_(SPARQL *connection, const char *graph, SPARQLBODY *body, struct curl_slist **headers)
+{
+	CURL *ch;
+	char *uri;
+
+	if(connection->post_form)
+	{
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing POST to %s for %s\n", connection->data_uri, graph);
+		ch = sparql_curl_create_(connection, connection->data_uri);
+		*headers = curl_slist_append(NULL, "Content-type: application/x-www-form-urlencoded");
+	}
+	else
+	{
+		uri = sparql_data_graph_uri_(connection, graph);
+		if(!uri)
+		{
+			return NULL;
+		}
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing POST to %s\n", uri);
+		ch = sparql_curl_create_(connection, uri);
+		free(uri);
+		*headers = curl_slist_append(NULL, "Content-type: text/turtle; charset=utf-8");
+	}
+	if(!ch)
+	{
+		curl_slist_free_all(*headers);
+		*headers = NULL;
+		return NULL;
+	}
+	if(sparql_body_attach_(body, ch, headers))
+	{
+		curl_slist_free_all(*headers);
+		*headers = NULL;
+		curl_easy_cleanup(ch);
+		return NULL;
+	}
+	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, *headers);
+	return ch;
+}
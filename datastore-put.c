@@ -23,43 +23,309 @@
 
 #include "p_libsparqlclient.h"
 
-/* Perform a SPARQL PUT to the RESTful endpoint */
+#include <sys/stat.h>
+
+static int sparql_put_perform_(SPARQL *connection, const char *graph, SPARQLBODY *body);
+static int sparql_put_replace_(SPARQL *connection, const char *graph, const char *triples, size_t length, const char *path);
+static SPARQLBODY *sparql_put_clear_body_(SPARQL *connection, const char *graph);
+
+/* Perform a SPARQL PUT to the RESTful endpoint, or the equivalent sequence
+ * of updates if there isn't one; if a manifest is in use and shows that
+ * the graph already has the same content, nothing is sent
+ */
 int
 sparql_put(SPARQL *connection, const char *graph, const char *triples, size_t length)
 {
-	CURL *ch;
-	struct curl_slist *headers;
-	char *buf, *t;
-	size_t buflen;
+	SPARQLBODY *body;
+	char digest[SPARQL_DIGEST_SIZE];
+	int r, known;
+
+	known = 0;
+	if(connection->manifest && graph)
+	{
+		if(sparql_digest_turtle_(connection, graph, triples, length, digest))
+		{
+			sparql_logf_(connection, LOG_WARNING, "SPARQL: unable to compute digest of <%s>: %s\n", graph, sparql_error(connection));
+		}
+		else if(sparql_manifest_check_(connection, graph, digest))
+		{
+			return 0;
+		}
+		else
+		{
+			known = 1;
+		}
+	}
+	r = sparql_journal_add_(connection, SPARQL_WRITE_PUT, graph, triples, length);
+	if(r <= 0)
+	{
+		/* The outcome of a deferred PUT isn't known */
+		sparql_manifest_forget_(connection, graph);
+		return r;
+	}
+	if(!connection->data_uri)
+	{
+		r = sparql_put_replace_(connection, graph, triples, length, NULL);
+	}
+	else
+	{
+		body = sparql_body_create_(connection, NULL, 0);
+		if(!body)
+		{
+			return -1;
+		}
+		if(sparql_body_add_(body, triples, length))
+		{
+			sparql_body_destroy_(body);
+			return -1;
+		}
+		r = sparql_put_perform_(connection, graph, body);
+		sparql_body_destroy_(body);
+	}
+	if(!r && known)
+	{
+		sparql_manifest_record_(connection, graph, digest);
+	}
+	return r;
+}
+
+/* PUT the contents of the file at <path> to the RESTful endpoint; the
+ * file is mapped into memory and sent directly from there
+ */
+int
+sparql_put_file(SPARQL *connection, const char *graph, const char *path)
+{
+	SPARQLBODY *body;
 	int r;
 
 	if(!connection->data_uri)
 	{
-		/* TODO: perform a normal graph replace (DROP/CLEAR then INSERT) */
-		sparql_set_error_(connection, SPARQLSTATE_NO_DATASTORE, "cannot PUT to a server without a RESTful data endpoint");
+		return sparql_put_replace_(connection, graph, NULL, 0, path);
+	}
+	body = sparql_body_create_(connection, NULL, 0);
+	if(!body)
+	{
 		return -1;
 	}
-	buflen = sparql_urlencode_size_(graph);
+	if(sparql_body_add_file_(body, path))
+	{
+		sparql_body_destroy_(body);
+		return -1;
+	}
+	r = sparql_put_perform_(connection, graph, body);
+	sparql_body_destroy_(body);
+	return r;
+}
+
+/* Construct the URI of <graph> (or the default graph, if <graph> is NULL)
+ * at the RESTful data endpoint, as described by the SPARQL 1.1 Graph Store
+ * HTTP Protocol; the caller must free the result
+ */
+char *
+sparql_data_graph_uri_(SPARQL *connection, const char *graph)
+{
+	char *buf, *t;
+	size_t buflen;
+
+	buflen = (graph ? sparql_urlencode_size_(graph) : 0);
 	buf = (char *) malloc(strlen(connection->data_uri) + buflen + 16);
+	if(!buf)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+		return NULL;
+	}
+	if(!graph)
+	{
+		sprintf(buf, "%s?default", connection->data_uri);
+		return buf;
+	}
 	sprintf(buf, "%s?graph=", connection->data_uri);
 	t = strchr(buf, 0);
 	sparql_urlencode_(graph, t, buflen);
+	return buf;
+}
+
+static int
+sparql_put_perform_(SPARQL *connection, const char *graph, SPARQLBODY *body)
+{
+	CURL *ch;
+	struct curl_slist *headers;
+	char *buf;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	sparql_manifest_forget_(connection, graph);
+	buf = sparql_data_graph_uri_(connection, graph);
+	if(!buf)
+	{
+		return -1;
+	}
 	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing PUT to %s\n", buf);
-	r = -1;
 	ch = sparql_curl_create_(connection, buf);
+	free(buf);
 	if(!ch)
 	{
 		return -1;
 	}
-	curl_easy_setopt(ch, CURLOPT_POST, 1);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDS, triples);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDSIZE, length);
-	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, "PUT");
 	headers = curl_slist_append(NULL, "Content-type: text/turtle; charset=utf-8");
+	if(sparql_body_attach_(body, ch, &headers))
+	{
+		curl_slist_free_all(headers);
+		curl_easy_cleanup(ch);
+		return -1;
+	}
+	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, "PUT");
 	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
 	r = sparql_curl_perform_(ch);
-	free(buf);
 	curl_slist_free_all(headers);
 	curl_easy_cleanup(ch);
 	return r;
 }
+
+/* Replace the contents of <graph> using SPARQL Update, for servers which
+ * lack a RESTful data endpoint. The Turtle (either <triples> or the file
+ * at <path>) is parsed up-front, so that malformed input is rejected
+ * before anything is changed. If it fits within the connection's chunk
+ * limits, the graph is cleared and repopulated by a single (and so
+ * atomic) update; otherwise, it's cleared and then populated in chunks,
+ * and readers may briefly observe a partially-populated graph.
+ */
+static int
+sparql_put_replace_(SPARQL *connection, const char *graph, const char *triples, size_t length, const char *path)
+{
+	librdf_world *world;
+	librdf_storage *storage;
+	librdf_model *model;
+	librdf_parser *parser;
+	librdf_uri *base, *uri;
+	librdf_stream *stream;
+	SPARQLBODY *body;
+	struct stat sbuf;
+	int r, size;
+
+	if(!graph)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_URI, "a graph URI must be specified");
+		return -1;
+	}
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	sparql_manifest_forget_(connection, graph);
+	world = sparql_world(connection);
+	if(!world)
+	{
+		return -1;
+	}
+	if(path)
+	{
+		if(stat(path, &sbuf))
+		{
+			sparql_logf_(connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+			sparql_set_error_(connection, SPARQLSTATE_FILE, "failed to open file");
+			return -1;
+		}
+		length = (size_t) sbuf.st_size;
+	}
+	r = -1;
+	storage = librdf_new_storage(world, "memory", NULL, NULL);
+	model = (storage ? librdf_new_model(world, storage, NULL) : NULL);
+	parser = librdf_new_parser(world, "turtle", NULL, NULL);
+	base = librdf_new_uri(world, (const unsigned char *) graph);
+	uri = (path ? librdf_new_uri_from_filename(world, path) : NULL);
+	if(!model || !parser || !base || (path && !uri))
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to create model for graph replacement");
+	}
+	else if(path ? librdf_parser_parse_into_model(parser, uri, base, model) :
+			librdf_parser_parse_counted_string_into_model(parser, (const unsigned char *) triples, length, base, model))
+	{
+		sparql_set_error_(connection, SPARQLSTATE_SERIALISE, "failed to parse Turtle");
+	}
+	else
+	{
+		size = librdf_model_size(model);
+		if((!connection->chunk_bytes || length <= connection->chunk_bytes) &&
+		   (!connection->chunk_triples || (size >= 0 && (size_t) size <= connection->chunk_triples)))
+		{
+			sparql_logf_(connection, LOG_DEBUG, "SPARQL: replacing <%s> with a single update\n", graph);
+			body = sparql_put_clear_body_(connection, graph);
+			stream = (body ? librdf_model_as_stream(model) : NULL);
+			if(stream &&
+			   !sparql_body_add_str_(body, " ;\nINSERT DATA { GRAPH <") &&
+			   !sparql_body_add_str_(body, graph) &&
+			   !sparql_body_add_str_(body, "> { ") &&
+			   !sparql_body_add_stream_(body, stream) &&
+			   !sparql_body_add_str_(body, " } }"))
+			{
+				r = sparql_update_perform_(connection, body);
+			}
+			if(stream)
+			{
+				librdf_free_stream(stream);
+			}
+			if(body)
+			{
+				sparql_body_destroy_(body);
+			}
+		}
+		else
+		{
+			sparql_logf_(connection, LOG_DEBUG, "SPARQL: replacing <%s> in chunks\n", graph);
+			body = sparql_put_clear_body_(connection, graph);
+			if(body)
+			{
+				r = sparql_update_perform_(connection, body);
+				sparql_body_destroy_(body);
+			}
+			if(!r)
+			{
+				r = sparql_insert_model_(connection, model, graph);
+			}
+		}
+	}
+	if(uri)
+	{
+		librdf_free_uri(uri);
+	}
+	if(base)
+	{
+		librdf_free_uri(base);
+	}
+	if(parser)
+	{
+		librdf_free_parser(parser);
+	}
+	if(model)
+	{
+		librdf_free_model(model);
+	}
+	if(storage)
+	{
+		librdf_free_storage(storage);
+	}
+	return r;
+}
+
+/* Create an update request body which clears <graph>; further operations
+ * may be appended to it
+ */
+static SPARQLBODY *
+sparql_put_clear_body_(SPARQL *connection, const char *graph)
+{
+	SPARQLBODY *body;
+
+	body = sparql_update_body_(connection);
+	if(!body)
+	{
+		return NULL;
+	}
+	if(sparql_body_add_str_(body, "CLEAR SILENT GRAPH <") ||
+	   sparql_body_add_str_(body, graph) ||
+	   sparql_body_add_str_(body, ">"))
+	{
+		sparql_body_destroy_(body);
+		return NULL;
+	}
+	return body;
+}
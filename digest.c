@@ -0,0 +1,408 @@
+/* SPARQL client: graph content digests
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#include <inttypes.h>
+
+/* A digest is a 128-bit, order-independent summary of a set of statements,
+ * rendered as 32 hexadecimal digits. Each statement is hashed and the
+ * hashes are summed, so neither the order in which statements are
+ * produced nor the way the input was serialised affects the result.
+ *
+ * Blank node labels are arbitrary, so rather than being hashed directly
+ * each blank node is given a signature derived from the statements it
+ * participates in; the signatures are refined over several rounds so
+ * that they reflect the structure surrounding each node, not just its
+ * immediate neighbours. Isomorphic graphs therefore produce the same
+ * digest regardless of how their blank nodes are labelled.
+ */
+
+#define DIGEST_ROUNDS                   3
+#define DIGEST_BLOCK                    1024
+
+#define DIGEST_GOLDEN                   UINT64_C(0x9e3779b97f4a7c15)
+#define DIGEST_BLANK                    UINT64_C(0x5851f42d4c957f2d)
+
+struct sparql_digest_triple_struct
+{
+	uint64_t s, p, o;
+	/* Nonzero if the subject or object is a blank node, in which case it's
+	 * the index (plus one) of the node's signature
+	 */
+	size_t sb, ob;
+};
+
+struct sparql_digest_context_struct
+{
+	SPARQL *connection;
+	struct sparql_digest_triple_struct *triples;
+	size_t count;
+	size_t size;
+	SPARQLHASH *bnodes;
+	SPARQLHASH *seen;
+	raptor_iostream *iostr;
+	uint64_t h;
+};
+
+static int sparql_digest_add_(struct sparql_digest_context_struct *context, librdf_statement *statement);
+static int sparql_digest_term_(struct sparql_digest_context_struct *context, librdf_node *node, uint64_t *h, size_t *b);
+static int sparql_digest_finish_(struct sparql_digest_context_struct *context, char *digest);
+static uint64_t sparql_digest_fmix_(uint64_t h);
+static uint64_t sparql_digest_mix_(uint64_t a, uint64_t b);
+static int sparql_digest_write_byte_(void *context, const int byte);
+static int sparql_digest_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb);
+
+static const raptor_iostream_handler sparql_digest_handler_ = {
+	2,
+	NULL,
+	NULL,
+	sparql_digest_write_byte_,
+	sparql_digest_write_bytes_,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Compute the digest of the statements in <stream>, which is consumed;
+ * <digest> must be at least SPARQL_DIGEST_SIZE bytes long
+ */
+int
+sparql_digest_stream(SPARQL *connection, librdf_stream *stream, char *digest)
+{
+	struct sparql_digest_context_struct context;
+	librdf_world *world;
+	int r;
+
+	world = sparql_world(connection);
+	if(!world)
+	{
+		return -1;
+	}
+	memset(&context, 0, sizeof(context));
+	context.connection = connection;
+	r = -1;
+	context.bnodes = sparql_hash_create_(connection, NULL);
+	context.seen = sparql_hash_create_(connection, NULL);
+	if(context.bnodes && context.seen)
+	{
+		context.iostr = raptor_new_iostream_from_handler(librdf_world_get_raptor(world), &context, &sparql_digest_handler_);
+		if(context.iostr)
+		{
+			r = 0;
+		}
+		else
+		{
+			sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to create Raptor iostream for statement digest");
+		}
+	}
+	for(; !r && !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		if((r = sparql_digest_add_(&context, librdf_stream_get_object(stream))))
+		{
+			break;
+		}
+	}
+	if(!r)
+	{
+		r = sparql_digest_finish_(&context, digest);
+	}
+	if(context.iostr)
+	{
+		raptor_free_iostream(context.iostr);
+	}
+	if(context.bnodes)
+	{
+		sparql_hash_destroy_(context.bnodes);
+	}
+	if(context.seen)
+	{
+		sparql_hash_destroy_(context.seen);
+	}
+	free(context.triples);
+	return r;
+}
+
+/* Compute the digest of the statements in <model>; if <node> is not NULL,
+ * only those in that context are included
+ */
+int
+sparql_digest_model(SPARQL *connection, librdf_model *model, librdf_node *node, char *digest)
+{
+	librdf_stream *stream;
+	int r;
+
+	if(node)
+	{
+		stream = librdf_model_context_as_stream(model, node);
+	}
+	else
+	{
+		stream = librdf_model_as_stream(model);
+	}
+	if(!stream)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to obtain stream from model");
+		return -1;
+	}
+	r = sparql_digest_stream(connection, stream, digest);
+	librdf_free_stream(stream);
+	return r;
+}
+
+/* Compute the digest of a Turtle document, resolving relative URIs
+ * against <base>
+ */
+int
+sparql_digest_turtle_(SPARQL *connection, const char *base, const char *buf, size_t len, char *digest)
+{
+	librdf_world *world;
+	librdf_parser *parser;
+	librdf_uri *uri;
+	librdf_stream *stream;
+	int r;
+
+	world = sparql_world(connection);
+	if(!world)
+	{
+		return -1;
+	}
+	parser = librdf_new_parser(world, "turtle", NULL, NULL);
+	if(!parser)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to create Turtle parser");
+		return -1;
+	}
+	uri = librdf_new_uri(world, (const unsigned char *) (base ? base : "about:blank"));
+	if(!uri)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_URI, "failed to create base URI for Turtle parser");
+		librdf_free_parser(parser);
+		return -1;
+	}
+	stream = librdf_parser_parse_counted_string_as_stream(parser, (const unsigned char *) buf, len, uri);
+	if(!stream)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to parse Turtle");
+		r = -1;
+	}
+	else
+	{
+		r = sparql_digest_stream(connection, stream, digest);
+		librdf_free_stream(stream);
+	}
+	librdf_free_uri(uri);
+	librdf_free_parser(parser);
+	return r;
+}
+
+/* Add a statement to the list, unless it's a duplicate (which a parser may
+ * well produce); duplicates are identified by their terms rather than
+ * their hashes, so that distinct but indistinguishable blank nodes aren't
+ * conflated
+ */
+static int
+sparql_digest_add_(struct sparql_digest_context_struct *context, librdf_statement *statement)
+{
+	struct sparql_digest_triple_struct *p;
+	SPARQLHASHENTRY *entry;
+	uint64_t key[5];
+	size_t dummy;
+
+	if(context->count + 1 > context->size)
+	{
+		p = (struct sparql_digest_triple_struct *) realloc(context->triples, sizeof(struct sparql_digest_triple_struct) * (context->size + DIGEST_BLOCK));
+		if(!p)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to reallocate digest statement list\n");
+			return -1;
+		}
+		context->triples = p;
+		context->size += DIGEST_BLOCK;
+	}
+	p = &(context->triples[context->count]);
+	if(sparql_digest_term_(context, librdf_statement_get_subject(statement), &(p->s), &(p->sb)) ||
+	   sparql_digest_term_(context, librdf_statement_get_predicate(statement), &(p->p), &dummy) ||
+	   sparql_digest_term_(context, librdf_statement_get_object(statement), &(p->o), &(p->ob)))
+	{
+		return -1;
+	}
+	key[0] = p->s;
+	key[1] = p->p;
+	key[2] = p->o;
+	key[3] = (uint64_t) p->sb;
+	key[4] = (uint64_t) p->ob;
+	if(sparql_hash_lookup_(context->seen, (const char *) key, sizeof(key), 0))
+	{
+		return 0;
+	}
+	entry = sparql_hash_lookup_(context->seen, (const char *) key, sizeof(key), 1);
+	if(!entry)
+	{
+		return -1;
+	}
+	context->count++;
+	return 0;
+}
+
+/* Hash the serialised form of a ground term; for a blank node, instead
+ * obtain the index of its signature
+ */
+static int
+sparql_digest_term_(struct sparql_digest_context_struct *context, librdf_node *node, uint64_t *h, size_t *b)
+{
+	SPARQLHASHENTRY *entry;
+	const char *label;
+
+	*h = 0;
+	*b = 0;
+	if(librdf_node_is_blank(node))
+	{
+		label = (const char *) librdf_node_get_blank_identifier(node);
+		if(!label)
+		{
+			label = "";
+		}
+		entry = sparql_hash_lookup_(context->bnodes, label, strlen(label), 1);
+		if(!entry)
+		{
+			return -1;
+		}
+		if(!entry->data)
+		{
+			entry->index = sparql_hash_count_(context->bnodes);
+			entry->data = entry;
+		}
+		*b = entry->index;
+		return 0;
+	}
+	context->h = 0;
+	if(librdf_node_write(node, context->iostr))
+	{
+		sparql_set_error_(context->connection, SPARQLSTATE_SERIALISE, "failed to serialise node for digest");
+		return -1;
+	}
+	*h = context->h;
+	return 0;
+}
+
+static int
+sparql_digest_finish_(struct sparql_digest_context_struct *context, char *digest)
+{
+	struct sparql_digest_triple_struct *t;
+	uint64_t *sig, *next, sv, ov, h, a, b;
+	size_t nbnodes, c, round;
+
+	nbnodes = sparql_hash_count_(context->bnodes);
+	sig = NULL;
+	next = NULL;
+	if(nbnodes)
+	{
+		sig = (uint64_t *) malloc(sizeof(uint64_t) * nbnodes);
+		next = (uint64_t *) malloc(sizeof(uint64_t) * nbnodes);
+		if(!sig || !next)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for blank node signatures\n");
+			free(sig);
+			free(next);
+			return -1;
+		}
+		for(c = 0; c < nbnodes; c++)
+		{
+			sig[c] = DIGEST_BLANK;
+		}
+	}
+	for(round = 0; nbnodes && round < DIGEST_ROUNDS; round++)
+	{
+		memset(next, 0, sizeof(uint64_t) * nbnodes);
+		for(c = 0; c < context->count; c++)
+		{
+			t = &(context->triples[c]);
+			sv = (t->sb ? sig[t->sb - 1] : t->s);
+			ov = (t->ob ? sig[t->ob - 1] : t->o);
+			if(t->sb)
+			{
+				next[t->sb - 1] += sparql_digest_mix_(sparql_digest_mix_(1, t->p), ov);
+			}
+			if(t->ob)
+			{
+				next[t->ob - 1] += sparql_digest_mix_(sparql_digest_mix_(2, t->p), sv);
+			}
+		}
+		for(c = 0; c < nbnodes; c++)
+		{
+			sig[c] = sparql_digest_mix_(sig[c], next[c]);
+		}
+	}
+	free(next);
+	a = b = 0;
+	for(c = 0; c < context->count; c++)
+	{
+		t = &(context->triples[c]);
+		sv = (t->sb ? sig[t->sb - 1] : t->s);
+		ov = (t->ob ? sig[t->ob - 1] : t->o);
+		h = sparql_digest_mix_(sparql_digest_mix_(sv, t->p), ov);
+		a += h;
+		b += sparql_digest_mix_(h, DIGEST_GOLDEN);
+	}
+	free(sig);
+	a = sparql_digest_mix_(a, (uint64_t) context->count);
+	snprintf(digest, SPARQL_DIGEST_SIZE, "%016" PRIx64 "%016" PRIx64, a, b);
+	return 0;
+}
+
+/* The finaliser from SplitMix64 */
+static uint64_t
+sparql_digest_fmix_(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= UINT64_C(0xbf58476d1ce4e5b9);
+	h ^= h >> 27;
+	h *= UINT64_C(0x94d049bb133111eb);
+	h ^= h >> 31;
+	return h;
+}
+
+static uint64_t
+sparql_digest_mix_(uint64_t a, uint64_t b)
+{
+	return sparql_digest_fmix_(a ^ sparql_digest_fmix_(b + DIGEST_GOLDEN));
+}
+
+static int
+sparql_digest_write_byte_(void *context, const int byte)
+{
+	char ch;
+
+	ch = (char) byte;
+	return (sparql_digest_write_bytes_(context, &ch, 1, 1) == 1 ? 0 : 1);
+}
+
+static int
+sparql_digest_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb)
+{
+	struct sparql_digest_context_struct *p = (struct sparql_digest_context_struct *) context;
+
+	p->h = sparql_hash_(ptr, size * nmemb, p->h);
+	return (int) nmemb;
+}
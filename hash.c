@@ -0,0 +1,228 @@
+/* SPARQL client: internal hash tables
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* A simple chained hash table keyed on arbitrary byte strings, used for
+ * blank node bookkeeping, de-duplication and interning. Keys are copied
+ * into the entries; the data pointers are owned by the caller unless a
+ * destructor is supplied when the table is created.
+ */
+
+#define HASH_INITIAL_SIZE               64
+
+#define FNV_OFFSET_BASIS                UINT64_C(14695981039346656037)
+#define FNV_PRIME                       UINT64_C(1099511628211)
+
+struct sparql_hash_struct
+{
+	SPARQL *connection;
+	void (*destructor)(void *data);
+	SPARQLHASHENTRY **buckets;
+	size_t size;
+	size_t count;
+};
+
+static int sparql_hash_resize_(SPARQLHASH *hash);
+
+SPARQLHASH *
+sparql_hash_create_(SPARQL *connection, void (*destructor)(void *data))
+{
+	SPARQLHASH *p;
+
+	p = (SPARQLHASH *) calloc(1, sizeof(SPARQLHASH));
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for hash table\n");
+		return NULL;
+	}
+	p->connection = connection;
+	p->destructor = destructor;
+	p->buckets = (SPARQLHASHENTRY **) calloc(HASH_INITIAL_SIZE, sizeof(SPARQLHASHENTRY *));
+	if(!p->buckets)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for hash table\n");
+		free(p);
+		return NULL;
+	}
+	p->size = HASH_INITIAL_SIZE;
+	return p;
+}
+
+int
+sparql_hash_destroy_(SPARQLHASH *hash)
+{
+	sparql_hash_clear_(hash);
+	free(hash->buckets);
+	free(hash);
+	return 0;
+}
+
+/* Remove all of the entries from a hash table */
+int
+sparql_hash_clear_(SPARQLHASH *hash)
+{
+	SPARQLHASHENTRY *entry, *next;
+	size_t c;
+
+	for(c = 0; c < hash->size; c++)
+	{
+		for(entry = hash->buckets[c]; entry; entry = next)
+		{
+			next = entry->next;
+			if(hash->destructor && entry->data)
+			{
+				hash->destructor(entry->data);
+			}
+			free(entry);
+		}
+		hash->buckets[c] = NULL;
+	}
+	hash->count = 0;
+	return 0;
+}
+
+size_t
+sparql_hash_count_(SPARQLHASH *hash)
+{
+	return hash->count;
+}
+
+/* Locate the entry for <key>; if it does not exist and <create> is
+ * nonzero, a new entry with NULL data is added. Returns NULL if the entry
+ * does not exist and was not (or could not be) created.
+ */
+SPARQLHASHENTRY *
+sparql_hash_lookup_(SPARQLHASH *hash, const char *key, size_t keylen, int create)
+{
+	SPARQLHASHENTRY *entry;
+	uint64_t h;
+	size_t bucket;
+
+	h = sparql_hash_(key, keylen, 0);
+	bucket = (size_t) (h % hash->size);
+	for(entry = hash->buckets[bucket]; entry; entry = entry->next)
+	{
+		if(entry->hash == h && entry->keylen == keylen && !memcmp(entry->key, key, keylen))
+		{
+			return entry;
+		}
+	}
+	if(!create)
+	{
+		return NULL;
+	}
+	if(hash->count + 1 > (hash->size / 4) * 3)
+	{
+		if(sparql_hash_resize_(hash))
+		{
+			return NULL;
+		}
+		bucket = (size_t) (h % hash->size);
+	}
+	entry = (SPARQLHASHENTRY *) calloc(1, sizeof(SPARQLHASHENTRY) + keylen + 1);
+	if(!entry)
+	{
+		sparql_logf_(hash->connection, LOG_CRIT, "SPARQL: failed to allocate memory for hash table entry\n");
+		return NULL;
+	}
+	entry->key = (char *) (entry + 1);
+	memcpy(entry->key, key, keylen);
+	entry->key[keylen] = 0;
+	entry->keylen = keylen;
+	entry->hash = h;
+	entry->next = hash->buckets[bucket];
+	hash->buckets[bucket] = entry;
+	hash->count++;
+	return entry;
+}
+
+/* Invoke <callback> for each entry in the table, stopping if it returns
+ * nonzero
+ */
+int
+sparql_hash_iterate_(SPARQLHASH *hash, int (*callback)(SPARQLHASHENTRY *entry, void *data), void *data)
+{
+	SPARQLHASHENTRY *entry;
+	size_t c;
+	int r;
+
+	for(c = 0; c < hash->size; c++)
+	{
+		for(entry = hash->buckets[c]; entry; entry = entry->next)
+		{
+			if((r = callback(entry, data)))
+			{
+				return r;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Compute the 64-bit FNV-1a hash of a buffer; a non-zero <seed> allows
+ * hashes to be chained across multiple buffers.
+ */
+uint64_t
+sparql_hash_(const void *buf, size_t len, uint64_t seed)
+{
+	const unsigned char *p;
+	uint64_t h;
+
+	h = (seed ? seed : FNV_OFFSET_BASIS);
+	for(p = (const unsigned char *) buf; len; len--, p++)
+	{
+		h ^= *p;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static int
+sparql_hash_resize_(SPARQLHASH *hash)
+{
+	SPARQLHASHENTRY **buckets, *entry, *next;
+	size_t size, c, bucket;
+
+	size = hash->size * 2;
+	buckets = (SPARQLHASHENTRY **) calloc(size, sizeof(SPARQLHASHENTRY *));
+	if(!buckets)
+	{
+		sparql_logf_(hash->connection, LOG_CRIT, "SPARQL: failed to resize hash table to %u buckets\n", (unsigned) size);
+		return -1;
+	}
+	for(c = 0; c < hash->size; c++)
+	{
+		for(entry = hash->buckets[c]; entry; entry = next)
+		{
+			next = entry->next;
+			bucket = (size_t) (entry->hash % size);
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+		}
+	}
+	free(hash->buckets);
+	hash->buckets = buckets;
+	hash->size = size;
+	return 0;
+}
@@ -0,0 +1,837 @@
+/* SPARQL client: chunked, parallel insertion of models
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* Each graph in the model is split into chunks bounded by the connection's
+ * chunk limits, and the chunks are uploaded concurrently.
+ *
+ * Blank node labels are scoped to a single request, so statements which
+ * share a blank node must be sent together: statements which don't
+ * involve any blank nodes are chunked as they are read, while those which
+ * do are set aside, grouped into connected components, and each component
+ * is then placed into a chunk in its entirety (even if that means the
+ * chunk exceeds the limits).
+ *
+ * Chunks aren't closed at the end of each graph unless they have to be:
+ * when the data is sent as INSERT DATA, a chunk consists of a GRAPH block
+ * for each of the graphs it contains, and when the data endpoint accepts
+ * N-Quads, each statement carries its own graph. Only Turtle POSTs to the
+ * data endpoint, which target a single graph, require a request per
+ * graph. Models with many small graphs therefore need far fewer requests.
+ */
+
+#define INSERT_BNODE_BLOCK              256
+#define INSERT_SECTION_BLOCK            32
+
+typedef enum
+{
+	IP_NEXT_GRAPH,
+	IP_GROUND,
+	IP_BNODES
+} SPARQLINSERTPHASE;
+
+/* The portion of a chunk's buffer which belongs to a particular graph */
+struct sparql_insert_section_struct
+{
+	char *graph;
+	size_t start;
+};
+
+struct sparql_insert_chunk_struct
+{
+	size_t seq;
+	char *graph;
+	struct sparql_insert_section_struct *sections;
+	size_t nsections;
+	char *buf;
+	size_t len;
+	size_t triples;
+	SPARQLBODY *body;
+	struct curl_slist *headers;
+	struct sparql_capture_struct capture;
+};
+
+struct sparql_insert_context_struct
+{
+	SPARQL *connection;
+	librdf_world *world;
+	librdf_model *model;
+	/* The graph to insert into if the model doesn't support contexts */
+	const char *target;
+	librdf_iterator *contexts;
+	int started;
+	int finished;
+	int error;
+	/* Nonzero if chunks may span graphs, and if they're sent as N-Quads */
+	int pack;
+	int quads;
+	SPARQLINSERTPHASE phase;
+	/* The graph currently being read */
+	librdf_stream *stream;
+	char *graph;
+	/* The chunk currently being built */
+	raptor_iostream *iostr;
+	void *buf;
+	size_t buflen;
+	size_t triples;
+	struct sparql_insert_section_struct *sections;
+	size_t nsections;
+	size_t sectsize;
+	/* Statements involving blank nodes */
+	SPARQLHASH *bnodes;
+	librdf_statement **bstatements;
+	size_t *parent;
+	size_t *order;
+	size_t bcount;
+	size_t bsize;
+	size_t bpos;
+	/* Outcome */
+	size_t chunks;
+	size_t failed;
+	char state[16];
+	char *error_msg;
+};
+
+static CURL *sparql_insert_next_(SPARQL *connection, void *data);
+static void sparql_insert_done_(SPARQL *connection, CURL *ch, CURLcode result, void *data);
+static int sparql_insert_next_graph_(struct sparql_insert_context_struct *context);
+static int sparql_insert_write_(struct sparql_insert_context_struct *context, librdf_statement *statement);
+static int sparql_insert_full_(struct sparql_insert_context_struct *context);
+static CURL *sparql_insert_flush_(struct sparql_insert_context_struct *context);
+static int sparql_insert_add_bnode_(struct sparql_insert_context_struct *context, librdf_statement *statement);
+static int sparql_insert_union_(struct sparql_insert_context_struct *context, size_t index, librdf_node *node);
+static size_t sparql_insert_find_(struct sparql_insert_context_struct *context, size_t index);
+static int sparql_insert_components_(struct sparql_insert_context_struct *context);
+static void sparql_insert_reset_bnodes_(struct sparql_insert_context_struct *context);
+static int sparql_insert_section_(struct sparql_insert_context_struct *context);
+static SPARQLBODY *sparql_insert_chunk_body_(SPARQL *connection, struct sparql_insert_chunk_struct *chunk);
+static void sparql_insert_sections_free_(struct sparql_insert_section_struct *sections, size_t count);
+static void sparql_insert_chunk_destroy_(struct sparql_insert_chunk_struct *chunk);
+
+int
+sparql_insert_model(SPARQL *connection, librdf_model *model)
+{
+	return sparql_insert_model_(connection, model, NULL);
+}
+
+/* Insert the contents of <model>; if it doesn't support contexts, its
+ * statements are inserted into <graph> (or the default graph, if <graph>
+ * is NULL)
+ */
+int
+sparql_insert_model_(SPARQL *connection, librdf_model *model, const char *graph)
+{
+	struct sparql_insert_context_struct context;
+	char *msg;
+	size_t l;
+	int r;
+
+	if(!librdf_model_size(model))
+	{
+		return 0;
+	}
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	memset(&context, 0, sizeof(context));
+	context.connection = connection;
+	context.model = model;
+	context.target = graph;
+	context.phase = IP_NEXT_GRAPH;
+	context.quads = (connection->data_uri && connection->data_quads);
+	context.pack = (context.quads || !connection->data_uri);
+	context.world = sparql_world(connection);
+	if(!context.world)
+	{
+		return -1;
+	}
+	context.bnodes = sparql_hash_create_(connection, NULL);
+	if(!context.bnodes)
+	{
+		return -1;
+	}
+	r = sparql_multi_perform_(connection, connection->parallel, sparql_insert_next_, sparql_insert_done_, (void *) &context);
+	if(context.iostr)
+	{
+		raptor_free_iostream(context.iostr);
+	}
+	free(context.buf);
+	sparql_insert_sections_free_(context.sections, context.nsections);
+	if(context.stream)
+	{
+		librdf_free_stream(context.stream);
+	}
+	if(context.contexts)
+	{
+		librdf_free_iterator(context.contexts);
+	}
+	free(context.graph);
+	sparql_insert_reset_bnodes_(&context);
+	free(context.bstatements);
+	free(context.parent);
+	free(context.order);
+	sparql_hash_destroy_(context.bnodes);
+	if(context.failed)
+	{
+		l = (context.error_msg ? strlen(context.error_msg) : 0) + 96;
+		msg = (char *) malloc(l);
+		if(msg)
+		{
+			snprintf(msg, l, "%u of %u insert requests failed; first error: %s", (unsigned) context.failed, (unsigned) context.chunks, context.error_msg ? context.error_msg : "unknown error");
+		}
+		sparql_set_error_(connection, context.state, msg);
+		free(msg);
+		free(context.error_msg);
+		return -1;
+	}
+	free(context.error_msg);
+	if(r || context.error)
+	{
+		return -1;
+	}
+	sparql_set_nerror_(connection, 0, NULL);
+	return 0;
+}
+
+/* Invoked by sparql_multi_perform_() to obtain the next chunk to send */
+static CURL *
+sparql_insert_next_(SPARQL *connection, void *data)
+{
+	struct sparql_insert_context_struct *context = (struct sparql_insert_context_struct *) data;
+	librdf_statement *statement;
+	librdf_node *subject, *object;
+	size_t root;
+	int r;
+
+	(void) connection;
+
+	while(!context->error)
+	{
+		switch(context->phase)
+		{
+		case IP_NEXT_GRAPH:
+			r = sparql_insert_next_graph_(context);
+			if(r > 0)
+			{
+				/* There are no more graphs; send whatever remains */
+				context->finished = 1;
+				if(context->triples)
+				{
+					return sparql_insert_flush_(context);
+				}
+				return NULL;
+			}
+			if(r < 0)
+			{
+				context->error = 1;
+				return NULL;
+			}
+			context->phase = IP_GROUND;
+			break;
+		case IP_GROUND:
+			while(!librdf_stream_end(context->stream))
+			{
+				statement = librdf_stream_get_object(context->stream);
+				if(statement)
+				{
+					subject = librdf_statement_get_subject(statement);
+					object = librdf_statement_get_object(statement);
+					if((subject && librdf_node_is_blank(subject)) ||
+					   (object && librdf_node_is_blank(object)))
+					{
+						r = sparql_insert_add_bnode_(context, statement);
+					}
+					else
+					{
+						r = sparql_insert_write_(context, statement);
+					}
+					if(r)
+					{
+						context->error = 1;
+						return NULL;
+					}
+				}
+				librdf_stream_next(context->stream);
+				if(sparql_insert_full_(context))
+				{
+					return sparql_insert_flush_(context);
+				}
+			}
+			librdf_free_stream(context->stream);
+			context->stream = NULL;
+			if(sparql_insert_components_(context))
+			{
+				context->error = 1;
+				return NULL;
+			}
+			context->phase = IP_BNODES;
+			break;
+		case IP_BNODES:
+			while(context->bpos < context->bcount)
+			{
+				root = context->parent[context->order[context->bpos]];
+				while(context->bpos < context->bcount &&
+					  context->parent[context->order[context->bpos]] == root)
+				{
+					if(sparql_insert_write_(context, context->bstatements[context->order[context->bpos]]))
+					{
+						context->error = 1;
+						return NULL;
+					}
+					context->bpos++;
+				}
+				if(sparql_insert_full_(context))
+				{
+					return sparql_insert_flush_(context);
+				}
+			}
+			sparql_insert_reset_bnodes_(context);
+			context->phase = IP_NEXT_GRAPH;
+			if(context->triples && !context->pack)
+			{
+				return sparql_insert_flush_(context);
+			}
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Invoked by sparql_multi_perform_() when a chunk has been sent */
+static void
+sparql_insert_done_(SPARQL *connection, CURL *ch, CURLcode result, void *data)
+{
+	struct sparql_insert_context_struct *context = (struct sparql_insert_context_struct *) data;
+	struct sparql_insert_chunk_struct *chunk;
+
+	chunk = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **) &chunk);
+	if(sparql_curl_result_(connection, ch, result, &(chunk->capture)))
+	{
+		context->failed++;
+		sparql_logf_(connection, LOG_ERR, "SPARQL: failed to insert chunk %u (%u triples) into <%s>: [%s] %s\n", (unsigned) chunk->seq, (unsigned) chunk->triples, chunk->graph ? chunk->graph : "(default graph)", sparql_state(connection), sparql_error(connection));
+		if(!context->error_msg)
+		{
+			strcpy(context->state, sparql_state(connection));
+			context->error_msg = strdup(sparql_error(connection));
+		}
+	}
+	curl_easy_cleanup(ch);
+	sparql_insert_chunk_destroy_(chunk);
+}
+
+/* Advance to the next graph in the model; returns 1 if there are no more
+ * graphs, or -1 if an error occurs.
+ */
+static int
+sparql_insert_next_graph_(struct sparql_insert_context_struct *context)
+{
+	librdf_node *node;
+	librdf_uri *uri;
+	const char *uristr;
+	char digest[SPARQL_DIGEST_SIZE];
+
+	if(context->finished)
+	{
+		return 1;
+	}
+	free(context->graph);
+	context->graph = NULL;
+	if(!context->started)
+	{
+		context->started = 1;
+		if(!librdf_model_supports_contexts(context->model))
+		{
+			if(!(context->stream = librdf_model_as_stream(context->model)))
+			{
+				sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to obtain stream for model\n");
+				return -1;
+			}
+			if(context->target && !(context->graph = strdup(context->target)))
+			{
+				sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+				return -1;
+			}
+			return 0;
+		}
+		context->contexts = librdf_model_get_contexts(context->model);
+		if(!context->contexts)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to obtain model context iterator\n");
+			return -1;
+		}
+	}
+	else if(!context->contexts)
+	{
+		return 1;
+	}
+	else
+	{
+		librdf_iterator_next(context->contexts);
+	}
+	while(!librdf_iterator_end(context->contexts))
+	{
+		node = librdf_iterator_get_object(context->contexts);
+		if(node &&
+		   librdf_node_is_resource(node) &&
+		   (uri = librdf_node_get_uri(node)) &&
+		   (uristr = (const char *) librdf_uri_as_string(uri)))
+		{
+			if(context->connection->manifest)
+			{
+				/* Inserting content which the graph already holds is a no-op */
+				if(sparql_digest_model(context->connection, context->model, node, digest))
+				{
+					return -1;
+				}
+				if(sparql_manifest_check_(context->connection, uristr, digest))
+				{
+					librdf_iterator_next(context->contexts);
+					continue;
+				}
+				sparql_manifest_forget_(context->connection, uristr);
+			}
+			if(!(context->stream = librdf_model_context_as_stream(context->model, node)))
+			{
+				sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to obtain stream for context <%s>\n", uristr);
+				return -1;
+			}
+			context->graph = strdup(uristr);
+			if(!context->graph)
+			{
+				sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+				return -1;
+			}
+			return 0;
+		}
+		librdf_iterator_next(context->contexts);
+	}
+	return 1;
+}
+
+/* Append a statement to the chunk currently being built */
+static int
+sparql_insert_write_(struct sparql_insert_context_struct *context, librdf_statement *statement)
+{
+	if(!context->iostr)
+	{
+		context->buf = NULL;
+		context->buflen = 0;
+		context->triples = 0;
+		context->iostr = raptor_new_iostream_to_string(librdf_world_get_raptor(context->world), &(context->buf), &(context->buflen), malloc);
+		if(!context->iostr)
+		{
+			sparql_set_error_(context->connection, SPARQLSTATE_CREATE_STREAM, "failed to create Raptor iostream for statement serialisation");
+			return -1;
+		}
+	}
+	if(context->quads)
+	{
+		if(sparql_quad_write_(context->connection, statement, context->graph, context->iostr))
+		{
+			return -1;
+		}
+		context->triples++;
+		return 0;
+	}
+	if(sparql_insert_section_(context))
+	{
+		return -1;
+	}
+	if(sparql_statement_write_(context->connection, statement, context->iostr))
+	{
+		return -1;
+	}
+	context->triples++;
+	return 0;
+}
+
+/* Begin a new section of the chunk currently being built if the graph
+ * has changed since the last statement was written to it
+ */
+static int
+sparql_insert_section_(struct sparql_insert_context_struct *context)
+{
+	struct sparql_insert_section_struct *p;
+	const char *last;
+
+	if(context->nsections)
+	{
+		last = context->sections[context->nsections - 1].graph;
+		if((!last && !context->graph) ||
+		   (last && context->graph && !strcmp(last, context->graph)))
+		{
+			return 0;
+		}
+	}
+	if(context->nsections + 1 > context->sectsize)
+	{
+		p = (struct sparql_insert_section_struct *) realloc(context->sections, sizeof(struct sparql_insert_section_struct) * (context->sectsize + INSERT_SECTION_BLOCK));
+		if(!p)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to reallocate chunk section list\n");
+			return -1;
+		}
+		context->sections = p;
+		context->sectsize += INSERT_SECTION_BLOCK;
+	}
+	p = &(context->sections[context->nsections]);
+	p->graph = NULL;
+	if(context->graph && !(p->graph = strdup(context->graph)))
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+		return -1;
+	}
+	p->start = (size_t) raptor_iostream_tell(context->iostr);
+	context->nsections++;
+	return 0;
+}
+
+/* Determine whether the chunk currently being built has reached the
+ * connection's limits
+ */
+static int
+sparql_insert_full_(struct sparql_insert_context_struct *context)
+{
+	if(!context->iostr || !context->triples)
+	{
+		return 0;
+	}
+	if(context->connection->chunk_triples && context->triples >= context->connection->chunk_triples)
+	{
+		return 1;
+	}
+	if(context->connection->chunk_bytes && raptor_iostream_tell(context->iostr) >= context->connection->chunk_bytes)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Complete the chunk currently being built and prepare a request to send
+ * it
+ */
+static CURL *
+sparql_insert_flush_(struct sparql_insert_context_struct *context)
+{
+	struct sparql_insert_chunk_struct *chunk;
+	SPARQL *connection;
+	CURL *ch;
+
+	connection = context->connection;
+	raptor_free_iostream(context->iostr);
+	context->iostr = NULL;
+	chunk = (struct sparql_insert_chunk_struct *) calloc(1, sizeof(struct sparql_insert_chunk_struct));
+	if(!chunk)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for insert chunk\n");
+		free(context->buf);
+		context->buf = NULL;
+		context->error = 1;
+		return NULL;
+	}
+	chunk->buf = (char *) context->buf;
+	chunk->len = context->buflen;
+	chunk->triples = context->triples;
+	chunk->sections = context->sections;
+	chunk->nsections = context->nsections;
+	context->buf = NULL;
+	context->buflen = 0;
+	context->triples = 0;
+	context->sections = NULL;
+	context->nsections = context->sectsize = 0;
+	if(chunk->nsections ? chunk->sections[0].graph != NULL : (context->graph != NULL && !context->quads))
+	{
+		chunk->graph = strdup(chunk->nsections ? chunk->sections[0].graph : context->graph);
+		if(!chunk->graph)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+			sparql_insert_chunk_destroy_(chunk);
+			context->error = 1;
+			return NULL;
+		}
+	}
+	if(context->quads)
+	{
+		chunk->body = sparql_body_create_(connection, NULL, 0);
+		if(chunk->body && sparql_body_add_(chunk->body, chunk->buf, chunk->len))
+		{
+			sparql_body_destroy_(chunk->body);
+			chunk->body = NULL;
+		}
+		ch = (chunk->body ? sparql_post_quads_prepare_(connection, chunk->body, &(chunk->headers)) : NULL);
+	}
+	else if(connection->data_uri)
+	{
+		chunk->body = sparql_post_body_(connection, chunk->graph);
+		if(chunk->body && sparql_body_add_(chunk->body, chunk->buf, chunk->len))
+		{
+			sparql_body_destroy_(chunk->body);
+			chunk->body = NULL;
+		}
+		ch = (chunk->body ? sparql_post_prepare_(connection, chunk->graph, chunk->body, &(chunk->headers)) : NULL);
+	}
+	else
+	{
+		chunk->body = sparql_insert_chunk_body_(connection, chunk);
+		ch = (chunk->body ? sparql_update_prepare_(connection, chunk->body, &(chunk->headers)) : NULL);
+	}
+	if(!ch)
+	{
+		sparql_insert_chunk_destroy_(chunk);
+		context->error = 1;
+		return NULL;
+	}
+	context->chunks++;
+	chunk->seq = context->chunks;
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: sending chunk %u (%u triples, %u bytes) for <%s>%s\n", (unsigned) chunk->seq, (unsigned) chunk->triples, (unsigned) chunk->len, chunk->graph ? chunk->graph : "(default graph)", (chunk->nsections > 1 || context->quads) ? " and others" : "");
+	/* Each chunk captures its own response, and replaces the connection as
+	 * the handle's private pointer so that sparql_insert_done_() can find
+	 * it
+	 */
+	curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *) &(chunk->capture));
+	curl_easy_setopt(ch, CURLOPT_PRIVATE, (void *) chunk);
+	return ch;
+}
+
+/* Build an INSERT DATA request body consisting of a GRAPH block for each
+ * of the sections of <chunk>, referencing rather than copying the chunk's
+ * buffer
+ */
+static SPARQLBODY *
+sparql_insert_chunk_body_(SPARQL *connection, struct sparql_insert_chunk_struct *chunk)
+{
+	SPARQLBODY *body;
+	size_t c, end;
+	int r;
+
+	if(chunk->nsections < 2)
+	{
+		return sparql_insert_body_(connection, chunk->graph, chunk->buf, chunk->len, NULL);
+	}
+	body = sparql_update_body_(connection);
+	if(!body)
+	{
+		return NULL;
+	}
+	r = sparql_body_add_str_(body, "INSERT DATA { ");
+	for(c = 0; !r && c < chunk->nsections; c++)
+	{
+		end = (c + 1 < chunk->nsections ? chunk->sections[c + 1].start : chunk->len);
+		if(chunk->sections[c].graph)
+		{
+			r = sparql_body_add_str_(body, "GRAPH <") ||
+				sparql_body_add_str_(body, chunk->sections[c].graph) ||
+				sparql_body_add_str_(body, "> { ") ||
+				sparql_body_add_(body, chunk->buf + chunk->sections[c].start, end - chunk->sections[c].start) ||
+				sparql_body_add_str_(body, " } ");
+		}
+		else
+		{
+			r = sparql_body_add_(body, chunk->buf + chunk->sections[c].start, end - chunk->sections[c].start);
+		}
+	}
+	if(!r)
+	{
+		r = sparql_body_add_str_(body, " }");
+	}
+	if(r)
+	{
+		sparql_body_destroy_(body);
+		return NULL;
+	}
+	return body;
+}
+
+/* Set aside a statement which involves blank nodes, merging it into the
+ * component of any other statements which share them
+ */
+static int
+sparql_insert_add_bnode_(struct sparql_insert_context_struct *context, librdf_statement *statement)
+{
+	librdf_statement **p;
+	size_t *q, index;
+
+	if(context->bcount + 1 > context->bsize)
+	{
+		p = (librdf_statement **) realloc(context->bstatements, sizeof(librdf_statement *) * (context->bsize + INSERT_BNODE_BLOCK));
+		if(!p)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to reallocate blank node statement list\n");
+			return -1;
+		}
+		context->bstatements = p;
+		q = (size_t *) realloc(context->parent, sizeof(size_t) * (context->bsize + INSERT_BNODE_BLOCK));
+		if(!q)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to reallocate blank node statement list\n");
+			return -1;
+		}
+		context->parent = q;
+		context->bsize += INSERT_BNODE_BLOCK;
+	}
+	index = context->bcount;
+	context->bstatements[index] = librdf_new_statement_from_statement(statement);
+	if(!context->bstatements[index])
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to copy statement\n");
+		return -1;
+	}
+	context->parent[index] = index;
+	context->bcount++;
+	if(sparql_insert_union_(context, index, librdf_statement_get_subject(statement)) ||
+	   sparql_insert_union_(context, index, librdf_statement_get_object(statement)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_insert_union_(struct sparql_insert_context_struct *context, size_t index, librdf_node *node)
+{
+	SPARQLHASHENTRY *entry;
+	const char *id;
+	size_t a, b;
+
+	if(!node || !librdf_node_is_blank(node))
+	{
+		return 0;
+	}
+	id = (const char *) librdf_node_get_blank_identifier(node);
+	if(!id)
+	{
+		return 0;
+	}
+	entry = sparql_hash_lookup_(context->bnodes, id, strlen(id), 1);
+	if(!entry)
+	{
+		return -1;
+	}
+	if(!entry->data)
+	{
+		/* This is the first statement to mention this blank node */
+		entry->data = (void *) context->bstatements[index];
+		entry->index = index;
+		return 0;
+	}
+	a = sparql_insert_find_(context, index);
+	b = sparql_insert_find_(context, entry->index);
+	if(a != b)
+	{
+		context->parent[(a > b ? a : b)] = (a > b ? b : a);
+	}
+	return 0;
+}
+
+static size_t
+sparql_insert_find_(struct sparql_insert_context_struct *context, size_t index)
+{
+	while(context->parent[index] != index)
+	{
+		context->parent[index] = context->parent[context->parent[index]];
+		index = context->parent[index];
+	}
+	return index;
+}
+
+/* Order the blank node statements so that each component is contiguous */
+static int
+sparql_insert_components_(struct sparql_insert_context_struct *context)
+{
+	size_t *start, c, pos, n;
+
+	context->bpos = 0;
+	if(!context->bcount)
+	{
+		return 0;
+	}
+	free(context->order);
+	context->order = (size_t *) calloc(context->bcount, sizeof(size_t));
+	start = (size_t *) calloc(context->bcount, sizeof(size_t));
+	if(!context->order || !start)
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for blank node components\n");
+		free(start);
+		return -1;
+	}
+	for(c = 0; c < context->bcount; c++)
+	{
+		context->parent[c] = sparql_insert_find_(context, c);
+		start[context->parent[c]]++;
+	}
+	for(c = pos = 0; c < context->bcount; c++)
+	{
+		n = start[c];
+		start[c] = pos;
+		pos += n;
+	}
+	for(c = 0; c < context->bcount; c++)
+	{
+		context->order[start[context->parent[c]]] = c;
+		start[context->parent[c]]++;
+	}
+	free(start);
+	return 0;
+}
+
+static void
+sparql_insert_reset_bnodes_(struct sparql_insert_context_struct *context)
+{
+	size_t c;
+
+	for(c = 0; c < context->bcount; c++)
+	{
+		librdf_free_statement(context->bstatements[c]);
+	}
+	context->bcount = 0;
+	context->bpos = 0;
+	sparql_hash_clear_(context->bnodes);
+}
+
+static void
+sparql_insert_sections_free_(struct sparql_insert_section_struct *sections, size_t count)
+{
+	size_t c;
+
+	for(c = 0; c < count; c++)
+	{
+		free(sections[c].graph);
+	}
+	free(sections);
+}
+
+static void
+sparql_insert_chunk_destroy_(struct sparql_insert_chunk_struct *chunk)
+{
+	if(chunk->body)
+	{
+		sparql_body_destroy_(chunk->body);
+	}
+	curl_slist_free_all(chunk->headers);
+	free(chunk->capture.buf);
+	free(chunk->buf);
+	free(chunk->graph);
+	sparql_insert_sections_free_(chunk->sections, chunk->nsections);
+	free(chunk);
+}
@@ -0,0 +1,179 @@
+/* SPARQL client: interning of URI nodes and datatype URIs
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* The same predicate, graph and datatype IRIs appear in almost every row
+ * of a typical result set. An interning cache holds a reference to each
+ * node and URI built while processing a query's results, and hands out
+ * further references to them (which librdf implements as a reference
+ * count increment) rather than constructing them afresh.
+ *
+ * Each table is emptied once it reaches SPARQL_INTERN_LIMIT entries, so
+ * that a result set containing many distinct IRIs doesn't hold on to all
+ * of them; references which have already been handed out are unaffected.
+ */
+
+struct sparql_intern_struct
+{
+	SPARQL *connection;
+	librdf_world *world;
+	SPARQLHASH *nodes;
+	SPARQLHASH *uris;
+};
+
+static void sparql_intern_free_node_(void *data);
+static void sparql_intern_free_uri_(void *data);
+
+SPARQLINTERN *
+sparql_intern_create_(SPARQL *connection, librdf_world *world)
+{
+	SPARQLINTERN *p;
+
+	p = (SPARQLINTERN *) calloc(1, sizeof(SPARQLINTERN));
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for interning cache\n");
+		return NULL;
+	}
+	p->connection = connection;
+	p->world = world;
+	p->nodes = sparql_hash_create_(connection, sparql_intern_free_node_);
+	p->uris = sparql_hash_create_(connection, sparql_intern_free_uri_);
+	if(!p->nodes || !p->uris)
+	{
+		sparql_intern_destroy_(p);
+		return NULL;
+	}
+	return p;
+}
+
+int
+sparql_intern_destroy_(SPARQLINTERN *intern)
+{
+	if(intern->nodes)
+	{
+		sparql_hash_destroy_(intern->nodes);
+	}
+	if(intern->uris)
+	{
+		sparql_hash_destroy_(intern->uris);
+	}
+	free(intern);
+	return 0;
+}
+
+/* Return a new reference to a URI node for <uri>, which the caller must
+ * free; as with librdf, a NULL <uri> yields no node
+ */
+librdf_node *
+sparql_intern_node_(SPARQLINTERN *intern, const char *uri)
+{
+	SPARQLHASHENTRY *entry;
+	librdf_node *node;
+	size_t len;
+
+	if(!uri)
+	{
+		return NULL;
+	}
+	len = strlen(uri);
+	entry = sparql_hash_lookup_(intern->nodes, uri, len, 0);
+	if(entry)
+	{
+		return librdf_new_node_from_node((librdf_node *) entry->data);
+	}
+	node = librdf_new_node_from_counted_uri_string(intern->world, (const unsigned char *) uri, len);
+	if(!node)
+	{
+		return NULL;
+	}
+	if(sparql_hash_count_(intern->nodes) >= SPARQL_INTERN_LIMIT)
+	{
+		sparql_hash_clear_(intern->nodes);
+	}
+	entry = sparql_hash_lookup_(intern->nodes, uri, len, 1);
+	if(entry)
+	{
+		entry->data = (void *) librdf_new_node_from_node(node);
+		if(!entry->data)
+		{
+			/* The entry will be replaced by the next lookup */
+			sparql_hash_clear_(intern->nodes);
+		}
+	}
+	return node;
+}
+
+/* Return a new reference to a URI for <uri> (typically a literal's
+ * datatype), which the caller must free
+ */
+librdf_uri *
+sparql_intern_uri_(SPARQLINTERN *intern, const char *uri)
+{
+	SPARQLHASHENTRY *entry;
+	librdf_uri *p;
+	size_t len;
+
+	if(!uri)
+	{
+		return NULL;
+	}
+	len = strlen(uri);
+	entry = sparql_hash_lookup_(intern->uris, uri, len, 0);
+	if(entry)
+	{
+		return librdf_new_uri_from_uri((librdf_uri *) entry->data);
+	}
+	p = librdf_new_uri(intern->world, (const unsigned char *) uri);
+	if(!p)
+	{
+		return NULL;
+	}
+	if(sparql_hash_count_(intern->uris) >= SPARQL_INTERN_LIMIT)
+	{
+		sparql_hash_clear_(intern->uris);
+	}
+	entry = sparql_hash_lookup_(intern->uris, uri, len, 1);
+	if(entry)
+	{
+		entry->data = (void *) librdf_new_uri_from_uri(p);
+		if(!entry->data)
+		{
+			sparql_hash_clear_(intern->uris);
+		}
+	}
+	return p;
+}
+
+static void
+sparql_intern_free_node_(void *data)
+{
+	librdf_free_node((librdf_node *) data);
+}
+
+static void
+sparql_intern_free_uri_(void *data)
+{
+	librdf_free_uri((librdf_uri *) data);
+}
@@ -0,0 +1,682 @@
+/* SPARQL client: write-behind journal
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/* In write-behind mode, sparql_insert(), sparql_update() and sparql_put()
+ * append a record to a local journal file and return immediately. A
+ * background thread, which has its own connection to the server, reads
+ * the journal and applies the records in order, in batches (inserts are
+ * coalesced via the write buffer), recording the offset it has reached
+ * in a checkpoint file alongside the journal. When the store cannot be
+ * reached, or fails, the batch is retried with backoff; records which the
+ * store rejects are passed to the write error callback.
+ *
+ * If the process exits before the journal has been drained, the remaining
+ * records are applied when the journal is next opened. A batch which
+ * partially succeeded before a transient failure is sent again in full,
+ * so batches only contain records which can safely be applied twice: PUTs
+ * and inserts of triples without blank nodes. Anything else (an update,
+ * or an insert involving blank nodes) is sent on its own, and checkpointed
+ * as soon as it has been applied; it is only repeated if the connection
+ * failed after the store had applied it, but before it said so.
+ *
+ * Each record consists of a header line:
+ *
+ *   SJ KIND GRAPHLEN LEN HASH
+ *
+ * followed by the graph URI (if any), the payload, and a newline; HASH is
+ * the FNV-1a hash of the graph URI and payload, which allows a record
+ * torn by a crash to be detected (and discarded) on replay.
+ */
+
+#define JOURNAL_HEADER_MAX              96
+#define JOURNAL_BATCH_BYTES             (4 * 1024 * 1024)
+#define JOURNAL_BACKOFF_MAX             60
+
+struct sparql_journal_struct
+{
+	SPARQL *connection;
+	SPARQL *drain;
+	char *path;
+	char *ckpath;
+	int fd;
+	int flags;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	/* Offset of the end of the journal, and of the first record which has
+	 * not yet been applied
+	 */
+	off_t end;
+	off_t drained;
+	/* Set while the drain thread is waiting to retry */
+	int backoff;
+	/* Set by the error callback if a batch failed transiently */
+	int transient;
+	unsigned long failures;
+};
+
+struct sparql_journal_record_struct
+{
+	int kind;
+	size_t glen;
+	size_t len;
+	uint64_t hash;
+	size_t hlen;
+};
+
+static int sparql_journal_scan_(SPARQLJOURNAL *journal);
+static int sparql_journal_header_(SPARQLJOURNAL *journal, off_t pos, struct sparql_journal_record_struct *rec);
+static int sparql_journal_checkpoint_(SPARQLJOURNAL *journal, off_t offset);
+static off_t sparql_journal_read_checkpoint_(SPARQLJOURNAL *journal);
+static void *sparql_journal_thread_(void *arg);
+static int sparql_journal_batch_(SPARQLJOURNAL *journal, off_t start, off_t limit, off_t *next);
+static int sparql_journal_idempotent_(int kind, const char *text, size_t len);
+static void sparql_journal_error_(SPARQL *connection, int kind, const char *graph, const char *text, size_t length, void *data);
+static void sparql_journal_free_(SPARQLJOURNAL *journal);
+
+/* Enable write-behind mode, using the journal file at <path> (which will
+ * be created if it doesn't exist, and any outstanding records in which
+ * will be applied); if <path> is NULL, write-behind mode is disabled once
+ * the background thread has applied everything it can, leaving any
+ * records which could not be applied in the journal.
+ */
+int
+sparql_set_journal(SPARQL *connection, const char *path, int flags)
+{
+	SPARQLJOURNAL *p;
+
+	if(!path)
+	{
+		return sparql_journal_destroy_(connection);
+	}
+	if(connection->journal)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_JOURNAL, "a journal is already in use by this connection");
+		return -1;
+	}
+	p = (SPARQLJOURNAL *) calloc(1, sizeof(SPARQLJOURNAL));
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for journal\n");
+		return -1;
+	}
+	p->connection = connection;
+	p->flags = flags;
+	p->fd = -1;
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->cond), NULL);
+	p->path = strdup(path);
+	p->ckpath = (char *) malloc(strlen(path) + 8);
+	if(!p->path || !p->ckpath)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for journal\n");
+		sparql_journal_free_(p);
+		return -1;
+	}
+	sprintf(p->ckpath, "%s.ckpt", path);
+	p->fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if(p->fd == -1)
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+		sparql_set_error_(connection, SPARQLSTATE_JOURNAL, "failed to open journal");
+		sparql_journal_free_(p);
+		return -1;
+	}
+	if(flock(p->fd, LOCK_EX|LOCK_NB))
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: journal is in use by another process\n", path);
+		sparql_set_error_(connection, SPARQLSTATE_JOURNAL, "journal is in use by another process");
+		sparql_journal_free_(p);
+		return -1;
+	}
+	if(sparql_journal_scan_(p))
+	{
+		sparql_set_error_(connection, SPARQLSTATE_JOURNAL, "failed to read journal");
+		sparql_journal_free_(p);
+		return -1;
+	}
+	if(p->drained < p->end)
+	{
+		sparql_logf_(connection, LOG_NOTICE, "SPARQL: %s: replaying %lu bytes of journalled writes\n", path, (unsigned long) (p->end - p->drained));
+	}
+	p->drain = sparql_clone_(connection);
+	if(!p->drain ||
+	   sparql_set_write_buffer(p->drain, JOURNAL_BATCH_BYTES, 0, 0) ||
+	   sparql_set_write_error_callback(p->drain, sparql_journal_error_, (void *) p))
+	{
+		sparql_journal_free_(p);
+		return -1;
+	}
+	if(pthread_create(&(p->thread), NULL, sparql_journal_thread_, (void *) p))
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to create journal thread\n");
+		sparql_journal_free_(p);
+		return -1;
+	}
+	p->running = 1;
+	connection->journal = p;
+	return 0;
+}
+
+/* Append a write to the journal, if the connection is in write-behind
+ * mode; returns 0 if the write was journalled, 1 if the caller should
+ * perform it directly, or -1 on error.
+ */
+int
+sparql_journal_add_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len)
+{
+	SPARQLJOURNAL *j;
+	struct iovec iov[4];
+	char header[JOURNAL_HEADER_MAX];
+	size_t glen, total;
+	uint64_t hash;
+	ssize_t r;
+
+	j = connection->journal;
+	if(!j)
+	{
+		return 1;
+	}
+	glen = (graph ? strlen(graph) : 0);
+	hash = sparql_hash_(graph, glen, 0);
+	hash = sparql_hash_(text, len, hash);
+	snprintf(header, sizeof(header), "SJ %d %lu %lu %016llx\n", kind, (unsigned long) glen, (unsigned long) len, (unsigned long long) hash);
+	iov[0].iov_base = header;
+	iov[0].iov_len = strlen(header);
+	iov[1].iov_base = (void *) graph;
+	iov[1].iov_len = glen;
+	iov[2].iov_base = (void *) text;
+	iov[2].iov_len = len;
+	iov[3].iov_base = (void *) "\n";
+	iov[3].iov_len = 1;
+	total = iov[0].iov_len + glen + len + 1;
+	pthread_mutex_lock(&(j->lock));
+	r = writev(j->fd, iov, 4);
+	if(r < 0 || (size_t) r != total)
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: failed to append to journal: %s\n", j->path, r < 0 ? strerror(errno) : "short write");
+		if(r > 0)
+		{
+			/* Don't leave a partial record behind */
+			if(ftruncate(j->fd, j->end))
+			{
+				sparql_logf_(connection, LOG_CRIT, "SPARQL: %s: failed to truncate journal: %s\n", j->path, strerror(errno));
+			}
+		}
+		pthread_mutex_unlock(&(j->lock));
+		sparql_set_error_(connection, SPARQLSTATE_JOURNAL, "failed to append to journal");
+		return -1;
+	}
+	if((j->flags & SPARQL_JOURNAL_SYNC) && fdatasync(j->fd))
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: failed to sync journal: %s\n", j->path, strerror(errno));
+	}
+	j->end += total;
+	pthread_cond_broadcast(&(j->cond));
+	pthread_mutex_unlock(&(j->lock));
+	return 0;
+}
+
+/* Wait until everything which has been journalled has been applied (or
+ * has been rejected by the store); returns -1 if any writes were rejected
+ * while waiting.
+ */
+int
+sparql_journal_wait_(SPARQL *connection)
+{
+	SPARQLJOURNAL *j;
+	unsigned long failures;
+	off_t target;
+	int r;
+
+	j = connection->journal;
+	if(!j)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&(j->lock));
+	target = j->end;
+	failures = j->failures;
+	while(j->running && j->drained < target && j->end >= target)
+	{
+		pthread_cond_wait(&(j->cond), &(j->lock));
+	}
+	r = (j->failures != failures ? -1 : 0);
+	pthread_mutex_unlock(&(j->lock));
+	return r;
+}
+
+/* Stop the background thread and close the journal */
+int
+sparql_journal_destroy_(SPARQL *connection)
+{
+	SPARQLJOURNAL *j;
+
+	j = connection->journal;
+	if(!j)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&(j->lock));
+	j->stop = 1;
+	pthread_cond_broadcast(&(j->cond));
+	pthread_mutex_unlock(&(j->lock));
+	pthread_join(j->thread, NULL);
+	if(j->drained < j->end)
+	{
+		sparql_logf_(connection, LOG_WARNING, "SPARQL: %s: %lu bytes of journalled writes remain outstanding\n", j->path, (unsigned long) (j->end - j->drained));
+	}
+	connection->journal = NULL;
+	sparql_journal_free_(j);
+	return 0;
+}
+
+/* Determine the checkpoint and the end of the last intact record, and
+ * discard anything after it (which can only be the result of a crash
+ * part-way through appending)
+ */
+static int
+sparql_journal_scan_(SPARQLJOURNAL *journal)
+{
+	struct sparql_journal_record_struct rec;
+	struct stat sbuf;
+	off_t pos;
+
+	if(fstat(journal->fd, &sbuf))
+	{
+		sparql_logf_(journal->connection, LOG_ERR, "SPARQL: %s: %s\n", journal->path, strerror(errno));
+		return -1;
+	}
+	journal->drained = sparql_journal_read_checkpoint_(journal);
+	if(journal->drained > sbuf.st_size)
+	{
+		/* The journal was compacted but the checkpoint wasn't reset */
+		journal->drained = 0;
+	}
+	pos = journal->drained;
+	while(pos < sbuf.st_size)
+	{
+		if(sparql_journal_header_(journal, pos, &rec) ||
+		   pos + (off_t) (rec.hlen + rec.glen + rec.len + 1) > sbuf.st_size)
+		{
+			break;
+		}
+		pos += rec.hlen + rec.glen + rec.len + 1;
+	}
+	if(pos < sbuf.st_size)
+	{
+		sparql_logf_(journal->connection, LOG_WARNING, "SPARQL: %s: discarding %lu bytes of incomplete journal record\n", journal->path, (unsigned long) (sbuf.st_size - pos));
+		if(ftruncate(journal->fd, pos))
+		{
+			sparql_logf_(journal->connection, LOG_ERR, "SPARQL: %s: failed to truncate journal: %s\n", journal->path, strerror(errno));
+			return -1;
+		}
+	}
+	journal->end = pos;
+	return 0;
+}
+
+/* Read and parse the header of the record at <pos> */
+static int
+sparql_journal_header_(SPARQLJOURNAL *journal, off_t pos, struct sparql_journal_record_struct *rec)
+{
+	char buf[JOURNAL_HEADER_MAX + 1], *t;
+	unsigned long glen, len;
+	unsigned long long hash;
+	ssize_t r;
+
+	r = pread(journal->fd, buf, JOURNAL_HEADER_MAX, pos);
+	if(r <= 0)
+	{
+		return -1;
+	}
+	buf[r] = 0;
+	t = strchr(buf, '\n');
+	if(!t)
+	{
+		return -1;
+	}
+	*t = 0;
+	if(sscanf(buf, "SJ %d %lu %lu %llx", &(rec->kind), &glen, &len, &hash) != 4)
+	{
+		return -1;
+	}
+	rec->glen = glen;
+	rec->len = len;
+	rec->hash = hash;
+	rec->hlen = t - buf + 1;
+	return 0;
+}
+
+static int
+sparql_journal_checkpoint_(SPARQLJOURNAL *journal, off_t offset)
+{
+	FILE *f;
+	char *tmp;
+
+	tmp = (char *) malloc(strlen(journal->ckpath) + 8);
+	if(!tmp)
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.new", journal->ckpath);
+	f = fopen(tmp, "w");
+	if(!f)
+	{
+		sparql_logf_(journal->connection, LOG_ERR, "SPARQL: %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "%lu\n", (unsigned long) offset);
+	if(fclose(f) || rename(tmp, journal->ckpath))
+	{
+		sparql_logf_(journal->connection, LOG_ERR, "SPARQL: %s: %s\n", journal->ckpath, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+static off_t
+sparql_journal_read_checkpoint_(SPARQLJOURNAL *journal)
+{
+	FILE *f;
+	unsigned long offset;
+
+	f = fopen(journal->ckpath, "r");
+	if(!f)
+	{
+		return 0;
+	}
+	if(fscanf(f, "%lu", &offset) != 1)
+	{
+		offset = 0;
+	}
+	fclose(f);
+	return (off_t) offset;
+}
+
+static void *
+sparql_journal_thread_(void *arg)
+{
+	SPARQLJOURNAL *j = (SPARQLJOURNAL *) arg;
+	struct timeval now;
+	struct timespec until;
+	off_t start, limit, next;
+	int delay, r;
+
+	delay = 0;
+	pthread_mutex_lock(&(j->lock));
+	for(;;)
+	{
+		while(!j->stop && j->drained >= j->end)
+		{
+			pthread_cond_wait(&(j->cond), &(j->lock));
+		}
+		if(j->drained >= j->end)
+		{
+			break;
+		}
+		start = j->drained;
+		limit = j->end;
+		pthread_mutex_unlock(&(j->lock));
+		r = sparql_journal_batch_(j, start, limit, &next);
+		pthread_mutex_lock(&(j->lock));
+		if(r > 0)
+		{
+			/* Retry the batch after a delay, unless we're stopping */
+			if(j->stop)
+			{
+				break;
+			}
+			delay = (delay ? delay * 2 : 1);
+			if(delay > JOURNAL_BACKOFF_MAX)
+			{
+				delay = JOURNAL_BACKOFF_MAX;
+			}
+			sparql_logf_(j->connection, LOG_WARNING, "SPARQL: %s: failed to apply journalled writes (%s); retrying in %ds\n", j->path, sparql_error(j->drain), delay);
+			gettimeofday(&now, NULL);
+			until.tv_sec = now.tv_sec + delay;
+			until.tv_nsec = now.tv_usec * 1000;
+			j->backoff = 1;
+			while(!j->stop && pthread_cond_timedwait(&(j->cond), &(j->lock), &until) != ETIMEDOUT)
+			{
+				/* Woken by an append; keep waiting */
+			}
+			j->backoff = 0;
+			continue;
+		}
+		delay = 0;
+		j->drained = next;
+		if(j->drained >= j->end)
+		{
+			/* Everything has been applied: compact the journal */
+			if(!ftruncate(j->fd, 0))
+			{
+				j->drained = j->end = 0;
+			}
+		}
+		sparql_journal_checkpoint_(j, j->drained);
+		pthread_cond_broadcast(&(j->cond));
+	}
+	j->running = 0;
+	pthread_cond_broadcast(&(j->cond));
+	pthread_mutex_unlock(&(j->lock));
+	return NULL;
+}
+
+/* Apply the records from <start> up to (approximately) the batch size;
+ * returns 0 and sets <next> to the offset of the next record if the batch
+ * was applied, or 1 if it should be retried.
+ */
+static int
+sparql_journal_batch_(SPARQLJOURNAL *j, off_t start, off_t limit, off_t *next)
+{
+	struct sparql_journal_record_struct rec;
+	char *buf, *graph;
+	size_t size;
+	off_t pos;
+	int r, idempotent;
+
+	buf = NULL;
+	size = 0;
+	pos = start;
+	j->transient = 0;
+	while(pos < limit && pos - start < JOURNAL_BATCH_BYTES)
+	{
+		if(sparql_journal_header_(j, pos, &rec))
+		{
+			sparql_logf_(j->connection, LOG_CRIT, "SPARQL: %s: journal is corrupt at offset %lu; discarding the remainder\n", j->path, (unsigned long) pos);
+			pos = limit;
+			break;
+		}
+		if(rec.glen + rec.len + 1 > size)
+		{
+			free(buf);
+			size = rec.glen + rec.len + 1;
+			buf = (char *) malloc(size);
+			if(!buf)
+			{
+				sparql_logf_(j->connection, LOG_CRIT, "SPARQL: failed to allocate %lu bytes for journal record\n", (unsigned long) size);
+				size = 0;
+				j->transient = 1;
+				break;
+			}
+		}
+		if(pread(j->fd, buf, rec.glen + rec.len, pos + rec.hlen) != (ssize_t) (rec.glen + rec.len) ||
+		   sparql_hash_(buf + rec.glen, rec.len, sparql_hash_(buf, rec.glen, 0)) != rec.hash)
+		{
+			sparql_logf_(j->connection, LOG_CRIT, "SPARQL: %s: journal record at offset %lu is corrupt; skipping it\n", j->path, (unsigned long) pos);
+			pos += rec.hlen + rec.glen + rec.len + 1;
+			continue;
+		}
+		idempotent = sparql_journal_idempotent_(rec.kind, buf + rec.glen, rec.len);
+		if(!idempotent && pos > start)
+		{
+			/* This record will begin the next batch, on its own */
+			break;
+		}
+		graph = NULL;
+		if(rec.glen)
+		{
+			graph = (char *) malloc(rec.glen + 1);
+			if(!graph)
+			{
+				j->transient = 1;
+				break;
+			}
+			memcpy(graph, buf, rec.glen);
+			graph[rec.glen] = 0;
+		}
+		switch(rec.kind)
+		{
+		case SPARQL_WRITE_INSERT:
+			r = sparql_insert(j->drain, buf + rec.glen, rec.len, graph);
+			break;
+		case SPARQL_WRITE_UPDATE:
+			r = sparql_update(j->drain, buf + rec.glen, rec.len);
+			break;
+		case SPARQL_WRITE_PUT:
+			/* Don't replace the graph if the writes preceding it didn't
+			 * make it to the store
+			 */
+			sparql_flush(j->drain);
+			r = (j->transient ? 0 : sparql_put(j->drain, graph, buf + rec.glen, rec.len));
+			break;
+		default:
+			sparql_logf_(j->connection, LOG_ERR, "SPARQL: %s: skipping journal record of unknown kind %d\n", j->path, rec.kind);
+			r = 0;
+		}
+		if(r)
+		{
+			/* Buffered writes report failures via the callback; this one
+			 * was performed directly
+			 */
+			sparql_journal_error_(j->drain, rec.kind, graph, buf + rec.glen, rec.len, (void *) j);
+		}
+		free(graph);
+		pos += rec.hlen + rec.glen + rec.len + 1;
+		if(j->transient || !idempotent)
+		{
+			break;
+		}
+	}
+	free(buf);
+	if(!j->transient)
+	{
+		sparql_flush(j->drain);
+	}
+	if(j->transient)
+	{
+		/* Discard anything still buffered; it will be re-read */
+		sparql_writebuf_discard_(j->drain);
+		return 1;
+	}
+	*next = pos;
+	return 0;
+}
+
+/* Determine whether a record can be applied more than once without ill
+ * effect. An insert is only idempotent if it contains no blank nodes,
+ * which is checked conservatively: an underscore-colon or bracket
+ * anywhere (even within a literal) counts.
+ */
+static int
+sparql_journal_idempotent_(int kind, const char *text, size_t len)
+{
+	size_t c;
+
+	switch(kind)
+	{
+	case SPARQL_WRITE_PUT:
+		return 1;
+	case SPARQL_WRITE_INSERT:
+		for(c = 0; c < len; c++)
+		{
+			if(text[c] == '[' || (text[c] == '_' && c + 1 < len && text[c + 1] == ':'))
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Invoked (on the background thread) for each journalled write which
+ * failed; transient failures cause the batch to be retried, anything else
+ * is passed to the connection's write error callback
+ */
+static void
+sparql_journal_error_(SPARQL *connection, int kind, const char *graph, const char *text, size_t length, void *data)
+{
+	SPARQLJOURNAL *j = (SPARQLJOURNAL *) data;
+
+	if(sparql_error_transient_(connection))
+	{
+		j->transient = 1;
+		return;
+	}
+	pthread_mutex_lock(&(j->lock));
+	j->failures++;
+	pthread_mutex_unlock(&(j->lock));
+	if(j->connection->write_error)
+	{
+		j->connection->write_error(connection, kind, graph, text, length, j->connection->write_error_data);
+	}
+	else
+	{
+		sparql_logf_(j->connection, LOG_ERR, "SPARQL: journalled write to <%s> was rejected: %s\n", graph ? graph : "(default graph)", sparql_error(connection));
+	}
+}
+
+static void
+sparql_journal_free_(SPARQLJOURNAL *journal)
+{
+	if(journal->drain)
+	{
+		sparql_destroy(journal->drain);
+	}
+	if(journal->fd != -1)
+	{
+		close(journal->fd);
+	}
+	pthread_cond_destroy(&(journal->cond));
+	pthread_mutex_destroy(&(journal->lock));
+	free(journal->path);
+	free(journal->ckpath);
+	free(journal);
+}
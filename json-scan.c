@@ -0,0 +1,758 @@
+/* SPARQL client: streaming parser for the SPARQL 1.1 Query Results JSON
+ * Format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* The JSON document is tokenised as it arrives and translated into the
+ * same element, character data and end-of-element events that an XML
+ * results document would produce, so that the query's callbacks are
+ * invoked in exactly the same way regardless of the format. For example,
+ * each member of a solution object becomes:
+ *
+ *   <binding name="x"><literal xml:lang="en">value</literal></binding>
+ *
+ * The members of a binding object may appear in any order, so each is
+ * collected until the object closes. Members which aren't part of the
+ * results format are skipped.
+ */
+
+/* Maximum nesting depth, including skipped values */
+#define SPARQL_JSONSCAN_DEPTH           32
+
+#define JSON_KEY_IS(scan, k)            ((scan)->str.len == sizeof(k) - 1 && !memcmp((scan)->str.buf, k, sizeof(k) - 1))
+
+/* Tokeniser states */
+enum sparql_jsonscan_lex
+{
+	JL_VALUE,
+	JL_VALUE_OR_CLOSE,
+	JL_KEY,
+	JL_KEY_OR_CLOSE,
+	JL_COLON,
+	JL_COMMA,
+	JL_STRING,
+	JL_ESCAPE,
+	JL_UNICODE,
+	JL_SURROGATE,
+	JL_LITERAL,
+	JL_DONE
+};
+
+/* The meaning of a value, determined by its position in the document */
+enum sparql_jsonscan_role
+{
+	JR_TOP,
+	JR_HEAD,
+	JR_VARS,
+	JR_VAR,
+	JR_LINKS,
+	JR_LINK,
+	JR_RESULTS,
+	JR_BINDINGS,
+	JR_RESULT,
+	JR_BINDING,
+	JR_TYPE,
+	JR_VALUE,
+	JR_LANG,
+	JR_DATATYPE,
+	JR_BOOLEAN,
+	JR_SKIP
+};
+
+struct sparql_jsonscan_struct
+{
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	enum sparql_jsonscan_lex lex;
+	/* The role of the next value within the current object */
+	enum sparql_jsonscan_role next;
+	/* The string currently being read, and whether it's a member name */
+	SPARQLSCANBUF str;
+	int key;
+	/* Partially-decoded \u escape */
+	unsigned long ucs;
+	unsigned long high;
+	int nhex;
+	/* Literal (number, true, false or null) currently being read */
+	char lit[8];
+	size_t litlen;
+	/* Open objects and arrays */
+	enum sparql_jsonscan_role stack[SPARQL_JSONSCAN_DEPTH];
+	char close[SPARQL_JSONSCAN_DEPTH];
+	size_t depth;
+	/* The binding currently being collected */
+	SPARQLSCANBUF name;
+	SPARQLSCANBUF type;
+	SPARQLSCANBUF value;
+	SPARQLSCANBUF lang;
+	SPARQLSCANBUF datatype;
+	int has_lang;
+	int has_datatype;
+};
+
+static int sparql_jsonscan_byte_(SPARQLJSONSCAN *scan, int c);
+static int sparql_jsonscan_string_(SPARQLJSONSCAN *scan, const char **ptr, const char *end);
+static int sparql_jsonscan_open_(SPARQLJSONSCAN *scan, int c);
+static int sparql_jsonscan_closed_(SPARQLJSONSCAN *scan);
+static int sparql_jsonscan_key_(SPARQLJSONSCAN *scan);
+static int sparql_jsonscan_strvalue_(SPARQLJSONSCAN *scan);
+static int sparql_jsonscan_literal_(SPARQLJSONSCAN *scan);
+static int sparql_jsonscan_binding_(SPARQLJSONSCAN *scan);
+static enum sparql_jsonscan_role sparql_jsonscan_role_(SPARQLJSONSCAN *scan);
+static void sparql_jsonscan_done_(SPARQLJSONSCAN *scan);
+static void sparql_jsonscan_swap_(SPARQLSCANBUF *a, SPARQLSCANBUF *b);
+static int sparql_jsonscan_error_(SPARQLJSONSCAN *scan, const char *what);
+
+SPARQLJSONSCAN *
+sparql_jsonscan_create_(SPARQL *connection, SPARQLQUERY *query)
+{
+	SPARQLJSONSCAN *p;
+
+	p = (SPARQLJSONSCAN *) calloc(1, sizeof(SPARQLJSONSCAN));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->connection = connection;
+	p->query = query;
+	p->lex = JL_VALUE;
+	return p;
+}
+
+int
+sparql_jsonscan_destroy_(SPARQLJSONSCAN *scan)
+{
+	free(scan->str.buf);
+	free(scan->name.buf);
+	free(scan->type.buf);
+	free(scan->value.buf);
+	free(scan->lang.buf);
+	free(scan->datatype.buf);
+	free(scan);
+	return 0;
+}
+
+/* Process the next <len> bytes of a results document; <final> is nonzero
+ * once the whole document has been received
+ */
+int
+sparql_jsonscan_parse_(SPARQLJSONSCAN *scan, const char *buf, size_t len, int final)
+{
+	const char *p, *end;
+	int r;
+
+	p = buf;
+	end = buf + len;
+	while(p < end)
+	{
+		if(scan->lex == JL_STRING)
+		{
+			if(sparql_jsonscan_string_(scan, &p, end))
+			{
+				return -1;
+			}
+			continue;
+		}
+		r = sparql_jsonscan_byte_(scan, (unsigned char) *p);
+		if(r < 0)
+		{
+			return -1;
+		}
+		/* A literal is terminated by the character following it, which
+		 * must then be processed in its own right
+		 */
+		if(!r)
+		{
+			p++;
+		}
+	}
+	if(final && scan->lex != JL_DONE)
+	{
+		return sparql_jsonscan_error_(scan, "document is incomplete");
+	}
+	return 0;
+}
+
+/* Process a single character outside of a run of string data; returns 1
+ * if the character should be processed again
+ */
+static int
+sparql_jsonscan_byte_(SPARQLJSONSCAN *scan, int c)
+{
+	char ch, utf8[4];
+
+	switch(scan->lex)
+	{
+	case JL_ESCAPE:
+		switch(c)
+		{
+		case '"':
+		case '\\':
+		case '/':
+			ch = (char) c;
+			break;
+		case 'b':
+			ch = '\b';
+			break;
+		case 'f':
+			ch = '\f';
+			break;
+		case 'n':
+			ch = '\n';
+			break;
+		case 'r':
+			ch = '\r';
+			break;
+		case 't':
+			ch = '\t';
+			break;
+		case 'u':
+			scan->lex = JL_UNICODE;
+			scan->ucs = 0;
+			scan->nhex = 0;
+			return 0;
+		default:
+			return sparql_jsonscan_error_(scan, "invalid escape sequence");
+		}
+		scan->lex = JL_STRING;
+		return sparql_scanbuf_append_(scan->connection, &(scan->str), &ch, 1);
+	case JL_UNICODE:
+		if(!isxdigit(c))
+		{
+			return sparql_jsonscan_error_(scan, "invalid \\u escape sequence");
+		}
+		scan->ucs = (scan->ucs << 4) | (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+		scan->nhex++;
+		if(scan->nhex < 4)
+		{
+			return 0;
+		}
+		if(scan->high)
+		{
+			if(scan->ucs < 0xdc00 || scan->ucs > 0xdfff)
+			{
+				return sparql_jsonscan_error_(scan, "invalid surrogate pair");
+			}
+			scan->ucs = 0x10000 + ((scan->high - 0xd800) << 10) + (scan->ucs - 0xdc00);
+			scan->high = 0;
+		}
+		else if(scan->ucs >= 0xd800 && scan->ucs <= 0xdbff)
+		{
+			/* The low surrogate must follow immediately */
+			scan->high = scan->ucs;
+			scan->lex = JL_SURROGATE;
+			scan->nhex = 0;
+			return 0;
+		}
+		else if(scan->ucs >= 0xdc00 && scan->ucs <= 0xdfff)
+		{
+			return sparql_jsonscan_error_(scan, "invalid surrogate pair");
+		}
+		scan->lex = JL_STRING;
+		return sparql_scanbuf_append_(scan->connection, &(scan->str), utf8, sparql_utf8_encode_(scan->ucs, utf8));
+	case JL_SURROGATE:
+		if(!scan->nhex && c == '\\')
+		{
+			scan->nhex = 1;
+			return 0;
+		}
+		if(scan->nhex == 1 && c == 'u')
+		{
+			scan->lex = JL_UNICODE;
+			scan->ucs = 0;
+			scan->nhex = 0;
+			return 0;
+		}
+		return sparql_jsonscan_error_(scan, "invalid surrogate pair");
+	case JL_LITERAL:
+		if(isalnum(c) || c == '.' || c == '+' || c == '-')
+		{
+			if(scan->litlen < sizeof(scan->lit) - 1)
+			{
+				scan->lit[scan->litlen] = (char) c;
+			}
+			scan->litlen++;
+			return 0;
+		}
+		if(sparql_jsonscan_literal_(scan))
+		{
+			return -1;
+		}
+		return 1;
+	default:
+		break;
+	}
+	if(c == ' ' || c == '\t' || c == '\n' || c == '\r')
+	{
+		return 0;
+	}
+	switch(scan->lex)
+	{
+	case JL_DONE:
+		return sparql_jsonscan_error_(scan, "content found after the document");
+	case JL_COLON:
+		if(c != ':')
+		{
+			return sparql_jsonscan_error_(scan, "expected ':'");
+		}
+		scan->lex = JL_VALUE;
+		return 0;
+	case JL_KEY_OR_CLOSE:
+		if(c == '}')
+		{
+			return sparql_jsonscan_closed_(scan);
+		}
+		/* Fall through */
+	case JL_KEY:
+		if(c != '"')
+		{
+			return sparql_jsonscan_error_(scan, "expected a member name");
+		}
+		scan->key = 1;
+		scan->str.len = 0;
+		scan->lex = JL_STRING;
+		return 0;
+	case JL_COMMA:
+		if(c == ',')
+		{
+			scan->lex = (scan->close[scan->depth - 1] == '}' ? JL_KEY : JL_VALUE);
+			return 0;
+		}
+		if(c == scan->close[scan->depth - 1])
+		{
+			return sparql_jsonscan_closed_(scan);
+		}
+		return sparql_jsonscan_error_(scan, "expected ',' or the end of an object or array");
+	case JL_VALUE_OR_CLOSE:
+		if(c == ']')
+		{
+			return sparql_jsonscan_closed_(scan);
+		}
+		/* Fall through */
+	case JL_VALUE:
+		if(c == '{' || c == '[')
+		{
+			return sparql_jsonscan_open_(scan, c);
+		}
+		if(c == '"')
+		{
+			scan->key = 0;
+			scan->str.len = 0;
+			scan->lex = JL_STRING;
+			return 0;
+		}
+		if(c == '-' || isalnum(c))
+		{
+			scan->lit[0] = (char) c;
+			scan->litlen = 1;
+			scan->lex = JL_LITERAL;
+			return 0;
+		}
+		return sparql_jsonscan_error_(scan, "expected a value");
+	default:
+		break;
+	}
+	return sparql_jsonscan_error_(scan, "unexpected character");
+}
+
+/* Consume string data up to the next escape sequence or the closing
+ * quote
+ */
+static int
+sparql_jsonscan_string_(SPARQLJSONSCAN *scan, const char **ptr, const char *end)
+{
+	const char *p, *q;
+
+	p = *ptr;
+	for(q = p; q < end && *q != '"' && *q != '\\'; q++)
+	{
+	}
+	if(sparql_scanbuf_append_(scan->connection, &(scan->str), p, q - p))
+	{
+		return -1;
+	}
+	if(q == end)
+	{
+		*ptr = q;
+		return 0;
+	}
+	*ptr = q + 1;
+	if(*q == '\\')
+	{
+		scan->lex = JL_ESCAPE;
+		return 0;
+	}
+	if(scan->key)
+	{
+		return sparql_jsonscan_key_(scan);
+	}
+	return sparql_jsonscan_strvalue_(scan);
+}
+
+/* Determine the role of a value beginning at the current position */
+static enum sparql_jsonscan_role
+sparql_jsonscan_role_(SPARQLJSONSCAN *scan)
+{
+	if(!scan->depth)
+	{
+		return JR_TOP;
+	}
+	if(scan->close[scan->depth - 1] == '}')
+	{
+		return scan->next;
+	}
+	switch(scan->stack[scan->depth - 1])
+	{
+	case JR_VARS:
+		return JR_VAR;
+	case JR_LINKS:
+		return JR_LINK;
+	case JR_BINDINGS:
+		return JR_RESULT;
+	default:
+		break;
+	}
+	return JR_SKIP;
+}
+
+/* An object or array has been opened */
+static int
+sparql_jsonscan_open_(SPARQLJSONSCAN *scan, int c)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	enum sparql_jsonscan_role role;
+	int r;
+
+	role = sparql_jsonscan_role_(scan);
+	if(scan->depth == SPARQL_JSONSCAN_DEPTH)
+	{
+		return sparql_jsonscan_error_(scan, "objects and arrays are nested too deeply");
+	}
+	r = 0;
+	if(c == '{')
+	{
+		switch(role)
+		{
+		case JR_TOP:
+			r = sparql_query_startel_(scan->query, SQE_SPARQL, "sparql", 6, &noattrs);
+			break;
+		case JR_HEAD:
+			r = sparql_query_startel_(scan->query, SQE_HEAD, "head", 4, &noattrs);
+			break;
+		case JR_RESULTS:
+			r = sparql_query_startel_(scan->query, SQE_RESULTS, "results", 7, &noattrs);
+			break;
+		case JR_RESULT:
+			r = sparql_query_startel_(scan->query, SQE_RESULT, "result", 6, &noattrs);
+			break;
+		case JR_BINDING:
+			scan->type.len = 0;
+			scan->value.len = 0;
+			scan->has_lang = 0;
+			scan->has_datatype = 0;
+			break;
+		case JR_SKIP:
+			break;
+		default:
+			return sparql_jsonscan_error_(scan, "unexpected object");
+		}
+		scan->lex = JL_KEY_OR_CLOSE;
+		scan->close[scan->depth] = '}';
+	}
+	else
+	{
+		switch(role)
+		{
+		case JR_VARS:
+		case JR_LINKS:
+		case JR_BINDINGS:
+		case JR_SKIP:
+			break;
+		default:
+			return sparql_jsonscan_error_(scan, "unexpected array");
+		}
+		scan->lex = JL_VALUE_OR_CLOSE;
+		scan->close[scan->depth] = ']';
+	}
+	if(r)
+	{
+		return -1;
+	}
+	scan->stack[scan->depth] = role;
+	scan->depth++;
+	return 0;
+}
+
+/* The innermost object or array has been closed */
+static int
+sparql_jsonscan_closed_(SPARQLJSONSCAN *scan)
+{
+	int r;
+
+	scan->depth--;
+	r = 0;
+	switch(scan->stack[scan->depth])
+	{
+	case JR_TOP:
+	case JR_HEAD:
+	case JR_RESULTS:
+	case JR_RESULT:
+		r = sparql_query_endel_(scan->query);
+		break;
+	case JR_BINDING:
+		r = sparql_jsonscan_binding_(scan);
+		break;
+	default:
+		break;
+	}
+	sparql_jsonscan_done_(scan);
+	return (r ? -1 : 0);
+}
+
+/* A member name has been read */
+static int
+sparql_jsonscan_key_(SPARQLJSONSCAN *scan)
+{
+	enum sparql_jsonscan_role next;
+
+	next = JR_SKIP;
+	switch(scan->stack[scan->depth - 1])
+	{
+	case JR_TOP:
+		if(JSON_KEY_IS(scan, "head"))
+		{
+			next = JR_HEAD;
+		}
+		else if(JSON_KEY_IS(scan, "results"))
+		{
+			next = JR_RESULTS;
+		}
+		else if(JSON_KEY_IS(scan, "boolean"))
+		{
+			next = JR_BOOLEAN;
+		}
+		break;
+	case JR_HEAD:
+		if(JSON_KEY_IS(scan, "vars"))
+		{
+			next = JR_VARS;
+		}
+		else if(JSON_KEY_IS(scan, "link"))
+		{
+			next = JR_LINKS;
+		}
+		break;
+	case JR_RESULTS:
+		if(JSON_KEY_IS(scan, "bindings"))
+		{
+			next = JR_BINDINGS;
+		}
+		break;
+	case JR_RESULT:
+		/* The member name is the variable name */
+		sparql_jsonscan_swap_(&(scan->name), &(scan->str));
+		next = JR_BINDING;
+		break;
+	case JR_BINDING:
+		if(JSON_KEY_IS(scan, "type"))
+		{
+			next = JR_TYPE;
+		}
+		else if(JSON_KEY_IS(scan, "value"))
+		{
+			next = JR_VALUE;
+		}
+		else if(JSON_KEY_IS(scan, "xml:lang"))
+		{
+			next = JR_LANG;
+		}
+		else if(JSON_KEY_IS(scan, "datatype"))
+		{
+			next = JR_DATATYPE;
+		}
+		break;
+	default:
+		break;
+	}
+	scan->next = next;
+	scan->lex = JL_COLON;
+	return 0;
+}
+
+/* A string value has been read */
+static int
+sparql_jsonscan_strvalue_(SPARQLJSONSCAN *scan)
+{
+	struct sparql_query_attrs_struct attrs;
+	int r;
+
+	memset(&attrs, 0, sizeof(attrs));
+	r = 0;
+	switch(sparql_jsonscan_role_(scan))
+	{
+	case JR_VAR:
+		attrs.name = scan->str.buf;
+		attrs.namelen = scan->str.len;
+		r = sparql_query_simple_(scan->query, SQE_VARIABLE, "variable", &attrs, NULL, 0);
+		break;
+	case JR_LINK:
+		attrs.href = scan->str.buf;
+		attrs.hreflen = scan->str.len;
+		r = sparql_query_simple_(scan->query, SQE_LINK, "link", &attrs, NULL, 0);
+		break;
+	case JR_TYPE:
+		sparql_jsonscan_swap_(&(scan->type), &(scan->str));
+		break;
+	case JR_VALUE:
+		sparql_jsonscan_swap_(&(scan->value), &(scan->str));
+		break;
+	case JR_LANG:
+		sparql_jsonscan_swap_(&(scan->lang), &(scan->str));
+		scan->has_lang = 1;
+		break;
+	case JR_DATATYPE:
+		sparql_jsonscan_swap_(&(scan->datatype), &(scan->str));
+		scan->has_datatype = 1;
+		break;
+	case JR_SKIP:
+		break;
+	default:
+		return sparql_jsonscan_error_(scan, "unexpected string");
+	}
+	sparql_jsonscan_done_(scan);
+	return r;
+}
+
+/* A number, true, false or null has been read */
+static int
+sparql_jsonscan_literal_(SPARQLJSONSCAN *scan)
+{
+	int r;
+
+	r = 0;
+	switch(sparql_jsonscan_role_(scan))
+	{
+	case JR_BOOLEAN:
+		if(scan->litlen == 4 && !memcmp(scan->lit, "true", 4))
+		{
+			r = sparql_query_simple_(scan->query, SQE_BOOLEAN, "boolean", NULL, "true", 4);
+		}
+		else if(scan->litlen == 5 && !memcmp(scan->lit, "false", 5))
+		{
+			r = sparql_query_simple_(scan->query, SQE_BOOLEAN, "boolean", NULL, "false", 5);
+		}
+		else
+		{
+			return sparql_jsonscan_error_(scan, "expected true or false");
+		}
+		break;
+	case JR_SKIP:
+		break;
+	default:
+		return sparql_jsonscan_error_(scan, "unexpected value");
+	}
+	sparql_jsonscan_done_(scan);
+	return r;
+}
+
+/* A binding object has been closed: emit the equivalent of
+ * <binding name="..."><uri|literal|bnode ...>value</...></binding>
+ */
+static int
+sparql_jsonscan_binding_(SPARQLJSONSCAN *scan)
+{
+	struct sparql_query_attrs_struct attrs;
+	SPARQLELEMENT el;
+	const char *localname;
+
+	memset(&attrs, 0, sizeof(attrs));
+	if(scan->type.len == 3 && !memcmp(scan->type.buf, "uri", 3))
+	{
+		el = SQE_URI;
+		localname = "uri";
+	}
+	else if((scan->type.len == 7 && !memcmp(scan->type.buf, "literal", 7)) ||
+			(scan->type.len == 13 && !memcmp(scan->type.buf, "typed-literal", 13)))
+	{
+		el = SQE_LITERAL;
+		localname = "literal";
+		if(scan->has_lang)
+		{
+			attrs.lang = scan->lang.buf;
+			attrs.langlen = scan->lang.len;
+		}
+		if(scan->has_datatype)
+		{
+			attrs.datatype = scan->datatype.buf;
+			attrs.datatypelen = scan->datatype.len;
+		}
+	}
+	else if(scan->type.len == 5 && !memcmp(scan->type.buf, "bnode", 5))
+	{
+		el = SQE_BNODE;
+		localname = "bnode";
+	}
+	else
+	{
+		sparql_logf_(scan->connection, LOG_ERR, "unsupported type '%.*s' for binding to '%.*s' in JSON results\n", (int) scan->type.len, scan->type.buf ? scan->type.buf : "", (int) scan->name.len, scan->name.buf ? scan->name.buf : "");
+		return -1;
+	}
+	attrs.name = (scan->name.buf ? scan->name.buf : "");
+	attrs.namelen = scan->name.len;
+	if(sparql_query_startel_(scan->query, SQE_BINDING, "binding", 7, &attrs))
+	{
+		return -1;
+	}
+	attrs.name = NULL;
+	attrs.namelen = 0;
+	if(sparql_query_simple_(scan->query, el, localname, &attrs, scan->value.buf, scan->value.len))
+	{
+		return -1;
+	}
+	return sparql_query_endel_(scan->query);
+}
+
+/* A value has been completed */
+static void
+sparql_jsonscan_done_(SPARQLJSONSCAN *scan)
+{
+	scan->lex = (scan->depth ? JL_COMMA : JL_DONE);
+}
+
+static void
+sparql_jsonscan_swap_(SPARQLSCANBUF *a, SPARQLSCANBUF *b)
+{
+	SPARQLSCANBUF t;
+
+	t = *a;
+	*a = *b;
+	*b = t;
+}
+
+static int
+sparql_jsonscan_error_(SPARQLJSONSCAN *scan, const char *what)
+{
+	sparql_logf_(scan->connection, LOG_ERR, "returned JSON document was not well-formed: %s\n", what);
+	return -1;
+}
@@ -32,13 +32,71 @@ typedef struct sparql_row_struct SPARQLROW;
 extern "C" {
 # endif
 
+/* Request body compression methods */
+# define SPARQL_COMPRESS_NONE           0
+# define SPARQL_COMPRESS_GZIP           1
+# define SPARQL_COMPRESS_ZSTD           2
+
+/* How sparql_query_model() adds statements in named graphs to the model */
+# define SPARQL_MODEL_LOOKUP            0
+# define SPARQL_MODEL_BULK              1
+# define SPARQL_MODEL_BULK_NODEDUP      2
+
+/* Storage engines for result-sets. With SPARQL_RESULTS_COLUMNS, the row
+ * returned by sparqlres_next() is a cursor belonging to the result-set:
+ * it's repositioned by each call, so a SPARQLROW pointer obtained earlier
+ * refers to the current row rather than the one it was returned for.
+ * Nodes returned by sparqlrow_binding() remain valid until the result-set
+ * is destroyed.
+ */
+# define SPARQL_RESULTS_ROWS            0
+# define SPARQL_RESULTS_COLUMNS         1
+
+/* Kinds of buffered write operation. Writes buffered by
+ * sparql_set_write_buffer() are sent when a limit is reached, when
+ * another request is made on the connection, or by sparql_flush(); the
+ * age limit is checked on the next write rather than by a timer, so a
+ * connection which falls idle should be flushed explicitly.
+ */
+# define SPARQL_WRITE_INSERT            1
+# define SPARQL_WRITE_UPDATE            2
+# define SPARQL_WRITE_PUT               3
+
+/* Flags for sparql_set_journal(). Journalled writes are applied by a
+ * background thread with its own connection, and it's that connection
+ * (not the one the journal was set on) which is passed to the write error
+ * callback, from that thread; use it only to call sparql_error() and
+ * sparql_state().
+ */
+# define SPARQL_JOURNAL_SYNC            1
+
+/* Size of the buffer required to hold a graph digest */
+# define SPARQL_DIGEST_SIZE             33
+
 typedef void (*sparql_logger_fn)(int priority, const char *format, va_list args);
+typedef int (*sparql_statement_fn)(SPARQL *connection, librdf_statement *statement, librdf_node *graph, void *data);
+typedef void (*sparql_write_error_fn)(SPARQL *connection, int kind, const char *graph, const char *text, size_t length, void *data);
 
 SPARQL *sparql_create(const char *baseuri);
 int sparql_destroy(SPARQL *connection);
 int sparql_set_base(SPARQL *connection, const char *uri);
 int sparql_set_logger(SPARQL *connection, sparql_logger_fn logger);
 int sparql_set_verbose(SPARQL *connection, int verbose);
+int sparql_set_update_form(SPARQL *connection, int form);
+int sparql_set_post_form(SPARQL *connection, int form);
+int sparql_set_data_quads(SPARQL *connection, int quads);
+int sparql_set_xml_scanner(SPARQL *connection, int scanner);
+int sparql_set_results_formats(SPARQL *connection, const char *formats);
+int sparql_set_parallel(SPARQL *connection, size_t parallel);
+int sparql_set_chunk_limits(SPARQL *connection, size_t bytes, size_t triples);
+int sparql_set_compression(SPARQL *connection, int method);
+int sparql_set_model_mode(SPARQL *connection, int mode);
+int sparql_set_results_storage(SPARQL *connection, int storage);
+int sparql_set_write_buffer(SPARQL *connection, size_t bytes, size_t count, unsigned long ms);
+int sparql_set_write_error_callback(SPARQL *connection, sparql_write_error_fn callback, void *data);
+int sparql_set_journal(SPARQL *connection, const char *path, int flags);
+int sparql_set_manifest(SPARQL *connection, const char *path);
+int sparql_flush(SPARQL *connection);
 int sparql_set_world(SPARQL *connection, librdf_world *world);
 librdf_world *sparql_world(SPARQL *connection);
 librdf_storage *sparql_storage(SPARQL *connection);
@@ -53,16 +111,28 @@ SPARQLRES *sparql_queryf(SPARQL *connection, const char *format, ...);
 int sparql_query_model(SPARQL *connection, const char *querybuf, size_t length, librdf_model *model);
 int sparql_vqueryf_model(SPARQL *connection, librdf_model *model, const char *format, va_list ap);
 int sparql_queryf_model(SPARQL *connection, librdf_model *model, const char *format, ...);
+int sparql_construct_stream(SPARQL *connection, const char *querybuf, size_t length, sparql_statement_fn callback, void *data);
 
 int sparql_update(SPARQL *connection, const char *statement, size_t length);
 int sparql_vupdatef(SPARQL *connection, const char *format, va_list ap);
 int sparql_updatef(SPARQL *connection, const char *format, ...);
+int sparql_update_file(SPARQL *connection, const char *path);
 
 int sparql_put(SPARQL *connection, const char *graph, const char *turtle, size_t length);
 int sparql_post(SPARQL *connection, const char *graph, const char *turtle, size_t length);
+int sparql_put_file(SPARQL *connection, const char *graph, const char *path);
+int sparql_post_file(SPARQL *connection, const char *graph, const char *path);
+int sparql_get_graph(SPARQL *connection, const char *graph, librdf_model *model);
+int sparql_fetch_graphs(SPARQL *connection, const char *const *graphs, size_t count, librdf_model *model);
+int sparql_head_graph(SPARQL *connection, const char *graph);
+int sparql_delete_graph(SPARQL *connection, const char *graph);
 int sparql_insert(SPARQL *connection, const char *triples, size_t len, const char *graphuri);
 int sparql_insert_stream(SPARQL *connection, librdf_stream *stream, const char *graphuri);
 int sparql_insert_model(SPARQL *connection, librdf_model *model);
+int sparql_sync_graph(SPARQL *connection, const char *graph, librdf_model *model);
+
+int sparql_digest_stream(SPARQL *connection, librdf_stream *stream, char *digest);
+int sparql_digest_model(SPARQL *connection, librdf_model *model, librdf_node *context, char *digest);
 
 int sparqlres_is_boolean(SPARQLRES *res);
 int sparqlres_boolean(SPARQLRES *res);
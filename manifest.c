@@ -0,0 +1,342 @@
+/* SPARQL client: local manifest of graph digests
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* The manifest records the digest of the content most recently written to
+ * each graph by an operation which replaces the graph in its entirety
+ * (sparql_put() and sparql_sync_graph()). Before such an operation, or
+ * sparql_insert_model() (inserting content which a graph already holds is
+ * a no-op), the digest of the new content is compared with the manifest,
+ * and the operation is skipped if they match.
+ *
+ * Other writes to a graph which are made through this connection cause
+ * its entry to be forgotten. Writes made by other means (including
+ * arbitrary updates via sparql_update()) aren't tracked, and an
+ * application which makes them should not use a manifest for the graphs
+ * concerned.
+ *
+ * The manifest file consists of lines of the form:
+ *
+ *   DIGEST <tab> GRAPH
+ *
+ * which are appended as entries change; a DIGEST of "-" removes the entry.
+ * The last line for a graph takes precedence, and the file is rewritten
+ * when it's opened if it has accumulated too many superseded lines.
+ */
+
+struct sparql_manifest_struct
+{
+	SPARQL *connection;
+	char *path;
+	FILE *f;
+	SPARQLHASH *graphs;
+};
+
+static int sparql_manifest_load_(SPARQLMANIFEST *manifest, size_t *lines);
+static int sparql_manifest_compact_(SPARQLMANIFEST *manifest);
+static int sparql_manifest_write_entry_(SPARQLHASHENTRY *entry, void *data);
+static int sparql_manifest_set_(SPARQL *connection, const char *graph, const char *digest);
+static void sparql_manifest_free_(SPARQLMANIFEST *manifest);
+
+/* Use the manifest file at <path> (which will be created if it doesn't
+ * exist) to skip writes of unchanged graphs; if <path> is NULL, stop
+ * using the manifest
+ */
+int
+sparql_set_manifest(SPARQL *connection, const char *path)
+{
+	SPARQLMANIFEST *p;
+	size_t lines;
+
+	sparql_manifest_destroy_(connection);
+	if(!path)
+	{
+		return 0;
+	}
+	p = (SPARQLMANIFEST *) calloc(1, sizeof(SPARQLMANIFEST));
+	if(!p)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for manifest\n");
+		return -1;
+	}
+	p->connection = connection;
+	p->path = strdup(path);
+	p->graphs = sparql_hash_create_(connection, free);
+	if(!p->path || !p->graphs)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for manifest\n");
+		sparql_manifest_free_(p);
+		return -1;
+	}
+	if(sparql_manifest_load_(p, &lines))
+	{
+		sparql_manifest_free_(p);
+		return -1;
+	}
+	if(lines > 64 && lines > sparql_hash_count_(p->graphs) * 2)
+	{
+		if(sparql_manifest_compact_(p))
+		{
+			sparql_manifest_free_(p);
+			return -1;
+		}
+	}
+	p->f = fopen(path, "a");
+	if(!p->f)
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: %s\n", path, strerror(errno));
+		sparql_set_error_(connection, SPARQLSTATE_FILE, "failed to open manifest");
+		sparql_manifest_free_(p);
+		return -1;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: %s: manifest contains %u graphs\n", path, (unsigned) sparql_hash_count_(p->graphs));
+	connection->manifest = p;
+	return 0;
+}
+
+int
+sparql_manifest_destroy_(SPARQL *connection)
+{
+	if(connection->manifest)
+	{
+		sparql_manifest_free_(connection->manifest);
+		connection->manifest = NULL;
+	}
+	return 0;
+}
+
+/* Returns 1 if the manifest shows that the content of <graph> already has
+ * the digest <digest>, 0 otherwise
+ */
+int
+sparql_manifest_check_(SPARQL *connection, const char *graph, const char *digest)
+{
+	SPARQLHASHENTRY *entry;
+
+	if(!connection->manifest || !graph)
+	{
+		return 0;
+	}
+	entry = sparql_hash_lookup_(connection->manifest->graphs, graph, strlen(graph), 0);
+	if(entry && entry->data && !strcmp((const char *) entry->data, digest))
+	{
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: <%s> is unchanged (%s)\n", graph, digest);
+		return 1;
+	}
+	return 0;
+}
+
+/* Record that the content of <graph> now has the digest <digest> */
+int
+sparql_manifest_record_(SPARQL *connection, const char *graph, const char *digest)
+{
+	if(!connection->manifest || !graph)
+	{
+		return 0;
+	}
+	return sparql_manifest_set_(connection, graph, digest);
+}
+
+/* Record that the content of <graph> is no longer known */
+int
+sparql_manifest_forget_(SPARQL *connection, const char *graph)
+{
+	if(!connection->manifest || !graph ||
+	   !sparql_hash_lookup_(connection->manifest->graphs, graph, strlen(graph), 0))
+	{
+		return 0;
+	}
+	return sparql_manifest_set_(connection, graph, NULL);
+}
+
+static int
+sparql_manifest_set_(SPARQL *connection, const char *graph, const char *digest)
+{
+	SPARQLMANIFEST *manifest;
+	SPARQLHASHENTRY *entry;
+	char *p;
+
+	manifest = connection->manifest;
+	entry = sparql_hash_lookup_(manifest->graphs, graph, strlen(graph), 1);
+	if(!entry)
+	{
+		return -1;
+	}
+	if(entry->data && digest && !strcmp((const char *) entry->data, digest))
+	{
+		return 0;
+	}
+	p = NULL;
+	if(digest && !(p = strdup(digest)))
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for manifest entry\n");
+		return -1;
+	}
+	free(entry->data);
+	entry->data = p;
+	if(fprintf(manifest->f, "%s\t%s\n", digest ? digest : "-", graph) < 0 ||
+	   fflush(manifest->f))
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %s: %s\n", manifest->path, strerror(errno));
+		sparql_set_error_(connection, SPARQLSTATE_FILE, "failed to update manifest");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_manifest_load_(SPARQLMANIFEST *manifest, size_t *lines)
+{
+	SPARQLHASHENTRY *entry;
+	FILE *f;
+	char *line, *graph, *t, *p;
+	size_t size;
+	ssize_t len;
+	int r;
+
+	*lines = 0;
+	f = fopen(manifest->path, "r");
+	if(!f)
+	{
+		if(errno == ENOENT)
+		{
+			return 0;
+		}
+		sparql_logf_(manifest->connection, LOG_ERR, "SPARQL: %s: %s\n", manifest->path, strerror(errno));
+		sparql_set_error_(manifest->connection, SPARQLSTATE_FILE, "failed to read manifest");
+		return -1;
+	}
+	line = NULL;
+	size = 0;
+	r = 0;
+	while(!r && (len = getline(&line, &size, f)) > 0)
+	{
+		if(line[len - 1] != '\n')
+		{
+			/* Ignore a line torn by a crash */
+			break;
+		}
+		line[len - 1] = 0;
+		graph = strchr(line, '\t');
+		if(!graph)
+		{
+			continue;
+		}
+		*graph = 0;
+		graph++;
+		(*lines)++;
+		if(!strcmp(line, "-"))
+		{
+			entry = sparql_hash_lookup_(manifest->graphs, graph, strlen(graph), 0);
+			if(entry)
+			{
+				free(entry->data);
+				entry->data = NULL;
+			}
+			continue;
+		}
+		entry = sparql_hash_lookup_(manifest->graphs, graph, strlen(graph), 1);
+		p = (entry ? strdup(line) : NULL);
+		if(!p)
+		{
+			r = -1;
+			break;
+		}
+		t = (char *) entry->data;
+		free(t);
+		entry->data = p;
+	}
+	free(line);
+	fclose(f);
+	return r;
+}
+
+/* Rewrite the manifest so that it contains only the current entries */
+static int
+sparql_manifest_compact_(SPARQLMANIFEST *manifest)
+{
+	char *tmp;
+	int r;
+
+	tmp = (char *) malloc(strlen(manifest->path) + 8);
+	if(!tmp)
+	{
+		sparql_logf_(manifest->connection, LOG_CRIT, "SPARQL: failed to allocate memory for manifest path\n");
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", manifest->path);
+	manifest->f = fopen(tmp, "w");
+	r = -1;
+	if(manifest->f)
+	{
+		r = sparql_hash_iterate_(manifest->graphs, sparql_manifest_write_entry_, manifest);
+		if(fclose(manifest->f))
+		{
+			r = -1;
+		}
+		manifest->f = NULL;
+		if(!r && rename(tmp, manifest->path))
+		{
+			r = -1;
+		}
+	}
+	if(r)
+	{
+		sparql_logf_(manifest->connection, LOG_ERR, "SPARQL: %s: %s\n", tmp, strerror(errno));
+		sparql_set_error_(manifest->connection, SPARQLSTATE_FILE, "failed to rewrite manifest");
+		unlink(tmp);
+	}
+	free(tmp);
+	return r;
+}
+
+static int
+sparql_manifest_write_entry_(SPARQLHASHENTRY *entry, void *data)
+{
+	SPARQLMANIFEST *manifest = (SPARQLMANIFEST *) data;
+
+	if(!entry->data)
+	{
+		return 0;
+	}
+	return (fprintf(manifest->f, "%s\t%s\n", (const char *) entry->data, entry->key) < 0 ? -1 : 0);
+}
+
+static void
+sparql_manifest_free_(SPARQLMANIFEST *manifest)
+{
+	if(manifest->f)
+	{
+		fclose(manifest->f);
+	}
+	if(manifest->graphs)
+	{
+		sparql_hash_destroy_(manifest->graphs);
+	}
+	free(manifest->path);
+	free(manifest);
+}
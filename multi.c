@@ -0,0 +1,146 @@
+/* SPARQL client: parallel transfers
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* Perform a sequence of transfers, at most <parallel> at a time, using
+ * the cURL multi interface (which also pools connections to the server
+ * between them).
+ *
+ * <next> is invoked whenever there is capacity for another transfer, and
+ * should return a prepared easy handle, or NULL if there are no more
+ * transfers to perform (or an error occurred preparing one, in which case
+ * no further transfers will be started). <done> is invoked as each
+ * transfer completes, and is responsible for determining its outcome
+ * (usually via sparql_curl_result_()) and cleaning up the handle.
+ *
+ * Returns 0 if the multi interface itself operated correctly; the callers
+ * are responsible for aggregating the results of individual transfers.
+ */
+int
+sparql_multi_perform_(SPARQL *connection, size_t parallel, CURL *(*next)(SPARQL *connection, void *data), void (*done)(SPARQL *connection, CURL *ch, CURLcode result, void *data), void *data)
+{
+	CURLM *multi;
+	CURLMcode mc;
+	CURLMsg *msg;
+	CURL *ch, **handles;
+	size_t active, c;
+	int running, remaining, exhausted, r;
+
+	if(!parallel)
+	{
+		parallel = 1;
+	}
+	handles = (CURL **) calloc(parallel, sizeof(CURL *));
+	if(!handles)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for transfer list\n");
+		return -1;
+	}
+	multi = curl_multi_init();
+	if(!multi)
+	{
+		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to create new cURL multi handle\n");
+		free(handles);
+		return -1;
+	}
+	r = 0;
+	active = 0;
+	exhausted = 0;
+	for(;;)
+	{
+		while(!exhausted && active < parallel)
+		{
+			ch = next(connection, data);
+			if(!ch)
+			{
+				exhausted = 1;
+				break;
+			}
+			mc = curl_multi_add_handle(multi, ch);
+			if(mc != CURLM_OK)
+			{
+				sparql_logf_(connection, LOG_ERR, "SPARQL: failed to add transfer to cURL multi handle: %s\n", curl_multi_strerror(mc));
+				done(connection, ch, CURLE_FAILED_INIT, data);
+				r = -1;
+				exhausted = 1;
+				break;
+			}
+			for(c = 0; handles[c]; c++)
+			{
+				/* Find a free slot */
+			}
+			handles[c] = ch;
+			active++;
+		}
+		if(!active)
+		{
+			break;
+		}
+		running = 0;
+		mc = curl_multi_perform(multi, &running);
+		if(mc != CURLM_OK)
+		{
+			sparql_logf_(connection, LOG_ERR, "SPARQL: cURL multi transfer failed: %s\n", curl_multi_strerror(mc));
+			r = -1;
+			break;
+		}
+		while((msg = curl_multi_info_read(multi, &remaining)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+			{
+				continue;
+			}
+			ch = msg->easy_handle;
+			curl_multi_remove_handle(multi, ch);
+			for(c = 0; c < parallel; c++)
+			{
+				if(handles[c] == ch)
+				{
+					handles[c] = NULL;
+					break;
+				}
+			}
+			active--;
+			done(connection, ch, msg->data.result, data);
+		}
+		if(running)
+		{
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+	/* If the multi handle itself failed, abandon any transfers which are
+	 * still in progress
+	 */
+	for(c = 0; c < parallel; c++)
+	{
+		if(handles[c])
+		{
+			curl_multi_remove_handle(multi, handles[c]);
+			done(connection, handles[c], CURLE_ABORTED_BY_CALLBACK, data);
+		}
+	}
+	curl_multi_cleanup(multi);
+	free(handles);
+	return r;
+}
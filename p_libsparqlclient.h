@@ -23,7 +23,9 @@
 # include <stddef.h>
 # include <stdlib.h>
 # include <stdarg.h>
+# include <stdint.h>
 # include <string.h>
+# include <strings.h>
 # include <ctype.h>
 # include <errno.h>
 # include <syslog.h>
@@ -50,13 +52,47 @@
 # define SPARQLSTATE_CREATE_STREAM      "X0006"
 # define SPARQLSTATE_BIND_INVALID       "X0007"
 # define SPARQLSTATE_SERIALISE          "X0008"
+# define SPARQLSTATE_COMPRESS           "X0009"
+# define SPARQLSTATE_FILE               "X0010"
+# define SPARQLSTATE_JOURNAL            "X0011"
+# define SPARQLSTATE_RESULTS_FORMAT     "X0012"
+# define SPARQLSTATE_MODEL_MODE         "X0013"
+# define SPARQLSTATE_RESULTS_STORAGE    "X0014"
+
+/* Default limits for chunked, parallel uploads */
+# define SPARQL_DEFAULT_PARALLEL        4
+# define SPARQL_DEFAULT_CHUNK_BYTES     (4 * 1024 * 1024)
+# define SPARQL_DEFAULT_CHUNK_TRIPLES   50000
+
+/* The number of statements added to a model per transaction in bulk mode */
+# define SPARQL_MODEL_BATCH             10000
+
+/* The maximum number of nodes or URIs held by an interning cache */
+# define SPARQL_INTERN_LIMIT            4096
 
 # define SPARQLSTATE_INDEX_BOUNDS       "W0001"
 # define SPARQLSTATE_RESET_BOOL         "W0002"
 # define SPARQLSTATE_FETCH_BOOL         "W0003"
 
 typedef struct sparql_query_struct SPARQLQUERY;
+typedef struct sparql_body_struct SPARQLBODY;
+typedef struct sparql_hash_struct SPARQLHASH;
+typedef struct sparql_hash_entry_struct SPARQLHASHENTRY;
+typedef struct sparql_intern_struct SPARQLINTERN;
+typedef struct sparql_writebuf_struct SPARQLWRITEBUF;
+typedef struct sparql_journal_struct SPARQLJOURNAL;
+typedef struct sparql_manifest_struct SPARQLMANIFEST;
+typedef struct sparql_xmlscan_struct SPARQLXMLSCAN;
+typedef struct sparql_jsonscan_struct SPARQLJSONSCAN;
+typedef struct sparql_tsvscan_struct SPARQLTSVSCAN;
+typedef struct sparql_binscan_struct SPARQLBINSCAN;
+typedef struct sparql_rdfscan_struct SPARQLRDFSCAN;
+typedef struct sparql_scanbuf_struct SPARQLSCANBUF;
 typedef enum sparql_parse_state SPARQLSTATE;
+typedef enum sparql_results_element SPARQLELEMENT;
+typedef struct sparql_results_format_struct SPARQLFORMAT;
+
+# define SPARQL_RESULTS_NS              "http://www.w3.org/2005/sparql-results#"
 
 enum sparql_parse_state
 {
@@ -76,6 +112,67 @@ enum sparql_parse_state
 	SQS_CAPTURE
 };
 
+/* Elements of the SPARQL Query Results XML Format */
+enum sparql_results_element
+{
+	SQE_OTHER = 0,
+	SQE_SPARQL,
+	SQE_HEAD,
+	SQE_LINK,
+	SQE_VARIABLE,
+	SQE_RESULTS,
+	SQE_RESULT,
+	SQE_BINDING,
+	SQE_URI,
+	SQE_LITERAL,
+	SQE_BNODE,
+	SQE_BOOLEAN
+};
+
+/* Parsers for query results */
+enum sparql_results_parser
+{
+	SRP_XML = 0,
+	SRP_JSON,
+	SRP_TSV,
+	SRP_BINARY,
+	/* An RDF graph, in response to CONSTRUCT or DESCRIBE */
+	SRP_RDF,
+	SRP_CAPTURE
+};
+
+/* A query results format which may be requested and parsed */
+struct sparql_results_format_struct
+{
+	/* The short name used in sparql_set_results_formats() */
+	const char *name;
+	const char *mimetype;
+	enum sparql_results_parser parser;
+};
+
+/* The attributes of a results element which are of interest; each is NULL
+ * if not present, and values are not NUL-terminated
+ */
+struct sparql_query_attrs_struct
+{
+	const char *name;
+	size_t namelen;
+	const char *href;
+	size_t hreflen;
+	const char *datatype;
+	size_t datatypelen;
+	const char *lang;
+	size_t langlen;
+};
+
+/* A growable buffer used by the results scanners, kept NUL-terminated */
+struct sparql_scanbuf_struct
+{
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
 struct sparql_capture_struct
 {
 	char *buf;
@@ -83,12 +180,38 @@ struct sparql_capture_struct
 	size_t pos;
 };
 
+struct sparql_hash_entry_struct
+{
+	char *key;
+	size_t keylen;
+	uint64_t hash;
+	void *data;
+	size_t index;
+	SPARQLHASHENTRY *next;
+};
+
 struct sparql_connection_struct
 {
 	URI *base;
 	char *query_uri;
 	char *update_uri;
 	char *data_uri;
+	int update_form;
+	int post_form;
+	int data_quads;
+	int xml_scan;
+	char *accept;
+	size_t parallel;
+	size_t chunk_bytes;
+	size_t chunk_triples;
+	int compress;
+	int model_mode;
+	int results_storage;
+	SPARQLWRITEBUF *writebuf;
+	SPARQLJOURNAL *journal;
+	SPARQLMANIFEST *manifest;
+	sparql_write_error_fn write_error;
+	void *write_error_data;
 	int verbose;
 	sparql_logger_fn logger;
 	librdf_world *world;
@@ -105,6 +228,9 @@ int sparql_urlencode_l_(const char *src, size_t srclen, char *dest, size_t destl
 
 void sparql_set_error_(SPARQL *connection, const char *state, const char *error);
 void sparql_set_nerror_(SPARQL *connection, int status, const char *error);
+int sparql_error_transient_(SPARQL *connection);
+
+SPARQL *sparql_clone_(SPARQL *connection);
 
 void sparql_logf_(SPARQL *connection, int priority, const char *format, ...);
 
@@ -121,14 +247,47 @@ int sparql_query_set_literal_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *q
 int sparql_query_set_uri_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, const char *name, const char *uri, void *data));
 int sparql_query_set_bnode_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, const char *name, const char *ref, void *data));
 int sparql_query_set_boolean_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, int value, void *data));
+int sparql_query_set_statement_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph, void *data));
 int sparql_query_set_complete_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, void *data));
 int sparql_query_set_error_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, void *data));
 int sparql_query_perform_(SPARQLQUERY *query, const char *statement, size_t length);
+SPARQLELEMENT sparql_query_element_(const char *name, size_t len);
+int sparql_query_startel_(SPARQLQUERY *query, SPARQLELEMENT el, const char *localname, size_t namelen, const struct sparql_query_attrs_struct *attrs);
+int sparql_query_endel_(SPARQLQUERY *query);
+int sparql_query_characters_(SPARQLQUERY *query, const char *ch, size_t len);
+int sparql_query_simple_(SPARQLQUERY *query, SPARQLELEMENT el, const char *localname, const struct sparql_query_attrs_struct *attrs, const char *text, size_t len);
+size_t sparql_utf8_encode_(unsigned long c, char *out);
+int sparql_scanbuf_append_(SPARQL *connection, SPARQLSCANBUF *buf, const void *p, size_t len);
+int sparql_query_statement_(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph);
+const SPARQLFORMAT *sparql_query_format_(const char *name, size_t len);
+char *sparql_query_accept_(SPARQL *connection, const char *formats);
+
+SPARQLXMLSCAN *sparql_xmlscan_create_(SPARQL *connection, SPARQLQUERY *query);
+int sparql_xmlscan_destroy_(SPARQLXMLSCAN *scan);
+int sparql_xmlscan_parse_(SPARQLXMLSCAN *scan, const char *buf, size_t len, int final);
+const char *sparql_xmlscan_pending_(SPARQLXMLSCAN *scan, size_t *len);
+
+SPARQLJSONSCAN *sparql_jsonscan_create_(SPARQL *connection, SPARQLQUERY *query);
+int sparql_jsonscan_destroy_(SPARQLJSONSCAN *scan);
+int sparql_jsonscan_parse_(SPARQLJSONSCAN *scan, const char *buf, size_t len, int final);
+
+SPARQLTSVSCAN *sparql_tsvscan_create_(SPARQL *connection, SPARQLQUERY *query);
+int sparql_tsvscan_destroy_(SPARQLTSVSCAN *scan);
+int sparql_tsvscan_parse_(SPARQLTSVSCAN *scan, const char *buf, size_t len, int final);
+
+SPARQLBINSCAN *sparql_binscan_create_(SPARQL *connection, SPARQLQUERY *query);
+int sparql_binscan_destroy_(SPARQLBINSCAN *scan);
+int sparql_binscan_parse_(SPARQLBINSCAN *scan, const char *buf, size_t len, int final);
+
+SPARQLRDFSCAN *sparql_rdfscan_create_(SPARQL *connection, SPARQLQUERY *query, const char *type);
+int sparql_rdfscan_destroy_(SPARQLRDFSCAN *scan);
+int sparql_rdfscan_parse_(SPARQLRDFSCAN *scan, const char *buf, size_t len, int final);
 
 SPARQLRES *sparqlres_create_(SPARQL *connection);
 int sparqlres_set_boolean_(SPARQLRES *res, int value);
 int sparqlres_add_variable_(SPARQLRES *res, const char *name);
 int sparqlres_add_link_(SPARQLRES *res, const char *href);
+int sparqlres_complete_(SPARQLRES *res);
 
 SPARQLROW *sparqlrow_create_(SPARQLRES *res);
 int sparqlrow_set_uri_(SPARQLRES *res, SPARQLROW *row, const char *binding, const char *uri);
@@ -137,8 +296,66 @@ int sparqlrow_set_bnode_(SPARQLRES *res, SPARQLROW *row, const char *binding, co
 
 int sparql_vasprintf_(SPARQL *restrict connection, char *restrict *ptr, const char *restrict format_string, va_list vargs);
 
+SPARQLBODY *sparql_body_create_(SPARQL *connection, const char *prefix, int encode);
+int sparql_body_destroy_(SPARQLBODY *body);
+int sparql_body_add_(SPARQLBODY *body, const char *buf, size_t length);
+int sparql_body_add_copy_(SPARQLBODY *body, const char *buf, size_t length);
+int sparql_body_add_str_(SPARQLBODY *body, const char *str);
+int sparql_body_add_file_(SPARQLBODY *body, const char *path);
+int sparql_body_add_stream_(SPARQLBODY *body, librdf_stream *stream);
+curl_off_t sparql_body_length_(SPARQLBODY *body);
+size_t sparql_body_read_(SPARQLBODY *body, char *buf, size_t size);
+int sparql_body_attach_(SPARQLBODY *body, CURL *ch, struct curl_slist **headers);
+int sparql_statement_write_(SPARQL *connection, librdf_statement *statement, raptor_iostream *iostr);
+int sparql_quad_write_(SPARQL *connection, librdf_statement *statement, const char *graph, raptor_iostream *iostr);
+
+SPARQLBODY *sparql_update_body_(SPARQL *connection);
+CURL *sparql_update_prepare_(SPARQL *connection, SPARQLBODY *body, struct curl_slist **headers);
+int sparql_update_perform_(SPARQL *connection, SPARQLBODY *body);
+SPARQLBODY *sparql_insert_body_(SPARQL *connection, const char *graphuri, const char *triples, size_t len, librdf_stream *stream);
+
+SPARQLBODY *sparql_post_body_(SPARQL *connection, const char *graph);
+CURL *sparql_post_prepare_(SPARQL *connection, const char *graph, SPARQLBODY *body, struct curl_slist **headers);
+int sparql_post_perform_(SPARQL *connection, const char *graph, SPARQLBODY *body);
+CURL *sparql_post_quads_prepare_(SPARQL *connection, SPARQLBODY *body, struct curl_slist **headers);
+
+int sparql_insert_model_(SPARQL *connection, librdf_model *model, const char *graph);
+
+char *sparql_data_graph_uri_(SPARQL *connection, const char *graph);
+
+SPARQLHASH *sparql_hash_create_(SPARQL *connection, void (*destructor)(void *data));
+int sparql_hash_destroy_(SPARQLHASH *hash);
+int sparql_hash_clear_(SPARQLHASH *hash);
+size_t sparql_hash_count_(SPARQLHASH *hash);
+SPARQLHASHENTRY *sparql_hash_lookup_(SPARQLHASH *hash, const char *key, size_t keylen, int create);
+int sparql_hash_iterate_(SPARQLHASH *hash, int (*callback)(SPARQLHASHENTRY *entry, void *data), void *data);
+uint64_t sparql_hash_(const void *buf, size_t len, uint64_t seed);
+
+SPARQLINTERN *sparql_intern_create_(SPARQL *connection, librdf_world *world);
+int sparql_intern_destroy_(SPARQLINTERN *intern);
+librdf_node *sparql_intern_node_(SPARQLINTERN *intern, const char *uri);
+librdf_uri *sparql_intern_uri_(SPARQLINTERN *intern, const char *uri);
+
 CURL *sparql_curl_create_(SPARQL *connection, const char *url);
 int sparql_curl_perform_(CURL *ch);
+int sparql_curl_result_(SPARQL *connection, CURL *ch, CURLcode e, struct sparql_capture_struct *capture);
+int sparql_multi_perform_(SPARQL *connection, size_t parallel, CURL *(*next)(SPARQL *connection, void *data), void (*done)(SPARQL *connection, CURL *ch, CURLcode result, void *data), void *data);
 size_t sparql_curl_dummy_write_(char *ptr, size_t size, size_t nemb, void *userdata);
 
+int sparql_writebuf_add_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len);
+int sparql_writebuf_sync_(SPARQL *connection);
+int sparql_writebuf_discard_(SPARQL *connection);
+int sparql_writebuf_destroy_(SPARQL *connection);
+
+int sparql_journal_add_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len);
+int sparql_journal_wait_(SPARQL *connection);
+int sparql_journal_destroy_(SPARQL *connection);
+
+int sparql_digest_turtle_(SPARQL *connection, const char *base, const char *buf, size_t len, char *digest);
+
+int sparql_manifest_check_(SPARQL *connection, const char *graph, const char *digest);
+int sparql_manifest_record_(SPARQL *connection, const char *graph, const char *digest);
+int sparql_manifest_forget_(SPARQL *connection, const char *graph);
+int sparql_manifest_destroy_(SPARQL *connection);
+
 #endif /*!P_LIBSPARQLCLIENT_H_*/
@@ -24,6 +24,31 @@
 
 #include "p_libsparqlclient.h"
 
+/* The Accept header sent with queries unless sparql_set_results_formats()
+ * has been used to specify otherwise
+ */
+#define SPARQL_DEFAULT_ACCEPT           "Accept: application/x-binary-rdf-results-table, application/sparql-results+json;q=0.95, text/tab-separated-values;q=0.92, application/sparql-results+xml;q=0.9, application/n-quads;q=0.6, application/n-triples;q=0.6, text/turtle;q=0.5, application/ntriples;q=0.5"
+
+/* Query results formats which we can parse, including the RDF
+ * serialisations returned by CONSTRUCT and DESCRIBE; responses of any other
+ * type are treated as SPARQL results XML
+ */
+static const SPARQLFORMAT sparql_formats_[] = {
+	{ "binary", "application/x-binary-rdf-results-table", SRP_BINARY },
+	{ "json", "application/sparql-results+json", SRP_JSON },
+	{ "tsv", "text/tab-separated-values", SRP_TSV },
+	{ "xml", "application/sparql-results+xml", SRP_XML },
+	{ "nquads", "application/n-quads", SRP_RDF },
+	{ "ntriples", "application/n-triples", SRP_RDF },
+	{ "turtle", "text/turtle", SRP_RDF },
+	{ "trig", "application/trig", SRP_RDF },
+	{ "rdfxml", "application/rdf+xml", SRP_RDF },
+	{ NULL, "application/ntriples", SRP_RDF },
+	{ NULL, "application/x-turtle", SRP_RDF },
+	{ NULL, "text/plain", SRP_CAPTURE },
+	{ NULL, NULL, SRP_XML }
+};
+
 struct sparql_query_struct
 {
 	SPARQL *connection;
@@ -33,6 +58,9 @@ struct sparql_query_struct
 	xmlParserCtxtPtr ctx;
 	xmlDocPtr doc;
 	xmlSAXHandler sax;
+	SPARQLXMLSCAN *scan;
+	const SPARQLFORMAT *format;
+	void *parser;
 	char *buf;
 	char *name;
 	char *datatype;
@@ -51,14 +79,23 @@ struct sparql_query_struct
 	int (*uri)(SPARQLQUERY *query, const char *name, const char *uri, void *data);
 	int (*bnode)(SPARQLQUERY *query, const char *name, const char *ref, void *data);
 	int (*boolean)(SPARQLQUERY *query, int value, void *data);
+	int (*statement)(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph, void *data);
 	int (*complete)(SPARQLQUERY *query, void *data);
 	int (*error)(SPARQLQUERY *query, void *data);
 };
 
 static size_t sparql_query_write_(char *ptr, size_t size, size_t nemb, void *userdata);
+static int sparql_query_is_type_(const char *type, const char *mime);
+static const SPARQLFORMAT *sparql_query_content_type_(const char *type);
+static int sparql_query_has_q_(const char *params, size_t len);
+static int sparql_query_parser_create_(SPARQLQUERY *query, const char *type);
+static int sparql_query_parser_parse_(SPARQLQUERY *query, const char *buf, size_t len, int final);
+static void sparql_query_parser_destroy_(SPARQLQUERY *query);
 static void sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes);
 static void sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI);
 static void sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len);
+static char *sparql_query_strndup_(SPARQLQUERY *query, const char *value, size_t len, const char *what);
+static int sparql_query_attr_(const xmlChar **attributes, int nb_attributes, const char *ns, const char *name, const char **value, size_t *len);
 
 SPARQLQUERY *
 sparql_query_create_(SPARQL *connection)
@@ -89,6 +126,18 @@ sparql_query_create_(SPARQL *connection)
 		return NULL;
 	}
 	xmlCtxtUseOptions(p->ctx, XML_PARSE_NODICT | XML_PARSE_NOENT);
+	if(connection->xml_scan)
+	{
+		p->scan = sparql_xmlscan_create_(connection, p);
+		if(!p->scan)
+		{
+			sparql_logf_(p->connection, LOG_CRIT, "failed to create XML results scanner\n");
+			xmlFreeParserCtxt(p->ctx);
+			curl_easy_cleanup(p->ch);
+			free(p);
+			return NULL;
+		}
+	}
 	return p;
 }
 
@@ -100,6 +149,11 @@ sparql_query_destroy_(SPARQLQUERY *query)
 	free(query->datatype);
 	free(query->buf);
 	curl_easy_cleanup(query->ch);
+	if(query->scan)
+	{
+		sparql_xmlscan_destroy_(query->scan);
+	}
+	sparql_query_parser_destroy_(query);
 	if(query->doc)
 	{
 		xmlFreeDoc(query->doc);
@@ -190,6 +244,13 @@ sparql_query_set_boolean_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query
 	return 0;
 }
 
+int
+sparql_query_set_statement_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph, void *data))
+{
+	query->statement = callback;
+	return 0;
+}
+
 int
 sparql_query_set_complete_(SPARQLQUERY *query, int (*callback)(SPARQLQUERY *query, void *data))
 {
@@ -211,6 +272,7 @@ sparql_query_perform_(SPARQLQUERY *query, const char *statement, size_t length)
 	size_t buflen;
 	struct curl_slist *headers;
 	
+	sparql_writebuf_sync_(query->connection);
 	buflen = sparql_urlencode_lsize_(statement, length);
 	buf = (char *) malloc(strlen(query->connection->query_uri) + buflen + 16);
 	sprintf(buf, "%s?query=", query->connection->query_uri);
@@ -220,10 +282,11 @@ sparql_query_perform_(SPARQLQUERY *query, const char *statement, size_t length)
 	curl_easy_setopt(query->ch, CURLOPT_URL, buf);
 	curl_easy_setopt(query->ch, CURLOPT_WRITEDATA, (void *) query);
 	curl_easy_setopt(query->ch, CURLOPT_WRITEFUNCTION, sparql_query_write_);
-	headers = curl_slist_append(NULL, "Accept: application/sparql-results+xml, text/turtle, application/ntriples");
+	headers = curl_slist_append(NULL, (query->connection->accept ? query->connection->accept : SPARQL_DEFAULT_ACCEPT));
 	curl_easy_setopt(query->ch, CURLOPT_HTTPHEADER, headers);
 	query->result = 0;
 	query->state = SQS_ROOT;
+	sparql_query_parser_destroy_(query);
 	if(sparql_curl_perform_(query->ch))
 	{
 		query->result = -1;
@@ -255,6 +318,9 @@ sparql_query_write_(char *ptr, size_t size, size_t nemb, void *userdata)
 {
 	SPARQLQUERY *query = (SPARQLQUERY *) userdata;
 	char *type;
+	const char *buf;
+	size_t len;
+	int r;
 
 	if(query->state == SQS_CAPTURE)
 	{
@@ -264,16 +330,57 @@ sparql_query_write_(char *ptr, size_t size, size_t nemb, void *userdata)
 	{
 		return 0;
 	}
-	if(query->state == SQS_ROOT)
+	if(query->state == SQS_ROOT && !query->format)
 	{
+		/* Select a parser based upon the type of the response */
 		type = NULL;
 		curl_easy_getinfo(query->ch, CURLINFO_CONTENT_TYPE, &type);
-		if(!strcmp(type, "text/plain") ||
-		   !strncmp(type, "text/plain;", 11))
+		query->format = sparql_query_content_type_(type);
+		if(query->format->parser == SRP_CAPTURE)
 		{
 			query->state = SQS_CAPTURE;
 			return sparql_curl_dummy_write_(ptr, size, nemb, &(query->connection->capture));
-		}	
+		}
+		if(sparql_query_parser_create_(query, type))
+		{
+			query->result = -1;
+			return (size ? 0 : (size_t) -1);
+		}
+	}
+	if(query->parser)
+	{
+		if(sparql_query_parser_parse_(query, ptr, nemb * size, !size))
+		{
+			query->result = -1;
+			return (size ? 0 : (size_t) -1);
+		}
+		return (size ? nemb * size : 0);
+	}
+	if(query->scan)
+	{
+		r = sparql_xmlscan_parse_(query->scan, ptr, nemb * size, !size);
+		if(r < 0)
+		{
+			query->result = -1;
+			return (size ? 0 : (size_t) -1);
+		}
+		if(!r)
+		{
+			return (size ? nemb * size : 0);
+		}
+		/* The document isn't one which the scanner can process: hand
+		 * everything received so far (which will include this chunk) to
+		 * libxml2, and use it for the remainder of the response
+		 */
+		sparql_logf_(query->connection, LOG_DEBUG, "SPARQL: parsing XML results using libxml2\n");
+		buf = sparql_xmlscan_pending_(query->scan, &len);
+		xmlParseChunk(query->ctx, buf, len, 0);
+		sparql_xmlscan_destroy_(query->scan);
+		query->scan = NULL;
+		if(size)
+		{
+			return nemb * size;
+		}
 	}
 	if(!size)
 	{
@@ -291,50 +398,104 @@ sparql_query_write_(char *ptr, size_t size, size_t nemb, void *userdata)
 	return nemb * size;
 }
 
-static void
-sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes)
+/* Map the local name of an element in the SPARQL results namespace to
+ * one of the SQE_xxx constants
+ */
+SPARQLELEMENT
+sparql_query_element_(const char *name, size_t len)
+{
+	switch(len)
+	{
+	case 3:
+		return (!memcmp(name, "uri", 3) ? SQE_URI : SQE_OTHER);
+	case 4:
+		if(!memcmp(name, "head", 4))
+		{
+			return SQE_HEAD;
+		}
+		return (!memcmp(name, "link", 4) ? SQE_LINK : SQE_OTHER);
+	case 5:
+		return (!memcmp(name, "bnode", 5) ? SQE_BNODE : SQE_OTHER);
+	case 6:
+		if(!memcmp(name, "sparql", 6))
+		{
+			return SQE_SPARQL;
+		}
+		return (!memcmp(name, "result", 6) ? SQE_RESULT : SQE_OTHER);
+	case 7:
+		if(!memcmp(name, "results", 7))
+		{
+			return SQE_RESULTS;
+		}
+		if(!memcmp(name, "binding", 7))
+		{
+			return SQE_BINDING;
+		}
+		if(!memcmp(name, "literal", 7))
+		{
+			return SQE_LITERAL;
+		}
+		return (!memcmp(name, "boolean", 7) ? SQE_BOOLEAN : SQE_OTHER);
+	case 8:
+		return (!memcmp(name, "variable", 8) ? SQE_VARIABLE : SQE_OTHER);
+	}
+	return SQE_OTHER;
+}
+
+/* Copy an attribute value into a newly-allocated buffer */
+static char *
+sparql_query_strndup_(SPARQLQUERY *query, const char *value, size_t len, const char *what)
 {
-	SPARQLQUERY *query = (SPARQLQUERY *) ctx;
-	size_t i, l;
-	int c;
 	char *p;
 
-	(void) prefix;
-	(void) nb_namespaces;
-	(void) namespaces;
-	(void) nb_defaulted;
-	
-	if(query->result)
+	p = (char *) malloc(len + 1);
+	if(!p)
 	{
-		return;
+		sparql_logf_(query->connection, LOG_CRIT, "failed to allocate %u bytes for %s\n", (unsigned) len + 1, what);
+		query->result = -1;
+		return NULL;
 	}
-	if(strcmp((const char *) URI, "http://www.w3.org/2005/sparql-results#"))
+	memcpy(p, value, len);
+	p[len] = 0;
+	return p;
+}
+
+/* Process the start of an element in the SPARQL results namespace; this is
+ * invoked both by the libxml2 SAX handler and by the results scanner,
+ * <localname> (which is <namelen> bytes long) is used only in messages
+ */
+int
+sparql_query_startel_(SPARQLQUERY *query, SPARQLELEMENT el, const char *localname, size_t namelen, const struct sparql_query_attrs_struct *attrs)
+{
+	char *p;
+	int nl;
+
+	if(query->result)
 	{
-		sparql_logf_(query->connection, LOG_ERR, "unexpected namespace <%s> in SPARQL results\n", URI);
-		query->result = -1;
-		return;
+		return -1;
 	}
+	nl = (int) namelen;
 	switch(query->state)
 	{
 	case SQS_CAPTURE:
 	case SQS_ERROR:
 		query->result = -1;
-		return;
+		break;
 	case SQS_ROOT:
-		if(!strcmp((const char *) localname, "sparql"))
+		if(el == SQE_SPARQL)
 		{
 			query->state = SQS_SPARQL;
-			return;
+			break;
 		}
-		sparql_logf_(query->connection, LOG_ERR, "expected: <sparql>, found: <%s>\n", localname);
+		sparql_logf_(query->connection, LOG_ERR, "expected: <sparql>, found: <%.*s>\n", nl, localname);
 		query->result = -1;
 		break;
 	case SQS_SPARQL:
-		if(!strcmp((const char *) localname, "head"))
+		if(el == SQE_HEAD)
 		{
 			query->state = SQS_HEAD;
 		}
-		else if(!strcmp((const char *) localname, "results"))
+		else if(el == SQE_RESULTS)
 		{
 			query->state = SQS_RESULTS;
 			if(query->beginresults)
@@ -343,116 +504,78 @@ sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *pr
 				{
 					sparql_logf_(query->connection, LOG_DEBUG, "beginresults callback failed\n");
 					query->result = -1;
-					return;
 				}
 			}
 		}
-		else if(!strcmp((const char *) localname, "boolean"))
+		else if(el == SQE_BOOLEAN)
 		{
 			query->state = SQS_BOOLEAN;
 		}
 		else
 		{
-			sparql_logf_(query->connection, LOG_ERR, "expected: <head>, <results>, or <boolean>; found: <%s>\n", localname);
+			sparql_logf_(query->connection, LOG_ERR, "expected: <head>, <results>, or <boolean>; found: <%.*s>\n", nl, localname);
 			query->result = -1;
-			return;
 		}
 		break;
 	case SQS_HEAD:
-		if(!strcmp((const char *) localname, "link"))
+		if(el == SQE_LINK)
 		{
 			query->state = SQS_LINK;
-			p = NULL;
-			for(c = i = 0; c < nb_attributes; c++)
+			if(!attrs->href)
 			{
-				if((!attributes[i+2] || !attributes[i+2][0]) &&
-				   !strcmp((const char *) attributes[i], "href"))
-				{
-					l = attributes[i+4] - attributes[i+3];
-					p = (char *) malloc(l + 1);
-					if(!p)
-					{
-						sparql_logf_(query->connection, LOG_CRIT, "failed to allocate %u bytes for link URI\n", (unsigned) l + 1);
-						query->result = -1;
-						return;
-					}
-					memcpy(p, attributes[i+3], l);
-					p[l] = 0;
-				}
-				i += 5;
+				sparql_logf_(query->connection, LOG_WARNING, "warning: ignoring <link> with no href attribute\n");
+				break;
 			}
-			if(p)
+			if(!query->link)
 			{
-				if(query->link)
-				{
-					if(query->link(query, p, query->data))
-					{
-						sparql_logf_(query->connection, LOG_DEBUG, "link callback failed\n");
-						query->result = -1;
-						free(p);
-						return;
-					}
-				}
-				free(p);
+				break;
 			}
-			else
+			if(!(p = sparql_query_strndup_(query, attrs->href, attrs->hreflen, "link URI")))
 			{
-				sparql_logf_(query->connection, LOG_WARNING, "warning: ignoring <link> with no href attribute\n");
+				break;
+			}
+			if(query->link(query, p, query->data))
+			{
+				sparql_logf_(query->connection, LOG_DEBUG, "link callback failed\n");
+				query->result = -1;
 			}
+			free(p);
 		}
-		else if(!strcmp((const char *) localname, "variable"))
+		else if(el == SQE_VARIABLE)
 		{
 			query->state = SQS_VARIABLE;
-			p = NULL;
-			for(i = c = 0; c < nb_attributes; c++)
+			if(!attrs->name)
 			{
-				if((!attributes[i+2] || !attributes[i+2][0]) &&
-				   !strcmp((const char *) attributes[i], "name"))
-				{
-					l = attributes[i+4] - attributes[i+3];
-					p = (char *) malloc(l + 1);
-					if(!p)
-					{
-						sparql_logf_(query->connection, LOG_CRIT, "failed to allocate %u bytes for variable name\n", (unsigned) l + 1);
-						query->result = -1;
-						return;
-					}
-					memcpy(p, attributes[i+3], l);
-					p[l] = 0;
-				}
-				i += 5;
+				sparql_logf_(query->connection, LOG_WARNING, "warning: ignoring <variable> with no name attribute\n");
+				break;
 			}
-			if(p)
+			if(!query->variable)
 			{
-				if(query->variable)
-				{
-					if(query->variable(query, p, query->data))
-					{
-						sparql_logf_(query->connection, LOG_DEBUG, "variable callback failed\n");
-						query->result = -1;
-						free(p);
-						return;
-					}
-				}
-				free(p);
+				break;
 			}
-			else
+			if(!(p = sparql_query_strndup_(query, attrs->name, attrs->namelen, "variable name")))
 			{
-				sparql_logf_(query->connection, LOG_WARNING, "warning: ignoring <variable> with no name attribute\n");
+				break;
+			}
+			if(query->variable(query, p, query->data))
+			{
+				sparql_logf_(query->connection, LOG_DEBUG, "variable callback failed\n");
+				query->result = -1;
 			}
+			free(p);
 		}
 		else
 		{
-			sparql_logf_(query->connection, LOG_ERR, "expected: <variable> or <link>; found: <%s>\n", localname);
+			sparql_logf_(query->connection, LOG_ERR, "expected: <variable> or <link>; found: <%.*s>\n", nl, localname);
 			query->result = -1;
 		}
 		break;
 	case SQS_VARIABLE:
-		sparql_logf_(query->connection, LOG_ERR, "unexpected child of <variable> found (<%s>)\n", localname);
+		sparql_logf_(query->connection, LOG_ERR, "unexpected child of <variable> found (<%.*s>)\n", nl, localname);
 		query->result = -1;
 		break;
 	case SQS_RESULTS:
-		if(!strcmp((const char *) localname, "result"))
+		if(el == SQE_RESULT)
 		{
 			query->state = SQS_RESULT;
 			if(query->beginresult)
@@ -461,49 +584,31 @@ sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *pr
 				{
 					sparql_logf_(query->connection, LOG_DEBUG, "beginresult callback failed\n");
 					query->result = -1;
-					return;
 				}
 			}
 		}
 		else
 		{
-			sparql_logf_(query->connection, LOG_ERR, "expected: <result>, found: <%s>\n", localname);
+			sparql_logf_(query->connection, LOG_ERR, "expected: <result>, found: <%.*s>\n", nl, localname);
 			query->result = -1;
 		}
 		break;
 	case SQS_RESULT:
-		if(!strcmp((const char *) localname, "binding"))
+		if(el == SQE_BINDING)
 		{
 			query->state = SQS_BINDING;
 			query->bound = 0;
-			for(i = c = 0; c < nb_attributes; c++)
-			{
-				if((!attributes[i+2] || !attributes[i+2][0]) &&
-				   !strcmp((const char *) attributes[i], "name"))
-				{
-					l = attributes[i+4] - attributes[i+3];
-					query->name = (char *) malloc(l + 1);
-					if(!query->name)
-					{
-						sparql_logf_(query->connection, LOG_CRIT, "failed to allocate memory for binding name\n");
-						query->result = -1;
-						return;
-					}
-					memcpy(query->name, attributes[i+3], l);
-					query->name[l] = 0;
-					break;
-				}
-				i += 5;
-			}
-			if(!query->name)
+			if(!attrs->name)
 			{
 				sparql_logf_(query->connection, LOG_ERR, "<binding> does not have a name\n");
 				query->result = -1;
-			}			
+				break;
+			}
+			query->name = sparql_query_strndup_(query, attrs->name, attrs->namelen, "binding name");
 		}
 		else
 		{
-			sparql_logf_(query->connection, LOG_ERR, "expected: <binding>, found: <%s>\n", localname);
+			sparql_logf_(query->connection, LOG_ERR, "expected: <binding>, found: <%.*s>\n", nl, localname);
 			query->result = -1;
 		}
 		break;
@@ -512,56 +617,34 @@ sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *pr
 		{
 			sparql_logf_(query->connection, LOG_ERR, "multiple values provided for binding to '%s'\n", query->name);
 			query->result = -1;
-			return;
+			break;
 		}
-		if(!strcmp((const char *) localname, "uri"))
+		if(el == SQE_URI)
 		{
 			query->state = SQS_URI;
 		}
-		else if(!strcmp((const char *) localname, "literal"))
+		else if(el == SQE_LITERAL)
 		{
 			query->state = SQS_LITERAL;
-			for(i = c = 0; c < nb_attributes; c++)
+			if(attrs->datatype)
 			{
-				if((!attributes[i+2] || !attributes[i+2][0]) &&
-				   !strcmp((const char *) attributes[i], "datatype"))
+				if(!(query->datatype = sparql_query_strndup_(query, attrs->datatype, attrs->datatypelen, "literal datatype URI")))
 				{
-					l = attributes[i+4] - attributes[i+3];
-					query->datatype = (char *) malloc(l + 1);
-					if(!query->datatype)
-					{
-						sparql_logf_(query->connection, LOG_CRIT, "failed to allocate %u bytes for literal datatype URI\n", (unsigned) l + 1);
-						query->result = -1;
-						return;
-					}
-					memcpy(query->datatype, attributes[i+3], l);
-					query->datatype[l] = 0;
-				}
-				else if(attributes[i+2] &&
-						!strcmp((const char *) attributes[i+2], "http://www.w3.org/XML/1998/namespace") &&
-						!strcmp((const char *) attributes[i], "lang"))
-				{					
-					l = attributes[i+4] - attributes[i+3];
-					query->language = (char *) malloc(l + 1);
-					if(!query->language)
-					{
-						sparql_logf_(query->connection, LOG_CRIT, "failed to allocate %u bytes for literal language tag\n", (unsigned) l + 1);
-						query->result = -1;
-						return;
-					}
-					memcpy(query->language, attributes[i+3], l);
-					query->language[l] = 0;
+					break;
 				}
-				i += 5;
+			}
+			if(attrs->lang)
+			{
+				query->language = sparql_query_strndup_(query, attrs->lang, attrs->langlen, "literal language tag");
 			}
 		}
-		else if(!strcmp((const char *) localname, "bnode"))
+		else if(el == SQE_BNODE)
 		{
 			query->state = SQS_BNODE;
 		}
 		else
 		{
-			sparql_logf_(query->connection, LOG_ERR, "expected: <uri>, <literal>, or <bnode>, found: <%s>\n", localname);
+			sparql_logf_(query->connection, LOG_ERR, "expected: <uri>, <literal>, or <bnode>, found: <%.*s>\n", nl, localname);
 			query->result = -1;
 		}
 		break;
@@ -570,26 +653,330 @@ sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *pr
 	case SQS_BNODE:
 	case SQS_BOOLEAN:
 	case SQS_LINK:
-		sparql_logf_(query->connection, LOG_ERR, "unexpected value child found, <%s>\n", localname);
+		sparql_logf_(query->connection, LOG_ERR, "unexpected value child found, <%.*s>\n", nl, localname);
 		query->result = -1;
 		break;
 	}
+	return query->result;
+}
+
+/* Determine whether a Content-Type header value specifies <mime>,
+ * ignoring any parameters
+ */
+static int
+sparql_query_is_type_(const char *type, const char *mime)
+{
+	size_t l;
+
+	if(!type)
+	{
+		return 0;
+	}
+	l = strlen(mime);
+	if(strncasecmp(type, mime, l))
+	{
+		return 0;
+	}
+	return (!type[l] || type[l] == ';' || isspace((unsigned char) type[l]));
+}
+
+/* Locate the results format whose short name is <name> */
+const SPARQLFORMAT *
+sparql_query_format_(const char *name, size_t len)
+{
+	size_t c;
+
+	for(c = 0; sparql_formats_[c].mimetype; c++)
+	{
+		if(sparql_formats_[c].name && strlen(sparql_formats_[c].name) == len &&
+		   !strncasecmp(sparql_formats_[c].name, name, len))
+		{
+			return &(sparql_formats_[c]);
+		}
+	}
+	return NULL;
+}
+
+/* Locate the results format for a response whose Content-Type is <type>,
+ * which may be NULL; anything unrecognised is assumed to be XML
+ */
+static const SPARQLFORMAT *
+sparql_query_content_type_(const char *type)
+{
+	size_t c;
+
+	for(c = 0; sparql_formats_[c].mimetype; c++)
+	{
+		if(sparql_query_is_type_(type, sparql_formats_[c].mimetype))
+		{
+			return &(sparql_formats_[c]);
+		}
+	}
+	return sparql_query_format_("xml", 3);
+}
+
+/* Build an Accept header from a comma-separated list of results formats
+ * in order of preference, each either a short name from sparql_formats_
+ * or a MIME type, and optionally followed by parameters. Formats which
+ * don't specify a q-value are assigned one which reflects their position
+ * in the list.
+ */
+char *
+sparql_query_accept_(SPARQL *connection, const char *formats)
+{
+	const SPARQLFORMAT *format;
+	const char *p, *end, *params;
+	char *buf, *t;
+	size_t len, n;
+	int c;
+
+	/* Expanding a short name and adding a q-value grows each entry by no
+	 * more than 64 bytes
+	 */
+	len = 8 + strlen(formats) + 64;
+	for(p = formats; *p; p++)
+	{
+		if(*p == ',')
+		{
+			len += 64;
+		}
+	}
+	buf = (char *) malloc(len);
+	if(!buf)
+	{
+		sparql_logf_(connection, LOG_CRIT, "failed to allocate memory for Accept header\n");
+		return NULL;
+	}
+	strcpy(buf, "Accept: ");
+	t = strchr(buf, 0);
+	c = 0;
+	for(p = formats; *p; p = end)
+	{
+		while(*p == ',' || isspace((unsigned char) *p))
+		{
+			p++;
+		}
+		if(!*p)
+		{
+			break;
+		}
+		for(end = p; *end && *end != ','; end++);
+		for(params = p; params < end && *params != ';'; params++);
+		for(n = params - p; n && isspace((unsigned char) p[n - 1]); n--);
+		if(!n)
+		{
+			sparql_logf_(connection, LOG_ERR, "SPARQL: empty entry in results formats list\n");
+			free(buf);
+			return NULL;
+		}
+		if(c)
+		{
+			strcpy(t, ", ");
+			t += 2;
+		}
+		if(memchr(p, '/', n))
+		{
+			memcpy(t, p, n);
+			t += n;
+		}
+		else
+		{
+			format = sparql_query_format_(p, n);
+			if(!format)
+			{
+				sparql_logf_(connection, LOG_ERR, "SPARQL: unrecognised results format '%.*s'\n", (int) n, p);
+				free(buf);
+				return NULL;
+			}
+			strcpy(t, format->mimetype);
+			t = strchr(t, 0);
+		}
+		for(n = end - params; n && isspace((unsigned char) params[n - 1]); n--);
+		memcpy(t, params, n);
+		t += n;
+		if(c && !sparql_query_has_q_(params, n))
+		{
+			sprintf(t, ";q=0.%d", (c < 9 ? 10 - c : 1));
+			t = strchr(t, 0);
+		}
+		c++;
+	}
+	*t = 0;
+	if(!c)
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: no results formats were specified\n");
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Determine whether the media type parameters <params> include a q-value */
+static int
+sparql_query_has_q_(const char *params, size_t len)
+{
+	size_t c;
+
+	for(c = 0; c + 1 < len; c++)
+	{
+		if(params[c] == ';')
+		{
+			for(c++; c < len && isspace((unsigned char) params[c]); c++);
+			if(c + 1 < len && (params[c] == 'q' || params[c] == 'Q') && params[c + 1] == '=')
+			{
+				return 1;
+			}
+			c--;
+		}
+	}
+	return 0;
+}
+
+/* Create the parser for the response's results format, if it isn't XML */
+static int
+sparql_query_parser_create_(SPARQLQUERY *query, const char *type)
+{
+	switch(query->format->parser)
+	{
+	case SRP_RDF:
+		if(!query->statement)
+		{
+			sparql_logf_(query->connection, LOG_ERR, "unexpected RDF graph (%s) returned in response to query\n", type);
+			return -1;
+		}
+		query->parser = sparql_rdfscan_create_(query->connection, query, type);
+		break;
+	case SRP_JSON:
+		query->parser = sparql_jsonscan_create_(query->connection, query);
+		break;
+	case SRP_TSV:
+		query->parser = sparql_tsvscan_create_(query->connection, query);
+		break;
+	case SRP_BINARY:
+		query->parser = sparql_binscan_create_(query->connection, query);
+		break;
+	default:
+		return 0;
+	}
+	if(!query->parser)
+	{
+		sparql_logf_(query->connection, LOG_CRIT, "failed to create parser for %s query results\n", query->format->mimetype);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_query_parser_parse_(SPARQLQUERY *query, const char *buf, size_t len, int final)
+{
+	switch(query->format->parser)
+	{
+	case SRP_JSON:
+		return sparql_jsonscan_parse_((SPARQLJSONSCAN *) query->parser, buf, len, final);
+	case SRP_TSV:
+		return sparql_tsvscan_parse_((SPARQLTSVSCAN *) query->parser, buf, len, final);
+	case SRP_BINARY:
+		return sparql_binscan_parse_((SPARQLBINSCAN *) query->parser, buf, len, final);
+	case SRP_RDF:
+		return sparql_rdfscan_parse_((SPARQLRDFSCAN *) query->parser, buf, len, final);
+	default:
+		return -1;
+	}
 }
 
 static void
-sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI)
+sparql_query_parser_destroy_(SPARQLQUERY *query)
+{
+	if(query->parser)
+	{
+		switch(query->format->parser)
+		{
+		case SRP_JSON:
+			sparql_jsonscan_destroy_((SPARQLJSONSCAN *) query->parser);
+			break;
+		case SRP_TSV:
+			sparql_tsvscan_destroy_((SPARQLTSVSCAN *) query->parser);
+			break;
+		case SRP_BINARY:
+			sparql_binscan_destroy_((SPARQLBINSCAN *) query->parser);
+			break;
+		case SRP_RDF:
+			sparql_rdfscan_destroy_((SPARQLRDFSCAN *) query->parser);
+			break;
+		default:
+			break;
+		}
+	}
+	query->parser = NULL;
+	query->format = NULL;
+}
+
+static void
+sparql_query_sax_startel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes)
 {
 	SPARQLQUERY *query = (SPARQLQUERY *) ctx;
-	int v;
+	struct sparql_query_attrs_struct attrs;
+	size_t l;
 
-	(void) localname;
 	(void) prefix;
-	(void) URI;
-
+	(void) nb_namespaces;
+	(void) namespaces;
+	(void) nb_defaulted;
+	
 	if(query->result)
 	{
 		return;
-	}	
+	}
+	if(!URI || strcmp((const char *) URI, SPARQL_RESULTS_NS))
+	{
+		sparql_logf_(query->connection, LOG_ERR, "unexpected namespace <%s> in SPARQL results\n", URI ? (const char *) URI : "");
+		query->result = -1;
+		return;
+	}
+	memset(&attrs, 0, sizeof(attrs));
+	sparql_query_attr_(attributes, nb_attributes, NULL, "name", &(attrs.name), &(attrs.namelen));
+	sparql_query_attr_(attributes, nb_attributes, NULL, "href", &(attrs.href), &(attrs.hreflen));
+	sparql_query_attr_(attributes, nb_attributes, NULL, "datatype", &(attrs.datatype), &(attrs.datatypelen));
+	sparql_query_attr_(attributes, nb_attributes, (const char *) XML_XML_NAMESPACE, "lang", &(attrs.lang), &(attrs.langlen));
+	l = strlen((const char *) localname);
+	sparql_query_startel_(query, sparql_query_element_((const char *) localname, l), (const char *) localname, l, &attrs);
+}
+
+/* Locate an attribute in the list supplied to the SAX startElementNs
+ * handler; <ns> is NULL for attributes with no namespace
+ */
+static int
+sparql_query_attr_(const xmlChar **attributes, int nb_attributes, const char *ns, const char *name, const char **value, size_t *len)
+{
+	int c;
+
+	for(c = 0; c < nb_attributes; c++, attributes += 5)
+	{
+		if(strcmp((const char *) attributes[0], name))
+		{
+			continue;
+		}
+		if(ns ? (!attributes[2] || strcmp((const char *) attributes[2], ns)) : (attributes[2] && attributes[2][0]))
+		{
+			continue;
+		}
+		*value = (const char *) attributes[3];
+		*len = attributes[4] - attributes[3];
+		return 1;
+	}
+	return 0;
+}
+
+/* Process the end of the current element */
+int
+sparql_query_endel_(SPARQLQUERY *query)
+{
+	int v;
+
+	if(query->result)
+	{
+		return -1;
+	}
 	switch(query->state)
 	{
 	case SQS_ROOT:
@@ -618,7 +1005,7 @@ sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *pref
 			{
 				sparql_logf_(query->connection, LOG_DEBUG, "endresults callback failed\n");
 				query->result = -1;
-				return;
+				return -1;
 			}
 		}
 		break;
@@ -630,7 +1017,7 @@ sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *pref
 			{
 				sparql_logf_(query->connection, LOG_DEBUG, "endresult callback failed\n");
 				query->result = -1;
-				return;
+				return -1;
 			}
 		}
 		break;
@@ -696,8 +1083,9 @@ sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *pref
 		{
 			sparql_logf_(query->connection, LOG_ERR, "expected 'true' or 'false' within <boolean>\n");
 			query->result = -1;
-			return;
+			return -1;
 		}
+		query->state = SQS_SPARQL;
 		if(query->boolean)
 		{
 			if(query->boolean(query, v, query->data))
@@ -707,19 +1095,29 @@ sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *pref
 		}
 		break;
 	}
+	return query->result;
 }
-		
 
-static void 
-sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len)
+static void
+sparql_query_sax_endel_(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI)
+{
+	(void) localname;
+	(void) prefix;
+	(void) URI;
+
+	sparql_query_endel_((SPARQLQUERY *) ctx);
+}
+
+/* Process character data within the current element */
+int
+sparql_query_characters_(SPARQLQUERY *query, const char *ch, size_t len)
 {
-	SPARQLQUERY *query = (SPARQLQUERY *) ctx;
 	char *p;
 	size_t l;
 
 	if(query->result)
 	{
-		return;
+		return -1;
 	}
 	switch(query->state)
 	{
@@ -736,7 +1134,7 @@ sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len)
 			{
 				sparql_logf_(query->connection, LOG_CRIT, "failed to reallocate buffer to %u bytes\n", (unsigned) l);
 				query->result = -1;
-				return;
+				return -1;
 			}
 			query->buf = p;
 			query->bufsize = l;
@@ -748,7 +1146,7 @@ sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len)
 	default:
 		for(; len; len--)
 		{
-			if(!isspace(*ch))
+			if(!isspace((unsigned char) *ch))
 			{
 				sparql_logf_(query->connection, LOG_WARNING, "warning: ignored unexpected literal in parser state %d\n", (int) query->state);
 				break;
@@ -757,4 +1155,111 @@ sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len)
 		}
 		break;
 	}
+	return 0;
+}
+
+/* Process an element with (optionally) some character data and no
+ * children, as the scanners for the non-XML formats produce them
+ */
+int
+sparql_query_simple_(SPARQLQUERY *query, SPARQLELEMENT el, const char *localname, const struct sparql_query_attrs_struct *attrs, const char *text, size_t len)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+
+	if(sparql_query_startel_(query, el, localname, strlen(localname), attrs ? attrs : &noattrs))
+	{
+		return -1;
+	}
+	if(len && sparql_query_characters_(query, text, len))
+	{
+		return -1;
+	}
+	return sparql_query_endel_(query);
+}
+
+/* Write the UTF-8 encoding of the code point <c> to <out>, which must have
+ * room for four bytes, and return its length
+ */
+size_t
+sparql_utf8_encode_(unsigned long c, char *out)
+{
+	if(c < 0x80)
+	{
+		out[0] = (char) c;
+		return 1;
+	}
+	if(c < 0x800)
+	{
+		out[0] = (char) (0xc0 | (c >> 6));
+		out[1] = (char) (0x80 | (c & 0x3f));
+		return 2;
+	}
+	if(c < 0x10000)
+	{
+		out[0] = (char) (0xe0 | (c >> 12));
+		out[1] = (char) (0x80 | ((c >> 6) & 0x3f));
+		out[2] = (char) (0x80 | (c & 0x3f));
+		return 3;
+	}
+	out[0] = (char) (0xf0 | (c >> 18));
+	out[1] = (char) (0x80 | ((c >> 12) & 0x3f));
+	out[2] = (char) (0x80 | ((c >> 6) & 0x3f));
+	out[3] = (char) (0x80 | (c & 0x3f));
+	return 4;
+}
+
+/* Append to a scanner buffer, growing it geometrically and keeping it
+ * NUL-terminated
+ */
+int
+sparql_scanbuf_append_(SPARQL *connection, SPARQLSCANBUF *buf, const void *p, size_t len)
+{
+	char *q;
+	size_t size;
+
+	if(buf->len + len + 1 > buf->size)
+	{
+		for(size = (buf->size ? buf->size : 128); size < buf->len + len + 1; size *= 2)
+		{
+		}
+		q = (char *) realloc(buf->buf, size);
+		if(!q)
+		{
+			sparql_logf_(connection, LOG_CRIT, "failed to reallocate buffer to %u bytes\n", (unsigned) size);
+			return -1;
+		}
+		buf->buf = q;
+		buf->size = size;
+	}
+	if(len)
+	{
+		memcpy(&(buf->buf[buf->len]), p, len);
+	}
+	buf->len += len;
+	buf->buf[buf->len] = 0;
+	return 0;
+}
+
+/* Process a statement from an RDF graph returned by CONSTRUCT or DESCRIBE;
+ * <graph> is NULL unless the serialisation includes graph names
+ */
+int
+sparql_query_statement_(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph)
+{
+	if(query->result)
+	{
+		return -1;
+	}
+	if(query->statement(query, statement, graph, query->data))
+	{
+		query->result = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+sparql_query_sax_characters_(void *ctx, const xmlChar *ch, int len)
+{
+	sparql_query_characters_((SPARQLQUERY *) ctx, (const char *) ch, (size_t) len);
 }
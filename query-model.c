@@ -30,8 +30,21 @@ struct sparql_query_context_struct
 	SPARQLQUERY *query;
 	librdf_world *world;
 	librdf_model *model;
+	sparql_statement_fn callback;
+	void *cbdata;
 	librdf_node *g;
 	librdf_statement *statement;
+	/* Graph, predicate and datatype IRIs repeat on almost every row */
+	SPARQLINTERN *intern;
+	int mode;
+	/* Statements in named graphs added so far, in SPARQL_MODEL_BULK mode */
+	SPARQLHASH *seen;
+	char *key;
+	size_t keylen;
+	size_t keysize;
+	/* Set while a transaction is open, in the bulk modes */
+	int txn;
+	size_t batched;
 };
 
 static int sparql_query_variable_(SPARQLQUERY *query, const char *name, void *data);
@@ -43,49 +56,48 @@ static int sparql_query_literal_(SPARQLQUERY *query, const char *name, const cha
 static int sparql_query_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *data);
 static int sparql_query_bnode_(SPARQLQUERY *query, const char *name, const char *ref, void *data);
 static int sparql_query_boolean_(SPARQLQUERY *query, int value, void *data);
-
-/* Perform a query, returning a result-set */
+static int sparql_query_statement_cb_(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph, void *data);
+static int sparql_query_add_(struct sparql_query_context_struct *context, librdf_statement *statement, librdf_node *graph);
+static int sparql_query_seen_(struct sparql_query_context_struct *context, librdf_statement *statement, librdf_node *graph);
+static int sparql_query_key_(struct sparql_query_context_struct *context, librdf_node *node);
+static int sparql_query_key_append_(struct sparql_query_context_struct *context, char kind, const unsigned char *str, size_t len);
+static int sparql_query_batch_(struct sparql_query_context_struct *context);
+static int sparql_query_statements_(struct sparql_query_context_struct *context, const char *querybuf, size_t length);
+
+/* Perform a query, adding the resulting statements to <model>. The query
+ * may be a CONSTRUCT or DESCRIBE, in which case the returned graph is
+ * parsed directly into the model, or a SELECT whose result set has ?s, ?p
+ * and ?o (and optionally ?g) columns.
+ */
 int
 sparql_query_model(SPARQL *connection, const char *querybuf, size_t length, librdf_model *model)
 {
 	struct sparql_query_context_struct context;
-	int r;
 
 	memset(&context, 0, sizeof(context));
 	context.connection = connection;
-	context.query = sparql_query_create_(connection);
-	if(!context.query)
-	{
-		sparql_logf_(connection, LOG_CRIT, "failed to create SPARQL query structure\n");
-		return -1;
-	}
-	context.world = sparql_world(connection);
-	if(!context.world)
-	{
-		return -1;
-	}
 	context.model = model;
-	sparql_query_set_data_(context.query, (void *) &context);
-	sparql_query_set_variable_(context.query, sparql_query_variable_);
-	sparql_query_set_link_(context.query, sparql_query_link_);
-	sparql_query_set_beginresults_(context.query, sparql_query_beginresults_);
-	sparql_query_set_beginresult_(context.query, sparql_query_beginresult_);
-	sparql_query_set_endresult_(context.query, sparql_query_endresult_);
-	sparql_query_set_literal_(context.query, sparql_query_literal_);
-	sparql_query_set_bnode_(context.query, sparql_query_bnode_);
-	sparql_query_set_uri_(context.query, sparql_query_uri_);
-	sparql_query_set_boolean_(context.query, sparql_query_boolean_);
-	r = sparql_query_perform_(context.query, querybuf, length);
-	sparql_query_destroy_(context.query);
-	if(context.statement)
-	{
-		librdf_free_statement(context.statement);
-	}
-	if(context.g)
-	{
-		librdf_free_node(context.g);
-	}
-	return r;
+	context.mode = connection->model_mode;
+	return sparql_query_statements_(&context, querybuf, length);
+}
+
+/* Perform a query, passing each resulting statement to <callback> as soon
+ * as it has been decoded. As with sparql_query_model(), the query may be a
+ * CONSTRUCT or DESCRIBE, or a SELECT with ?s, ?p, ?o and optionally ?g
+ * columns. <graph> is NULL unless the response includes graph names; both
+ * it and <statement> are only valid until the callback returns. If the
+ * callback returns nonzero, the query is aborted.
+ */
+int
+sparql_construct_stream(SPARQL *connection, const char *querybuf, size_t length, sparql_statement_fn callback, void *data)
+{
+	struct sparql_query_context_struct context;
+
+	memset(&context, 0, sizeof(context));
+	context.connection = connection;
+	context.callback = callback;
+	context.cbdata = data;
+	return sparql_query_statements_(&context, querybuf, length);
 }
 
 int
@@ -167,7 +179,7 @@ static int
 sparql_query_endresult_(SPARQLQUERY *query, void *data)
 {
 	struct sparql_query_context_struct *context = (struct sparql_query_context_struct *) data;
-	librdf_stream *st;
+	int r;
 
 	(void) query;
 
@@ -176,19 +188,7 @@ sparql_query_endresult_(SPARQLQUERY *query, void *data)
 		sparql_logf_(context->connection, LOG_ERR, "result row does not contain a complete statement\n");
 		return -1;
 	}
-	if(context->g)
-	{
-		st = librdf_model_find_statements_with_options(context->model, context->statement, context->g, NULL);
-		if(librdf_stream_end(st))
-		{
-			librdf_model_context_add_statement(context->model, context->g, context->statement);
-		}
-		librdf_free_stream(st);
-	}
-	else
-	{
-		librdf_model_add_statement(context->model, context->statement);
-	}
+	r = sparql_query_add_(context, context->statement, context->g);
 	librdf_free_statement(context->statement);
 	context->statement = NULL;
 	if(context->g)
@@ -196,7 +196,7 @@ sparql_query_endresult_(SPARQLQUERY *query, void *data)
 		librdf_free_node(context->g);
 		context->g = NULL;
 	}
-	return 0;
+	return r;
 }
 
 static int
@@ -210,22 +210,22 @@ sparql_query_literal_(SPARQLQUERY *query, const char *name, const char *language
 
 	if(datatype)
 	{
-		typeuri = librdf_new_uri(context->world, (const unsigned char *) datatype);
+		typeuri = sparql_intern_uri_(context->intern, datatype);
 	}
 	else
 	{
 		typeuri = NULL;
 	}
 	node = librdf_new_node_from_typed_literal(context->world, (const unsigned char *) text, language, typeuri);
+	if(typeuri)
+	{
+		librdf_free_uri(typeuri);
+	}
 	if(!strcmp(name, "o"))
 	{
 		librdf_statement_set_object(context->statement, node);
 		return 0;
 	}
-	if(typeuri)
-	{
-		librdf_free_uri(typeuri);
-	}
 	librdf_free_node(node);
 	sparql_logf_(context->connection, LOG_ERR, "unexpected literal value bound to '%s'\n", name);
 	return -1;	
@@ -239,7 +239,12 @@ sparql_query_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *d
 
 	(void) query;
 
-	node = librdf_new_node_from_uri_string(context->world, (const unsigned char *) uri);
+	node = sparql_intern_node_(context->intern, uri);
+	if(!node)
+	{
+		sparql_logf_(context->connection, LOG_ERR, "failed to create URI node for '%s'\n", name);
+		return -1;
+	}
 	if(!strcmp(name, "g"))
 	{
 		context->g = node;
@@ -299,3 +304,264 @@ sparql_query_boolean_(SPARQLQUERY *query, int value, void *data)
 	return -1;
 }
 
+/* Invoked for each statement in a graph returned by CONSTRUCT or DESCRIBE */
+static int
+sparql_query_statement_cb_(SPARQLQUERY *query, librdf_statement *statement, librdf_node *graph, void *data)
+{
+	struct sparql_query_context_struct *context = (struct sparql_query_context_struct *) data;
+
+	(void) query;
+
+	return sparql_query_add_(context, statement, graph);
+}
+
+/* Pass a statement to the callback, or else add it to the model, in the
+ * context <graph> if it's not NULL
+ */
+static int
+sparql_query_add_(struct sparql_query_context_struct *context, librdf_statement *statement, librdf_node *graph)
+{
+	librdf_stream *st;
+	int r;
+
+	if(context->callback)
+	{
+		return (context->callback(context->connection, statement, graph, context->cbdata) ? -1 : 0);
+	}
+	r = 0;
+	if(graph && context->mode == SPARQL_MODEL_LOOKUP)
+	{
+		st = librdf_model_find_statements_with_options(context->model, statement, graph, NULL);
+		if(librdf_stream_end(st))
+		{
+			r = librdf_model_context_add_statement(context->model, graph, statement);
+		}
+		librdf_free_stream(st);
+	}
+	else if(graph)
+	{
+		if(context->seen)
+		{
+			r = sparql_query_seen_(context, statement, graph);
+			if(r)
+			{
+				/* Either a duplicate or an error */
+				return (r > 0 ? 0 : -1);
+			}
+		}
+		r = librdf_model_context_add_statement(context->model, graph, statement);
+	}
+	else
+	{
+		r = librdf_model_add_statement(context->model, statement);
+	}
+	if(r)
+	{
+		sparql_logf_(context->connection, LOG_ERR, "failed to add statement to model\n");
+		return -1;
+	}
+	if(context->txn)
+	{
+		context->batched++;
+		if(context->batched >= SPARQL_MODEL_BATCH)
+		{
+			return sparql_query_batch_(context);
+		}
+	}
+	return 0;
+}
+
+/* Determine whether a statement in a named graph has been added already,
+ * returning 1 if so, 0 if not (in which case it's recorded), or -1 on
+ * error
+ */
+static int
+sparql_query_seen_(struct sparql_query_context_struct *context, librdf_statement *statement, librdf_node *graph)
+{
+	SPARQLHASHENTRY *entry;
+
+	context->keylen = 0;
+	if(sparql_query_key_(context, graph) ||
+	   sparql_query_key_(context, librdf_statement_get_subject(statement)) ||
+	   sparql_query_key_(context, librdf_statement_get_predicate(statement)) ||
+	   sparql_query_key_(context, librdf_statement_get_object(statement)))
+	{
+		return -1;
+	}
+	entry = sparql_hash_lookup_(context->seen, context->key, context->keylen, 1);
+	if(!entry)
+	{
+		return -1;
+	}
+	if(entry->data)
+	{
+		return 1;
+	}
+	entry->data = (void *) context;
+	return 0;
+}
+
+/* Append an unambiguous encoding of <node> to the de-duplication key */
+static int
+sparql_query_key_(struct sparql_query_context_struct *context, librdf_node *node)
+{
+	const unsigned char *str;
+	librdf_uri *uri;
+	size_t len;
+
+	if(librdf_node_is_resource(node))
+	{
+		str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		return sparql_query_key_append_(context, 'U', str, len);
+	}
+	if(librdf_node_is_blank(node))
+	{
+		str = librdf_node_get_counted_blank_identifier(node, &len);
+		return sparql_query_key_append_(context, 'B', str, len);
+	}
+	str = librdf_node_get_literal_value_as_counted_string(node, &len);
+	if(sparql_query_key_append_(context, 'L', str, len))
+	{
+		return -1;
+	}
+	str = (const unsigned char *) librdf_node_get_literal_value_language(node);
+	if(str && sparql_query_key_append_(context, '@', str, strlen((const char *) str)))
+	{
+		return -1;
+	}
+	uri = librdf_node_get_literal_value_datatype_uri(node);
+	if(uri)
+	{
+		str = librdf_uri_as_counted_string(uri, &len);
+		return sparql_query_key_append_(context, '^', str, len);
+	}
+	return 0;
+}
+
+/* Append a kind indicator, a length and a string to the key */
+static int
+sparql_query_key_append_(struct sparql_query_context_struct *context, char kind, const unsigned char *str, size_t len)
+{
+	char *p;
+	size_t l;
+
+	l = context->keylen + len + 24;
+	if(l > context->keysize)
+	{
+		l = ((l / 256) + 1) * 256;
+		p = (char *) realloc(context->key, l);
+		if(!p)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "failed to reallocate buffer to %u bytes\n", (unsigned) l);
+			return -1;
+		}
+		context->key = p;
+		context->keysize = l;
+	}
+	context->keylen += sprintf(&(context->key[context->keylen]), "%c%lu:", kind, (unsigned long) len);
+	if(len)
+	{
+		memcpy(&(context->key[context->keylen]), str, len);
+		context->keylen += len;
+	}
+	return 0;
+}
+
+/* Commit the current transaction and begin another */
+static int
+sparql_query_batch_(struct sparql_query_context_struct *context)
+{
+	context->batched = 0;
+	context->txn = 0;
+	if(librdf_model_transaction_commit(context->model))
+	{
+		sparql_logf_(context->connection, LOG_ERR, "failed to commit statements to model\n");
+		return -1;
+	}
+	context->txn = !librdf_model_transaction_start(context->model);
+	return 0;
+}
+
+/* Perform a query whose results are statements */
+static int
+sparql_query_statements_(struct sparql_query_context_struct *context, const char *querybuf, size_t length)
+{
+	SPARQL *connection;
+	int r;
+
+	connection = context->connection;
+	context->world = sparql_world(connection);
+	if(!context->world)
+	{
+		return -1;
+	}
+	context->intern = sparql_intern_create_(connection, context->world);
+	if(!context->intern)
+	{
+		return -1;
+	}
+	context->query = sparql_query_create_(connection);
+	if(!context->query)
+	{
+		sparql_logf_(connection, LOG_CRIT, "failed to create SPARQL query structure\n");
+		sparql_intern_destroy_(context->intern);
+		return -1;
+	}
+	sparql_query_set_data_(context->query, (void *) context);
+	sparql_query_set_variable_(context->query, sparql_query_variable_);
+	sparql_query_set_link_(context->query, sparql_query_link_);
+	sparql_query_set_beginresults_(context->query, sparql_query_beginresults_);
+	sparql_query_set_beginresult_(context->query, sparql_query_beginresult_);
+	sparql_query_set_endresult_(context->query, sparql_query_endresult_);
+	sparql_query_set_literal_(context->query, sparql_query_literal_);
+	sparql_query_set_bnode_(context->query, sparql_query_bnode_);
+	sparql_query_set_uri_(context->query, sparql_query_uri_);
+	sparql_query_set_boolean_(context->query, sparql_query_boolean_);
+	sparql_query_set_statement_(context->query, sparql_query_statement_cb_);
+	if(context->model && context->mode != SPARQL_MODEL_LOOKUP)
+	{
+		if(context->mode == SPARQL_MODEL_BULK)
+		{
+			context->seen = sparql_hash_create_(connection, NULL);
+			if(!context->seen)
+			{
+				sparql_query_destroy_(context->query);
+				sparql_intern_destroy_(context->intern);
+				return -1;
+			}
+		}
+		/* Storages which don't support transactions fail to start one,
+		 * in which case statements are simply added individually
+		 */
+		context->txn = !librdf_model_transaction_start(context->model);
+	}
+	r = sparql_query_perform_(context->query, querybuf, length);
+	sparql_query_destroy_(context->query);
+	if(context->txn)
+	{
+		if(r)
+		{
+			librdf_model_transaction_rollback(context->model);
+		}
+		else if(librdf_model_transaction_commit(context->model))
+		{
+			sparql_logf_(connection, LOG_ERR, "failed to commit statements to model\n");
+			r = -1;
+		}
+	}
+	if(context->seen)
+	{
+		sparql_hash_destroy_(context->seen);
+	}
+	free(context->key);
+	if(context->statement)
+	{
+		librdf_free_statement(context->statement);
+	}
+	if(context->g)
+	{
+		librdf_free_node(context->g);
+	}
+	sparql_intern_destroy_(context->intern);
+	return r;
+}
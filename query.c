@@ -82,6 +82,7 @@ sparql_query(SPARQL *connection, const char *querybuf, size_t length)
 		return NULL;
 	}
 	sparql_query_destroy_(context.query);
+	sparqlres_complete_(context.results);
 	return context.results;
 }
 
@@ -0,0 +1,159 @@
+/* SPARQL client: parsing of RDF graphs returned by CONSTRUCT and DESCRIBE
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* The response to a CONSTRUCT or DESCRIBE query is a serialised graph
+ * rather than a result set. It's fed to a raptor parser in push mode as it
+ * arrives, and each statement is passed to the query's statement callback
+ * as soon as the parser produces it.
+ */
+
+struct sparql_rdfscan_struct
+{
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	raptor_parser *parser;
+	raptor_uri *base;
+	int failed;
+	size_t triples;
+};
+
+static void sparql_rdfscan_statement_(void *data, raptor_statement *statement);
+
+/* Create a parser for a response whose Content-Type is <type> */
+SPARQLRDFSCAN *
+sparql_rdfscan_create_(SPARQL *connection, SPARQLQUERY *query, const char *type)
+{
+	SPARQLRDFSCAN *p;
+	librdf_world *world;
+	raptor_world *raptor;
+	const char *name;
+	char *mime, *t;
+
+	world = sparql_world(connection);
+	if(!world)
+	{
+		return NULL;
+	}
+	p = (SPARQLRDFSCAN *) calloc(1, sizeof(SPARQLRDFSCAN));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->connection = connection;
+	p->query = query;
+	raptor = librdf_world_get_raptor(world);
+	name = NULL;
+	if(type && (mime = strdup(type)))
+	{
+		/* Discard any parameters */
+		for(t = mime; *t && *t != ';' && !isspace((unsigned char) *t); t++)
+		{
+		}
+		*t = 0;
+		name = raptor_world_guess_parser_name(raptor, NULL, mime, NULL, 0, NULL);
+		free(mime);
+	}
+	if(!name)
+	{
+		name = "turtle";
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: parsing query response of type '%s' using the '%s' parser\n", type ? type : "(unknown)", name);
+	p->parser = raptor_new_parser(raptor, name);
+	p->base = raptor_new_uri(raptor, (const unsigned char *) connection->query_uri);
+	if(!p->parser || !p->base)
+	{
+		sparql_logf_(connection, LOG_CRIT, "failed to create RDF parser for query response\n");
+		sparql_rdfscan_destroy_(p);
+		return NULL;
+	}
+	raptor_parser_set_statement_handler(p->parser, (void *) p, sparql_rdfscan_statement_);
+	if(raptor_parser_parse_start(p->parser, p->base))
+	{
+		sparql_logf_(connection, LOG_ERR, "failed to start parsing query response\n");
+		sparql_rdfscan_destroy_(p);
+		return NULL;
+	}
+	return p;
+}
+
+int
+sparql_rdfscan_destroy_(SPARQLRDFSCAN *scan)
+{
+	if(scan->parser)
+	{
+		raptor_free_parser(scan->parser);
+	}
+	if(scan->base)
+	{
+		raptor_free_uri(scan->base);
+	}
+	free(scan);
+	return 0;
+}
+
+/* Process the next <len> bytes of the response; <final> is nonzero once
+ * the whole response has been received
+ */
+int
+sparql_rdfscan_parse_(SPARQLRDFSCAN *scan, const char *buf, size_t len, int final)
+{
+	if(scan->failed)
+	{
+		return -1;
+	}
+	if(raptor_parser_parse_chunk(scan->parser, (const unsigned char *) (len ? buf : NULL), len, final) || scan->failed)
+	{
+		if(!scan->failed)
+		{
+			sparql_logf_(scan->connection, LOG_ERR, "returned RDF graph could not be parsed\n");
+		}
+		scan->failed = 1;
+		return -1;
+	}
+	if(final)
+	{
+		sparql_logf_(scan->connection, LOG_DEBUG, "SPARQL: parsed %u statements from query response\n", (unsigned) scan->triples);
+	}
+	return 0;
+}
+
+/* Invoked by the parser for each statement */
+static void
+sparql_rdfscan_statement_(void *data, raptor_statement *statement)
+{
+	SPARQLRDFSCAN *scan = (SPARQLRDFSCAN *) data;
+
+	if(scan->failed)
+	{
+		return;
+	}
+	if(sparql_query_statement_(scan->query, (librdf_statement *) statement, (librdf_node *) statement->graph))
+	{
+		scan->failed = 1;
+		raptor_parser_parse_abort(scan->parser);
+		return;
+	}
+	scan->triples++;
+}
@@ -24,6 +24,14 @@
 
 #include "p_libsparqlclient.h"
 
+struct sparql_row_struct
+{
+	SPARQLRES *results;
+	librdf_node **nodes;
+	/* The row's index, in columnar mode */
+	size_t index;
+};
+
 struct sparql_results_struct
 {
 	SPARQL *connection;
@@ -39,16 +47,42 @@ struct sparql_results_struct
 	size_t linkcount;
 	size_t current;
 	int reset;
+	/* URI nodes and datatypes, which repeat from row to row */
+	SPARQLINTERN *intern;
+	/* Set if values are stored in columns of term IDs rather than as
+	 * per-row arrays of nodes
+	 */
+	int columnar;
+	/* One array of term IDs per variable, where 0 means unbound */
+	uint32_t **columns;
+	size_t colsize;
+	/* Term ID n is terms[n - 1] */
+	struct sparql_term_struct *terms;
+	size_t termcount;
+	size_t termsize;
+	SPARQLHASH *termindex;
+	/* The row returned by sparqlres_next() in columnar mode */
+	SPARQLROW cursor;
 };
 
-struct sparql_row_struct
+/* A term in the dictionary of a columnar result-set; the term is encoded
+ * in the key of its index entry as a kind indicator (U, B or L), followed
+ * by the NUL-terminated value, language and datatype
+ */
+struct sparql_term_struct
 {
-	SPARQLRES *results;
-	librdf_node **nodes;
+	const char *key;
+	/* Created when first requested */
+	librdf_node *node;
 };
 
 static int sparqlrow_set_node_(SPARQLRES *res, SPARQLROW *row, size_t index, librdf_node *node);
 static char *sparqlrow_node_string_(SPARQLROW *row, librdf_node *node);
+static SPARQLINTERN *sparqlres_intern_(SPARQLRES *res, librdf_world *world);
+static SPARQLROW *sparqlrow_create_columnar_(SPARQLRES *res);
+static int sparqlrow_set_term_(SPARQLRES *res, SPARQLROW *row, size_t index, char kind, const char *value, const char *language, const char *datatype);
+static librdf_node *sparqlrow_node_(SPARQLROW *row, size_t index);
+static int sparqlres_widths_(SPARQLRES *res);
 
 SPARQLRES *
 sparqlres_create_(SPARQL *connection)
@@ -63,6 +97,8 @@ sparqlres_create_(SPARQL *connection)
 	p->connection = connection;
 	p->boolean = -1;
 	p->reset = 1;
+	p->columnar = (connection->results_storage == SPARQL_RESULTS_COLUMNS);
+	p->cursor.results = p;
 	return p;
 }
 
@@ -122,6 +158,20 @@ sparqlres_add_variable_(SPARQLRES *res, const char *name)
 	return 0;
 }
 
+/* Invoked once all of the rows have been added to a result-set, to release
+ * resources which are only needed while it's being built
+ */
+int
+sparqlres_complete_(SPARQLRES *res)
+{
+	if(res->intern)
+	{
+		sparql_intern_destroy_(res->intern);
+		res->intern = NULL;
+	}
+	return 0;
+}
+
 int
 sparqlres_add_link_(SPARQLRES *res, const char *href)
 {
@@ -228,6 +278,11 @@ sparqlres_next(SPARQLRES *res)
 	{
 		return NULL;
 	}
+	if(res->columnar)
+	{
+		res->cursor.index = res->current;
+		return &(res->cursor);
+	}
 	return &(res->rows[res->current]);
 }
 
@@ -262,7 +317,7 @@ sparqlres_destroy(SPARQLRES *res)
 		free(res->variables[n]);
 	}
 	free(res->variables);
-	for(i = 0; i < res->rowcount; i++)
+	for(i = 0; !res->columnar && i < res->rowcount; i++)
 	{
 		for(n = 0; n < res->varcount; n++)
 		{
@@ -274,7 +329,28 @@ sparqlres_destroy(SPARQLRES *res)
 		free(res->rows[i].nodes);
 	}
 	free(res->rows);
+	for(n = 0; res->columns && n < res->varcount; n++)
+	{
+		free(res->columns[n]);
+	}
+	free(res->columns);
+	for(i = 0; i < res->termcount; i++)
+	{
+		if(res->terms[i].node)
+		{
+			librdf_free_node(res->terms[i].node);
+		}
+	}
+	free(res->terms);
+	if(res->termindex)
+	{
+		sparql_hash_destroy_(res->termindex);
+	}
 	free(res->widths);
+	if(res->intern)
+	{
+		sparql_intern_destroy_(res->intern);
+	}
 	free(res);
 	return 0;
 }
@@ -285,6 +361,10 @@ sparqlrow_create_(SPARQLRES *res)
 	SPARQLROW *p;
 	size_t l;
 
+	if(res->columnar)
+	{
+		return sparqlrow_create_columnar_(res);
+	}
 	if(res->rowcount + 1 >= res->rowsize)
 	{
 		l = sizeof(SPARQLROW) * (res->rowsize + 8);
@@ -334,15 +414,30 @@ sparqlrow_set_uri_(SPARQLRES *res, SPARQLROW *row, const char *binding, const ch
 		sparql_set_error_(row->results->connection, SPARQLSTATE_BIND_INVALID, "failed to bind URI to a variable which does not exist");
 		return -1;
 	}
-	node = librdf_new_node_from_uri_string(world, (const unsigned char *) uri);
-	if(!node)
+	if(!uri)
 	{
-		sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new URI node");
+		sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "cannot bind an empty URI");
 		return -1;
 	}
-	if(sparqlrow_set_node_(res, row, index, node))
+	if(res->columnar)
 	{
-		return -1;
+		if(sparqlrow_set_term_(res, row, index, 'U', uri, NULL, NULL))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		node = (sparqlres_intern_(row->results, world) ? sparql_intern_node_(row->results->intern, uri) : NULL);
+		if(!node)
+		{
+			sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new URI node");
+			return -1;
+		}
+		if(sparqlrow_set_node_(res, row, index, node))
+		{
+			return -1;
+		}
 	}
 	l = strlen(uri) + 2;
 	if(res->widths[index] < l)
@@ -372,15 +467,30 @@ sparqlrow_set_bnode_(SPARQLRES *res, SPARQLROW *row, const char *binding, const
 		sparql_set_error_(row->results->connection, SPARQLSTATE_BIND_INVALID, "failed to bind URI to a variable which does not exist");
 		return -1;
 	}
-	node = librdf_new_node_from_blank_identifier(world, (const unsigned char *) ref);
-	if(!node)
+	if(!ref)
 	{
-		sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new blank node");
+		sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "cannot bind an empty blank node identifier");
 		return -1;
 	}
-	if(sparqlrow_set_node_(res, row, index, node))
+	if(res->columnar)
 	{
-		return -1;
+		if(sparqlrow_set_term_(res, row, index, 'B', ref, NULL, NULL))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		node = librdf_new_node_from_blank_identifier(world, (const unsigned char *) ref);
+		if(!node)
+		{
+			sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new blank node");
+			return -1;
+		}
+		if(sparqlrow_set_node_(res, row, index, node))
+		{
+			return -1;
+		}
 	}
 	l = strlen(ref) + 3;
 	if(res->widths[index] < l)
@@ -411,32 +521,44 @@ sparqlrow_set_literal_(SPARQLRES *res, SPARQLROW *row, const char *binding, cons
 		sparql_set_error_(row->results->connection, SPARQLSTATE_BIND_INVALID, "failed to bind URI to a variable which does not exist");
 		return -1;
 	}
-	if(datatype)
+	if(!value)
 	{
-		type = librdf_new_uri(world, (const unsigned char *) datatype);
-		if(!type)
+		/* An empty literal element */
+		value = "";
+	}
+	if(res->columnar)
+	{
+		if(sparqlrow_set_term_(res, row, index, 'L', value, language, datatype))
 		{
-			sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_URI, "failed to create datatype URI");
 			return -1;
 		}
 	}
 	else
 	{
 		type = NULL;
-	}
-	node = librdf_new_node_from_typed_literal(world, (const unsigned char *) value, language, type);
-	if(type)
-	{
-		librdf_free_uri(type);
-	}
-	if(!node)
-	{
-		sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new literal node");
-		return -1;
-	}
-	if(sparqlrow_set_node_(res, row, index, node))
-	{
-		return -1;
+		if(datatype)
+		{
+			type = (sparqlres_intern_(row->results, world) ? sparql_intern_uri_(row->results->intern, datatype) : NULL);
+			if(!type)
+			{
+				sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_URI, "failed to create datatype URI");
+				return -1;
+			}
+		}
+		node = librdf_new_node_from_typed_literal(world, (const unsigned char *) value, language, type);
+		if(type)
+		{
+			librdf_free_uri(type);
+		}
+		if(!node)
+		{
+			sparql_set_error_(row->results->connection, SPARQLSTATE_CREATE_NODE, "failed to create new literal node");
+			return -1;
+		}
+		if(sparqlrow_set_node_(res, row, index, node))
+		{
+			return -1;
+		}
 	}
 	l = strlen(value) + 2 + (language ? strlen(language) + 1 : 0) + (datatype ? strlen(datatype) + 2 : 0);
 	if(res->widths[index] < l)
@@ -461,7 +583,7 @@ sparqlrow_binding(SPARQLROW *row, size_t index)
 		return NULL;
 	}
 	sparql_set_nerror_(row->results->connection, 0, NULL);
-	return row->nodes[index];
+	return sparqlrow_node_(row, index);
 }
 
 /* Copy at most buflen bytes of the value of result field index into
@@ -485,7 +607,7 @@ sparqlrow_value(SPARQLROW *row, size_t index, char *buf, size_t buflen)
 		sparql_set_error_(row->results->connection, SPARQLSTATE_INDEX_BOUNDS, "cannot retrieve a value with an index out of range");
 		return (size_t) -1;
 	}
-	str = sparqlrow_node_string_(row, row->nodes[index]);
+	str = sparqlrow_node_string_(row, sparqlrow_node_(row, index));
 	if(str)
 	{
 		l = strlen(str) + 1;
@@ -506,13 +628,10 @@ sparqlrow_value(SPARQLROW *row, size_t index, char *buf, size_t buflen)
 static int
 sparqlrow_set_node_(SPARQLRES *res, SPARQLROW *row, size_t index, librdf_node *node)
 {
-	if(!res->widths)
+	if(sparqlres_widths_(res))
 	{
-		res->widths = (size_t *) calloc(res->varcount, sizeof(size_t));
-		if(!res->widths)
-		{
-			return -1;
-		}
+		librdf_free_node(node);
+		return -1;
 	}
 	if(row->nodes[index])
 	{
@@ -548,3 +667,217 @@ sparqlrow_node_string_(SPARQLROW *row, librdf_node *node)
 	}
 	return buf;
 }
+
+/* Obtain the result-set's interning cache, creating it if needed */
+static SPARQLINTERN *
+sparqlres_intern_(SPARQLRES *res, librdf_world *world)
+{
+	if(!res->intern)
+	{
+		res->intern = sparql_intern_create_(res->connection, world);
+	}
+	return res->intern;
+}
+
+static int
+sparqlres_widths_(SPARQLRES *res)
+{
+	if(!res->widths)
+	{
+		res->widths = (size_t *) calloc(res->varcount, sizeof(size_t));
+		if(!res->widths)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Add a row to a columnar result-set, returning the cursor positioned on
+ * it; each column grows geometrically, and new cells are unbound
+ */
+static SPARQLROW *
+sparqlrow_create_columnar_(SPARQLRES *res)
+{
+	uint32_t *p;
+	size_t n, size;
+
+	if(res->varcount && !res->columns)
+	{
+		res->columns = (uint32_t **) calloc(res->varcount, sizeof(uint32_t *));
+		if(!res->columns)
+		{
+			sparql_logf_(res->connection, LOG_CRIT, "failed to allocate memory for result-set columns\n");
+			return NULL;
+		}
+	}
+	if(res->rowcount >= res->colsize)
+	{
+		size = (res->colsize ? res->colsize * 2 : 64);
+		for(n = 0; n < res->varcount; n++)
+		{
+			p = (uint32_t *) realloc(res->columns[n], size * sizeof(uint32_t));
+			if(!p)
+			{
+				sparql_logf_(res->connection, LOG_CRIT, "failed to reallocate result-set column to %u bytes\n", (unsigned) (size * sizeof(uint32_t)));
+				return NULL;
+			}
+			memset(&(p[res->colsize]), 0, (size - res->colsize) * sizeof(uint32_t));
+			res->columns[n] = p;
+		}
+		res->colsize = size;
+	}
+	res->cursor.index = res->rowcount;
+	res->rowcount++;
+	return &(res->cursor);
+}
+
+/* Store a value in a columnar result-set, adding it to the dictionary if
+ * it hasn't been seen before
+ */
+static int
+sparqlrow_set_term_(SPARQLRES *res, SPARQLROW *row, size_t index, char kind, const char *value, const char *language, const char *datatype)
+{
+	SPARQLHASHENTRY *entry;
+	struct sparql_term_struct *p;
+	char *key;
+	size_t vlen, llen, dlen, l;
+
+	if(sparqlres_widths_(res))
+	{
+		return -1;
+	}
+	if(!res->termindex)
+	{
+		res->termindex = sparql_hash_create_(res->connection, NULL);
+		if(!res->termindex)
+		{
+			return -1;
+		}
+	}
+	vlen = strlen(value);
+	llen = (language ? strlen(language) : 0);
+	dlen = (datatype ? strlen(datatype) : 0);
+	l = 1 + vlen + 1 + llen + 1 + dlen;
+	key = (char *) malloc(l + 1);
+	if(!key)
+	{
+		sparql_logf_(res->connection, LOG_CRIT, "failed to allocate memory for result-set term\n");
+		return -1;
+	}
+	key[0] = kind;
+	memcpy(&(key[1]), value, vlen + 1);
+	if(llen)
+	{
+		memcpy(&(key[2 + vlen]), language, llen);
+	}
+	key[2 + vlen + llen] = 0;
+	if(dlen)
+	{
+		memcpy(&(key[3 + vlen + llen]), datatype, dlen);
+	}
+	key[l] = 0;
+	entry = sparql_hash_lookup_(res->termindex, key, l, 1);
+	free(key);
+	if(!entry)
+	{
+		return -1;
+	}
+	if(!entry->data)
+	{
+		if(res->termcount >= UINT32_MAX - 1)
+		{
+			sparql_logf_(res->connection, LOG_ERR, "too many distinct terms in result-set\n");
+			return -1;
+		}
+		if(res->termcount >= res->termsize)
+		{
+			l = (res->termsize ? res->termsize * 2 : 64);
+			p = (struct sparql_term_struct *) realloc(res->terms, l * sizeof(struct sparql_term_struct));
+			if(!p)
+			{
+				sparql_logf_(res->connection, LOG_CRIT, "failed to reallocate result-set dictionary to %u bytes\n", (unsigned) (l * sizeof(struct sparql_term_struct)));
+				return -1;
+			}
+			res->terms = p;
+			res->termsize = l;
+		}
+		res->terms[res->termcount].key = entry->key;
+		res->terms[res->termcount].node = NULL;
+		res->termcount++;
+		entry->data = (void *) res;
+		entry->index = res->termcount;
+	}
+	res->columns[index][row->index] = (uint32_t) entry->index;
+	return 0;
+}
+
+/* Obtain the node bound to variable <index> in a row, which remains owned
+ * by the result-set; in columnar mode, the node for a term is created the
+ * first time it's requested
+ */
+static librdf_node *
+sparqlrow_node_(SPARQLROW *row, size_t index)
+{
+	SPARQLRES *res;
+	struct sparql_term_struct *term;
+	librdf_world *world;
+	librdf_uri *type;
+	const char *value, *language, *datatype;
+	uint32_t id;
+
+	res = row->results;
+	if(!res->columnar)
+	{
+		return row->nodes[index];
+	}
+	id = res->columns[index][row->index];
+	if(!id)
+	{
+		return NULL;
+	}
+	term = &(res->terms[id - 1]);
+	if(term->node)
+	{
+		return term->node;
+	}
+	world = sparql_world(res->connection);
+	if(!world)
+	{
+		return NULL;
+	}
+	value = &(term->key[1]);
+	language = strchr(value, 0) + 1;
+	datatype = strchr(language, 0) + 1;
+	switch(term->key[0])
+	{
+	case 'U':
+		term->node = librdf_new_node_from_uri_string(world, (const unsigned char *) value);
+		break;
+	case 'B':
+		term->node = librdf_new_node_from_blank_identifier(world, (const unsigned char *) value);
+		break;
+	default:
+		type = NULL;
+		if(datatype[0])
+		{
+			type = librdf_new_uri(world, (const unsigned char *) datatype);
+			if(!type)
+			{
+				sparql_set_error_(res->connection, SPARQLSTATE_CREATE_URI, "failed to create datatype URI");
+				return NULL;
+			}
+		}
+		term->node = librdf_new_node_from_typed_literal(world, (const unsigned char *) value, (language[0] ? language : NULL), type);
+		if(type)
+		{
+			librdf_free_uri(type);
+		}
+		break;
+	}
+	if(!term->node)
+	{
+		sparql_set_error_(res->connection, SPARQLSTATE_CREATE_NODE, "failed to create node for result-set term");
+	}
+	return term->node;
+}
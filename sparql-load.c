@@ -0,0 +1,1121 @@
+/* SPARQL client library: parallel bulk loader
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <curl/curl.h>
+
+#include "libsparqlclient.h"
+
+/* sparql-load parses each input file, splits the statements into chunks of
+ * bounded size and hands them to a pool of worker threads, each of which
+ * has its own connection to the server and uploads chunks with
+ * sparql_insert() (and therefore via POST when a data endpoint is
+ * available, or INSERT DATA otherwise).
+ *
+ * Blank node labels are scoped to a single request, so statements which
+ * involve blank nodes can't be split arbitrarily: they are set aside as
+ * the file is parsed and uploaded with sparql_insert_model() once it has
+ * been read in full, which keeps each set of connected statements within
+ * the same request.
+ *
+ * Chunk boundaries are deterministic for a given chunk size, so progress
+ * can be recorded in a state file as the number of leading chunks of each
+ * file which have been uploaded successfully, allowing an interrupted or
+ * partially-failed load to be resumed.
+ *
+ * Blank node statements are the exception: sparql_insert_model() uploads
+ * them in several requests, and only their overall success is recorded.
+ * If some of those requests failed, resuming sends all of them again, and
+ * because re-inserting a blank node creates a new one, the statements
+ * from the requests which had succeeded are duplicated.
+ */
+
+#define DEFAULT_WORKERS                 4
+#define DEFAULT_CHUNK_BYTES             (4 * 1024 * 1024)
+#define DEFAULT_RETRIES                 3
+
+#define CHUNK_PENDING                   0
+#define CHUNK_DONE                      1
+#define CHUNK_FAILED                    2
+
+struct load_file
+{
+	char *path;
+	const char *format;
+	size_t watermark;
+	int bnodes_done;
+	int complete;
+	int failed;
+	/* Set once the file has been parsed in full */
+	int parsed;
+	size_t nchunks;
+	unsigned char *status;
+	size_t statussize;
+};
+
+struct load_job
+{
+	struct load_job *next;
+	size_t file;
+	size_t seq;
+	char *graph;
+	char *buf;
+	size_t len;
+	size_t triples;
+};
+
+struct load_worker
+{
+	pthread_t thread;
+	SPARQL *sparql;
+};
+
+static const char *short_program_name;
+static const char *base_uri;
+static const char *default_graph;
+static const char *force_format;
+static const char *state_path;
+static size_t nworkers = DEFAULT_WORKERS;
+static size_t chunk_bytes = DEFAULT_CHUNK_BYTES;
+static int retries = DEFAULT_RETRIES;
+static int use_put;
+static int verbose;
+static int quiet;
+
+static struct load_file *files;
+static size_t nfiles, filessize;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct load_job *queue_head, *queue_tail;
+static size_t queue_count, queue_limit;
+static int queue_closed;
+
+static struct timeval started, last_report, last_save;
+static int state_dirty;
+static unsigned long long triples_sent, bytes_sent, chunks_sent, chunks_failed;
+
+static void usage(void);
+static void logger(int priority, const char *format, va_list ap);
+static int add_path(const char *path, int explicit);
+static int add_file(const char *path, const char *format);
+static const char *format_for(const char *path);
+static int state_load(void);
+static int state_save(void);
+static void state_sync_locked(int force);
+static int load_file(SPARQL *sparql, librdf_world *world, size_t index);
+static int put_file(librdf_world *world, size_t index);
+static int put_format(const char *format);
+static int chunk_statement(raptor_iostream *iostr, librdf_statement *statement);
+static int queue_chunk(size_t index, size_t seq, const char *graph, char *buf, size_t len, size_t triples);
+static void queue_push(struct load_job *job);
+static struct load_job *queue_pop(void);
+static void *worker(void *arg);
+static void job_complete(struct load_job *job, int ok);
+static void file_complete_locked(struct load_file *file);
+static void report(int force);
+static double elapsed(struct timeval *since);
+
+int
+main(int argc, char **argv)
+{
+	struct load_worker *workers;
+	librdf_world *world;
+	SPARQL *sparql;
+	size_t c;
+	int ch, r;
+
+	if((short_program_name = strrchr(argv[0], '/')))
+	{
+		short_program_name++;
+	}
+	else
+	{
+		short_program_name = argv[0];
+	}
+	while((ch = getopt(argc, argv, "hvqpg:f:j:b:r:R:")) != -1)
+	{
+		switch(ch)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'p':
+			use_put = 1;
+			break;
+		case 'g':
+			default_graph = optarg;
+			break;
+		case 'f':
+			force_format = optarg;
+			break;
+		case 'j':
+			nworkers = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			chunk_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			state_path = optarg;
+			break;
+		case 'R':
+			retries = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(argc - optind < 2 || !nworkers || chunk_bytes < 1024)
+	{
+		usage();
+		return 1;
+	}
+	if(use_put && force_format && !put_format(force_format))
+	{
+		fprintf(stderr, "%s: -p cannot be used with %s input\n", short_program_name, force_format);
+		return 1;
+	}
+	base_uri = argv[optind];
+	for(c = optind + 1; c < (size_t) argc; c++)
+	{
+		if(add_path(argv[c], 1))
+		{
+			return 1;
+		}
+	}
+	if(state_path && state_load())
+	{
+		return 1;
+	}
+	curl_global_init(CURL_GLOBAL_ALL);
+	world = librdf_new_world();
+	if(!world)
+	{
+		fprintf(stderr, "%s: failed to create librdf world\n", short_program_name);
+		return 1;
+	}
+	librdf_world_open(world);
+	/* The main thread's connection is used for blank node statements, and
+	 * shares the parser's world; the workers each have their own.
+	 */
+	sparql = sparql_create(base_uri);
+	if(!sparql)
+	{
+		fprintf(stderr, "%s: failed to create SPARQL connection for <%s>\n", short_program_name, base_uri);
+		return 1;
+	}
+	sparql_set_logger(sparql, logger);
+	sparql_set_verbose(sparql, verbose);
+	sparql_set_world(sparql, world);
+	sparql_set_parallel(sparql, nworkers);
+	sparql_set_chunk_limits(sparql, chunk_bytes, 0);
+	workers = (struct load_worker *) calloc(nworkers, sizeof(struct load_worker));
+	if(!workers)
+	{
+		fprintf(stderr, "%s: %s\n", short_program_name, strerror(errno));
+		return 1;
+	}
+	queue_limit = nworkers * 2;
+	for(c = 0; c < nworkers; c++)
+	{
+		workers[c].sparql = sparql_create(base_uri);
+		if(!workers[c].sparql)
+		{
+			fprintf(stderr, "%s: failed to create SPARQL connection for <%s>\n", short_program_name, base_uri);
+			return 1;
+		}
+		sparql_set_logger(workers[c].sparql, logger);
+		sparql_set_verbose(workers[c].sparql, verbose);
+		if(pthread_create(&(workers[c].thread), NULL, worker, (void *) &(workers[c])))
+		{
+			fprintf(stderr, "%s: failed to create worker thread\n", short_program_name);
+			return 1;
+		}
+	}
+	gettimeofday(&started, NULL);
+	last_report = started;
+	last_save = started;
+	for(c = 0; c < nfiles; c++)
+	{
+		if(files[c].complete)
+		{
+			if(verbose)
+			{
+				fprintf(stderr, "%s: %s: already loaded, skipping\n", short_program_name, files[c].path);
+			}
+			continue;
+		}
+		if(use_put)
+		{
+			put_file(world, c);
+		}
+		else
+		{
+			load_file(sparql, world, c);
+		}
+	}
+	pthread_mutex_lock(&lock);
+	queue_closed = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&lock);
+	for(c = 0; c < nworkers; c++)
+	{
+		pthread_join(workers[c].thread, NULL);
+		sparql_destroy(workers[c].sparql);
+	}
+	free(workers);
+	sparql_destroy(sparql);
+	librdf_free_world(world);
+	pthread_mutex_lock(&lock);
+	state_sync_locked(1);
+	pthread_mutex_unlock(&lock);
+	report(1);
+	r = 0;
+	for(c = 0; c < nfiles; c++)
+	{
+		if(!files[c].complete)
+		{
+			fprintf(stderr, "%s: %s: not loaded in full\n", short_program_name, files[c].path);
+			r = 1;
+		}
+	}
+	if(r && state_path)
+	{
+		fprintf(stderr, "%s: re-run with the same options to resume the load\n", short_program_name);
+	}
+	curl_global_cleanup();
+	return r;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] URI FILE|DIRECTORY...\n"
+			"\n"
+			"OPTIONS is one or more of:\n"
+			"  -h             Print this usage message and exit\n"
+			"  -v             Verbose output\n"
+			"  -q             Don't report progress\n"
+			"  -g GRAPH       Load triples into GRAPH (defaults to the file's URI)\n"
+			"  -f FORMAT      Parse input as ntriples, nquads or turtle (defaults\n"
+			"                 to determining the format from the file extension)\n"
+			"  -j WORKERS     Perform up to WORKERS uploads concurrently (default %d)\n"
+			"  -b BYTES       Upload chunks of approximately BYTES each (default %d)\n"
+			"  -p             PUT each file in full, replacing the target graph,\n"
+			"                 instead of splitting it into chunks (ntriples and\n"
+			"                 turtle input only)\n"
+			"  -r STATEFILE   Record progress in STATEFILE, and resume from it (a\n"
+			"                 file's statements involving blank nodes are resent in\n"
+			"                 full if they were only partially loaded, and so may\n"
+			"                 be duplicated)\n"
+			"  -R RETRIES     Retry each failed upload up to RETRIES times (default %d)\n",
+			short_program_name, DEFAULT_WORKERS, DEFAULT_CHUNK_BYTES, DEFAULT_RETRIES);
+}
+
+static void
+logger(int priority, const char *format, va_list ap)
+{
+	if(priority > LOG_INFO && !verbose)
+	{
+		return;
+	}
+	fprintf(stderr, "%s<%d>: ", short_program_name, priority);
+	vfprintf(stderr, format, ap);
+}
+
+/* Add a file, or the files within a directory (recursively, in sorted
+ * order so that resuming a load is predictable), to the list of inputs
+ */
+static int
+add_path(const char *path, int explicit)
+{
+	struct stat sbuf;
+	struct dirent **entries;
+	const char *format;
+	char *p;
+	int n, c, r;
+
+	if(stat(path, &sbuf))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+		return -1;
+	}
+	if(S_ISDIR(sbuf.st_mode))
+	{
+		n = scandir(path, &entries, NULL, alphasort);
+		if(n < 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+			return -1;
+		}
+		r = 0;
+		for(c = 0; c < n; c++)
+		{
+			if(!r && entries[c]->d_name[0] != '.')
+			{
+				p = (char *) malloc(strlen(path) + strlen(entries[c]->d_name) + 2);
+				if(!p)
+				{
+					r = -1;
+				}
+				else
+				{
+					sprintf(p, "%s/%s", path, entries[c]->d_name);
+					r = add_path(p, 0);
+					free(p);
+				}
+			}
+			free(entries[c]);
+		}
+		free(entries);
+		return r;
+	}
+	format = (force_format ? force_format : format_for(path));
+	if(!format)
+	{
+		if(explicit)
+		{
+			fprintf(stderr, "%s: %s: cannot determine the format of this file (use -f to specify it)\n", short_program_name, path);
+			return -1;
+		}
+		if(verbose)
+		{
+			fprintf(stderr, "%s: %s: skipping file of unknown format\n", short_program_name, path);
+		}
+		return 0;
+	}
+	return add_file(path, format);
+}
+
+static int
+add_file(const char *path, const char *format)
+{
+	struct load_file *p;
+
+	if(nfiles + 1 > filessize)
+	{
+		p = (struct load_file *) realloc(files, sizeof(struct load_file) * (filessize + 32));
+		if(!p)
+		{
+			fprintf(stderr, "%s: %s\n", short_program_name, strerror(errno));
+			return -1;
+		}
+		files = p;
+		filessize += 32;
+	}
+	p = &(files[nfiles]);
+	memset(p, 0, sizeof(struct load_file));
+	p->path = strdup(path);
+	if(!p->path)
+	{
+		fprintf(stderr, "%s: %s\n", short_program_name, strerror(errno));
+		return -1;
+	}
+	p->format = format;
+	nfiles++;
+	return 0;
+}
+
+static const char *
+format_for(const char *path)
+{
+	const char *t;
+
+	t = strrchr(path, '.');
+	if(!t)
+	{
+		return NULL;
+	}
+	if(!strcmp(t, ".nt"))
+	{
+		return "ntriples";
+	}
+	if(!strcmp(t, ".nq"))
+	{
+		return "nquads";
+	}
+	if(!strcmp(t, ".ttl"))
+	{
+		return "turtle";
+	}
+	return NULL;
+}
+
+/* The state file consists of a header line recording the chunk size in
+ * use, followed by a line for each input file of the form:
+ *
+ * CHUNKS <tab> FLAGS <tab> PATH
+ *
+ * Where CHUNKS is the number of leading chunks which have been loaded,
+ * and FLAGS contains 'b' if the file's blank node statements have been
+ * loaded and 'c' if the whole file has been. There's no record of blank
+ * node statements which were only partially loaded, so they aren't
+ * resumable: they're all sent again until 'b' is set.
+ */
+static int
+state_load(void)
+{
+	FILE *f;
+	char buf[4096], *t, *flags, *path;
+	unsigned long size;
+	size_t c, chunks;
+
+	f = fopen(state_path, "r");
+	if(!f)
+	{
+		if(errno == ENOENT)
+		{
+			return 0;
+		}
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, state_path, strerror(errno));
+		return -1;
+	}
+	if(!fgets(buf, sizeof(buf), f) || sscanf(buf, "sparql-load 1 %lu", &size) != 1)
+	{
+		fprintf(stderr, "%s: %s: not a valid state file\n", short_program_name, state_path);
+		fclose(f);
+		return -1;
+	}
+	if(size != chunk_bytes)
+	{
+		fprintf(stderr, "%s: %s: state was recorded with a chunk size of %lu bytes; specify -b %lu to resume\n", short_program_name, state_path, size, size);
+		fclose(f);
+		return -1;
+	}
+	while(fgets(buf, sizeof(buf), f))
+	{
+		t = strchr(buf, '\n');
+		if(t)
+		{
+			*t = 0;
+		}
+		chunks = strtoul(buf, &flags, 10);
+		if(*flags != '\t' || !(path = strchr(flags + 1, '\t')))
+		{
+			continue;
+		}
+		flags++;
+		*path = 0;
+		path++;
+		for(c = 0; c < nfiles; c++)
+		{
+			if(!strcmp(files[c].path, path))
+			{
+				files[c].watermark = chunks;
+				files[c].bnodes_done = (strchr(flags, 'b') != NULL);
+				files[c].complete = (strchr(flags, 'c') != NULL);
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Write the state file; called with the lock held */
+static int
+state_save(void)
+{
+	FILE *f;
+	char *tmp;
+	size_t c;
+
+	if(!state_path)
+	{
+		return 0;
+	}
+	tmp = (char *) malloc(strlen(state_path) + 8);
+	if(!tmp)
+	{
+		return -1;
+	}
+	sprintf(tmp, "%s.new", state_path);
+	f = fopen(tmp, "w");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "sparql-load 1 %lu\n", (unsigned long) chunk_bytes);
+	for(c = 0; c < nfiles; c++)
+	{
+		fprintf(f, "%lu\t%s%s\t%s\n", (unsigned long) files[c].watermark,
+				files[c].bnodes_done ? "b" : "", files[c].complete ? "c" : "",
+				files[c].path);
+	}
+	if(fclose(f) || rename(tmp, state_path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, state_path, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* Parse a file and queue its ground statements in chunks; the current
+ * chunk is flushed when it reaches the size limit or the target graph
+ * changes (N-Quads dumps are normally grouped by graph).
+ */
+static int
+load_file(SPARQL *sparql, librdf_world *world, size_t index)
+{
+	struct load_file *file;
+	librdf_parser *parser;
+	librdf_uri *uri;
+	librdf_stream *stream;
+	librdf_statement *statement;
+	librdf_node *context;
+	librdf_storage *storage;
+	librdf_model *model;
+	raptor_iostream *iostr;
+	char *buf, *graph, *filegraph;
+	const char *g;
+	size_t seq, triples, len;
+	int r;
+
+	file = &(files[index]);
+	if(verbose)
+	{
+		fprintf(stderr, "%s: %s: loading as %s\n", short_program_name, file->path, file->format);
+	}
+	parser = librdf_new_parser(world, file->format, NULL, NULL);
+	uri = librdf_new_uri_from_filename(world, file->path);
+	if(!parser || !uri)
+	{
+		fprintf(stderr, "%s: %s: failed to create parser\n", short_program_name, file->path);
+		goto failed;
+	}
+	filegraph = strdup(default_graph ? default_graph : (const char *) librdf_uri_as_string(uri));
+	storage = librdf_new_storage(world, "hashes", NULL, "hash-type='memory',contexts='yes'");
+	model = (storage ? librdf_new_model(world, storage, NULL) : NULL);
+	stream = librdf_parser_parse_as_stream(parser, uri, uri);
+	if(!filegraph || !model || !stream)
+	{
+		fprintf(stderr, "%s: %s: failed to parse file\n", short_program_name, file->path);
+		if(stream)
+		{
+			librdf_free_stream(stream);
+		}
+		if(model)
+		{
+			librdf_free_model(model);
+		}
+		if(storage)
+		{
+			librdf_free_storage(storage);
+		}
+		free(filegraph);
+		goto failed;
+	}
+	r = 0;
+	seq = 0;
+	triples = 0;
+	buf = NULL;
+	graph = NULL;
+	iostr = NULL;
+	for(; !r && !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		statement = librdf_stream_get_object(stream);
+		context = librdf_stream_get_context2(stream);
+		if(context && librdf_node_is_resource(context))
+		{
+			g = (const char *) librdf_uri_as_string(librdf_node_get_uri(context));
+		}
+		else
+		{
+			g = filegraph;
+		}
+		if(librdf_node_is_blank(librdf_statement_get_subject(statement)) ||
+		   librdf_node_is_blank(librdf_statement_get_object(statement)))
+		{
+			if(!file->bnodes_done)
+			{
+				context = librdf_new_node_from_uri_string(world, (const unsigned char *) g);
+				r = (!context || librdf_model_context_add_statement(model, context, statement));
+				if(context)
+				{
+					librdf_free_node(context);
+				}
+			}
+			continue;
+		}
+		if(iostr && strcmp(graph, g))
+		{
+			raptor_free_iostream(iostr);
+			iostr = NULL;
+			r = queue_chunk(index, seq, graph, buf, strlen(buf), triples);
+			seq++;
+			buf = NULL;
+			if(r)
+			{
+				break;
+			}
+		}
+		if(!iostr)
+		{
+			free(graph);
+			graph = strdup(g);
+			triples = 0;
+			iostr = raptor_new_iostream_to_string(librdf_world_get_raptor(world), (void **) &buf, NULL, malloc);
+			if(!graph || !iostr)
+			{
+				r = -1;
+				break;
+			}
+		}
+		r = chunk_statement(iostr, statement);
+		triples++;
+		if(!r && (size_t) raptor_iostream_tell(iostr) >= chunk_bytes)
+		{
+			raptor_free_iostream(iostr);
+			iostr = NULL;
+			len = strlen(buf);
+			r = queue_chunk(index, seq, graph, buf, len, triples);
+			seq++;
+			buf = NULL;
+		}
+	}
+	if(iostr)
+	{
+		raptor_free_iostream(iostr);
+		if(!r)
+		{
+			r = queue_chunk(index, seq, graph, buf, strlen(buf), triples);
+			seq++;
+		}
+		else
+		{
+			free(buf);
+		}
+	}
+	free(graph);
+	librdf_free_stream(stream);
+	if(r)
+	{
+		fprintf(stderr, "%s: %s: failed to process file\n", short_program_name, file->path);
+	}
+	else if(!file->bnodes_done)
+	{
+		if(librdf_model_size(model) > 0)
+		{
+			if(verbose)
+			{
+				fprintf(stderr, "%s: %s: loading %d statements involving blank nodes\n", short_program_name, file->path, librdf_model_size(model));
+			}
+			if(sparql_insert_model(sparql, model))
+			{
+				fprintf(stderr, "%s: %s: failed to load statements involving blank nodes: %s\n", short_program_name, file->path, sparql_error(sparql));
+				if(state_path)
+				{
+					fprintf(stderr, "%s: %s: some of these may have been loaded; resuming will load all of them again\n", short_program_name, file->path);
+				}
+				r = -1;
+			}
+		}
+	}
+	librdf_free_model(model);
+	librdf_free_storage(storage);
+	free(filegraph);
+	librdf_free_uri(uri);
+	librdf_free_parser(parser);
+	pthread_mutex_lock(&lock);
+	if(r)
+	{
+		file->failed = 1;
+	}
+	else if(!file->bnodes_done)
+	{
+		file->bnodes_done = 1;
+		state_dirty = 1;
+	}
+	file->nchunks = seq;
+	file->parsed = 1;
+	file_complete_locked(file);
+	pthread_mutex_unlock(&lock);
+	return r;
+
+failed:
+	if(uri)
+	{
+		librdf_free_uri(uri);
+	}
+	if(parser)
+	{
+		librdf_free_parser(parser);
+	}
+	pthread_mutex_lock(&lock);
+	file->failed = 1;
+	file->parsed = 1;
+	pthread_mutex_unlock(&lock);
+	return -1;
+}
+
+/* Queue a file to be PUT in full, into the same graph as load_file()
+ * would use
+ */
+static int
+put_file(librdf_world *world, size_t index)
+{
+	struct load_job *job;
+	librdf_uri *uri;
+	char *graph;
+
+	if(!put_format(files[index].format))
+	{
+		/* A quad file can't be PUT into a single graph */
+		fprintf(stderr, "%s: %s: cannot PUT %s input (omit -p to load it in chunks)\n", short_program_name, files[index].path, files[index].format);
+		pthread_mutex_lock(&lock);
+		files[index].failed = 1;
+		files[index].parsed = 1;
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	graph = NULL;
+	if(default_graph)
+	{
+		graph = strdup(default_graph);
+	}
+	else
+	{
+		uri = librdf_new_uri_from_filename(world, files[index].path);
+		if(!uri)
+		{
+			fprintf(stderr, "%s: %s: failed to create URI for file\n", short_program_name, files[index].path);
+			return -1;
+		}
+		graph = strdup((const char *) librdf_uri_as_string(uri));
+		librdf_free_uri(uri);
+	}
+	job = (struct load_job *) calloc(1, sizeof(struct load_job));
+	if(!graph || !job)
+	{
+		fprintf(stderr, "%s: %s\n", short_program_name, strerror(errno));
+		free(graph);
+		free(job);
+		return -1;
+	}
+	job->file = index;
+	job->graph = graph;
+	pthread_mutex_lock(&lock);
+	files[index].nchunks = 1;
+	files[index].parsed = 1;
+	files[index].bnodes_done = 1;
+	pthread_mutex_unlock(&lock);
+	queue_push(job);
+	return 0;
+}
+
+/* Determine whether files of <format> can be PUT as they are: the graph
+ * store is sent them as Turtle, of which N-Triples is a subset
+ */
+static int
+put_format(const char *format)
+{
+	return (!strcmp(format, "ntriples") || !strcmp(format, "turtle"));
+}
+
+static int
+chunk_statement(raptor_iostream *iostr, librdf_statement *statement)
+{
+	if(librdf_node_write(librdf_statement_get_subject(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_predicate(statement), iostr) ||
+	   raptor_iostream_write_byte(' ', iostr) ||
+	   librdf_node_write(librdf_statement_get_object(statement), iostr) ||
+	   raptor_iostream_counted_string_write(" .\n", 3, iostr))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Hand a chunk to the workers, unless it was loaded by a previous run;
+ * takes ownership of <buf>
+ */
+static int
+queue_chunk(size_t index, size_t seq, const char *graph, char *buf, size_t len, size_t triples)
+{
+	struct load_job *job;
+
+	if(seq < files[index].watermark)
+	{
+		free(buf);
+		return 0;
+	}
+	job = (struct load_job *) calloc(1, sizeof(struct load_job));
+	if(!job || !(job->graph = strdup(graph)))
+	{
+		fprintf(stderr, "%s: %s\n", short_program_name, strerror(errno));
+		free(job);
+		free(buf);
+		return -1;
+	}
+	job->file = index;
+	job->seq = seq;
+	job->buf = buf;
+	job->len = len;
+	job->triples = triples;
+	queue_push(job);
+	return 0;
+}
+
+/* Add a job to the queue, waiting for space if it is full */
+static void
+queue_push(struct load_job *job)
+{
+	pthread_mutex_lock(&lock);
+	while(queue_count >= queue_limit)
+	{
+		pthread_cond_wait(&queue_cond, &lock);
+	}
+	if(queue_tail)
+	{
+		queue_tail->next = job;
+	}
+	else
+	{
+		queue_head = job;
+	}
+	queue_tail = job;
+	queue_count++;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Remove a job from the queue, waiting for one to become available;
+ * returns NULL once the queue has been closed and drained
+ */
+static struct load_job *
+queue_pop(void)
+{
+	struct load_job *job;
+
+	pthread_mutex_lock(&lock);
+	while(!queue_head && !queue_closed)
+	{
+		pthread_cond_wait(&queue_cond, &lock);
+	}
+	job = queue_head;
+	if(job)
+	{
+		queue_head = job->next;
+		if(!queue_head)
+		{
+			queue_tail = NULL;
+		}
+		queue_count--;
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+static void *
+worker(void *arg)
+{
+	struct load_worker *self = (struct load_worker *) arg;
+	struct load_job *job;
+	int attempt, r;
+
+	while((job = queue_pop()))
+	{
+		r = -1;
+		for(attempt = 0; attempt <= retries; attempt++)
+		{
+			if(attempt)
+			{
+				fprintf(stderr, "%s: %s: chunk %lu failed (%s), retrying\n", short_program_name, files[job->file].path, (unsigned long) job->seq, sparql_error(self->sparql));
+				sleep(1 << (attempt - 1));
+			}
+			if(job->buf)
+			{
+				r = sparql_insert(self->sparql, job->buf, job->len, job->graph);
+			}
+			else
+			{
+				r = sparql_put_file(self->sparql, job->graph, files[job->file].path);
+			}
+			if(!r)
+			{
+				break;
+			}
+		}
+		if(r)
+		{
+			fprintf(stderr, "%s: %s: chunk %lu failed: %s\n", short_program_name, files[job->file].path, (unsigned long) job->seq, sparql_error(self->sparql));
+		}
+		job_complete(job, !r);
+	}
+	return NULL;
+}
+
+/* Record the outcome of a job, advance the file's watermark past any
+ * contiguous run of completed chunks, and update the state file if it's
+ * due
+ */
+static void
+job_complete(struct load_job *job, int ok)
+{
+	struct load_file *file;
+	unsigned char *p;
+	size_t size;
+
+	pthread_mutex_lock(&lock);
+	file = &(files[job->file]);
+	if(job->seq >= file->statussize)
+	{
+		size = (job->seq + 64) & ~((size_t) 63);
+		p = (unsigned char *) realloc(file->status, size);
+		if(p)
+		{
+			memset(p + file->statussize, CHUNK_PENDING, size - file->statussize);
+			file->status = p;
+			file->statussize = size;
+		}
+	}
+	if(job->seq < file->statussize)
+	{
+		file->status[job->seq] = (ok ? CHUNK_DONE : CHUNK_FAILED);
+	}
+	if(ok)
+	{
+		chunks_sent++;
+		triples_sent += job->triples;
+		bytes_sent += job->len;
+	}
+	else
+	{
+		chunks_failed++;
+		file->failed = 1;
+	}
+	while(file->watermark < file->statussize && file->status[file->watermark] == CHUNK_DONE)
+	{
+		file->watermark++;
+		state_dirty = 1;
+	}
+	file_complete_locked(file);
+	pthread_mutex_unlock(&lock);
+	report(0);
+	free(job->buf);
+	free(job->graph);
+	free(job);
+}
+
+/* Determine whether a file has been loaded in full, and record progress */
+static void
+file_complete_locked(struct load_file *file)
+{
+	if(!file->complete && file->parsed && !file->failed && file->bnodes_done && file->watermark >= file->nchunks)
+	{
+		file->complete = 1;
+		state_dirty = 1;
+		free(file->status);
+		file->status = NULL;
+		file->statussize = 0;
+		if(verbose)
+		{
+			fprintf(stderr, "%s: %s: complete\n", short_program_name, file->path);
+		}
+	}
+	state_sync_locked(0);
+}
+
+/* Save the state file if progress has been made since it was last saved,
+ * at most once per second unless <force> is set; called with the lock held
+ */
+static void
+state_sync_locked(int force)
+{
+	if(!state_dirty || (!force && elapsed(&last_save) < 1.0))
+	{
+		return;
+	}
+	gettimeofday(&last_save, NULL);
+	if(!state_save())
+	{
+		state_dirty = 0;
+	}
+}
+
+/* Print a progress report, at most once per second unless <force> is set */
+static void
+report(int force)
+{
+	struct timeval now;
+	double secs;
+
+	if(quiet)
+	{
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	gettimeofday(&now, NULL);
+	if(!force && elapsed(&last_report) < 1.0)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	last_report = now;
+	secs = elapsed(&started);
+	if(secs < 0.001)
+	{
+		secs = 0.001;
+	}
+	fprintf(stderr, "%s: %llu triples in %llu chunks (%.1f MB) in %.1fs; %.0f triples/s, %.2f MB/s%s",
+			short_program_name, triples_sent, chunks_sent, (double) bytes_sent / 1048576.0,
+			secs, (double) triples_sent / secs, (double) bytes_sent / 1048576.0 / secs,
+			force ? "" : "\n");
+	if(force)
+	{
+		fprintf(stderr, "; %llu chunks failed\n", chunks_failed);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static double
+elapsed(struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (double) (now.tv_sec - since->tv_sec) + (double) (now.tv_usec - since->tv_usec) / 1000000.0;
+}
@@ -0,0 +1,671 @@
+/* SPARQL client: differential graph replacement
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+/* sparql_sync_graph() makes the contents of a remote graph match a local
+ * model by sending only the differences between the two, rather than
+ * replacing the whole graph.
+ *
+ * Every ground statement in the model is serialised as N-Triples and
+ * added to a hash table; the remote graph is then queried and each of its
+ * ground statements is serialised in the same way and looked up. Those
+ * which are found are marked, and those which aren't are queued for
+ * deletion. Whatever remains unmarked afterwards is queued for insertion.
+ * The deletions and insertions are then sent as DELETE DATA and INSERT
+ * DATA operations: in a single request if they fit within the
+ * connection's chunk limits, otherwise in as many as those limits need.
+ *
+ * Statements are compared by their N-Triples form, not by value. The only
+ * difference which is normalised is that many stores return plain
+ * literals typed as xsd:string; any other difference in lexical form (for
+ * example "01" and "1" as xsd:integer, or the case of a language tag)
+ * causes the statement to be deleted and re-inserted. The result is still
+ * correct, but the update is larger than it needs to be.
+ *
+ * Blank nodes can't be matched between the two sides because their labels
+ * aren't stable, so statements involving them are replaced wholesale: any
+ * which exist remotely are removed with a single DELETE ... WHERE, and the
+ * local ones are inserted together in a single request so that their
+ * labels remain consistent.
+ */
+
+#define XSD_STRING                      "http://www.w3.org/2001/XMLSchema#string"
+
+/* A growable buffer which serialised statements are written to */
+struct sparql_sync_buf_struct
+{
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t triples;
+};
+
+struct sparql_sync_context_struct
+{
+	SPARQL *connection;
+	const char *graph;
+	librdf_world *world;
+	SPARQLHASH *hash;
+	librdf_statement *statement;
+	int blank;
+	int error;
+	/* The serialisation of the current statement */
+	struct sparql_sync_buf_struct key;
+	raptor_iostream *keystr;
+	/* Pending operations */
+	struct sparql_sync_buf_struct deletes;
+	struct sparql_sync_buf_struct inserts;
+	struct sparql_sync_buf_struct bnodes;
+	size_t remote_bnodes;
+};
+
+static int sparql_sync_local_(struct sparql_sync_context_struct *context, librdf_model *model);
+static int sparql_sync_remote_(struct sparql_sync_context_struct *context);
+static int sparql_sync_unmatched_(SPARQLHASHENTRY *entry, void *data);
+static int sparql_sync_fits_(struct sparql_sync_context_struct *context);
+static int sparql_sync_send_all_(struct sparql_sync_context_struct *context);
+static int sparql_sync_send_(struct sparql_sync_context_struct *context, const char *op, struct sparql_sync_buf_struct *buf, int split);
+static int sparql_sync_add_op_(struct sparql_sync_context_struct *context, SPARQLBODY *body, const char *op, const char *text, size_t len);
+static int sparql_sync_serialise_(struct sparql_sync_context_struct *context, librdf_statement *statement);
+static int sparql_sync_append_(struct sparql_sync_context_struct *context, struct sparql_sync_buf_struct *buf, const char *text, size_t len);
+static int sparql_sync_beginresult_(SPARQLQUERY *query, void *data);
+static int sparql_sync_endresult_(SPARQLQUERY *query, void *data);
+static int sparql_sync_literal_(SPARQLQUERY *query, const char *name, const char *language, const char *datatype, const char *text, void *data);
+static int sparql_sync_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *data);
+static int sparql_sync_bnode_(SPARQLQUERY *query, const char *name, const char *ref, void *data);
+static int sparql_sync_boolean_(SPARQLQUERY *query, int value, void *data);
+static int sparql_sync_set_node_(struct sparql_sync_context_struct *context, const char *name, librdf_node *node);
+static int sparql_sync_key_write_byte_(void *context, const int byte);
+static int sparql_sync_key_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb);
+
+static const raptor_iostream_handler sparql_sync_key_handler_ = {
+	2,
+	NULL,
+	NULL,
+	sparql_sync_key_write_byte_,
+	sparql_sync_key_write_bytes_,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Marks hash entries which exist on both sides */
+static char sparql_sync_matched_;
+
+/* Update the remote graph <graph> so that its contents match those of
+ * <model>, sending only the statements which have changed
+ */
+int
+sparql_sync_graph(SPARQL *connection, const char *graph, librdf_model *model)
+{
+	struct sparql_sync_context_struct context;
+	char digest[SPARQL_DIGEST_SIZE];
+	int r;
+
+	if(!graph)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_URI, "a graph URI must be specified");
+		return -1;
+	}
+	memset(&context, 0, sizeof(context));
+	context.connection = connection;
+	context.graph = graph;
+	context.world = sparql_world(connection);
+	if(!context.world)
+	{
+		return -1;
+	}
+	/* Anything buffered for this graph must land before it's read back */
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	if(connection->manifest)
+	{
+		if(sparql_digest_model(connection, model, NULL, digest))
+		{
+			return -1;
+		}
+		if(sparql_manifest_check_(connection, graph, digest))
+		{
+			return 0;
+		}
+		sparql_manifest_forget_(connection, graph);
+	}
+	r = -1;
+	context.hash = sparql_hash_create_(connection, NULL);
+	context.keystr = raptor_new_iostream_from_handler(librdf_world_get_raptor(context.world), &(context.key), &sparql_sync_key_handler_);
+	if(!context.hash || !context.keystr)
+	{
+		sparql_set_error_(connection, SPARQLSTATE_CREATE_STREAM, "failed to create state for graph synchronisation");
+	}
+	else if(!sparql_sync_local_(&context, model) &&
+			!sparql_sync_remote_(&context) &&
+			!sparql_hash_iterate_(context.hash, sparql_sync_unmatched_, &context))
+	{
+		sparql_logf_(connection, LOG_DEBUG, "SPARQL: <%s>: %u triples to delete, %u to insert, %u remote and %u local involving blank nodes\n", graph, (unsigned) context.deletes.triples, (unsigned) context.inserts.triples, (unsigned) context.remote_bnodes, (unsigned) context.bnodes.triples);
+		if(sparql_sync_fits_(&context))
+		{
+			r = sparql_sync_send_all_(&context);
+		}
+		else
+		{
+			r = 0;
+			if(context.remote_bnodes)
+			{
+				r = sparql_sync_send_(&context, NULL, NULL, 0);
+			}
+			if(!r)
+			{
+				r = sparql_sync_send_(&context, "DELETE DATA", &(context.deletes), 1);
+			}
+			if(!r)
+			{
+				r = sparql_sync_send_(&context, "INSERT DATA", &(context.inserts), 1);
+			}
+			if(!r)
+			{
+				r = sparql_sync_send_(&context, "INSERT DATA", &(context.bnodes), 0);
+			}
+		}
+	}
+	if(context.keystr)
+	{
+		raptor_free_iostream(context.keystr);
+	}
+	if(context.hash)
+	{
+		sparql_hash_destroy_(context.hash);
+	}
+	if(context.statement)
+	{
+		librdf_free_statement(context.statement);
+	}
+	free(context.key.buf);
+	free(context.deletes.buf);
+	free(context.inserts.buf);
+	free(context.bnodes.buf);
+	if(!r && connection->manifest)
+	{
+		sparql_manifest_record_(connection, graph, digest);
+	}
+	return r;
+}
+
+/* Add the serialised form of each ground statement in <model> to the hash
+ * table, setting aside those which involve blank nodes
+ */
+static int
+sparql_sync_local_(struct sparql_sync_context_struct *context, librdf_model *model)
+{
+	librdf_stream *stream;
+	librdf_statement *statement;
+	int r;
+
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		sparql_set_error_(context->connection, SPARQLSTATE_CREATE_STREAM, "failed to obtain stream from model");
+		return -1;
+	}
+	r = 0;
+	for(; !r && !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		statement = librdf_stream_get_object(stream);
+		if((r = sparql_sync_serialise_(context, statement)))
+		{
+			break;
+		}
+		if(librdf_node_is_blank(librdf_statement_get_subject(statement)) ||
+		   librdf_node_is_blank(librdf_statement_get_object(statement)))
+		{
+			r = sparql_sync_append_(context, &(context->bnodes), context->key.buf, context->key.len);
+		}
+		else if(!sparql_hash_lookup_(context->hash, context->key.buf, context->key.len, 1))
+		{
+			r = -1;
+		}
+	}
+	librdf_free_stream(stream);
+	return r;
+}
+
+/* Query the remote graph, marking each of its statements which exists
+ * locally and queuing the deletion of those which don't
+ */
+static int
+sparql_sync_remote_(struct sparql_sync_context_struct *context)
+{
+	SPARQLQUERY *query;
+	char *qbuf;
+	size_t len;
+	int r;
+
+	len = strlen(context->graph) + 64;
+	qbuf = (char *) malloc(len);
+	if(!qbuf)
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to allocate memory for query\n");
+		return -1;
+	}
+	snprintf(qbuf, len, "SELECT ?s ?p ?o WHERE { GRAPH <%s> { ?s ?p ?o } }", context->graph);
+	query = sparql_query_create_(context->connection);
+	if(!query)
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "failed to create SPARQL query structure\n");
+		free(qbuf);
+		return -1;
+	}
+	sparql_query_set_data_(query, (void *) context);
+	sparql_query_set_beginresult_(query, sparql_sync_beginresult_);
+	sparql_query_set_endresult_(query, sparql_sync_endresult_);
+	sparql_query_set_literal_(query, sparql_sync_literal_);
+	sparql_query_set_uri_(query, sparql_sync_uri_);
+	sparql_query_set_bnode_(query, sparql_sync_bnode_);
+	sparql_query_set_boolean_(query, sparql_sync_boolean_);
+	r = sparql_query_perform_(query, qbuf, strlen(qbuf));
+	sparql_query_destroy_(query);
+	free(qbuf);
+	if(context->error)
+	{
+		r = -1;
+	}
+	return r;
+}
+
+/* Queue the insertion of each local statement which wasn't matched */
+static int
+sparql_sync_unmatched_(SPARQLHASHENTRY *entry, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+
+	if(entry->data == &sparql_sync_matched_)
+	{
+		return 0;
+	}
+	return sparql_sync_append_(context, &(context->inserts), entry->key, entry->keylen);
+}
+
+/* Determine whether all of the pending changes fit within the
+ * connection's chunk limits, and so can be sent in a single request
+ */
+static int
+sparql_sync_fits_(struct sparql_sync_context_struct *context)
+{
+	SPARQL *connection;
+	size_t triples, bytes;
+
+	connection = context->connection;
+	triples = context->deletes.triples + context->inserts.triples + context->bnodes.triples;
+	bytes = context->deletes.len + context->inserts.len + context->bnodes.len;
+	return (!connection->chunk_triples || triples <= connection->chunk_triples) &&
+		(!connection->chunk_bytes || bytes <= connection->chunk_bytes);
+}
+
+/* Send all of the pending changes as a single ';'-separated update, in
+ * the same order as they'd otherwise be sent individually
+ */
+static int
+sparql_sync_send_all_(struct sparql_sync_context_struct *context)
+{
+	SPARQLBODY *body;
+	int r, n;
+
+	if(!context->remote_bnodes && !context->deletes.len && !context->inserts.len && !context->bnodes.len)
+	{
+		return 0;
+	}
+	body = sparql_update_body_(context->connection);
+	if(!body)
+	{
+		return -1;
+	}
+	r = 0;
+	n = 0;
+	if(context->remote_bnodes)
+	{
+		r = sparql_sync_add_op_(context, body, NULL, NULL, 0);
+		n++;
+	}
+	if(!r && context->deletes.len)
+	{
+		r = (n && sparql_body_add_str_(body, " ;\n")) ||
+			sparql_sync_add_op_(context, body, "DELETE DATA", context->deletes.buf, context->deletes.len);
+		n++;
+	}
+	if(!r && context->inserts.len)
+	{
+		r = (n && sparql_body_add_str_(body, " ;\n")) ||
+			sparql_sync_add_op_(context, body, "INSERT DATA", context->inserts.buf, context->inserts.len);
+		n++;
+	}
+	if(!r && context->bnodes.len)
+	{
+		r = (n && sparql_body_add_str_(body, " ;\n")) ||
+			sparql_sync_add_op_(context, body, "INSERT DATA", context->bnodes.buf, context->bnodes.len);
+		n++;
+	}
+	if(!r)
+	{
+		sparql_logf_(context->connection, LOG_DEBUG, "SPARQL: sending %d operations for <%s> in a single update\n", n, context->graph);
+		r = sparql_update_perform_(context->connection, body);
+	}
+	sparql_body_destroy_(body);
+	return (r ? -1 : 0);
+}
+
+/* Send the statements in <buf> as one or more <op> requests; unless
+ * <split> is nonzero, they're all sent in a single request regardless of
+ * the connection's chunk limits. If <op> is NULL, the statements in the
+ * remote graph which involve blank nodes are deleted instead.
+ */
+static int
+sparql_sync_send_(struct sparql_sync_context_struct *context, const char *op, struct sparql_sync_buf_struct *buf, int split)
+{
+	SPARQL *connection;
+	SPARQLBODY *body;
+	size_t start, end, triples;
+	int r;
+
+	connection = context->connection;
+	if(!op)
+	{
+		body = sparql_update_body_(connection);
+		if(!body)
+		{
+			return -1;
+		}
+		r = sparql_sync_add_op_(context, body, NULL, NULL, 0);
+		if(!r)
+		{
+			r = sparql_update_perform_(connection, body);
+		}
+		sparql_body_destroy_(body);
+		return (r ? -1 : 0);
+	}
+	for(start = 0; start < buf->len; start = end)
+	{
+		/* Find the end of this chunk, always on a statement boundary */
+		for(end = start, triples = 0; end < buf->len; )
+		{
+			end = (const char *) memchr(buf->buf + end, '\n', buf->len - end) - buf->buf + 1;
+			triples++;
+			if(split &&
+			   ((connection->chunk_triples && triples >= connection->chunk_triples) ||
+				(connection->chunk_bytes && end - start >= connection->chunk_bytes)))
+			{
+				break;
+			}
+		}
+		body = sparql_update_body_(connection);
+		if(!body)
+		{
+			return -1;
+		}
+		r = sparql_sync_add_op_(context, body, op, buf->buf + start, end - start);
+		if(!r)
+		{
+			sparql_logf_(connection, LOG_DEBUG, "SPARQL: %s: %u triples (%u bytes) for <%s>\n", op, (unsigned) triples, (unsigned) (end - start), context->graph);
+			r = sparql_update_perform_(connection, body);
+		}
+		sparql_body_destroy_(body);
+		if(r)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Add an <op> operation on the statements in <text> to <body>, or if <op>
+ * is NULL, the deletion of the remote statements involving blank nodes
+ */
+static int
+sparql_sync_add_op_(struct sparql_sync_context_struct *context, SPARQLBODY *body, const char *op, const char *text, size_t len)
+{
+	if(!op)
+	{
+		return sparql_body_add_str_(body, "DELETE { GRAPH <") ||
+			sparql_body_add_str_(body, context->graph) ||
+			sparql_body_add_str_(body, "> { ?s ?p ?o } } WHERE { GRAPH <") ||
+			sparql_body_add_str_(body, context->graph) ||
+			sparql_body_add_str_(body, "> { ?s ?p ?o . FILTER(isBlank(?s) || isBlank(?o)) } }");
+	}
+	return sparql_body_add_str_(body, op) ||
+		sparql_body_add_str_(body, " { GRAPH <") ||
+		sparql_body_add_str_(body, context->graph) ||
+		sparql_body_add_str_(body, "> { ") ||
+		sparql_body_add_(body, text, len) ||
+		sparql_body_add_str_(body, " } }");
+}
+
+/* Serialise <statement> into the key buffer */
+static int
+sparql_sync_serialise_(struct sparql_sync_context_struct *context, librdf_statement *statement)
+{
+	context->key.len = 0;
+	return sparql_statement_write_(context->connection, statement, context->keystr);
+}
+
+static int
+sparql_sync_append_(struct sparql_sync_context_struct *context, struct sparql_sync_buf_struct *buf, const char *text, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if(buf->len + len > buf->size)
+	{
+		for(size = (buf->size ? buf->size : 4096); size < buf->len + len; size *= 2)
+		{
+		}
+		p = (char *) realloc(buf->buf, size);
+		if(!p)
+		{
+			sparql_logf_(context->connection, LOG_CRIT, "SPARQL: failed to reallocate buffer to %u bytes\n", (unsigned) size);
+			return -1;
+		}
+		buf->buf = p;
+		buf->size = size;
+	}
+	memcpy(buf->buf + buf->len, text, len);
+	buf->len += len;
+	buf->triples++;
+	return 0;
+}
+
+static int
+sparql_sync_beginresult_(SPARQLQUERY *query, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+
+	(void) query;
+
+	context->blank = 0;
+	context->statement = librdf_new_statement(context->world);
+	if(!context->statement)
+	{
+		sparql_logf_(context->connection, LOG_CRIT, "failed to create new librdf statement\n");
+		context->error = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_sync_endresult_(SPARQLQUERY *query, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+	SPARQLHASHENTRY *entry;
+	int r;
+
+	(void) query;
+
+	r = 0;
+	if(!librdf_statement_is_complete(context->statement))
+	{
+		sparql_logf_(context->connection, LOG_ERR, "result row does not contain a complete statement\n");
+		r = -1;
+	}
+	else if(context->blank)
+	{
+		context->remote_bnodes++;
+	}
+	else if(!(r = sparql_sync_serialise_(context, context->statement)))
+	{
+		entry = sparql_hash_lookup_(context->hash, context->key.buf, context->key.len, 0);
+		if(entry)
+		{
+			entry->data = &sparql_sync_matched_;
+		}
+		else
+		{
+			r = sparql_sync_append_(context, &(context->deletes), context->key.buf, context->key.len);
+		}
+	}
+	librdf_free_statement(context->statement);
+	context->statement = NULL;
+	if(r)
+	{
+		context->error = 1;
+	}
+	return r;
+}
+
+/* Stores commonly return plain literals as xsd:string; they're normalised
+ * back to plain literals so that they match their local counterparts.
+ * Nothing else is canonicalised, so other lexical variants don't match.
+ */
+static int
+sparql_sync_literal_(SPARQLQUERY *query, const char *name, const char *language, const char *datatype, const char *text, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+	librdf_node *node;
+	librdf_uri *typeuri;
+
+	(void) query;
+
+	typeuri = NULL;
+	if(datatype && strcmp(datatype, XSD_STRING))
+	{
+		typeuri = librdf_new_uri(context->world, (const unsigned char *) datatype);
+	}
+	node = librdf_new_node_from_typed_literal(context->world, (const unsigned char *) text, language, typeuri);
+	if(typeuri)
+	{
+		librdf_free_uri(typeuri);
+	}
+	return sparql_sync_set_node_(context, name, node);
+}
+
+static int
+sparql_sync_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+
+	(void) query;
+
+	return sparql_sync_set_node_(context, name, librdf_new_node_from_uri_string(context->world, (const unsigned char *) uri));
+}
+
+static int
+sparql_sync_bnode_(SPARQLQUERY *query, const char *name, const char *ref, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+
+	(void) query;
+
+	context->blank = 1;
+	return sparql_sync_set_node_(context, name, librdf_new_node_from_blank_identifier(context->world, (const unsigned char *) ref));
+}
+
+static int
+sparql_sync_boolean_(SPARQLQUERY *query, int value, void *data)
+{
+	struct sparql_sync_context_struct *context = (struct sparql_sync_context_struct *) data;
+
+	(void) query;
+	(void) value;
+
+	sparql_logf_(context->connection, LOG_ERR, "unexpected boolean result from SPARQL query\n");
+	context->error = 1;
+	return -1;
+}
+
+static int
+sparql_sync_set_node_(struct sparql_sync_context_struct *context, const char *name, librdf_node *node)
+{
+	if(!node)
+	{
+		sparql_set_error_(context->connection, SPARQLSTATE_CREATE_NODE, "failed to create node from query result");
+		context->error = 1;
+		return -1;
+	}
+	if(!strcmp(name, "s"))
+	{
+		librdf_statement_set_subject(context->statement, node);
+	}
+	else if(!strcmp(name, "p"))
+	{
+		librdf_statement_set_predicate(context->statement, node);
+	}
+	else if(!strcmp(name, "o"))
+	{
+		librdf_statement_set_object(context->statement, node);
+	}
+	else
+	{
+		librdf_free_node(node);
+	}
+	return 0;
+}
+
+static int
+sparql_sync_key_write_byte_(void *context, const int byte)
+{
+	char c;
+
+	c = (char) byte;
+	return (sparql_sync_key_write_bytes_(context, &c, 1, 1) == 1 ? 0 : 1);
+}
+
+static int
+sparql_sync_key_write_bytes_(void *context, const void *ptr, size_t size, size_t nmemb)
+{
+	struct sparql_sync_buf_struct *key = (struct sparql_sync_buf_struct *) context;
+	size_t len;
+	char *p;
+
+	len = size * nmemb;
+	if(key->len + len > key->size)
+	{
+		p = (char *) realloc(key->buf, key->len + len + 256);
+		if(!p)
+		{
+			return -1;
+		}
+		key->buf = p;
+		key->size = key->len + len + 256;
+	}
+	memcpy(key->buf + key->len, ptr, len);
+	key->len += len;
+	return (int) nmemb;
+}
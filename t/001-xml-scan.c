@@ -0,0 +1,102 @@
+/* SPARQL client: tests for the built-in SPARQL XML results scanner
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "scantest.h"
+
+#define NS "http://www.w3.org/2005/sparql-results#"
+#define XSD "http://www.w3.org/2001/XMLSchema#"
+
+static const struct scantest_fixture fixtures[] = {
+	SCANTEST_FIXTURE("bindings",
+		"<?xml version=\"1.0\"?>\n"
+		"<sparql xmlns=\"" NS "\">\n"
+		"<head><variable name=\"x\"/><variable name='y'/><link href=\"a&amp;b\"/></head>\n"
+		"<results>\n"
+		"<result><binding name=\"x\"><uri>http://e/a</uri></binding>"
+		"<binding name=\"y\"><literal xml:lang=\"en\">chat</literal></binding></result>\n"
+		"<result><binding name=\"x\"><bnode>b0</bnode></binding>"
+		"<binding name=\"y\"><literal datatype=\"" XSD "integer\">42</literal></binding></result>\n"
+		"</results>\n"
+		"</sparql>\n",
+		"var(x) var(y) link(a&b) BR [uri(x,http://e/a)lit(y,en,-,\"chat\")] [bnode(x,b0)lit(y,-," XSD "integer,\"42\")] ER"),
+	SCANTEST_FIXTURE("empty values",
+		"<sparql xmlns=\"" NS "\"><head><variable name=\"x\"/></head><results>"
+		"<result><binding name=\"x\"><literal></literal></binding></result>"
+		"<result><binding name=\"x\"><literal/></binding></result>"
+		"<result></result>"
+		"<result/>"
+		"</results></sparql>",
+		"var(x) BR [lit(x,-,-,\"\")] [lit(x,-,-,\"\")] [] [] ER"),
+	SCANTEST_FIXTURE("escapes",
+		"<sparql xmlns=\"" NS "\"><head><variable name=\"x\"/></head><results>"
+		"<result><binding name=\"x\"><uri>http://e/&#x41;&#66;</uri></binding></result>"
+		"<result><binding name=\"x\"><literal>&lt;b&gt; &quot;c&quot; &apos;d&apos; &amp;\r\n\xc3\xa9&#xe9;&#128512;</literal></binding></result>"
+		"<result><binding name=\"x\"><literal><![CDATA[<raw> & stuff]]></literal></binding><!-- comment --></result>"
+		"</results></sparql>",
+		"var(x) BR [uri(x,http://e/AB)] [lit(x,-,-,\"<b> \"c\" 'd' &\n\xc3\xa9\xc3\xa9\xf0\x9f\x98\x80\")] [lit(x,-,-,\"<raw> & stuff\")] ER"),
+	SCANTEST_FIXTURE("prefixed elements",
+		"<res:sparql xmlns:res=\"" NS "\"><res:head><res:variable name=\"z\"/></res:head>"
+		"<res:results><res:result><res:binding name=\"z\"><res:literal>z</res:literal></res:binding></res:result>"
+		"</res:results></res:sparql>",
+		"(fallback)"),
+	SCANTEST_FIXTURE("boolean",
+		"\xef\xbb\xbf<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+		"<sparql xmlns=\"" NS "\"><head/><boolean>true</boolean></sparql>",
+		"bool(1)"),
+	SCANTEST_FIXTURE("document type declaration",
+		"<!DOCTYPE sparql [<!ENTITY e \"ent\">]><sparql xmlns=\"" NS "\"><head/></sparql>",
+		"(fallback)"),
+	SCANTEST_FIXTURE("quote within an attribute name",
+		"<sparql xmlns=\"" NS "\"><head><variable x\"y=\"></head></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("quote within an element name",
+		"<sparql xmlns=\"" NS "\"><head><var\"iable name=\"a\"/></head></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("entity reference beyond the end of the tag",
+		"<sparql xmlns=\"" NS "\"><head><variable x\"y=\"&amp;></head></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("unterminated attribute value",
+		"<sparql xmlns=\"" NS "\"><head><variable name=\"a/></head></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("attribute without a value",
+		"<sparql xmlns=\"" NS "\"><head><variable name/></head></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("mismatched end tag",
+		"<sparql xmlns=\"" NS "\"><head/><results><result><binding name=\"a\"><literal>x</uri></binding></result></results></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("unknown entity",
+		"<sparql xmlns=\"" NS "\"><head/><results><result><binding name=\"a\"><literal>&bogus;</literal></binding></result></results></sparql>",
+		NULL),
+	SCANTEST_FIXTURE("truncated document",
+		"<sparql xmlns=\"" NS "\"><head/><results><result><binding name=\"a\"><literal>x</literal></binding></result></results>",
+		NULL),
+	SCANTEST_FIXTURE("empty document",
+		"",
+		"(fallback)")
+};
+
+int
+main(int argc, char **argv)
+{
+	return (scantest_run(SCANTEST_XML, fixtures, sizeof(fixtures) / sizeof(fixtures[0])) ? 1 : 0);
+}
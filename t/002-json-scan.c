@@ -0,0 +1,82 @@
+/* SPARQL client: tests for the SPARQL JSON results parser
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "scantest.h"
+
+#define XSD "http://www.w3.org/2001/XMLSchema#"
+
+static const struct scantest_fixture fixtures[] = {
+	SCANTEST_FIXTURE("bindings",
+		"{\"head\":{\"vars\":[\"x\",\"y\"],\"link\":[\"http://e/l\"]},\"results\":{\"distinct\":false,\"bindings\":["
+		"{\"x\":{\"type\":\"uri\",\"value\":\"http://e/a\"},\"y\":{\"value\":\"chat\",\"xml:lang\":\"en\",\"type\":\"literal\"}},"
+		"{\"x\":{\"type\":\"bnode\",\"value\":\"b0\"},\"y\":{\"type\":\"typed-literal\",\"datatype\":\"" XSD "integer\",\"value\":\"42\"}}"
+		"]}}",
+		"var(x) var(y) link(http://e/l) BR [uri(x,http://e/a)lit(y,en,-,\"chat\")] [bnode(x,b0)lit(y,-," XSD "integer,\"42\")] ER"),
+	SCANTEST_FIXTURE("empty values",
+		"{\"head\":{\"vars\":[\"x\"]},\"results\":{\"bindings\":["
+		"{\"x\":{\"type\":\"literal\",\"value\":\"\"}},"
+		"{}"
+		"]}}",
+		"var(x) BR [lit(x,-,-,\"\")] [] ER"),
+	SCANTEST_FIXTURE("no results",
+		"{\"head\":{\"vars\":[]},\"results\":{\"bindings\":[]}}",
+		"BR ER"),
+	SCANTEST_FIXTURE("escapes",
+		"{\"head\":{\"vars\":[\"x\"]},\"results\":{\"bindings\":["
+		"{\"x\":{\"type\":\"literal\",\"value\":\"a <b> \\\"c\\\"\\n\\t\\\\\\/ \\u00e9\\ud83d\\ude00\"}}"
+		"]}}",
+		"var(x) BR [lit(x,-,-,\"a <b> \"c\"\n\t\\/ \xc3\xa9\xf0\x9f\x98\x80\")] ER"),
+	SCANTEST_FIXTURE("boolean and unknown members",
+		" { \"head\" : { } , \"boolean\" : true , \"extra\": [1, -2.5e3, null, {\"a\": [true, \"\\\"]\"]}] } \n",
+		"bool(1)"),
+	SCANTEST_FIXTURE("truncated document",
+		"{\"head\":{},\"results\":{\"bindings\":[{\"a\":{\"type\":\"literal\",\"value\":\"x\"}}",
+		NULL),
+	SCANTEST_FIXTURE("invalid boolean",
+		"{\"head\":{},\"boolean\":maybe}",
+		NULL),
+	SCANTEST_FIXTURE("unknown term type",
+		"{\"head\":{},\"results\":{\"bindings\":[{\"a\":{\"type\":\"weird\",\"value\":\"x\"}}]}}",
+		NULL),
+	SCANTEST_FIXTURE("invalid escape",
+		"{\"head\":{},\"results\":{\"bindings\":[{\"a\":{\"type\":\"literal\",\"value\":\"\\q\"}}]}}",
+		NULL),
+	SCANTEST_FIXTURE("unpaired surrogate",
+		"{\"head\":{},\"results\":{\"bindings\":[{\"a\":{\"type\":\"literal\",\"value\":\"\\ud83d\"}}]}}",
+		NULL),
+	SCANTEST_FIXTURE("not an object",
+		"[1]",
+		NULL),
+	SCANTEST_FIXTURE("trailing content",
+		"{\"head\":{}} x",
+		NULL),
+	SCANTEST_FIXTURE("empty document",
+		"",
+		NULL)
+};
+
+int
+main(int argc, char **argv)
+{
+	return (scantest_run(SCANTEST_JSON, fixtures, sizeof(fixtures) / sizeof(fixtures[0])) ? 1 : 0);
+}
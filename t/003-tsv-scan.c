@@ -0,0 +1,79 @@
+/* SPARQL client: tests for the SPARQL TSV results parser
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "scantest.h"
+
+#define XSD "http://www.w3.org/2001/XMLSchema#"
+
+static const struct scantest_fixture fixtures[] = {
+	SCANTEST_FIXTURE("bindings",
+		"?x\t?y\t?z\r\n"
+		"<http://e/a>\t\"chat\"@en\t_:b0\n"
+		"<http://e/b>\t\"x\"^^<http://e/dt>\t\"y\"\n",
+		"var(x) var(y) var(z) BR [uri(x,http://e/a)lit(y,en,-,\"chat\")bnode(z,b0)] [uri(x,http://e/b)lit(y,-,http://e/dt,\"x\")lit(z,-,-,\"y\")] ER"),
+	SCANTEST_FIXTURE("empty values",
+		"?x\t?y\n"
+		"\t\"\"\n"
+		"\t\n"
+		"\n",
+		"var(x) var(y) BR [lit(y,-,-,\"\")] [] [] ER"),
+	SCANTEST_FIXTURE("no trailing newline",
+		"?a\n<x>",
+		"var(a) BR [uri(a,x)] ER"),
+	SCANTEST_FIXTURE("escapes",
+		"?x\t?y\n"
+		"<http://e/A\\u0042>\t\"a\\tb \\\"c\\\"\\nd \\u00e9\\U0001F600\"\n"
+		"<http://e/c>\t\"\"\"long\"\"\"\n",
+		"var(x) var(y) BR [uri(x,http://e/AB)lit(y,-,-,\"a\tb \"c\"\nd \xc3\xa9\xf0\x9f\x98\x80\")] [uri(x,http://e/c)lit(y,-,-,\"long\")] ER"),
+	SCANTEST_FIXTURE("numbers and booleans",
+		"?a\n"
+		"42\n"
+		"-1.5e3\n"
+		".5\n"
+		"true\n",
+		"var(a) BR [lit(a,-," XSD "integer,\"42\")] [lit(a,-," XSD "double,\"-1.5e3\")] [lit(a,-," XSD "decimal,\".5\")] [lit(a,-," XSD "boolean,\"true\")] ER"),
+	SCANTEST_FIXTURE("too many values",
+		"?a\n<x>\t<y>\n",
+		NULL),
+	SCANTEST_FIXTURE("bare word",
+		"?a\nbogus\n",
+		NULL),
+	SCANTEST_FIXTURE("unterminated string",
+		"?a\n\"unterminated\n",
+		NULL),
+	SCANTEST_FIXTURE("unterminated IRI",
+		"?a\n<http://e/\n",
+		NULL),
+	SCANTEST_FIXTURE("invalid escape",
+		"?a\n\"\\q\"\n",
+		NULL),
+	SCANTEST_FIXTURE("empty document",
+		"",
+		NULL)
+};
+
+int
+main(int argc, char **argv)
+{
+	return (scantest_run(SCANTEST_TSV, fixtures, sizeof(fixtures) / sizeof(fixtures[0])) ? 1 : 0);
+}
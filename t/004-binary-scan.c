@@ -0,0 +1,114 @@
+/* SPARQL client: tests for the RDF4J binary results table decoder
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "scantest.h"
+
+#define RDF "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+#define XSD "http://www.w3.org/2001/XMLSchema#"
+
+/* Each line of a table holds one record, with its marker byte first */
+
+static const struct scantest_fixture fixtures[] = {
+	SCANTEST_FIXTURE("version 4 table",
+		"BRTR\000\000\000\004\000\000\000\003\000\000\000\001s\000\000\000\001p\000\000\000\001o" /* header */
+		"\002\000\000\000\000\000\000\000+http://www.w3.org/1999/02/22-rdf-syntax-ns#" /* namespace 0 */
+		"\004\000\000\000\012http://e/a\003\000\000\000\000\000\000\000\004type\004\000\000\000\012http://e/C" /* URI, QName, URI */
+		"\001\001\005\000\000\000\002b0" /* repeat, repeat, blank node */
+		"\000\001\007\000\000\000\004chat\000\000\000\002fr" /* null, repeat, language-tagged literal */
+		"\002\000\000\000\007\000\000\000!http://www.w3.org/2001/XMLSchema#" /* namespace 7 */
+		"\001\000\010\000\000\000\00242\003\000\000\000\007\000\000\000\007integer" /* repeat, null, datatyped QName literal */
+		"\011" /* empty row */
+		"\006\000\000\000\000\004\000\000\000\012http://e/p\010\000\000\000\001x\004\000\000\000\013http://e/dt" /* empty literal, URI, datatyped literal */
+		"\001\001\001" /* repeat, repeat, repeat */
+		"\177" /* end of table */,
+		"var(s) var(p) var(o) BR [uri(s,http://e/a)uri(p," RDF "type)uri(o,http://e/C)] [uri(s,http://e/a)uri(p," RDF "type)bnode(o,b0)] [uri(p," RDF "type)lit(o,fr,-,\"chat\")] [lit(o,-," XSD "integer,\"42\")] [] [lit(s,-,-,\"\")uri(p,http://e/p)lit(o,-,http://e/dt,\"x\")] [lit(s,-,-,\"\")uri(p,http://e/p)lit(o,-,http://e/dt,\"x\")] ER"),
+	SCANTEST_FIXTURE("version 1 table",
+		"BRTR\000\000\000\001\000\000\000\003\000\001s\000\001p\000\001o" /* header */
+		"\002\000\000\000\000\000+http://www.w3.org/1999/02/22-rdf-syntax-ns#" /* namespace 0 */
+		"\004\000\012http://e/a\003\000\000\000\000\000\004type\004\000\012http://e/C" /* URI, QName, URI */
+		"\001\001\005\000\002b0" /* repeat, repeat, blank node */
+		"\000\001\007\000\004chat\000\002fr" /* null, repeat, language-tagged literal */
+		"\002\000\000\000\007\000!http://www.w3.org/2001/XMLSchema#" /* namespace 7 */
+		"\001\000\010\000\00242\003\000\000\000\007\000\007integer" /* repeat, null, datatyped QName literal */
+		"\011" /* empty row */
+		"\006\000\000\004\000\012http://e/p\010\000\001x\004\000\013http://e/dt" /* empty literal, URI, datatyped literal */
+		"\001\001\001" /* repeat, repeat, repeat */
+		"\177" /* end of table */,
+		"var(s) var(p) var(o) BR [uri(s,http://e/a)uri(p," RDF "type)uri(o,http://e/C)] [uri(s,http://e/a)uri(p," RDF "type)bnode(o,b0)] [uri(p," RDF "type)lit(o,fr,-,\"chat\")] [lit(o,-," XSD "integer,\"42\")] [] [lit(s,-,-,\"\")uri(p,http://e/p)lit(o,-,http://e/dt,\"x\")] [lit(s,-,-,\"\")uri(p,http://e/p)lit(o,-,http://e/dt,\"x\")] ER"),
+	SCANTEST_FIXTURE("no columns",
+		"BRTR\000\000\000\004\000\000\000\000" /* header */
+		"\177" /* end of table */,
+		"BR ER"),
+	SCANTEST_FIXTURE("UTF-8 values",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001x" /* header */
+		"\006\000\000\000\006\303\251\360\237\230\200" /* plain literal */
+		"\177" /* end of table */,
+		"var(x) BR [lit(x,-,-,\"\303\251\360\237\230\200\")] ER"),
+	SCANTEST_FIXTURE("truncated record",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\004" /* incomplete URI */
+		"\000\000\000\005x",
+		NULL),
+	SCANTEST_FIXTURE("missing end of table",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\004\000\000\000\001x" /* URI */,
+		NULL),
+	SCANTEST_FIXTURE("data after the end of the table",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\177" /* end of table */
+		"\000" /* null */,
+		NULL),
+	SCANTEST_FIXTURE("undeclared namespace",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\003\000\000\000\005\000\000\000\001x" /* QName */
+		"\177" /* end of table */,
+		NULL),
+	SCANTEST_FIXTURE("error record",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\176\002\000\000\000\004boom" /* error */,
+		NULL),
+	SCANTEST_FIXTURE("unknown record type",
+		"BRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\067" /* unknown */
+		"\177" /* end of table */,
+		NULL),
+	SCANTEST_FIXTURE("unsupported version",
+		"BRTR\000\000\000\011\000\000\000\001\000\000\000\001a" /* header */
+		"\177" /* end of table */,
+		NULL),
+	SCANTEST_FIXTURE("incomplete solution",
+		"BRTR\000\000\000\004\000\000\000\002\000\000\000\001a\000\000\000\001b" /* header */
+		"\000" /* null */
+		"\177" /* end of table */,
+		NULL),
+	SCANTEST_FIXTURE("bad magic number",
+		"XRTR\000\000\000\004\000\000\000\001\000\000\000\001a" /* header */
+		"\177" /* end of table */,
+		NULL)
+};
+
+int
+main(int argc, char **argv)
+{
+	return (scantest_run(SCANTEST_BINARY, fixtures, sizeof(fixtures) / sizeof(fixtures[0])) ? 1 : 0);
+}
@@ -0,0 +1,367 @@
+/* SPARQL client: test harness for the query results scanners
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "p_libsparqlclient.h"
+#include "scantest.h"
+
+struct scantest_trace
+{
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static char *scantest_trace_(SCANTESTFORMAT format, const char *input, size_t len, size_t split, size_t step);
+static int scantest_feed_(SCANTESTFORMAT format, void *scan, const char *buf, size_t len, int final);
+static void scantest_emit_(struct scantest_trace *trace, const char *format, ...);
+static int scantest_variable_(SPARQLQUERY *query, const char *name, void *data);
+static int scantest_link_(SPARQLQUERY *query, const char *href, void *data);
+static int scantest_beginresults_(SPARQLQUERY *query, void *data);
+static int scantest_endresults_(SPARQLQUERY *query, void *data);
+static int scantest_beginresult_(SPARQLQUERY *query, void *data);
+static int scantest_endresult_(SPARQLQUERY *query, void *data);
+static int scantest_literal_(SPARQLQUERY *query, const char *name, const char *language, const char *datatype, const char *text, void *data);
+static int scantest_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *data);
+static int scantest_bnode_(SPARQLQUERY *query, const char *name, const char *ref, void *data);
+static int scantest_boolean_(SPARQLQUERY *query, int value, void *data);
+
+/* Run each of <count> fixtures through the scanner for <format>, returning
+ * the number of fixtures which failed
+ */
+int
+scantest_run(SCANTESTFORMAT format, const struct scantest_fixture *fixtures, size_t count)
+{
+	size_t n, split, step, failed;
+	char *trace;
+	int ok;
+
+	failed = 0;
+	printf("1..%u\n", (unsigned) count);
+	for(n = 0; n < count; n++)
+	{
+		ok = 1;
+		for(split = 0; ok && split < fixtures[n].len + 2; split++)
+		{
+			/* split == len + 1 feeds the input one byte at a time */
+			step = (split > fixtures[n].len ? 1 : 0);
+			trace = scantest_trace_(format, fixtures[n].input, fixtures[n].len, (step ? 0 : split), step);
+			if(!trace)
+			{
+				printf("Bail out! failed to create scanner\n");
+				exit(99);
+			}
+			if(fixtures[n].expect)
+			{
+				ok = !strcmp(trace, fixtures[n].expect);
+			}
+			else
+			{
+				ok = (strstr(trace, "FAIL") != NULL);
+			}
+			if(!ok)
+			{
+				if(step)
+				{
+					printf("# input fed one byte at a time\n");
+				}
+				else
+				{
+					printf("# input split at offset %u\n", (unsigned) split);
+				}
+				printf("# expected: %s\n", fixtures[n].expect ? fixtures[n].expect : "(failure)");
+				printf("#      got: %s\n", trace);
+			}
+			free(trace);
+		}
+		printf("%s %u - %s\n", (ok ? "ok" : "not ok"), (unsigned) (n + 1), fixtures[n].name);
+		if(!ok)
+		{
+			failed++;
+		}
+	}
+	return (int) failed;
+}
+
+/* Feed <len> bytes of <input> to a new scanner: first <split> bytes, then
+ * the remainder in chunks of <step> bytes (or all at once if <step> is
+ * zero), and return the resulting trace
+ */
+static char *
+scantest_trace_(SCANTESTFORMAT format, const char *input, size_t len, size_t split, size_t step)
+{
+	struct scantest_trace trace;
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	void *scan;
+	size_t pos, l;
+	int r;
+
+	memset(&trace, 0, sizeof(trace));
+	connection = sparql_create(NULL);
+	if(!connection)
+	{
+		return NULL;
+	}
+	query = sparql_query_create_(connection);
+	if(!query)
+	{
+		sparql_destroy(connection);
+		return NULL;
+	}
+	sparql_query_set_data_(query, (void *) &trace);
+	sparql_query_set_variable_(query, scantest_variable_);
+	sparql_query_set_link_(query, scantest_link_);
+	sparql_query_set_beginresults_(query, scantest_beginresults_);
+	sparql_query_set_endresults_(query, scantest_endresults_);
+	sparql_query_set_beginresult_(query, scantest_beginresult_);
+	sparql_query_set_endresult_(query, scantest_endresult_);
+	sparql_query_set_literal_(query, scantest_literal_);
+	sparql_query_set_uri_(query, scantest_uri_);
+	sparql_query_set_bnode_(query, scantest_bnode_);
+	sparql_query_set_boolean_(query, scantest_boolean_);
+	switch(format)
+	{
+	case SCANTEST_XML:
+		scan = (void *) sparql_xmlscan_create_(connection, query);
+		break;
+	case SCANTEST_JSON:
+		scan = (void *) sparql_jsonscan_create_(connection, query);
+		break;
+	case SCANTEST_TSV:
+		scan = (void *) sparql_tsvscan_create_(connection, query);
+		break;
+	case SCANTEST_BINARY:
+		scan = (void *) sparql_binscan_create_(connection, query);
+		break;
+	default:
+		scan = NULL;
+	}
+	if(!scan)
+	{
+		sparql_query_destroy_(query);
+		sparql_destroy(connection);
+		return NULL;
+	}
+	r = 0;
+	for(pos = 0; !r && pos < len; pos += l)
+	{
+		l = (pos ? step : split);
+		if(!l || l > len - pos)
+		{
+			l = len - pos;
+		}
+		r = scantest_feed_(format, scan, &(input[pos]), l, 0);
+	}
+	if(!r)
+	{
+		r = scantest_feed_(format, scan, "", 0, 1);
+	}
+	if(r < 0)
+	{
+		scantest_emit_(&trace, " FAIL");
+	}
+	else if(r > 0)
+	{
+		scantest_emit_(&trace, "(fallback)");
+	}
+	switch(format)
+	{
+	case SCANTEST_XML:
+		sparql_xmlscan_destroy_((SPARQLXMLSCAN *) scan);
+		break;
+	case SCANTEST_JSON:
+		sparql_jsonscan_destroy_((SPARQLJSONSCAN *) scan);
+		break;
+	case SCANTEST_TSV:
+		sparql_tsvscan_destroy_((SPARQLTSVSCAN *) scan);
+		break;
+	case SCANTEST_BINARY:
+		sparql_binscan_destroy_((SPARQLBINSCAN *) scan);
+		break;
+	}
+	sparql_query_destroy_(query);
+	sparql_destroy(connection);
+	if(!trace.buf)
+	{
+		return strdup("");
+	}
+	return trace.buf;
+}
+
+static int
+scantest_feed_(SCANTESTFORMAT format, void *scan, const char *buf, size_t len, int final)
+{
+	char *copy;
+	int r;
+
+	/* Use a copy of exactly <len> bytes, so that any read beyond the end
+	 * of the chunk is visible to memory checkers
+	 */
+	copy = (char *) malloc(len ? len : 1);
+	if(!copy)
+	{
+		return -1;
+	}
+	memcpy(copy, buf, len);
+	switch(format)
+	{
+	case SCANTEST_XML:
+		r = sparql_xmlscan_parse_((SPARQLXMLSCAN *) scan, copy, len, final);
+		break;
+	case SCANTEST_JSON:
+		r = sparql_jsonscan_parse_((SPARQLJSONSCAN *) scan, copy, len, final);
+		break;
+	case SCANTEST_TSV:
+		r = sparql_tsvscan_parse_((SPARQLTSVSCAN *) scan, copy, len, final);
+		break;
+	case SCANTEST_BINARY:
+		r = sparql_binscan_parse_((SPARQLBINSCAN *) scan, copy, len, final);
+		break;
+	default:
+		r = -1;
+	}
+	free(copy);
+	return r;
+}
+
+static void
+scantest_emit_(struct scantest_trace *trace, const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	int l;
+
+	va_start(ap, format);
+	l = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	if(l < 0)
+	{
+		return;
+	}
+	if(trace->len + l + 1 > trace->size)
+	{
+		p = (char *) realloc(trace->buf, trace->len + l + 256);
+		if(!p)
+		{
+			return;
+		}
+		trace->buf = p;
+		trace->size = trace->len + l + 256;
+	}
+	va_start(ap, format);
+	vsnprintf(&(trace->buf[trace->len]), trace->size - trace->len, format, ap);
+	va_end(ap);
+	trace->len += l;
+}
+
+static int
+scantest_variable_(SPARQLQUERY *query, const char *name, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "var(%s) ", name);
+	return 0;
+}
+
+static int
+scantest_link_(SPARQLQUERY *query, const char *href, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "link(%s) ", href);
+	return 0;
+}
+
+static int
+scantest_beginresults_(SPARQLQUERY *query, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "BR ");
+	return 0;
+}
+
+static int
+scantest_endresults_(SPARQLQUERY *query, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "ER");
+	return 0;
+}
+
+static int
+scantest_beginresult_(SPARQLQUERY *query, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "[");
+	return 0;
+}
+
+static int
+scantest_endresult_(SPARQLQUERY *query, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "] ");
+	return 0;
+}
+
+static int
+scantest_literal_(SPARQLQUERY *query, const char *name, const char *language, const char *datatype, const char *text, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "lit(%s,%s,%s,\"%s\")", name, (language ? language : "-"), (datatype ? datatype : "-"), (text ? text : ""));
+	return 0;
+}
+
+static int
+scantest_uri_(SPARQLQUERY *query, const char *name, const char *uri, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "uri(%s,%s)", name, (uri ? uri : ""));
+	return 0;
+}
+
+static int
+scantest_bnode_(SPARQLQUERY *query, const char *name, const char *ref, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "bnode(%s,%s)", name, (ref ? ref : ""));
+	return 0;
+}
+
+static int
+scantest_boolean_(SPARQLQUERY *query, int value, void *data)
+{
+	(void) query;
+
+	scantest_emit_((struct scantest_trace *) data, "bool(%d)", value);
+	return 0;
+}
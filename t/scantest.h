@@ -0,0 +1,62 @@
+/* SPARQL client: test harness for the query results scanners
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef SCANTEST_H_
+# define SCANTEST_H_                   1
+
+# include <stddef.h>
+
+/* Each fixture is fed to a scanner in one piece, split in two at every
+ * possible offset, and one byte at a time. The callbacks which the query
+ * receives are recorded as a trace, for example:
+ *
+ *   var(x) BR [uri(x,http://example/)lit(y,en,-,"text")] ER
+ *
+ * which must match <expect> in every case. If <expect> is NULL, the input
+ * is malformed and must be rejected however it's split.
+ *
+ * When the XML scanner declines a document (leaving it to libxml2), the
+ * trace ends with "(fallback)".
+ */
+
+typedef enum
+{
+	SCANTEST_XML,
+	SCANTEST_JSON,
+	SCANTEST_TSV,
+	SCANTEST_BINARY
+} SCANTESTFORMAT;
+
+struct scantest_fixture
+{
+	const char *name;
+	const char *input;
+	size_t len;
+	const char *expect;
+};
+
+/* Define a fixture whose input is a string literal, which may contain
+ * NUL bytes
+ */
+# define SCANTEST_FIXTURE(name, input, expect) \
+	{ name, input, sizeof(input) - 1, expect }
+
+int scantest_run(SCANTESTFORMAT format, const struct scantest_fixture *fixtures, size_t count);
+
+#endif /*!SCANTEST_H_*/
@@ -0,0 +1,576 @@
+/* SPARQL client: parser for the SPARQL 1.1 Query Results TSV Format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define SPARQL_TSVSCAN_SSE2            1
+#endif
+
+/* The first line of a TSV results document lists the variables, and each
+ * subsequent line is a solution, with one tab-separated field per
+ * variable. Each field is either empty (the variable is unbound) or an
+ * RDF term in Turtle syntax: <IRI>, _:label, a quoted literal with an
+ * optional @language or ^^<datatype>, or an abbreviated numeric or
+ * boolean literal.
+ *
+ * Complete lines are processed in place from the buffer supplied by
+ * cURL; only a line which spans two buffers is copied. The lines are
+ * translated into the same element, character data and end-of-element
+ * events that an XML results document would produce.
+ */
+
+#define XSD                             "http://www.w3.org/2001/XMLSchema#"
+
+struct sparql_tsvscan_struct
+{
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	/* Set once the variables line has been processed */
+	int started;
+	/* An incomplete line carried over from the previous buffer */
+	SPARQLSCANBUF line;
+	/* Decoded term values */
+	char *value;
+	size_t valuesize;
+	/* Variable names, indexed by column */
+	char **vars;
+	size_t *varlens;
+	size_t nvars;
+};
+
+static int sparql_tsvscan_line_(SPARQLTSVSCAN *scan, const char *p, const char *end);
+static int sparql_tsvscan_vars_(SPARQLTSVSCAN *scan, const char *p, const char *end);
+static int sparql_tsvscan_term_(SPARQLTSVSCAN *scan, size_t col, const char *p, const char *end, int escaped);
+static int sparql_tsvscan_unescape_(SPARQLTSVSCAN *scan, const char *p, const char *end, int escaped, const char **value, size_t *len);
+static const char *sparql_tsvscan_special_(const char *p, const char *end);
+static int sparql_tsvscan_error_(SPARQLTSVSCAN *scan, const char *what);
+
+SPARQLTSVSCAN *
+sparql_tsvscan_create_(SPARQL *connection, SPARQLQUERY *query)
+{
+	SPARQLTSVSCAN *p;
+
+	p = (SPARQLTSVSCAN *) calloc(1, sizeof(SPARQLTSVSCAN));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->connection = connection;
+	p->query = query;
+	return p;
+}
+
+int
+sparql_tsvscan_destroy_(SPARQLTSVSCAN *scan)
+{
+	size_t c;
+
+	for(c = 0; c < scan->nvars; c++)
+	{
+		free(scan->vars[c]);
+	}
+	free(scan->vars);
+	free(scan->varlens);
+	free(scan->line.buf);
+	free(scan->value);
+	free(scan);
+	return 0;
+}
+
+/* Process the next <len> bytes of a results document; <final> is nonzero
+ * once the whole document has been received
+ */
+int
+sparql_tsvscan_parse_(SPARQLTSVSCAN *scan, const char *buf, size_t len, int final)
+{
+	const char *p, *end, *nl;
+
+	p = buf;
+	end = buf + len;
+	if(scan->line.len)
+	{
+		/* Complete the line carried over from the previous buffer */
+		nl = memchr(p, '\n', end - p);
+		if(!nl)
+		{
+			if(sparql_scanbuf_append_(scan->connection, &(scan->line), p, end - p))
+			{
+				return -1;
+			}
+			p = end;
+		}
+		else
+		{
+			if(sparql_scanbuf_append_(scan->connection, &(scan->line), p, nl - p) ||
+			   sparql_tsvscan_line_(scan, scan->line.buf, scan->line.buf + scan->line.len))
+			{
+				return -1;
+			}
+			scan->line.len = 0;
+			p = nl + 1;
+		}
+	}
+	while(p < end)
+	{
+		nl = memchr(p, '\n', end - p);
+		if(!nl)
+		{
+			if(sparql_scanbuf_append_(scan->connection, &(scan->line), p, end - p))
+			{
+				return -1;
+			}
+			break;
+		}
+		if(sparql_tsvscan_line_(scan, p, nl))
+		{
+			return -1;
+		}
+		p = nl + 1;
+	}
+	if(!final)
+	{
+		return 0;
+	}
+	if(scan->line.len)
+	{
+		if(sparql_tsvscan_line_(scan, scan->line.buf, scan->line.buf + scan->line.len))
+		{
+			return -1;
+		}
+		scan->line.len = 0;
+	}
+	if(!scan->started)
+	{
+		return sparql_tsvscan_error_(scan, "no variables line was found");
+	}
+	if(sparql_query_endel_(scan->query) || sparql_query_endel_(scan->query))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Process a complete line, excluding the newline */
+static int
+sparql_tsvscan_line_(SPARQLTSVSCAN *scan, const char *p, const char *end)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	const char *s;
+	size_t col;
+	int escaped;
+
+	if(end > p && end[-1] == '\r')
+	{
+		end--;
+	}
+	if(!scan->started)
+	{
+		return sparql_tsvscan_vars_(scan, p, end);
+	}
+	if(sparql_query_startel_(scan->query, SQE_RESULT, "result", 6, &noattrs))
+	{
+		return -1;
+	}
+	if(p == end)
+	{
+		/* None of the variables are bound */
+		return sparql_query_endel_(scan->query);
+	}
+	col = 0;
+	s = p;
+	escaped = 0;
+	while(1)
+	{
+		p = sparql_tsvscan_special_(p, end);
+		if(p < end && *p == '\\')
+		{
+			/* Only a backslash within a literal is an escape, but it's
+			 * enough to note that unescaping may be necessary
+			 */
+			escaped = 1;
+			p += 2;
+			if(p > end)
+			{
+				p = end;
+			}
+			continue;
+		}
+		/* End of a field */
+		if(col >= scan->nvars)
+		{
+			return sparql_tsvscan_error_(scan, "a solution has more fields than there are variables");
+		}
+		if(p > s && sparql_tsvscan_term_(scan, col, s, p, escaped))
+		{
+			return -1;
+		}
+		col++;
+		if(p == end)
+		{
+			break;
+		}
+		p++;
+		s = p;
+		escaped = 0;
+	}
+	return sparql_query_endel_(scan->query);
+}
+
+/* Process the variables line */
+static int
+sparql_tsvscan_vars_(SPARQLTSVSCAN *scan, const char *p, const char *end)
+{
+	static const struct sparql_query_attrs_struct noattrs;
+	struct sparql_query_attrs_struct attrs;
+	const char *s;
+	char **vars;
+	size_t *lens;
+	size_t n, c;
+
+	scan->started = 1;
+	for(n = 1, s = p; (s = memchr(s, '\t', end - s)); s++)
+	{
+		n++;
+	}
+	vars = (char **) calloc(n, sizeof(char *));
+	lens = (size_t *) calloc(n, sizeof(size_t));
+	if(!vars || !lens)
+	{
+		free(vars);
+		free(lens);
+		sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for result variables\n");
+		return -1;
+	}
+	scan->vars = vars;
+	scan->varlens = lens;
+	if(sparql_query_startel_(scan->query, SQE_SPARQL, "sparql", 6, &noattrs) ||
+	   sparql_query_startel_(scan->query, SQE_HEAD, "head", 4, &noattrs))
+	{
+		return -1;
+	}
+	memset(&attrs, 0, sizeof(attrs));
+	for(c = 0; c < n; c++)
+	{
+		s = memchr(p, '\t', end - p);
+		if(!s)
+		{
+			s = end;
+		}
+		if(s > p && (*p == '?' || *p == '$'))
+		{
+			p++;
+		}
+		if(s == p)
+		{
+			/* An empty line means there are no variables */
+			if(n == 1)
+			{
+				break;
+			}
+			return sparql_tsvscan_error_(scan, "empty variable name");
+		}
+		vars[c] = (char *) malloc(s - p + 1);
+		if(!vars[c])
+		{
+			sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for result variables\n");
+			return -1;
+		}
+		memcpy(vars[c], p, s - p);
+		vars[c][s - p] = 0;
+		lens[c] = s - p;
+		scan->nvars = c + 1;
+		attrs.name = vars[c];
+		attrs.namelen = lens[c];
+		if(sparql_query_simple_(scan->query, SQE_VARIABLE, "variable", &attrs, NULL, 0))
+		{
+			return -1;
+		}
+		p = s + 1;
+	}
+	if(sparql_query_endel_(scan->query) ||
+	   sparql_query_startel_(scan->query, SQE_RESULTS, "results", 7, &noattrs))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Process a non-empty field, binding the variable in column <col> */
+static int
+sparql_tsvscan_term_(SPARQLTSVSCAN *scan, size_t col, const char *p, const char *end, int escaped)
+{
+	struct sparql_query_attrs_struct attrs;
+	SPARQLELEMENT el;
+	const char *localname, *value, *s;
+	size_t len;
+	char quote;
+
+	memset(&attrs, 0, sizeof(attrs));
+	if(*p == '<')
+	{
+		if(end - p < 2 || end[-1] != '>')
+		{
+			return sparql_tsvscan_error_(scan, "unterminated IRI");
+		}
+		el = SQE_URI;
+		localname = "uri";
+		if(sparql_tsvscan_unescape_(scan, p + 1, end - 1, escaped, &value, &len))
+		{
+			return -1;
+		}
+	}
+	else if(end - p > 2 && p[0] == '_' && p[1] == ':')
+	{
+		el = SQE_BNODE;
+		localname = "bnode";
+		value = p + 2;
+		len = end - value;
+	}
+	else if(*p == '"' || *p == '\'')
+	{
+		el = SQE_LITERAL;
+		localname = "literal";
+		quote = *p;
+		/* The lexical form ends at the last quote; anything following it
+		 * is a language tag or datatype
+		 */
+		for(s = end - 1; s > p && *s != quote; s--)
+		{
+		}
+		if(s == p)
+		{
+			return sparql_tsvscan_error_(scan, "unterminated literal");
+		}
+		if(s + 1 < end)
+		{
+			if(s[1] == '@' && s + 2 < end)
+			{
+				attrs.lang = s + 2;
+				attrs.langlen = end - attrs.lang;
+			}
+			else if(end - s > 4 && s[1] == '^' && s[2] == '^' && s[3] == '<' && end[-1] == '>')
+			{
+				attrs.datatype = s + 4;
+				attrs.datatypelen = (end - 1) - attrs.datatype;
+			}
+			else
+			{
+				return sparql_tsvscan_error_(scan, "invalid literal suffix");
+			}
+		}
+		p++;
+		if(s - p >= 4 && p[0] == quote && p[1] == quote && s[-1] == quote && s[-2] == quote)
+		{
+			/* A long string */
+			p += 2;
+			s -= 2;
+		}
+		if(sparql_tsvscan_unescape_(scan, p, s, escaped, &value, &len))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		/* An abbreviated literal */
+		el = SQE_LITERAL;
+		localname = "literal";
+		value = p;
+		len = end - p;
+		if((len == 4 && !memcmp(p, "true", 4)) || (len == 5 && !memcmp(p, "false", 5)))
+		{
+			attrs.datatype = XSD "boolean";
+		}
+		else if(memchr(p, 'e', len) || memchr(p, 'E', len))
+		{
+			attrs.datatype = XSD "double";
+		}
+		else if(memchr(p, '.', len))
+		{
+			attrs.datatype = XSD "decimal";
+		}
+		else
+		{
+			attrs.datatype = XSD "integer";
+		}
+		for(s = p; s < end && attrs.datatype[sizeof(XSD) - 1] != 'b'; s++)
+		{
+			if(!isdigit((unsigned char) *s) && *s != '.' && *s != '+' && *s != '-' && *s != 'e' && *s != 'E')
+			{
+				return sparql_tsvscan_error_(scan, "unrecognised term");
+			}
+		}
+		attrs.datatypelen = strlen(attrs.datatype);
+	}
+	attrs.name = scan->vars[col];
+	attrs.namelen = scan->varlens[col];
+	if(sparql_query_startel_(scan->query, SQE_BINDING, "binding", 7, &attrs))
+	{
+		return -1;
+	}
+	attrs.name = NULL;
+	attrs.namelen = 0;
+	if(sparql_query_simple_(scan->query, el, localname, &attrs, value, len))
+	{
+		return -1;
+	}
+	return sparql_query_endel_(scan->query);
+}
+
+/* Decode any escape sequences in [p, end), or return the span as-is if
+ * there are none
+ */
+static int
+sparql_tsvscan_unescape_(SPARQLTSVSCAN *scan, const char *p, const char *end, int escaped, const char **value, size_t *len)
+{
+	unsigned long c;
+	char *out;
+	int n, i;
+
+	if(!escaped || !memchr(p, '\\', end - p))
+	{
+		*value = p;
+		*len = end - p;
+		return 0;
+	}
+	if((size_t) (end - p) + 1 > scan->valuesize)
+	{
+		out = (char *) realloc(scan->value, (end - p) + 1);
+		if(!out)
+		{
+			sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for literal value\n");
+			return -1;
+		}
+		scan->value = out;
+		scan->valuesize = (end - p) + 1;
+	}
+	out = scan->value;
+	while(p < end)
+	{
+		if(*p != '\\')
+		{
+			*out = *p;
+			out++;
+			p++;
+			continue;
+		}
+		p++;
+		if(p == end)
+		{
+			return sparql_tsvscan_error_(scan, "incomplete escape sequence");
+		}
+		switch(*p)
+		{
+		case 't':
+			*out = '\t';
+			break;
+		case 'b':
+			*out = '\b';
+			break;
+		case 'n':
+			*out = '\n';
+			break;
+		case 'r':
+			*out = '\r';
+			break;
+		case 'f':
+			*out = '\f';
+			break;
+		case '"':
+		case '\'':
+		case '\\':
+			*out = *p;
+			break;
+		case 'u':
+		case 'U':
+			n = (*p == 'u' ? 4 : 8);
+			if(end - p <= n)
+			{
+				return sparql_tsvscan_error_(scan, "incomplete escape sequence");
+			}
+			for(c = 0, i = 1; i <= n; i++)
+			{
+				if(!isxdigit((unsigned char) p[i]))
+				{
+					return sparql_tsvscan_error_(scan, "invalid escape sequence");
+				}
+				c = (c << 4) | (isdigit((unsigned char) p[i]) ? p[i] - '0' : tolower((unsigned char) p[i]) - 'a' + 10);
+			}
+			if(c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+			{
+				return sparql_tsvscan_error_(scan, "invalid escape sequence");
+			}
+			p += n;
+			/* A UTF-8 sequence is never longer than the escape */
+			out += sparql_utf8_encode_(c, out) - 1;
+			break;
+		default:
+			return sparql_tsvscan_error_(scan, "invalid escape sequence");
+		}
+		out++;
+		p++;
+	}
+	*value = scan->value;
+	*len = out - scan->value;
+	return 0;
+}
+
+/* Locate the next tab or backslash within a line */
+static const char *
+sparql_tsvscan_special_(const char *p, const char *end)
+{
+#ifdef SPARQL_TSVSCAN_SSE2
+	__m128i tab, bs, v;
+	int mask;
+
+	tab = _mm_set1_epi8('\t');
+	bs = _mm_set1_epi8('\\');
+	while(end - p >= 16)
+	{
+		v = _mm_loadu_si128((const __m128i *) p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, bs)));
+		if(mask)
+		{
+			return p + __builtin_ctz((unsigned int) mask);
+		}
+		p += 16;
+	}
+#endif
+	for(; p < end; p++)
+	{
+		if(*p == '\t' || *p == '\\')
+		{
+			break;
+		}
+	}
+	return p;
+}
+
+static int
+sparql_tsvscan_error_(SPARQLTSVSCAN *scan, const char *what)
+{
+	sparql_logf_(scan->connection, LOG_ERR, "returned TSV document was not valid: %s\n", what);
+	return -1;
+}
@@ -23,32 +23,131 @@
 
 #include "p_libsparqlclient.h"
 
+static int sparql_insert_perform_(SPARQL *connection, const char *graphuri, const char *triples, size_t len, librdf_stream *stream);
+
+/* Perform a SPARQL 1.1 update. Unless the connection has been configured
+ * to send urlencoded forms (as 4store requires), the statement is sent
+ * verbatim as the request body, without being copied.
+ */
 int
 sparql_update(SPARQL *connection, const char *statement, size_t length)
+{
+	SPARQLBODY *body;
+	int r;
+
+	r = sparql_journal_add_(connection, SPARQL_WRITE_UPDATE, NULL, statement, length);
+	if(r > 0)
+	{
+		r = sparql_writebuf_add_(connection, SPARQL_WRITE_UPDATE, NULL, statement, length);
+	}
+	if(r <= 0)
+	{
+		return r;
+	}
+	body = sparql_update_body_(connection);
+	if(!body)
+	{
+		return -1;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: %.*s\n", (int) length, statement);
+	if(sparql_body_add_(body, statement, length))
+	{
+		sparql_body_destroy_(body);
+		return -1;
+	}
+	r = sparql_update_perform_(connection, body);
+	sparql_body_destroy_(body);
+	return r;
+}
+
+/* Create a request body suitable for passing to sparql_update_perform_();
+ * the caller should append the update statement to it.
+ */
+SPARQLBODY *
+sparql_update_body_(SPARQL *connection)
+{
+	if(connection->update_form)
+	{
+		return sparql_body_create_(connection, "update=", 1);
+	}
+	return sparql_body_create_(connection, NULL, 0);
+}
+
+int
+sparql_update_perform_(SPARQL *connection, SPARQLBODY *body)
 {
 	CURL *ch;
-	char *buf;
-	size_t buflen;
+	struct curl_slist *headers;
 	int r;
 
-	ch = sparql_curl_create_(connection, connection->update_uri);
-	buflen = sparql_urlencode_lsize_(statement, length);
-	buf = (char *) malloc(16 + buflen);
-	if(!buf)
+	headers = NULL;
+	ch = sparql_update_prepare_(connection, body, &headers);
+	if(!ch)
 	{
-		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate %u bytes\n", (unsigned) length + 16);
-		curl_easy_cleanup(ch);
 		return -1;
 	}
-	strcpy(buf, "update=");
-	sparql_urlencode_l_(statement, length, buf + 7, buflen);
-	sparql_logf_(connection, LOG_DEBUG, "SPARQL: %.*s\n", length, statement);
-	curl_easy_setopt(ch, CURLOPT_POST, 1);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDS, buf);
-	curl_easy_setopt(ch, CURLOPT_POSTFIELDSIZE, strlen(buf));
 	r = sparql_curl_perform_(ch);
+	curl_slist_free_all(headers);
 	curl_easy_cleanup(ch);
-	free(buf);
+	return r;
+}
+
+/* Create a cURL handle which will perform an update whose payload is
+ * <body>; the caller must free <headers> once the transfer is complete.
+ */
+CURL *
+sparql_update_prepare_(SPARQL *connection, SPARQLBODY *body, struct curl_slist **headers)
+{
+	CURL *ch;
+
+	ch = sparql_curl_create_(connection, connection->update_uri);
+	if(!ch)
+	{
+		return NULL;
+	}
+	if(connection->update_form)
+	{
+		*headers = curl_slist_append(NULL, "Content-type: application/x-www-form-urlencoded");
+	}
+	else
+	{
+		*headers = curl_slist_append(NULL, "Content-type: application/sparql-update; charset=utf-8");
+	}
+	if(sparql_body_attach_(body, ch, headers))
+	{
+		curl_slist_free_all(*headers);
+		*headers = NULL;
+		curl_easy_cleanup(ch);
+		return NULL;
+	}
+	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, *headers);
+	return ch;
+}
+
+/* Perform a SPARQL 1.1 update read from the file at <path>, which is
+ * mapped into memory and sent directly from there
+ */
+int
+sparql_update_file(SPARQL *connection, const char *path)
+{
+	SPARQLBODY *body;
+	int r;
+
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	body = sparql_update_body_(connection);
+	if(!body)
+	{
+		return -1;
+	}
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing update from %s\n", path);
+	if(sparql_body_add_file_(body, path))
+	{
+		sparql_body_destroy_(body);
+		return -1;
+	}
+	r = sparql_update_perform_(connection, body);
+	sparql_body_destroy_(body);
 	return r;
 }
 
@@ -79,138 +178,126 @@ sparql_updatef(SPARQL *connection, const char *format, ...)
 int
 sparql_insert(SPARQL *connection, const char *triples, size_t len, const char *graphuri)
 {
-	size_t l;
-	char *buf, *bp;
 	int r;
-	
+
 	if(!len)
 	{
 		return 0;
 	}
-	if(connection->data_uri)
-	{
-		return sparql_post(connection, graphuri, triples, len);
-	}
-	l = len + 20;
-	if(graphuri)
+	sparql_manifest_forget_(connection, graphuri);
+	r = sparql_journal_add_(connection, SPARQL_WRITE_INSERT, graphuri, triples, len);
+	if(r > 0)
 	{
-		l += strlen(graphuri) + 15;
+		r = sparql_writebuf_add_(connection, SPARQL_WRITE_INSERT, graphuri, triples, len);
 	}
-	buf = (char *) malloc(l);
-	if(!buf)
+	if(r <= 0)
 	{
-		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate %u bytes for insert operation\n", (unsigned) (len + 20));
-		return -1;
-	}
-	strcpy(buf, "INSERT DATA { ");
-	bp = buf + 14;
-	if(graphuri)
-	{
-		bp += sprintf(bp, "GRAPH <%s> { ", graphuri);
+		return r;
 	}
-	strncpy(bp, triples, len);
-	bp += len;
-	if(graphuri)
+	if(connection->data_uri)
 	{
-		bp[0] = '}';
-		bp++;
+		return sparql_post(connection, graphuri, triples, len);
 	}
-	bp[0] = '}';
-	bp[1] = 0;
-	r = sparql_update(connection, buf, strlen(buf));
-	free(buf);
-	return r;
+	return sparql_insert_perform_(connection, graphuri, triples, len, NULL);
 }
 
+/* Serialise the statements in <stream> directly into the body of the
+ * request as it is sent, rather than into an intermediate buffer.
+ */
 int
 sparql_insert_stream(SPARQL *connection, librdf_stream *stream, const char *graphuri)
 {
-	librdf_world *world;
-	librdf_serializer *serializer;
-	char *buf;
-	size_t buflen;
+	SPARQLBODY *body;
 	int r;
 
-	world = sparql_world(connection);
-	if(!world)
-	{
-		return -1;
-	}
-	serializer = librdf_new_serializer(world, "ntriples", NULL, NULL);
-	if(!serializer)
+	if(librdf_stream_end(stream))
 	{
-		sparql_logf_(connection, LOG_ERR, "SPARQL: failed to create ntriples serializer\n");
-		return -1;
+		return 0;
 	}
-	buflen = 0;
-	buf = (char *) librdf_serializer_serialize_stream_to_counted_string(serializer, NULL, stream, &buflen);
-	if(!buf)
+	sparql_writebuf_sync_(connection);
+	sparql_journal_wait_(connection);
+	if(connection->data_uri)
 	{
-		librdf_free_serializer(serializer);
-		sparql_logf_(connection, LOG_ERR, "SPARQL: failed to serialise buffer\n");
-		return -1;
+		body = sparql_post_body_(connection, graphuri);
+		if(!body)
+		{
+			return -1;
+		}
+		if(sparql_body_add_stream_(body, stream))
+		{
+			sparql_body_destroy_(body);
+			return -1;
+		}
+		r = sparql_post_perform_(connection, graphuri, body);
+		sparql_body_destroy_(body);
+		return r;
 	}
-	r = sparql_insert(connection, buf, buflen, graphuri);
-	librdf_free_memory(buf);
-	librdf_free_serializer(serializer);
-	return r;
+	return sparql_insert_perform_(connection, graphuri, NULL, 0, stream);
 }
 
-int
-sparql_insert_model(SPARQL *connection, librdf_model *model)
+/* Create a request body for an INSERT DATA operation whose payload is
+ * either the buffer <triples> or the stream <stream>, without copying
+ * either.
+ */
+SPARQLBODY *
+sparql_insert_body_(SPARQL *connection, const char *graphuri, const char *triples, size_t len, librdf_stream *stream)
 {
-	librdf_iterator *iter;
-	librdf_node *node;
-	librdf_uri *uri;
-	librdf_stream *stream;
-	const char *uristr;
+	SPARQLBODY *body;
 	int r;
 
-	if(!librdf_model_size(model))
+	body = sparql_update_body_(connection);
+	if(!body)
 	{
-		return 0;
+		return NULL;
+	}
+	r = sparql_body_add_str_(body, "INSERT DATA { ");
+	if(!r && graphuri)
+	{
+		r = sparql_body_add_str_(body, "GRAPH <") ||
+			sparql_body_add_str_(body, graphuri) ||
+			sparql_body_add_str_(body, "> { ");
 	}
-	if(!librdf_model_supports_contexts(model))
+	if(!r)
 	{
-		if(!(stream = librdf_model_as_stream(model)))
+		if(stream)
 		{
-			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to obtain stream for model\n");
-			return -1;
+			r = sparql_body_add_stream_(body, stream);
+		}
+		else
+		{
+			r = sparql_body_add_(body, triples, len);
 		}
-		r = sparql_insert_stream(connection, stream, NULL);
-		librdf_free_stream(stream);
-		return r;
 	}
-	iter = librdf_model_get_contexts(model);
-	if(!iter)
+	if(!r && graphuri)
+	{
+		r = sparql_body_add_str_(body, " }");
+	}
+	if(!r)
+	{
+		r = sparql_body_add_str_(body, " }");
+	}
+	if(r)
+	{
+		sparql_body_destroy_(body);
+		return NULL;
+	}
+	return body;
+}
+
+static int
+sparql_insert_perform_(SPARQL *connection, const char *graphuri, const char *triples, size_t len, librdf_stream *stream)
+{
+	SPARQLBODY *body;
+	int r;
+
+	sparql_manifest_forget_(connection, graphuri);
+	body = sparql_insert_body_(connection, graphuri, triples, len, stream);
+	if(!body)
 	{
-		sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to obtain model context iterator\n");
 		return -1;
-	}	
-	while(!librdf_iterator_end(iter))
-	{
-		node = librdf_iterator_get_object(iter);
-		if(node &&
-		   librdf_node_is_resource(node) &&
-		   (uri = librdf_node_get_uri(node)) &&
-		   (uristr = (const char *) librdf_uri_as_string(uri)))
-		{
-			if(!(stream = librdf_model_context_as_stream(model, node)))
-			{
-				sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to obtain stream for context <%s>\n", uristr);
-				librdf_free_iterator(iter);
-				return -1;
-			}
-			r = sparql_insert_stream(connection, stream, uristr);
-			librdf_free_stream(stream);
-			if(r)
-			{
-				librdf_free_iterator(iter);
-				return -1;
-			}
-		}
-		librdf_iterator_next(iter);
 	}
-	librdf_free_iterator(iter);
-	return 0;
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: performing INSERT DATA into <%s>\n", graphuri ? graphuri : "(default graph)");
+	r = sparql_update_perform_(connection, body);
+	sparql_body_destroy_(body);
+	return r;
 }
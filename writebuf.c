@@ -0,0 +1,650 @@
+/* SPARQL client: write coalescing
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#include <sys/time.h>
+
+/* When a write buffer is configured, sparql_insert() and sparql_update()
+ * append to a list of pending operations instead of performing a request
+ * each. Consecutive inserts into the same graph are merged into a single
+ * INSERT DATA operation (inserts are never moved across an update, so the
+ * order in which changes are applied is preserved), and the whole list is
+ * sent as one ';'-separated update when a threshold is reached, when
+ * sparql_flush() is called, or before any other request is made on the
+ * connection. There is no timer: the age limit is only checked when a
+ * write is made.
+ *
+ * Blank node labels are scoped to the request rather than to each call,
+ * so when inserts are sent together, the labels in each are given a
+ * suffix which is unique to that call, so that "_:a" in one can't be
+ * conflated with "_:a" in another.
+ *
+ * Inserts on a connection with a Graph Store endpoint aren't buffered:
+ * they're POSTed as they would be otherwise, because their payload may
+ * be Turtle (with @prefix directives, for example), which can't be
+ * embedded in an INSERT DATA operation.
+ *
+ * If a combined update is rejected, each of the original calls is
+ * replayed on its own, so that the error callback can be told precisely
+ * which operations failed. If the server couldn't be reached, or failed
+ * itself, there is no point in doing so, and every operation is reported
+ * as having failed.
+ */
+
+#define WRITEBUF_OP_BLOCK               16
+#define WRITEBUF_FRAG_BLOCK             16
+
+struct sparql_write_fragment_struct
+{
+	size_t start;
+	size_t len;
+};
+
+struct sparql_write_op_struct
+{
+	int kind;
+	char *graph;
+	char *buf;
+	size_t len;
+	size_t size;
+	/* The extents of the individual calls within buf */
+	struct sparql_write_fragment_struct *frags;
+	size_t nfrags;
+	size_t fragsize;
+};
+
+struct sparql_writebuf_struct
+{
+	size_t max_bytes;
+	size_t max_count;
+	unsigned long max_ms;
+	struct sparql_write_op_struct *ops;
+	size_t nops;
+	size_t opsize;
+	size_t bytes;
+	size_t count;
+	struct timeval first;
+	int flushing;
+};
+
+static struct sparql_write_op_struct *sparql_writebuf_op_(SPARQL *connection, SPARQLWRITEBUF *wb, int kind, const char *graph);
+static int sparql_writebuf_append_(SPARQL *connection, struct sparql_write_op_struct *op, const char *text, size_t len);
+static int sparql_writebuf_due_(SPARQLWRITEBUF *wb);
+static int sparql_writebuf_send_(SPARQL *connection, struct sparql_write_op_struct *ops, size_t nops);
+static int sparql_writebuf_relabel_(SPARQLBODY *body, const char *text, size_t len, unsigned long seq);
+static int sparql_writebuf_replay_(SPARQL *connection, struct sparql_write_op_struct *ops, size_t nops);
+static int sparql_writebuf_perform_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len);
+static void sparql_writebuf_free_ops_(struct sparql_write_op_struct *ops, size_t nops);
+
+/* Configure the connection's write buffer: pending writes are flushed
+ * once they amount to <bytes> bytes or <count> operations, or the oldest
+ * has been waiting for <ms> milliseconds (checked whenever a write is
+ * made); zero means no limit. If both <bytes> and <count> are zero, any
+ * pending writes are flushed and buffering is disabled.
+ */
+int
+sparql_set_write_buffer(SPARQL *connection, size_t bytes, size_t count, unsigned long ms)
+{
+	SPARQLWRITEBUF *wb;
+
+	if(!bytes && !count)
+	{
+		return sparql_writebuf_destroy_(connection);
+	}
+	wb = connection->writebuf;
+	if(!wb)
+	{
+		wb = (SPARQLWRITEBUF *) calloc(1, sizeof(SPARQLWRITEBUF));
+		if(!wb)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for write buffer\n");
+			return -1;
+		}
+		connection->writebuf = wb;
+	}
+	wb->max_bytes = bytes;
+	wb->max_count = count;
+	wb->max_ms = ms;
+	return 0;
+}
+
+/* Specify a callback to be invoked for each buffered write which fails;
+ * the connection's error state describes the failure when it is invoked.
+ */
+int
+sparql_set_write_error_callback(SPARQL *connection, sparql_write_error_fn callback, void *data)
+{
+	connection->write_error = callback;
+	connection->write_error_data = data;
+	return 0;
+}
+
+/* Send any pending buffered writes, and wait for the write-behind journal
+ * (if any) to be drained; returns -1 if any of them failed
+ */
+int
+sparql_flush(SPARQL *connection)
+{
+	SPARQLWRITEBUF *wb;
+	struct sparql_write_op_struct *ops;
+	size_t nops;
+	int r;
+
+	wb = connection->writebuf;
+	if(!wb || !wb->nops || wb->flushing)
+	{
+		return sparql_journal_wait_(connection);
+	}
+	/* Detach the pending operations and mark the buffer as flushing; any
+	 * writes made by the error callback meanwhile bypass the buffer and are
+	 * performed directly, so they can't be caught up in this flush
+	 */
+	ops = wb->ops;
+	nops = wb->nops;
+	wb->ops = NULL;
+	wb->nops = wb->opsize = 0;
+	wb->bytes = wb->count = 0;
+	wb->flushing = 1;
+	sparql_logf_(connection, LOG_DEBUG, "SPARQL: flushing %u buffered write operations\n", (unsigned) nops);
+	r = sparql_writebuf_send_(connection, ops, nops);
+	if(r)
+	{
+		r = sparql_writebuf_replay_(connection, ops, nops);
+	}
+	wb->flushing = 0;
+	sparql_writebuf_free_ops_(ops, nops);
+	if(sparql_journal_wait_(connection))
+	{
+		r = -1;
+	}
+	return r;
+}
+
+/* Buffer a write of the given <kind> (an insert of triples into <graph>,
+ * or an update statement) if the connection has a write buffer; returns
+ * 0 if the write was buffered, 1 if the caller should perform it
+ * directly, or -1 on error.
+ */
+int
+sparql_writebuf_add_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len)
+{
+	SPARQLWRITEBUF *wb;
+	struct sparql_write_op_struct *op;
+
+	wb = connection->writebuf;
+	if(!wb || wb->flushing)
+	{
+		return 1;
+	}
+	if(kind == SPARQL_WRITE_INSERT && connection->data_uri)
+	{
+		/* To be POSTed directly, after anything already pending */
+		sparql_writebuf_sync_(connection);
+		return 1;
+	}
+	if(wb->max_bytes && len >= wb->max_bytes)
+	{
+		/* Too large to be worth buffering, but anything already pending
+		 * must be sent first
+		 */
+		sparql_flush(connection);
+		return 1;
+	}
+	if(wb->nops && sparql_writebuf_due_(wb))
+	{
+		sparql_flush(connection);
+	}
+	op = sparql_writebuf_op_(connection, wb, kind, graph);
+	if(!op)
+	{
+		return -1;
+	}
+	if(sparql_writebuf_append_(connection, op, text, len))
+	{
+		return -1;
+	}
+	if(!wb->count)
+	{
+		gettimeofday(&(wb->first), NULL);
+	}
+	wb->bytes += len;
+	wb->count++;
+	if((wb->max_bytes && wb->bytes >= wb->max_bytes) ||
+	   (wb->max_count && wb->count >= wb->max_count) ||
+	   sparql_writebuf_due_(wb))
+	{
+		/* The write itself has been accepted; failures are reported
+		 * via the callback
+		 */
+		sparql_flush(connection);
+	}
+	return 0;
+}
+
+/* Flush pending writes before performing some other kind of request, so
+ * that it observes them
+ */
+int
+sparql_writebuf_sync_(SPARQL *connection)
+{
+	if(!connection->writebuf || !connection->writebuf->nops)
+	{
+		return 0;
+	}
+	return sparql_flush(connection);
+}
+
+/* Throw away any pending writes without sending them */
+int
+sparql_writebuf_discard_(SPARQL *connection)
+{
+	SPARQLWRITEBUF *wb;
+
+	wb = connection->writebuf;
+	if(!wb || wb->flushing)
+	{
+		return 0;
+	}
+	sparql_writebuf_free_ops_(wb->ops, wb->nops);
+	wb->ops = NULL;
+	wb->nops = wb->opsize = 0;
+	wb->bytes = wb->count = 0;
+	return 0;
+}
+
+/* Flush and free the write buffer when the connection is destroyed */
+int
+sparql_writebuf_destroy_(SPARQL *connection)
+{
+	int r;
+
+	if(!connection->writebuf)
+	{
+		return 0;
+	}
+	r = sparql_flush(connection);
+	sparql_writebuf_free_ops_(connection->writebuf->ops, connection->writebuf->nops);
+	free(connection->writebuf);
+	connection->writebuf = NULL;
+	return r;
+}
+
+/* Find the operation which a write should be appended to: inserts are
+ * merged with an earlier insert into the same graph, provided there is no
+ * update between them; otherwise a new operation is added.
+ */
+static struct sparql_write_op_struct *
+sparql_writebuf_op_(SPARQL *connection, SPARQLWRITEBUF *wb, int kind, const char *graph)
+{
+	struct sparql_write_op_struct *p;
+	size_t c;
+
+	if(kind == SPARQL_WRITE_INSERT)
+	{
+		for(c = wb->nops; c > 0; c--)
+		{
+			p = &(wb->ops[c - 1]);
+			if(p->kind != SPARQL_WRITE_INSERT)
+			{
+				break;
+			}
+			if((!graph && !p->graph) || (graph && p->graph && !strcmp(graph, p->graph)))
+			{
+				return p;
+			}
+		}
+	}
+	if(wb->nops + 1 > wb->opsize)
+	{
+		p = (struct sparql_write_op_struct *) realloc(wb->ops, sizeof(struct sparql_write_op_struct) * (wb->opsize + WRITEBUF_OP_BLOCK));
+		if(!p)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to reallocate write buffer operation list\n");
+			return NULL;
+		}
+		wb->ops = p;
+		wb->opsize += WRITEBUF_OP_BLOCK;
+	}
+	p = &(wb->ops[wb->nops]);
+	memset(p, 0, sizeof(struct sparql_write_op_struct));
+	p->kind = kind;
+	if(graph)
+	{
+		p->graph = strdup(graph);
+		if(!p->graph)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to allocate memory for graph URI\n");
+			return NULL;
+		}
+	}
+	wb->nops++;
+	return p;
+}
+
+static int
+sparql_writebuf_append_(SPARQL *connection, struct sparql_write_op_struct *op, const char *text, size_t len)
+{
+	struct sparql_write_fragment_struct *f;
+	size_t needed;
+	char *p;
+
+	/* Each fragment is followed by a newline so that the last statement
+	 * of one insert can't run into the first of the next
+	 */
+	needed = op->len + len + 2;
+	if(needed > op->size)
+	{
+		needed = (needed + 1023) & ~((size_t) 1023);
+		p = (char *) realloc(op->buf, needed);
+		if(!p)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to reallocate write buffer to %u bytes\n", (unsigned) needed);
+			return -1;
+		}
+		op->buf = p;
+		op->size = needed;
+	}
+	if(op->nfrags + 1 > op->fragsize)
+	{
+		f = (struct sparql_write_fragment_struct *) realloc(op->frags, sizeof(struct sparql_write_fragment_struct) * (op->fragsize + WRITEBUF_FRAG_BLOCK));
+		if(!f)
+		{
+			sparql_logf_(connection, LOG_CRIT, "SPARQL: failed to reallocate write buffer fragment list\n");
+			return -1;
+		}
+		op->frags = f;
+		op->fragsize += WRITEBUF_FRAG_BLOCK;
+	}
+	op->frags[op->nfrags].start = op->len;
+	op->frags[op->nfrags].len = len;
+	op->nfrags++;
+	memcpy(&(op->buf[op->len]), text, len);
+	op->len += len;
+	op->buf[op->len] = '\n';
+	op->len++;
+	op->buf[op->len] = 0;
+	return 0;
+}
+
+/* Determine whether the oldest pending write has reached the age limit */
+static int
+sparql_writebuf_due_(SPARQLWRITEBUF *wb)
+{
+	struct timeval now;
+	unsigned long ms;
+
+	if(!wb->max_ms || !wb->count)
+	{
+		return 0;
+	}
+	gettimeofday(&now, NULL);
+	ms = (unsigned long) ((now.tv_sec - wb->first.tv_sec) * 1000 + (now.tv_usec - wb->first.tv_usec) / 1000);
+	return (ms >= wb->max_ms);
+}
+
+/* Send the operations as a single update */
+static int
+sparql_writebuf_send_(SPARQL *connection, struct sparql_write_op_struct *ops, size_t nops)
+{
+	SPARQLBODY *body;
+	size_t c, d;
+	unsigned long seq;
+	int r;
+
+	body = sparql_update_body_(connection);
+	if(!body)
+	{
+		return -1;
+	}
+	r = 0;
+	seq = 0;
+	for(c = 0; !r && c < nops; c++)
+	{
+		if(c)
+		{
+			r = sparql_body_add_str_(body, " ;\n");
+		}
+		if(r)
+		{
+			break;
+		}
+		if(ops[c].kind == SPARQL_WRITE_UPDATE)
+		{
+			r = sparql_body_add_(body, ops[c].buf, ops[c].len);
+			continue;
+		}
+		if(ops[c].graph)
+		{
+			r = sparql_body_add_str_(body, "INSERT DATA { GRAPH <") ||
+				sparql_body_add_str_(body, ops[c].graph) ||
+				sparql_body_add_str_(body, "> {\n");
+		}
+		else
+		{
+			r = sparql_body_add_str_(body, "INSERT DATA {\n");
+		}
+		for(d = 0; !r && d < ops[c].nfrags; d++)
+		{
+			r = sparql_writebuf_relabel_(body, &(ops[c].buf[ops[c].frags[d].start]), ops[c].frags[d].len, seq) ||
+				sparql_body_add_str_(body, "\n");
+			seq++;
+		}
+		if(!r)
+		{
+			r = sparql_body_add_str_(body, ops[c].graph ? "} }" : "}");
+		}
+	}
+	if(!r)
+	{
+		r = sparql_update_perform_(connection, body);
+	}
+	sparql_body_destroy_(body);
+	return r;
+}
+
+/* Add the triples in <text> to <body>, appending "_w<seq>" to each blank
+ * node label. Strings, IRIs and comments are skipped over so that their
+ * contents are left alone.
+ */
+static int
+sparql_writebuf_relabel_(SPARQLBODY *body, const char *text, size_t len, unsigned long seq)
+{
+	char suffix[32];
+	size_t start, c, e;
+	char quote;
+
+	start = 0;
+	c = 0;
+	while(c < len)
+	{
+		if(text[c] == '"' || text[c] == '\'')
+		{
+			quote = text[c];
+			if(c + 2 < len && text[c + 1] == quote && text[c + 2] == quote)
+			{
+				/* A long string, ending at the next unescaped triple quote */
+				for(c += 3; c < len; c++)
+				{
+					if(text[c] == '\\')
+					{
+						c++;
+					}
+					else if(c + 2 < len && text[c] == quote && text[c + 1] == quote && text[c + 2] == quote)
+					{
+						c += 2;
+						break;
+					}
+				}
+			}
+			else
+			{
+				for(c++; c < len && text[c] != quote; c++)
+				{
+					if(text[c] == '\\')
+					{
+						c++;
+					}
+				}
+			}
+			c++;
+			continue;
+		}
+		if(text[c] == '<')
+		{
+			for(c++; c < len && text[c] != '>'; c++);
+			c++;
+			continue;
+		}
+		if(text[c] == '#')
+		{
+			for(c++; c < len && text[c] != '\n' && text[c] != '\r'; c++);
+			continue;
+		}
+		if(text[c] != '_' || c + 1 >= len || text[c + 1] != ':')
+		{
+			c++;
+			continue;
+		}
+		/* Name characters, and dots other than at the end */
+		for(e = c + 2; e < len; e++)
+		{
+			if(!isalnum((unsigned char) text[e]) && !(text[e] & 0x80) && text[e] != '_' && text[e] != '-' && text[e] != '.')
+			{
+				break;
+			}
+		}
+		while(e > c + 2 && text[e - 1] == '.')
+		{
+			e--;
+		}
+		if(e > c + 2)
+		{
+			sprintf(suffix, "_w%lu", seq);
+			if(sparql_body_add_(body, &(text[start]), e - start) ||
+			   sparql_body_add_str_(body, suffix))
+			{
+				return -1;
+			}
+			start = e;
+		}
+		c = e;
+	}
+	if(start < len)
+	{
+		return sparql_body_add_(body, &(text[start]), len - start);
+	}
+	return 0;
+}
+
+/* Having failed to send the operations together, send each of the
+ * original writes individually, reporting any which fail
+ */
+static int
+sparql_writebuf_replay_(SPARQL *connection, struct sparql_write_op_struct *ops, size_t nops)
+{
+	struct sparql_write_fragment_struct *f;
+	size_t c, d, failed, total;
+	int transient;
+
+	failed = 0;
+	total = 0;
+	transient = sparql_error_transient_(connection);
+	if(!transient)
+	{
+		sparql_logf_(connection, LOG_NOTICE, "SPARQL: buffered update failed (%s); retrying operations individually\n", sparql_error(connection));
+	}
+	for(c = 0; c < nops; c++)
+	{
+		for(d = 0; d < ops[c].nfrags; d++)
+		{
+			f = &(ops[c].frags[d]);
+			total++;
+			if(!transient && !sparql_writebuf_perform_(connection, ops[c].kind, ops[c].graph, &(ops[c].buf[f->start]), f->len))
+			{
+				continue;
+			}
+			failed++;
+			if(connection->write_error)
+			{
+				connection->write_error(connection, ops[c].kind, ops[c].graph, &(ops[c].buf[f->start]), f->len, connection->write_error_data);
+			}
+			else
+			{
+				sparql_logf_(connection, LOG_ERR, "SPARQL: buffered %s failed: %s\n", ops[c].kind == SPARQL_WRITE_INSERT ? "insert" : "update", sparql_error(connection));
+			}
+		}
+	}
+	if(failed)
+	{
+		sparql_logf_(connection, LOG_ERR, "SPARQL: %u of %u buffered write operations failed\n", (unsigned) failed, (unsigned) total);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sparql_writebuf_perform_(SPARQL *connection, int kind, const char *graph, const char *text, size_t len)
+{
+	SPARQLBODY *body;
+	int r;
+
+	if(kind == SPARQL_WRITE_INSERT && connection->data_uri)
+	{
+		return sparql_post(connection, graph, text, len);
+	}
+	if(kind == SPARQL_WRITE_INSERT)
+	{
+		body = sparql_insert_body_(connection, graph, text, len, NULL);
+	}
+	else
+	{
+		body = sparql_update_body_(connection);
+		if(body && sparql_body_add_(body, text, len))
+		{
+			sparql_body_destroy_(body);
+			body = NULL;
+		}
+	}
+	if(!body)
+	{
+		return -1;
+	}
+	r = sparql_update_perform_(connection, body);
+	sparql_body_destroy_(body);
+	return r;
+}
+
+static void
+sparql_writebuf_free_ops_(struct sparql_write_op_struct *ops, size_t nops)
+{
+	size_t c;
+
+	for(c = 0; c < nops; c++)
+	{
+		free(ops[c].graph);
+		free(ops[c].buf);
+		free(ops[c].frags);
+	}
+	free(ops);
+}
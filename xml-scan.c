@@ -0,0 +1,846 @@
+/* SPARQL client: scanner for the SPARQL Query Results XML Format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsparqlclient.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define SPARQL_XMLSCAN_SSE2            1
+#endif
+
+/* SPARQL results documents use a small, fixed vocabulary in a single
+ * default namespace, which makes the general-purpose machinery of an XML
+ * parser (namespace resolution, DTD processing, and so on) largely
+ * redundant. This scanner handles documents of the form that servers
+ * actually produce and drives the same element, character data and
+ * end-of-element processing as the libxml2 SAX handlers do.
+ *
+ * Nothing is consumed until the document element has been seen: if the
+ * prologue contains a DTD or a non-UTF-8 encoding declaration, or the
+ * document element isn't <sparql> in the results namespace (or declares
+ * a prefix for it), sparql_xmlscan_parse_() returns 1 and the caller
+ * should pass the data returned by sparql_xmlscan_pending_() to libxml2
+ * instead and continue with it from there.
+ */
+
+/* Results documents are never deeper than this */
+#define SPARQL_XMLSCAN_DEPTH            8
+
+/* Give up and use libxml2 if the prologue is longer than this */
+#define SPARQL_XMLSCAN_PROLOGUE         65536
+
+enum sparql_xmlscan_state
+{
+	XS_PROLOGUE,
+	XS_BODY,
+	XS_EPILOGUE
+};
+
+struct sparql_xmlscan_struct
+{
+	SPARQL *connection;
+	SPARQLQUERY *query;
+	enum sparql_xmlscan_state state;
+	/* Unconsumed input */
+	SPARQLSCANBUF input;
+	/* Decoded attribute values */
+	char *scratch;
+	size_t scratchsize;
+	SPARQLELEMENT stack[SPARQL_XMLSCAN_DEPTH];
+	size_t depth;
+};
+
+static int sparql_xmlscan_run_(SPARQLXMLSCAN *scan, const char **ptr, const char *end, int final);
+static int sparql_xmlscan_text_(SPARQLXMLSCAN *scan, const char **ptr, const char *end, int final);
+static int sparql_xmlscan_cdata_(SPARQLXMLSCAN *scan, const char *p, const char *end);
+static int sparql_xmlscan_start_(SPARQLXMLSCAN *scan, const char *p, const char *gt);
+static int sparql_xmlscan_end_(SPARQLXMLSCAN *scan, const char *p, const char *gt);
+static int sparql_xmlscan_decl_(SPARQLXMLSCAN *scan, const char *p, const char *end);
+static const char *sparql_xmlscan_special_(const char *p, const char *end);
+static const char *sparql_xmlscan_find_(const char *p, const char *end, const char *str);
+static const char *sparql_xmlscan_tagend_(const char *p, const char *end);
+static int sparql_xmlscan_entity_(const char *p, const char *end, char *out, size_t *outlen);
+static int sparql_xmlscan_error_(SPARQLXMLSCAN *scan, const char *what);
+
+SPARQLXMLSCAN *
+sparql_xmlscan_create_(SPARQL *connection, SPARQLQUERY *query)
+{
+	SPARQLXMLSCAN *p;
+
+	p = (SPARQLXMLSCAN *) calloc(1, sizeof(SPARQLXMLSCAN));
+	if(!p)
+	{
+		return NULL;
+	}
+	p->connection = connection;
+	p->query = query;
+	p->state = XS_PROLOGUE;
+	return p;
+}
+
+int
+sparql_xmlscan_destroy_(SPARQLXMLSCAN *scan)
+{
+	free(scan->input.buf);
+	free(scan->scratch);
+	free(scan);
+	return 0;
+}
+
+/* Return the input which has been buffered but not yet consumed; after
+ * sparql_xmlscan_parse_() has returned 1, this is the whole document
+ * received so far
+ */
+const char *
+sparql_xmlscan_pending_(SPARQLXMLSCAN *scan, size_t *len)
+{
+	*len = scan->input.len;
+	return scan->input.buf;
+}
+
+/* Process the next <len> bytes of a results document; <final> is nonzero
+ * once the whole document has been received. Returns 0 on success, -1 if
+ * the document is malformed or processing was aborted, or 1 if the
+ * document should be handed to libxml2 instead.
+ */
+int
+sparql_xmlscan_parse_(SPARQLXMLSCAN *scan, const char *buf, size_t len, int final)
+{
+	const char *p, *end;
+	size_t remain;
+	int r, inplace;
+
+	inplace = 0;
+	if(scan->state == XS_PROLOGUE || scan->input.len)
+	{
+		if(sparql_scanbuf_append_(scan->connection, &(scan->input), buf, len))
+		{
+			return -1;
+		}
+		p = scan->input.buf;
+		end = scan->input.buf + scan->input.len;
+	}
+	else
+	{
+		/* Process the data in place, buffering only an incomplete
+		 * trailing construct
+		 */
+		p = buf;
+		end = buf + len;
+		inplace = 1;
+	}
+	r = sparql_xmlscan_run_(scan, &p, end, final);
+	if(r > 0)
+	{
+		return 1;
+	}
+	if(r < 0)
+	{
+		return -1;
+	}
+	if(scan->state == XS_PROLOGUE)
+	{
+		if(final || scan->input.len > SPARQL_XMLSCAN_PROLOGUE)
+		{
+			return 1;
+		}
+		return 0;
+	}
+	remain = end - p;
+	if(inplace)
+	{
+		if(sparql_scanbuf_append_(scan->connection, &(scan->input), p, remain))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		memmove(scan->input.buf, p, remain);
+		scan->input.len = remain;
+	}
+	if(final && (scan->input.len || scan->state != XS_EPILOGUE))
+	{
+		return sparql_xmlscan_error_(scan, "document is incomplete");
+	}
+	return 0;
+}
+
+/* Process as many complete constructs as possible, advancing *ptr past
+ * them; while in the prologue, *ptr is left untouched
+ */
+static int
+sparql_xmlscan_run_(SPARQLXMLSCAN *scan, const char **ptr, const char *end, int final)
+{
+	const char *p, *q;
+	int r;
+
+	p = *ptr;
+	if(scan->state == XS_PROLOGUE && end - p < 3)
+	{
+		if(p < end && !final && !memcmp(p, "\xef\xbb\xbf", end - p))
+		{
+			/* Wait for the remainder of a byte order mark */
+			return 0;
+		}
+	}
+	else if(scan->state == XS_PROLOGUE && !memcmp(p, "\xef\xbb\xbf", 3))
+	{
+		p += 3;
+	}
+	while(p < end)
+	{
+		if(*p != '<')
+		{
+			if(scan->state == XS_BODY)
+			{
+				if((r = sparql_xmlscan_text_(scan, &p, end, final)) < 0)
+				{
+					return -1;
+				}
+				if(r)
+				{
+					break;
+				}
+				continue;
+			}
+			if(isspace((unsigned char) *p))
+			{
+				p++;
+				continue;
+			}
+			if(scan->state == XS_PROLOGUE)
+			{
+				return 1;
+			}
+			return sparql_xmlscan_error_(scan, "content found after the document element");
+		}
+		if(end - p < 2)
+		{
+			break;
+		}
+		if(p[1] == '?')
+		{
+			if(!(q = sparql_xmlscan_find_(p + 2, end, "?>")))
+			{
+				break;
+			}
+			if(scan->state == XS_PROLOGUE && sparql_xmlscan_decl_(scan, p, q))
+			{
+				return 1;
+			}
+			p = q + 2;
+			continue;
+		}
+		if(p[1] == '!')
+		{
+			if(end - p < 4 || (end - p < 9 && !memcmp(p, "<![CDATA[", end - p)))
+			{
+				break;
+			}
+			if(!memcmp(p, "<!--", 4))
+			{
+				if(!(q = sparql_xmlscan_find_(p + 4, end, "-->")))
+				{
+					break;
+				}
+				p = q + 3;
+				continue;
+			}
+			if(scan->state == XS_BODY && !memcmp(p, "<![CDATA[", 9))
+			{
+				if(!(q = sparql_xmlscan_find_(p + 9, end, "]]>")))
+				{
+					break;
+				}
+				if(sparql_xmlscan_cdata_(scan, p + 9, q))
+				{
+					return -1;
+				}
+				p = q + 3;
+				continue;
+			}
+			/* A document type declaration, or something unexpected */
+			if(scan->state == XS_PROLOGUE)
+			{
+				return 1;
+			}
+			return sparql_xmlscan_error_(scan, "unexpected markup declaration");
+		}
+		if(!(q = sparql_xmlscan_tagend_(p, end)))
+		{
+			break;
+		}
+		if(p[1] == '/')
+		{
+			if(scan->state != XS_BODY)
+			{
+				return sparql_xmlscan_error_(scan, "unexpected end tag");
+			}
+			if(sparql_xmlscan_end_(scan, p, q))
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			if(scan->state == XS_EPILOGUE)
+			{
+				return sparql_xmlscan_error_(scan, "content found after the document element");
+			}
+			if((r = sparql_xmlscan_start_(scan, p, q)))
+			{
+				return r;
+			}
+		}
+		p = q + 1;
+	}
+	if(scan->state != XS_PROLOGUE)
+	{
+		*ptr = p;
+	}
+	return 0;
+}
+
+/* Process character data up to the next markup; returns 1 if more input
+ * is needed to complete an entity or line ending
+ */
+static int
+sparql_xmlscan_text_(SPARQLXMLSCAN *scan, const char **ptr, const char *end, int final)
+{
+	const char *p, *q;
+	char ent[4];
+	size_t l;
+
+	p = *ptr;
+	while(p < end)
+	{
+		q = sparql_xmlscan_special_(p, end);
+		if(q > p && sparql_query_characters_(scan->query, p, q - p))
+		{
+			return -1;
+		}
+		p = q;
+		if(p == end || *p == '<')
+		{
+			break;
+		}
+		if(*p == '\r')
+		{
+			/* Line endings are normalised to a single LF */
+			if(p + 1 == end && !final)
+			{
+				break;
+			}
+			if(sparql_query_characters_(scan->query, "\n", 1))
+			{
+				return -1;
+			}
+			p++;
+			if(p < end && *p == '\n')
+			{
+				p++;
+			}
+			continue;
+		}
+		/* An entity or character reference */
+		q = memchr(p, ';', end - p);
+		if(!q)
+		{
+			if(end - p < 16 && !final)
+			{
+				break;
+			}
+			return sparql_xmlscan_error_(scan, "unterminated entity reference");
+		}
+		if(sparql_xmlscan_entity_(p + 1, q, ent, &l))
+		{
+			return sparql_xmlscan_error_(scan, "invalid entity reference");
+		}
+		if(sparql_query_characters_(scan->query, ent, l))
+		{
+			return -1;
+		}
+		p = q + 1;
+	}
+	*ptr = p;
+	return (p < end && *p != '<');
+}
+
+/* Process the contents of a CDATA section */
+static int
+sparql_xmlscan_cdata_(SPARQLXMLSCAN *scan, const char *p, const char *end)
+{
+	const char *q;
+
+	while(p < end)
+	{
+		q = memchr(p, '\r', end - p);
+		if(!q)
+		{
+			q = end;
+		}
+		if(q > p && sparql_query_characters_(scan->query, p, q - p))
+		{
+			return -1;
+		}
+		if(q == end)
+		{
+			break;
+		}
+		if(sparql_query_characters_(scan->query, "\n", 1))
+		{
+			return -1;
+		}
+		p = q + 1;
+		if(p < end && *p == '\n')
+		{
+			p++;
+		}
+	}
+	return 0;
+}
+
+/* Process a start tag, from <p> (the '<') to <gt> (the '>') */
+static int
+sparql_xmlscan_start_(SPARQLXMLSCAN *scan, const char *p, const char *gt)
+{
+	struct sparql_query_attrs_struct attrs;
+	const char *name, *s, *an, *v, *semi;
+	const char **value;
+	size_t namelen, anlen, *vlen;
+	char *out, quote;
+	int empty, nsok, nsprefix;
+	size_t l;
+	SPARQLELEMENT el;
+
+	if((size_t) (gt - p) + 1 > scan->scratchsize)
+	{
+		out = (char *) realloc(scan->scratch, (gt - p) + 1);
+		if(!out)
+		{
+			sparql_logf_(scan->connection, LOG_CRIT, "failed to allocate memory for XML attributes\n");
+			return -1;
+		}
+		scan->scratch = out;
+		scan->scratchsize = (gt - p) + 1;
+	}
+	out = scan->scratch;
+	memset(&attrs, 0, sizeof(attrs));
+	empty = 0;
+	nsok = 0;
+	nsprefix = 0;
+	name = s = p + 1;
+	while(s < gt && *s != '/' && !isspace((unsigned char) *s))
+	{
+		s++;
+	}
+	namelen = s - name;
+	while(s < gt)
+	{
+		if(isspace((unsigned char) *s))
+		{
+			s++;
+			continue;
+		}
+		if(*s == '/' && s + 1 == gt)
+		{
+			empty = 1;
+			break;
+		}
+		an = s;
+		while(s < gt && *s != '=' && !isspace((unsigned char) *s))
+		{
+			s++;
+		}
+		anlen = s - an;
+		while(s < gt && isspace((unsigned char) *s))
+		{
+			s++;
+		}
+		if(s >= gt || *s != '=')
+		{
+			return sparql_xmlscan_error_(scan, "malformed attribute");
+		}
+		s++;
+		while(s < gt && isspace((unsigned char) *s))
+		{
+			s++;
+		}
+		if(s >= gt || (*s != '"' && *s != '\''))
+		{
+			return sparql_xmlscan_error_(scan, "malformed attribute");
+		}
+		quote = *s;
+		s++;
+		/* Decode the value into the scratch buffer */
+		v = out;
+		while(s < gt && *s != quote)
+		{
+			if(*s == '&')
+			{
+				s++;
+				semi = memchr(s, ';', gt - s);
+				if(!semi || sparql_xmlscan_entity_(s, semi, out, &l))
+				{
+					return sparql_xmlscan_error_(scan, "invalid entity reference");
+				}
+				out += l;
+				s = semi + 1;
+				continue;
+			}
+			if(*s == '<')
+			{
+				return sparql_xmlscan_error_(scan, "'<' within attribute value");
+			}
+			if(*s == '\r' && s[1] == '\n')
+			{
+				s++;
+			}
+			*out = (*s == '\t' || *s == '\n' || *s == '\r' ? ' ' : *s);
+			out++;
+			s++;
+		}
+		if(s >= gt)
+		{
+			/* The tag ended within the value: the quotes were paired
+			 * differently when locating the end of the tag
+			 */
+			return sparql_xmlscan_error_(scan, "malformed attribute");
+		}
+		s++;
+		value = NULL;
+		vlen = NULL;
+		if(anlen == 4 && !memcmp(an, "name", 4))
+		{
+			value = &(attrs.name);
+			vlen = &(attrs.namelen);
+		}
+		else if(anlen == 4 && !memcmp(an, "href", 4))
+		{
+			value = &(attrs.href);
+			vlen = &(attrs.hreflen);
+		}
+		else if(anlen == 8 && !memcmp(an, "datatype", 8))
+		{
+			value = &(attrs.datatype);
+			vlen = &(attrs.datatypelen);
+		}
+		else if(anlen == 8 && !memcmp(an, "xml:lang", 8))
+		{
+			value = &(attrs.lang);
+			vlen = &(attrs.langlen);
+		}
+		else if(anlen == 5 && !memcmp(an, "xmlns", 5))
+		{
+			if((size_t) (out - v) != sizeof(SPARQL_RESULTS_NS) - 1 ||
+			   memcmp(v, SPARQL_RESULTS_NS, out - v))
+			{
+				if(scan->state == XS_PROLOGUE)
+				{
+					return 1;
+				}
+				sparql_logf_(scan->connection, LOG_ERR, "unexpected namespace <%.*s> in SPARQL results\n", (int) (out - v), v);
+				return -1;
+			}
+			nsok = 1;
+		}
+		else if(anlen > 6 && !memcmp(an, "xmlns:", 6))
+		{
+			if((size_t) (out - v) == sizeof(SPARQL_RESULTS_NS) - 1 &&
+			   !memcmp(v, SPARQL_RESULTS_NS, out - v))
+			{
+				nsprefix = 1;
+			}
+		}
+		if(value)
+		{
+			*value = v;
+			*vlen = out - v;
+		}
+	}
+	if(memchr(name, ':', namelen))
+	{
+		if(scan->state == XS_PROLOGUE)
+		{
+			return 1;
+		}
+		sparql_logf_(scan->connection, LOG_ERR, "unexpected namespace for <%.*s> in SPARQL results\n", (int) namelen, name);
+		return -1;
+	}
+	el = sparql_query_element_(name, namelen);
+	if(scan->state == XS_PROLOGUE)
+	{
+		if(el != SQE_SPARQL || !nsok || nsprefix)
+		{
+			return 1;
+		}
+		scan->state = XS_BODY;
+	}
+	if(scan->depth == SPARQL_XMLSCAN_DEPTH)
+	{
+		return sparql_xmlscan_error_(scan, "elements are nested too deeply");
+	}
+	scan->stack[scan->depth] = el;
+	scan->depth++;
+	if(sparql_query_startel_(scan->query, el, name, namelen, &attrs))
+	{
+		return -1;
+	}
+	if(empty)
+	{
+		scan->depth--;
+		if(!scan->depth)
+		{
+			scan->state = XS_EPILOGUE;
+		}
+		return sparql_query_endel_(scan->query);
+	}
+	return 0;
+}
+
+/* Process an end tag, from <p> (the '<') to <gt> (the '>') */
+static int
+sparql_xmlscan_end_(SPARQLXMLSCAN *scan, const char *p, const char *gt)
+{
+	const char *name;
+
+	name = p + 2;
+	while(gt > name && isspace((unsigned char) gt[-1]))
+	{
+		gt--;
+	}
+	if(!scan->depth || memchr(name, ':', gt - name) ||
+	   sparql_query_element_(name, gt - name) != scan->stack[scan->depth - 1])
+	{
+		return sparql_xmlscan_error_(scan, "mismatched end tag");
+	}
+	scan->depth--;
+	if(!scan->depth)
+	{
+		scan->state = XS_EPILOGUE;
+	}
+	return sparql_query_endel_(scan->query);
+}
+
+/* Examine a processing instruction in the prologue, returning nonzero if
+ * it's an XML declaration specifying an encoding other than UTF-8
+ */
+static int
+sparql_xmlscan_decl_(SPARQLXMLSCAN *scan, const char *p, const char *end)
+{
+	const char *s;
+	char quote;
+
+	(void) scan;
+
+	if(end - p < 6 || memcmp(p, "<?xml", 5) || !isspace((unsigned char) p[5]))
+	{
+		return 0;
+	}
+	s = sparql_xmlscan_find_(p + 5, end, "encoding");
+	if(!s)
+	{
+		return 0;
+	}
+	for(s += 8; s < end && (isspace((unsigned char) *s) || *s == '='); s++)
+	{
+	}
+	if(s >= end || (*s != '"' && *s != '\''))
+	{
+		return 1;
+	}
+	quote = *s;
+	s++;
+	if(end - s >= 6 && !strncasecmp(s, "utf-8", 5) && s[5] == quote)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* Locate the next '<', '&' or CR within a run of character data */
+static const char *
+sparql_xmlscan_special_(const char *p, const char *end)
+{
+#ifdef SPARQL_XMLSCAN_SSE2
+	__m128i lt, amp, cr, v;
+	int mask;
+
+	lt = _mm_set1_epi8('<');
+	amp = _mm_set1_epi8('&');
+	cr = _mm_set1_epi8('\r');
+	while(end - p >= 16)
+	{
+		v = _mm_loadu_si128((const __m128i *) p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp)), _mm_cmpeq_epi8(v, cr)));
+		if(mask)
+		{
+			return p + __builtin_ctz((unsigned int) mask);
+		}
+		p += 16;
+	}
+#endif
+	for(; p < end; p++)
+	{
+		if(*p == '<' || *p == '&' || *p == '\r')
+		{
+			break;
+		}
+	}
+	return p;
+}
+
+/* Locate <str> within [p, end), or return NULL */
+static const char *
+sparql_xmlscan_find_(const char *p, const char *end, const char *str)
+{
+	size_t l;
+
+	l = strlen(str);
+	while(end - p >= (ptrdiff_t) l)
+	{
+		p = memchr(p, str[0], (end - p) - l + 1);
+		if(!p)
+		{
+			return NULL;
+		}
+		if(!memcmp(p, str, l))
+		{
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* Locate the '>' which ends the tag beginning at <p>, skipping any within
+ * quoted attribute values
+ */
+static const char *
+sparql_xmlscan_tagend_(const char *p, const char *end)
+{
+	const char *q;
+
+	for(p++; p < end; p++)
+	{
+		if(*p == '>')
+		{
+			return p;
+		}
+		if(*p == '"' || *p == '\'')
+		{
+			q = memchr(p + 1, *p, end - p - 1);
+			if(!q)
+			{
+				return NULL;
+			}
+			p = q;
+		}
+	}
+	return NULL;
+}
+
+/* Decode the entity or character reference whose name spans [p, end) as
+ * UTF-8 into <out>, which must have space for at least four bytes
+ */
+static int
+sparql_xmlscan_entity_(const char *p, const char *end, char *out, size_t *outlen)
+{
+	unsigned long c;
+	size_t l;
+	int hex;
+
+	l = end - p;
+	if(l == 2 && !memcmp(p, "lt", 2))
+	{
+		c = '<';
+	}
+	else if(l == 2 && !memcmp(p, "gt", 2))
+	{
+		c = '>';
+	}
+	else if(l == 3 && !memcmp(p, "amp", 3))
+	{
+		c = '&';
+	}
+	else if(l == 4 && !memcmp(p, "quot", 4))
+	{
+		c = '"';
+	}
+	else if(l == 4 && !memcmp(p, "apos", 4))
+	{
+		c = '\'';
+	}
+	else if(l > 1 && *p == '#')
+	{
+		p++;
+		hex = (*p == 'x');
+		if(hex)
+		{
+			p++;
+		}
+		if(p == end)
+		{
+			return -1;
+		}
+		for(c = 0; p < end; p++)
+		{
+			if(hex && isxdigit((unsigned char) *p))
+			{
+				c = (c << 4) | (isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a' + 10));
+			}
+			else if(!hex && isdigit((unsigned char) *p))
+			{
+				c = (c * 10) + (*p - '0');
+			}
+			else
+			{
+				return -1;
+			}
+			if(c > 0x10ffff)
+			{
+				return -1;
+			}
+		}
+		if((c < 0x20 && c != 0x09 && c != 0x0a && c != 0x0d) ||
+		   (c >= 0xd800 && c <= 0xdfff) || c == 0xfffe || c == 0xffff)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		/* Other named entities would require a DTD */
+		return -1;
+	}
+	*outlen = sparql_utf8_encode_(c, out);
+	return 0;
+}
+
+static int
+sparql_xmlscan_error_(SPARQLXMLSCAN *scan, const char *what)
+{
+	sparql_logf_(scan->connection, LOG_ERR, "returned XML document was not well-formed: %s\n", what);
+	return -1;
+}